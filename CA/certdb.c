@@ -0,0 +1,590 @@
+/*
+ * Copyright (c) 2018 Bob Beck <beck@obtuse.com>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/*
+ * The certificate database. See certdb.h for the layout.
+ *
+ * The hash tables use open addressing with linear probing. Each slot
+ * holds a record number plus one (zero is an empty slot) and 32 bits
+ * of the key's hash, so most probes that don't match never have to
+ * read the record. When a table gets half full we build one twice the
+ * size beside it from the slots alone, and rename it into place.
+ */
+
+#include <sys/types.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include <ctype.h>
+#include <err.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "certdb.h"
+
+#define TABLE_MAGIC	0x43444231	/* "CDB1" */
+#define TABLE_HEADER	4		/* magic, slots, used, unused */
+#define TABLE_MIN	1024
+
+#define RECLEN	sizeof(struct certdb_rec)
+
+#define KEY_SERIAL	0
+#define KEY_SUBJECT	1
+
+typedef char rec_is_512_bytes[RECLEN == 512 ? 1 : -1];
+
+static const char *reasons[] = {
+	"unspecified", "keyCompromise", "CAKeyCompromise",
+	"affiliationChanged", "superseded", "cessationOfOperation",
+	"certificateHold", NULL, "removeFromCRL",
+};
+
+static uint32_t
+hash(const char *s)
+{
+	uint64_t h = 0xcbf29ce484222325ULL;
+
+	while (*s != '\0') {
+		h ^= (unsigned char)*s++;
+		h *= 0x100000001b3ULL;
+	}
+	return h ^ (h >> 32);
+}
+
+static int
+dbfile(struct certdb *db, const char *suffix, char *buf, size_t len)
+{
+	if (snprintf(buf, len, "%s.%s", db->path, suffix) >= (int)len) {
+		warnx("%s - database path too long", db->path);
+		return -1;
+	}
+	return 0;
+}
+
+static size_t
+table_len(uint32_t slots)
+{
+	return (TABLE_HEADER + 2 * (size_t)slots) * sizeof(uint32_t);
+}
+
+static int
+table_map(struct certdb_table *t, int writable, const char *path)
+{
+	struct stat sb;
+
+	if (fstat(t->fd, &sb) == -1) {
+		warn("%s", path);
+		return -1;
+	}
+	t->maplen = sb.st_size;
+	t->map = mmap(NULL, t->maplen, PROT_READ |
+	    (writable ? PROT_WRITE : 0), MAP_SHARED, t->fd, 0);
+	if (t->map == MAP_FAILED) {
+		warn("can't map %s", path);
+		t->map = NULL;
+		return -1;
+	}
+	if (t->maplen < table_len(TABLE_MIN) || t->map[0] != TABLE_MAGIC ||
+	    t->maplen != table_len(t->map[1])) {
+		warnx("%s - not a certificate database table", path);
+		return -1;
+	}
+	return 0;
+}
+
+static int
+table_open(struct certdb *db, struct certdb_table *t, const char *suffix)
+{
+	char path[1100];
+	uint32_t header[TABLE_HEADER] = { TABLE_MAGIC, TABLE_MIN, 0, 0 };
+	struct stat sb;
+
+	if (dbfile(db, suffix, path, sizeof(path)) == -1)
+		return -1;
+	if ((t->fd = open(path, db->writable ? O_RDWR | O_CREAT : O_RDONLY,
+	    0644)) == -1) {
+		warn("%s", path);
+		return -1;
+	}
+	if (fstat(t->fd, &sb) == -1) {
+		warn("%s", path);
+		return -1;
+	}
+	if (sb.st_size == 0 && db->writable) {
+		if (ftruncate(t->fd, table_len(TABLE_MIN)) == -1 ||
+		    pwrite(t->fd, header, sizeof(header), 0) !=
+		    sizeof(header)) {
+			warn("%s", path);
+			return -1;
+		}
+	}
+	return table_map(t, db->writable, path);
+}
+
+static void
+table_close(struct certdb_table *t)
+{
+	if (t->map != NULL)
+		munmap(t->map, t->maplen);
+	if (t->fd != -1)
+		close(t->fd);
+	t->map = NULL;
+	t->fd = -1;
+}
+
+/*
+ * Find key in a table. Returns the slot it is in, or -1 with *empty
+ * set to the slot it would go in.
+ */
+static long
+table_find(struct certdb *db, struct certdb_table *t, int which,
+    const char *key, uint32_t h, struct certdb_rec *rec, long *empty)
+{
+	uint32_t slots = t->map[1], i, *slot;
+
+	for (i = h % slots; ; i = (i + 1) % slots) {
+		slot = &t->map[TABLE_HEADER + 2 * i];
+		if (slot[0] == 0) {
+			if (empty != NULL)
+				*empty = i;
+			return -1;
+		}
+		if (slot[1] != h || certdb_get(db, slot[0] - 1, rec) == -1)
+			continue;
+		if (strcmp(which == KEY_SERIAL ? rec->serial : rec->subject,
+		    key) == 0)
+			return i;
+	}
+}
+
+/*
+ * Make a table twice the size from the slots of the old one, and
+ * swap it in.
+ */
+static int
+table_grow(struct certdb *db, struct certdb_table *t, const char *suffix)
+{
+	struct certdb_table new;
+	char path[1100], tmp[1100];
+	uint32_t slots = t->map[1] * 2, i, j, *from, *to;
+
+	if (dbfile(db, suffix, path, sizeof(path)) == -1 ||
+	    snprintf(tmp, sizeof(tmp), "%s.new", path) >= (int)sizeof(tmp))
+		return -1;
+	if ((new.fd = open(tmp, O_RDWR | O_CREAT | O_TRUNC, 0644)) == -1) {
+		warn("%s", tmp);
+		return -1;
+	}
+	if (ftruncate(new.fd, table_len(slots)) == -1) {
+		warn("%s", tmp);
+		close(new.fd);
+		return -1;
+	}
+	new.maplen = table_len(slots);
+	new.map = mmap(NULL, new.maplen, PROT_READ | PROT_WRITE, MAP_SHARED,
+	    new.fd, 0);
+	if (new.map == MAP_FAILED) {
+		warn("can't map %s", tmp);
+		close(new.fd);
+		return -1;
+	}
+	new.map[0] = TABLE_MAGIC;
+	new.map[1] = slots;
+	new.map[2] = t->map[2];
+	for (i = 0; i < t->map[1]; i++) {
+		from = &t->map[TABLE_HEADER + 2 * i];
+		if (from[0] == 0)
+			continue;
+		for (j = from[1] % slots; ; j = (j + 1) % slots) {
+			to = &new.map[TABLE_HEADER + 2 * j];
+			if (to[0] == 0)
+				break;
+		}
+		to[0] = from[0];
+		to[1] = from[1];
+	}
+	if (rename(tmp, path) == -1) {
+		warn("%s", path);
+		table_close(&new);
+		return -1;
+	}
+	table_close(t);
+	*t = new;
+	return 0;
+}
+
+static void
+table_set(struct certdb_table *t, long i, uint32_t recno, uint32_t h)
+{
+	uint32_t *slot = &t->map[TABLE_HEADER + 2 * i];
+
+	if (slot[0] == 0)
+		t->map[2]++;
+	slot[0] = recno + 1;
+	slot[1] = h;
+}
+
+int
+certdb_open(struct certdb *db, const char *path, int writable)
+{
+	char file[1100];
+	struct stat sb;
+	int flags = writable ? O_RDWR | O_CREAT : O_RDONLY;
+
+	memset(db, 0, sizeof(*db));
+	db->recfd = db->revfd = db->ser.fd = db->sub.fd = -1;
+	db->writable = writable;
+	if (snprintf(db->path, sizeof(db->path), "%s", path) >=
+	    (int)sizeof(db->path)) {
+		warnx("%s - database path too long", path);
+		return -1;
+	}
+	if (dbfile(db, "rec", file, sizeof(file)) == -1)
+		return -1;
+	if ((db->recfd = open(file, flags, 0644)) == -1) {
+		warn("%s", file);
+		goto bad;
+	}
+	if (flock(db->recfd, writable ? LOCK_EX : LOCK_SH) == -1 ||
+	    fstat(db->recfd, &sb) == -1) {
+		warn("%s", file);
+		goto bad;
+	}
+	db->nrecs = sb.st_size / RECLEN;
+
+	if (dbfile(db, "rev", file, sizeof(file)) == -1)
+		goto bad;
+	if ((db->revfd = open(file, flags | (writable ? O_APPEND : 0),
+	    0644)) == -1 || fstat(db->revfd, &sb) == -1) {
+		warn("%s", file);
+		goto bad;
+	}
+	db->nrevoked = sb.st_size / sizeof(uint32_t);
+
+	if (table_open(db, &db->ser, "ser") == -1 ||
+	    table_open(db, &db->sub, "sub") == -1)
+		goto bad;
+	return 0;
+ bad:
+	certdb_close(db);
+	return -1;
+}
+
+void
+certdb_close(struct certdb *db)
+{
+	table_close(&db->ser);
+	table_close(&db->sub);
+	if (db->revfd != -1)
+		close(db->revfd);
+	if (db->recfd != -1)
+		close(db->recfd);
+	db->recfd = db->revfd = -1;
+}
+
+int
+certdb_get(struct certdb *db, uint32_t recno, struct certdb_rec *rec)
+{
+	if (recno >= db->nrecs ||
+	    pread(db->recfd, rec, RECLEN, (off_t)recno * RECLEN) != RECLEN)
+		return -1;
+	rec->serial[CERTDB_SERIAL - 1] = '\0';
+	rec->subject[CERTDB_SUBJECT - 1] = '\0';
+	return 0;
+}
+
+int
+certdb_get_revoked(struct certdb *db, uint32_t i, struct certdb_rec *rec)
+{
+	uint32_t recno;
+
+	if (i >= db->nrevoked || pread(db->revfd, &recno, sizeof(recno),
+	    (off_t)i * sizeof(recno)) != sizeof(recno))
+		return -1;
+	return certdb_get(db, recno, rec);
+}
+
+long
+certdb_find_serial(struct certdb *db, const char *serial,
+    struct certdb_rec *rec)
+{
+	char key[CERTDB_SERIAL];
+	long i;
+
+	if (certdb_serial(serial, key, sizeof(key)) == -1)
+		return -1;
+	if ((i = table_find(db, &db->ser, KEY_SERIAL, key, hash(key), rec,
+	    NULL)) == -1)
+		return -1;
+	return db->ser.map[TABLE_HEADER + 2 * i] - 1;
+}
+
+long
+certdb_find_subject(struct certdb *db, const char *subject,
+    struct certdb_rec *rec)
+{
+	long i;
+
+	if ((i = table_find(db, &db->sub, KEY_SUBJECT, subject,
+	    hash(subject), rec, NULL)) == -1)
+		return -1;
+	return db->sub.map[TABLE_HEADER + 2 * i] - 1;
+}
+
+int
+certdb_add(struct certdb *db, const char *serial, const char *subject,
+    time_t expires)
+{
+	struct certdb_rec rec, old;
+	uint32_t hser, hsub;
+	long sslot, bslot, found;
+
+	memset(&rec, 0, sizeof(rec));
+	if (certdb_serial(serial, rec.serial, sizeof(rec.serial)) == -1) {
+		warnx("%s - bad serial number", serial);
+		return -1;
+	}
+	if (snprintf(rec.subject, sizeof(rec.subject), "%s", subject) >=
+	    (int)sizeof(rec.subject)) {
+		warnx("%s - subject too long", subject);
+		return -1;
+	}
+	rec.status = CERTDB_VALID;
+	rec.reason = -1;
+	rec.expires = expires;
+
+	/* half full, time for bigger tables */
+	if ((db->ser.map[2] + 1) * 2 > db->ser.map[1] &&
+	    table_grow(db, &db->ser, "ser") == -1)
+		return -1;
+	if ((db->sub.map[2] + 1) * 2 > db->sub.map[1] &&
+	    table_grow(db, &db->sub, "sub") == -1)
+		return -1;
+
+	hser = hash(rec.serial);
+	if (table_find(db, &db->ser, KEY_SERIAL, rec.serial, hser, &old,
+	    &sslot) != -1) {
+		warnx("serial %s is already in the database", rec.serial);
+		return -1;
+	}
+	hsub = hash(rec.subject);
+	if ((found = table_find(db, &db->sub, KEY_SUBJECT, rec.subject, hsub,
+	    &old, &bslot)) != -1) {
+		/* we become the latest, and point back at the last one */
+		rec.same_subject = db->sub.map[TABLE_HEADER + 2 * found];
+		bslot = found;
+	}
+
+	/* the record goes down before anything points at it */
+	if (pwrite(db->recfd, &rec, RECLEN, (off_t)db->nrecs * RECLEN) !=
+	    RECLEN) {
+		warn("%s.rec", db->path);
+		return -1;
+	}
+	table_set(&db->ser, sslot, db->nrecs, hser);
+	table_set(&db->sub, bslot, db->nrecs, hsub);
+	db->nrecs++;
+	return 0;
+}
+
+int
+certdb_revoke(struct certdb *db, const char *serial, time_t when,
+    int reason)
+{
+	struct certdb_rec rec;
+	uint32_t recno;
+	long r;
+
+	if ((r = certdb_find_serial(db, serial, &rec)) == -1) {
+		warnx("serial %s is not in the database", serial);
+		return -1;
+	}
+	if (rec.status == CERTDB_REVOKED) {
+		warnx("serial %s is already revoked", rec.serial);
+		return -1;
+	}
+	recno = r;
+	rec.status = CERTDB_REVOKED;
+	rec.revoked = when;
+	rec.reason = reason;
+	if (pwrite(db->recfd, &rec, RECLEN, (off_t)recno * RECLEN) !=
+	    RECLEN || write(db->revfd, &recno, sizeof(recno)) !=
+	    sizeof(recno)) {
+		warn("%s", db->path);
+		return -1;
+	}
+	db->nrevoked++;
+	return 0;
+}
+
+int
+certdb_serial(const char *in, char *out, size_t outlen)
+{
+	size_t len, i;
+
+	if (in[0] == '0' && (in[1] == 'x' || in[1] == 'X'))
+		in += 2;
+	while (in[0] == '0' && in[1] != '\0')
+		in++;
+	len = strlen(in);
+	if (len == 0 || len + (len & 1) + 1 > outlen)
+		return -1;
+	/* whole bytes, like openssl writes them */
+	if (len & 1)
+		*out++ = '0';
+	for (i = 0; i < len; i++) {
+		if (!isxdigit((unsigned char)in[i]))
+			return -1;
+		out[i] = toupper((unsigned char)in[i]);
+	}
+	out[len] = '\0';
+	return 0;
+}
+
+void
+certdb_asn1time(time_t t, char *buf, size_t len)
+{
+	struct tm tm;
+
+	gmtime_r(&t, &tm);
+	/* UTCTime until 2050, as RFC 5280 wants, then GeneralizedTime */
+	strftime(buf, len, tm.tm_year >= 50 && tm.tm_year < 150 ?
+	    "%y%m%d%H%M%SZ" : "%Y%m%d%H%M%SZ", &tm);
+}
+
+static int
+parse_time(const char *s, time_t *t)
+{
+	struct tm tm;
+	size_t len = strlen(s), i;
+
+	if ((len != 13 && len != 15) || s[len - 1] != 'Z')
+		return -1;
+	for (i = 0; i < len - 1; i++)
+		if (!isdigit((unsigned char)s[i]))
+			return -1;
+	memset(&tm, 0, sizeof(tm));
+	if (len == 13) {
+		if (sscanf(s, "%2d%2d%2d%2d%2d%2d", &tm.tm_year, &tm.tm_mon,
+		    &tm.tm_mday, &tm.tm_hour, &tm.tm_min, &tm.tm_sec) != 6)
+			return -1;
+		if (tm.tm_year < 50)
+			tm.tm_year += 100;
+	} else {
+		if (sscanf(s, "%4d%2d%2d%2d%2d%2d", &tm.tm_year, &tm.tm_mon,
+		    &tm.tm_mday, &tm.tm_hour, &tm.tm_min, &tm.tm_sec) != 6)
+			return -1;
+		tm.tm_year -= 1900;
+	}
+	tm.tm_mon--;
+	*t = timegm(&tm);
+	return 0;
+}
+
+const char *
+certdb_reason_name(int reason)
+{
+	if (reason < 0 || reason >= (int)(sizeof(reasons) /
+	    sizeof(reasons[0])) || reasons[reason] == NULL)
+		return NULL;
+	return reasons[reason];
+}
+
+int
+certdb_reason_code(const char *name)
+{
+	size_t i;
+
+	for (i = 0; i < sizeof(reasons) / sizeof(reasons[0]); i++)
+		if (reasons[i] != NULL && strcmp(name, reasons[i]) == 0)
+			return i;
+	return -1;
+}
+
+/*
+ * index.txt has a line per certificate, with tabs between
+ *
+ *	status expiry revocation[,reason] serial filename subject
+ */
+int
+certdb_import(struct certdb *db, FILE *fp)
+{
+	char *line = NULL, *f[6], *p, *reason;
+	size_t linesize = 0, lineno = 0;
+	time_t expires, revoked;
+	int i, code;
+
+	while (getline(&line, &linesize, fp) != -1) {
+		lineno++;
+		line[strcspn(line, "\n")] = '\0';
+		p = line;
+		for (i = 0; i < 6 && p != NULL; i++)
+			f[i] = strsep(&p, "\t");
+		if (i < 6 || parse_time(f[1], &expires) == -1) {
+			warnx("index line %zu: can't parse it", lineno);
+			goto bad;
+		}
+		if (certdb_add(db, f[3], f[5], expires) == -1)
+			goto bad;
+		if (f[0][0] != 'R')
+			continue;
+		if ((reason = strchr(f[2], ',')) != NULL)
+			*reason++ = '\0';
+		code = reason ? certdb_reason_code(reason) : -1;
+		if (parse_time(f[2], &revoked) == -1 ||
+		    certdb_revoke(db, f[3], revoked, code) == -1) {
+			warnx("index line %zu: bad revocation", lineno);
+			goto bad;
+		}
+	}
+	free(line);
+	return ferror(fp) ? -1 : 0;
+ bad:
+	free(line);
+	return -1;
+}
+
+int
+certdb_export(struct certdb *db, FILE *fp)
+{
+	struct certdb_rec rec;
+	char expires[32], when[32], revoked[64];
+	const char *reason;
+	uint32_t i;
+
+	for (i = 0; i < db->nrecs; i++) {
+		if (certdb_get(db, i, &rec) == -1)
+			return -1;
+		certdb_asn1time(rec.expires, expires, sizeof(expires));
+		revoked[0] = '\0';
+		if (rec.status == CERTDB_REVOKED) {
+			certdb_asn1time(rec.revoked, when, sizeof(when));
+			reason = certdb_reason_name(rec.reason);
+			snprintf(revoked, sizeof(revoked), "%s%s%s", when,
+			    reason ? "," : "", reason ? reason : "");
+		}
+		if (fprintf(fp, "%c\t%s\t%s\t%s\tunknown\t%s\n", rec.status,
+		    expires, revoked, rec.serial, rec.subject) < 0)
+			return -1;
+	}
+	return 0;
+}
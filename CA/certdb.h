@@ -0,0 +1,106 @@
+/*
+ * Copyright (c) 2018 Bob Beck <beck@obtuse.com>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#ifndef CERTDB_H
+#define CERTDB_H
+
+#include <stdint.h>
+#include <stdio.h>
+#include <time.h>
+
+/*
+ * The CA's record of every certificate it has issued, in place of
+ * openssl ca's index.txt, which has to be read from the top every
+ * time anything looks something up in it.
+ *
+ * A database "path" is four files. path.rec holds fixed size records,
+ * one per certificate, appended as they are issued. path.ser and
+ * path.sub are hash tables, mapped into memory, that find a record by
+ * serial number or by subject in one or two probes. path.rev lists the
+ * records of revoked certificates in the order they were revoked, so a
+ * CRL only has to look at those. Writers hold an exclusive lock on
+ * path.rec, readers a shared one.
+ */
+
+#define CERTDB_VALID	'V'
+#define CERTDB_REVOKED	'R'
+
+#define CERTDB_SERIAL	48	/* upper case hex, without leading zeros */
+#define CERTDB_SUBJECT	440	/* as X509_NAME_oneline() writes it */
+
+/* one record, exactly as it is on disk */
+struct certdb_rec {
+	char status;		/* CERTDB_VALID or CERTDB_REVOKED */
+	int8_t reason;		/* CRL reason code, or -1 for none */
+	uint16_t unused;
+	uint32_t same_subject;	/* older record with our subject, + 1 */
+	int64_t expires;
+	int64_t revoked;	/* when, if we are */
+	char serial[CERTDB_SERIAL];
+	char subject[CERTDB_SUBJECT];
+};
+
+struct certdb_table {
+	int fd;
+	uint32_t *map;		/* header, then slots of recno + 1, hash */
+	size_t maplen;
+};
+
+struct certdb {
+	char path[1024];
+	int writable;
+	int recfd;
+	int revfd;
+	uint32_t nrecs;
+	uint32_t nrevoked;
+	struct certdb_table ser;
+	struct certdb_table sub;
+};
+
+/* Open (and with create, make) a database. -1 and warn on failure */
+int certdb_open(struct certdb *db, const char *path, int writable);
+void certdb_close(struct certdb *db);
+
+/* Add a new certificate. Its serial must not be in there already */
+int certdb_add(struct certdb *db, const char *serial, const char *subject,
+    time_t expires);
+/* Mark a certificate revoked. -1 if we don't have it, or already did */
+int certdb_revoke(struct certdb *db, const char *serial, time_t when,
+    int reason);
+
+/* Find a record. These return the record number, or -1 */
+long certdb_find_serial(struct certdb *db, const char *serial,
+    struct certdb_rec *rec);
+long certdb_find_subject(struct certdb *db, const char *subject,
+    struct certdb_rec *rec);
+int certdb_get(struct certdb *db, uint32_t recno, struct certdb_rec *rec);
+/* The i'th certificate to be revoked */
+int certdb_get_revoked(struct certdb *db, uint32_t i,
+    struct certdb_rec *rec);
+
+/* Tidy up a hex serial into the form we keep. -1 if it isn't hex */
+int certdb_serial(const char *in, char *out, size_t outlen);
+/* A time as index.txt and CRLs want it, YYMMDDHHMMSSZ */
+void certdb_asn1time(time_t t, char *buf, size_t len);
+/* CRL reason names, as index.txt has them, and back */
+const char *certdb_reason_name(int reason);
+int certdb_reason_code(const char *name);
+
+/* Read in an index.txt, or write one out */
+int certdb_import(struct certdb *db, FILE *fp);
+int certdb_export(struct certdb *db, FILE *fp);
+
+#endif /* CERTDB_H */
@@ -0,0 +1,257 @@
+/*
+ * Copyright (c) 2018 Bob Beck <beck@obtuse.com>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/*
+ * certdb - look after the CA's certificate database.
+ *
+ *	certdb [-d db] add cert.pem ...
+ *	certdb [-d db] [-r reason] revoke cert.pem | serial
+ *	certdb [-d db] show serial | subject
+ *	certdb [-d db] import [index.txt]
+ *	certdb [-d db] export [index.txt]
+ *
+ * add records certificates as they are issued, revoke marks them
+ * revoked, show prints what we know about one, and import and export
+ * move between the database and openssl ca's index.txt.
+ */
+
+#include <sys/types.h>
+
+#include <openssl/asn1.h>
+#include <openssl/bn.h>
+#include <openssl/err.h>
+#include <openssl/pem.h>
+#include <openssl/x509.h>
+
+#include <err.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "certdb.h"
+
+static struct certdb db;
+static int reason = -1;
+
+static void
+usage(void)
+{
+	extern char *__progname;
+
+	fprintf(stderr, "usage: %s [-d db] add cert.pem ...\n"
+	    "       %s [-d db] [-r reason] revoke cert.pem | serial\n"
+	    "       %s [-d db] show serial | subject\n"
+	    "       %s [-d db] import | export [index.txt]\n",
+	    __progname, __progname, __progname, __progname);
+	exit(1);
+}
+
+static void
+crypto_err(const char *what)
+{
+	ERR_print_errors_fp(stderr);
+	errx(1, "%s", what);
+}
+
+/* serial, subject and expiry of a certificate in a PEM file */
+static void
+read_cert(const char *path, char *serial, size_t slen, char *subject,
+    size_t sublen, time_t *expires)
+{
+	struct tm tm;
+	BIGNUM *bn;
+	X509 *cert;
+	FILE *fp;
+	char *hex;
+
+	if ((fp = fopen(path, "r")) == NULL)
+		err(1, "%s", path);
+	if ((cert = PEM_read_X509(fp, NULL, NULL, NULL)) == NULL)
+		crypto_err(path);
+	fclose(fp);
+	if ((bn = ASN1_INTEGER_to_BN(X509_get_serialNumber(cert),
+	    NULL)) == NULL || (hex = BN_bn2hex(bn)) == NULL)
+		crypto_err("serial number");
+	if (certdb_serial(hex, serial, slen) == -1)
+		errx(1, "%s: serial %s is no good to us", path, hex);
+	X509_NAME_oneline(X509_get_subject_name(cert), subject, sublen);
+	if (!ASN1_TIME_to_tm(X509_get_notAfter(cert), &tm))
+		crypto_err("notAfter");
+	*expires = timegm(&tm);
+	OPENSSL_free(hex);
+	BN_free(bn);
+	X509_free(cert);
+}
+
+static void
+print_rec(long recno, struct certdb_rec *rec)
+{
+	char when[32];
+	const char *why;
+
+	certdb_asn1time(rec->expires, when, sizeof(when));
+	printf("record %ld\n\tserial %s\n\tsubject %s\n\texpires %s\n",
+	    recno, rec->serial, rec->subject, when);
+	if (rec->status == CERTDB_REVOKED) {
+		certdb_asn1time(rec->revoked, when, sizeof(when));
+		why = certdb_reason_name(rec->reason);
+		printf("\trevoked %s%s%s\n", when, why ? " " : "",
+		    why ? why : "");
+	}
+}
+
+static int
+cmd_add(int argc, char **argv)
+{
+	char serial[CERTDB_SERIAL], subject[CERTDB_SUBJECT];
+	time_t expires;
+	int i;
+
+	if (argc < 2)
+		usage();
+	for (i = 1; i < argc; i++) {
+		read_cert(argv[i], serial, sizeof(serial), subject,
+		    sizeof(subject), &expires);
+		if (certdb_add(&db, serial, subject, expires) == -1)
+			return 1;
+	}
+	return 0;
+}
+
+static int
+cmd_revoke(int argc, char **argv)
+{
+	char serial[CERTDB_SERIAL], subject[CERTDB_SUBJECT];
+	time_t expires;
+
+	if (argc != 2)
+		usage();
+	if (access(argv[1], F_OK) == 0)
+		read_cert(argv[1], serial, sizeof(serial), subject,
+		    sizeof(subject), &expires);
+	else
+		snprintf(serial, sizeof(serial), "%s", argv[1]);
+	return certdb_revoke(&db, serial, time(NULL), reason) == -1;
+}
+
+static int
+cmd_show(int argc, char **argv)
+{
+	struct certdb_rec rec;
+	long recno;
+
+	if (argc != 2)
+		usage();
+	if ((recno = certdb_find_serial(&db, argv[1], &rec)) != -1) {
+		print_rec(recno, &rec);
+		return 0;
+	}
+	if ((recno = certdb_find_subject(&db, argv[1], &rec)) == -1)
+		errx(1, "%s - not in the database", argv[1]);
+	/* every certificate with the subject, latest first */
+	for (;;) {
+		print_rec(recno, &rec);
+		if (rec.same_subject == 0)
+			break;
+		recno = rec.same_subject - 1;
+		if (certdb_get(&db, recno, &rec) == -1)
+			errx(1, "%s: record %ld is missing", db.path, recno);
+	}
+	return 0;
+}
+
+static int
+cmd_port(int argc, char **argv, int in)
+{
+	const char *path = "intermediate/index.txt";
+	FILE *fp;
+	int rv;
+
+	if (argc > 2)
+		usage();
+	if (argc == 2)
+		path = argv[1];
+	if (!in && argc == 1)
+		fp = stdout;
+	else if ((fp = fopen(path, in ? "r" : "w")) == NULL)
+		err(1, "%s", path);
+	rv = in ? certdb_import(&db, fp) : certdb_export(&db, fp);
+	if (rv == -1 || (fp != stdout && fclose(fp) == EOF) ||
+	    (fp == stdout && fflush(fp) == EOF))
+		errx(1, "%s %s failed", in ? "import from" : "export to",
+		    fp == stdout ? "stdout" : path);
+	return 0;
+}
+
+static int
+cmd_import(int argc, char **argv)
+{
+	return cmd_port(argc, argv, 1);
+}
+
+static int
+cmd_export(int argc, char **argv)
+{
+	return cmd_port(argc, argv, 0);
+}
+
+int
+main(int argc, char *argv[])
+{
+	const char *path = "intermediate/certdb";
+	int (*cmd)(int, char **) = NULL;
+	int ch, writable = 1;
+
+	while ((ch = getopt(argc, argv, "d:r:")) != -1) {
+		switch (ch) {
+		case 'd':
+			path = optarg;
+			break;
+		case 'r':
+			if ((reason = certdb_reason_code(optarg)) == -1)
+				errx(1, "%s - unknown revocation reason",
+				    optarg);
+			break;
+		default:
+			usage();
+		}
+	}
+	argc -= optind;
+	argv += optind;
+	if (argc < 1)
+		usage();
+
+	if (strcmp(argv[0], "add") == 0)
+		cmd = cmd_add;
+	else if (strcmp(argv[0], "revoke") == 0)
+		cmd = cmd_revoke;
+	else if (strcmp(argv[0], "import") == 0)
+		cmd = cmd_import;
+	else if (strcmp(argv[0], "show") == 0) {
+		cmd = cmd_show;
+		writable = 0;
+	} else if (strcmp(argv[0], "export") == 0) {
+		cmd = cmd_export;
+		writable = 0;
+	} else
+		usage();
+
+	if (certdb_open(&db, path, writable) == -1)
+		return 1;
+	return cmd(argc, argv);
+}
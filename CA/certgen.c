@@ -0,0 +1,203 @@
+/*
+ * Copyright (c) 2018 Bob Beck <beck@obtuse.com>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/*
+ * certgen - make lots of test identities in memory, and time it.
+ *
+ * Every identity is issued by memca and then loaded into its own
+ * libtls server context the way a test or benchmark would, with
+ * tls_config_set_keypair_mem() and tls_config_set_ca_mem(), so what
+ * we report is the real cost of standing up that many servers (or
+ * clients) without ever touching the filesystem. -p prints the first
+ * identity, so you can look at it with openssl x509.
+ */
+
+#include <sys/types.h>
+
+#include <err.h>
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <tls.h>
+
+#include "memca.h"
+
+static void
+usage(void)
+{
+	extern char *__progname;
+
+	fprintf(stderr, "usage: %s [-CpR] [-a keytype] [-c cacert -k cakey "
+	    "-r rootcert]\n"
+	    "\t[-K keytype] [-n count] [-v seconds]\n", __progname);
+	exit(1);
+}
+
+static long long
+getnum(const char *s, long long min, long long max)
+{
+	char *ep;
+	long long n;
+
+	errno = 0;
+	n = strtoll(s, &ep, 10);
+	if (*s == '\0' || *ep != '\0')
+		errx(1, "%s - not a number", s);
+	if (errno == ERANGE || n < min || n > max)
+		errx(1, "%s - value out of range", s);
+	return n;
+}
+
+static int
+keytype(const char *s)
+{
+	int k;
+
+	if ((k = memca_keytype(s)) == -1)
+		errx(1, "%s - unknown key type, use rsa2048, rsa4096, "
+		    "ec256 or ec384", s);
+	return k;
+}
+
+static double
+now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+int
+main(int argc, char *argv[])
+{
+	struct tls_config *config;
+	struct memca_cred cred;
+	struct memca *ca;
+	struct tls *ctx;
+	const uint8_t *root;
+	const char *cacert = NULL, *cakey = NULL, *rootcert = NULL;
+	char name[64];
+	double start, t_ca, t_issue = 0, t_load = 0;
+	long long count = 100, valid = 3600, i;
+	size_t root_len;
+	int ch, cakeytype = MEMCA_EC256, leafkeytype = MEMCA_EC256;
+	int client = 0, print = 0, reuse = 0;
+
+	while ((ch = getopt(argc, argv, "a:Cc:K:k:n:pRr:v:")) != -1) {
+		switch (ch) {
+		case 'a':
+			cakeytype = keytype(optarg);
+			break;
+		case 'C':
+			client = 1;
+			break;
+		case 'c':
+			cacert = optarg;
+			break;
+		case 'K':
+			leafkeytype = keytype(optarg);
+			break;
+		case 'k':
+			cakey = optarg;
+			break;
+		case 'n':
+			count = getnum(optarg, 1, 10000000);
+			break;
+		case 'p':
+			print = 1;
+			break;
+		case 'R':
+			reuse = 1;
+			break;
+		case 'r':
+			rootcert = optarg;
+			break;
+		case 'v':
+			valid = getnum(optarg, 1, 100LL * 366 * 86400);
+			break;
+		default:
+			usage();
+		}
+	}
+	if (optind != argc)
+		usage();
+	if ((cacert != NULL || cakey != NULL || rootcert != NULL) &&
+	    (cacert == NULL || cakey == NULL || rootcert == NULL))
+		usage();
+
+	if (tls_init() == -1)
+		errx(1, "unable to initialize TLS");
+
+	start = now();
+	if (cacert != NULL) {
+		if ((ca = memca_load(cacert, cakey, rootcert)) == NULL)
+			errx(1, "unable to load CA from %s and %s", cacert,
+			    cakey);
+	} else if ((ca = memca_new(cakeytype, valid)) == NULL)
+		errx(1, "unable to make a CA");
+	t_ca = now() - start;
+	memca_reuse_key(ca, reuse);
+	root = memca_root(ca, &root_len);
+
+	for (i = 0; i < count; i++) {
+		snprintf(name, sizeof(name), "host%lld.example.com", i);
+		start = now();
+		if (memca_issue(ca, name, client ? MEMCA_CLIENT : MEMCA_SERVER,
+		    leafkeytype, valid, &cred) == -1)
+			errx(1, "unable to issue a certificate for %s", name);
+		t_issue += now() - start;
+		if (print && i == 0) {
+			fwrite(cred.cert, 1, cred.cert_len, stdout);
+			fwrite(cred.key, 1, cred.key_len, stdout);
+			fwrite(root, 1, root_len, stdout);
+		}
+
+		start = now();
+		if ((config = tls_config_new()) == NULL)
+			errx(1, "unable to allocate TLS config");
+		if (tls_config_set_keypair_mem(config, cred.cert,
+		    cred.cert_len, cred.key, cred.key_len) == -1)
+			errx(1, "unable to set keypair: %s",
+			    tls_config_error(config));
+		if (tls_config_set_ca_mem(config, root, root_len) == -1)
+			errx(1, "unable to set CA: %s",
+			    tls_config_error(config));
+		if ((ctx = client ? tls_client() : tls_server()) == NULL)
+			errx(1, "unable to allocate TLS context");
+		if (tls_configure(ctx, config) == -1)
+			errx(1, "unable to configure TLS for %s: %s", name,
+			    tls_error(ctx));
+		tls_free(ctx);
+		tls_config_free(config);
+		t_load += now() - start;
+		memca_cred_free(&cred);
+	}
+	memca_free(ca);
+
+	fprintf(print ? stderr : stdout,
+	    "ca %.3f ms\n"
+	    "issued %lld %s certs in %.3f s, %.3f ms each%s\n"
+	    "configured %lld tls contexts in %.3f s, %.3f ms each\n",
+	    t_ca * 1e3, count, client ? "client" : "server", t_issue,
+	    t_issue * 1e3 / count, reuse ? " (key reused)" : "",
+	    count, t_load, t_load * 1e3 / count);
+	return 0;
+}
@@ -0,0 +1,444 @@
+/*
+ * Copyright (c) 2018 Bob Beck <beck@obtuse.com>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/*
+ * crltool - build CRLs for the tutorial CA straight from its database.
+ *
+ * "openssl ca -gencrl" re-reads everything and re-signs the complete
+ * list on every revocation, and then everyone has to fetch and load
+ * the whole thing again. crltool can do the same full build, much
+ * faster, but can also issue a delta CRL (RFC 5280 section 5.2.4)
+ * against a base CRL: just the revocations the base doesn't have,
+ * plus removeFromCRL entries for anything in the base that is no
+ * longer revoked, which is small and cheap both to make and to apply.
+ *
+ * The revocations come from the CA's certificate database (certdb.h),
+ * which keeps a list of just those, or with -i from an index.txt in
+ * openssl ca's format.
+ */
+
+#include <sys/types.h>
+
+#include <openssl/asn1.h>
+#include <openssl/bn.h>
+#include <openssl/err.h>
+#include <openssl/evp.h>
+#include <openssl/pem.h>
+#include <openssl/x509.h>
+#include <openssl/x509v3.h>
+
+#include <err.h>
+#include <errno.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "certdb.h"
+
+#define REASON_REMOVE 8		/* removeFromCRL */
+
+struct revoked {
+	char serial[CERTDB_SERIAL];	/* hex, as in index.txt */
+	char date[32];		/* ASN1 time string, as in index.txt */
+	int reason;		/* CRL reason code, or -1 for none */
+};
+
+static struct revoked *revoked;
+static size_t nrevoked, revoked_max;
+
+static void
+usage(void)
+{
+	extern char *__progname;
+
+	fprintf(stderr, "usage: %s [-D basecrl] [-c cacert] [-d db | -i index] "
+	    "[-k cakey]\n"
+	    "\t[-n crlnumber] [-v hours] -o outfile\n", __progname);
+	exit(1);
+}
+
+static long long
+getnum(const char *s, long long min, long long max)
+{
+	char *ep;
+	long long n;
+
+	errno = 0;
+	n = strtoll(s, &ep, 10);
+	if (*s == '\0' || *ep != '\0')
+		errx(1, "%s - not a number", s);
+	if (errno == ERANGE || n < min || n > max)
+		errx(1, "%s - value out of range", s);
+	return n;
+}
+
+static void
+crypto_err(const char *what)
+{
+	ERR_print_errors_fp(stderr);
+	errx(1, "%s", what);
+}
+
+static struct revoked *
+new_revoked(void)
+{
+	if (nrevoked == revoked_max) {
+		revoked_max = revoked_max ? revoked_max * 2 : 1024;
+		if ((revoked = reallocarray(revoked, revoked_max,
+		    sizeof(*revoked))) == NULL)
+			err(1, NULL);
+	}
+	return &revoked[nrevoked++];
+}
+
+/*
+ * Pull the revoked certificates out of the database, which has a list
+ * of them, so we never look at the rest.
+ */
+static void
+read_db(const char *path)
+{
+	struct certdb db;
+	struct certdb_rec rec;
+	struct revoked *r;
+	uint32_t i;
+
+	if (certdb_open(&db, path, 0) == -1)
+		exit(1);
+	for (i = 0; i < db.nrevoked; i++) {
+		if (certdb_get_revoked(&db, i, &rec) == -1)
+			errx(1, "%s: revoked record %u is missing", path, i);
+		r = new_revoked();
+		memcpy(r->serial, rec.serial, sizeof(r->serial));
+		certdb_asn1time(rec.revoked, r->date, sizeof(r->date));
+		r->reason = rec.reason;
+	}
+	certdb_close(&db);
+}
+
+/*
+ * Pull the revoked certificates out of index.txt. We only need the
+ * first four fields of each line, so we don't bother with the rest.
+ */
+static void
+read_index(const char *path)
+{
+	struct revoked *r;
+	char *line = NULL, *f[4], *p, *reason;
+	size_t linesize = 0;
+	ssize_t len;
+	FILE *fp;
+	int i;
+
+	if ((fp = fopen(path, "r")) == NULL)
+		err(1, "%s", path);
+	while ((len = getline(&line, &linesize, fp)) != -1) {
+		if (line[0] != 'R')
+			continue;
+		p = line;
+		for (i = 0; i < 4; i++) {
+			f[i] = p;
+			if ((p = strchr(p, '\t')) == NULL)
+				break;
+			*p++ = '\0';
+		}
+		if (i < 4)
+			errx(1, "%s: bad line for revoked certificate", path);
+		r = new_revoked();
+		if ((reason = strchr(f[2], ',')) != NULL)
+			*reason++ = '\0';
+		r->reason = reason ? certdb_reason_code(reason) : -1;
+		if (snprintf(r->serial, sizeof(r->serial), "%s", f[3]) >=
+		    (int)sizeof(r->serial) ||
+		    snprintf(r->date, sizeof(r->date), "%s", f[2]) >=
+		    (int)sizeof(r->date))
+			errx(1, "%s: field too long", path);
+	}
+	free(line);
+	if (ferror(fp))
+		err(1, "%s", path);
+	fclose(fp);
+}
+
+static ASN1_INTEGER *
+hex_serial(const char *hex)
+{
+	ASN1_INTEGER *ai;
+	BIGNUM *bn = NULL;
+
+	if (BN_hex2bn(&bn, hex) == 0)
+		errx(1, "%s - bad serial number", hex);
+	if ((ai = BN_to_ASN1_INTEGER(bn, NULL)) == NULL)
+		crypto_err("BN_to_ASN1_INTEGER");
+	BN_free(bn);
+	return ai;
+}
+
+static int
+cmp_serial(const void *a, const void *b)
+{
+	return ASN1_INTEGER_cmp(*(ASN1_INTEGER * const *)a,
+	    *(ASN1_INTEGER * const *)b);
+}
+
+/*
+ * The serials already in the base CRL, sorted so we can look them up
+ * quickly, and the base's CRL number which the delta has to name.
+ */
+static ASN1_INTEGER **
+read_base(const char *path, X509 *cacert, size_t *count,
+    ASN1_INTEGER **number)
+{
+	STACK_OF(X509_REVOKED) *revs;
+	ASN1_INTEGER **serials;
+	X509_CRL *crl;
+	EVP_PKEY *pkey;
+	FILE *fp;
+	int i;
+
+	if ((fp = fopen(path, "r")) == NULL)
+		err(1, "%s", path);
+	if ((crl = PEM_read_X509_CRL(fp, NULL, NULL, NULL)) == NULL)
+		crypto_err("can't read base CRL");
+	fclose(fp);
+	if ((pkey = X509_get_pubkey(cacert)) == NULL ||
+	    X509_CRL_verify(crl, pkey) <= 0)
+		errx(1, "%s: not signed by our CA certificate", path);
+	EVP_PKEY_free(pkey);
+	if ((*number = X509_CRL_get_ext_d2i(crl, NID_crl_number, NULL,
+	    NULL)) == NULL)
+		errx(1, "%s: base CRL has no CRL number", path);
+
+	revs = X509_CRL_get_REVOKED(crl);
+	*count = revs ? sk_X509_REVOKED_num(revs) : 0;
+	if ((serials = calloc(*count + 1, sizeof(*serials))) == NULL)
+		err(1, NULL);
+	for (i = 0; i < (int)*count; i++)
+		serials[i] = ASN1_INTEGER_dup(X509_REVOKED_get0_serialNumber(
+		    sk_X509_REVOKED_value(revs, i)));
+	qsort(serials, *count, sizeof(*serials), cmp_serial);
+	X509_CRL_free(crl);
+	return serials;
+}
+
+/*
+ * Read the next CRL number from openssl ca's crlnumber file, and
+ * write back the one after it.
+ */
+static ASN1_INTEGER *
+next_number(const char *path)
+{
+	ASN1_INTEGER *ai;
+	BIGNUM *bn = NULL;
+	char buf[128], *hex;
+	FILE *fp;
+
+	if ((fp = fopen(path, "r")) == NULL)
+		err(1, "%s", path);
+	if (fgets(buf, sizeof(buf), fp) == NULL)
+		errx(1, "%s: empty", path);
+	fclose(fp);
+	buf[strcspn(buf, "\r\n")] = '\0';
+	if (BN_hex2bn(&bn, buf) == 0)
+		errx(1, "%s: bad CRL number", path);
+	if ((ai = BN_to_ASN1_INTEGER(bn, NULL)) == NULL)
+		crypto_err("BN_to_ASN1_INTEGER");
+	if (!BN_add_word(bn, 1) || (hex = BN_bn2hex(bn)) == NULL)
+		crypto_err("BN_add_word");
+	if ((fp = fopen(path, "w")) == NULL)
+		err(1, "%s", path);
+	fprintf(fp, "%s%s\n", strlen(hex) % 2 ? "0" : "", hex);
+	if (fclose(fp) == EOF)
+		err(1, "%s", path);
+	OPENSSL_free(hex);
+	BN_free(bn);
+	return ai;
+}
+
+static void
+add_entry(X509_CRL *crl, const struct revoked *r, ASN1_INTEGER *serial)
+{
+	X509_REVOKED *rev;
+	ASN1_ENUMERATED *reason;
+	ASN1_TIME *when;
+
+	if ((rev = X509_REVOKED_new()) == NULL ||
+	    (when = ASN1_TIME_new()) == NULL)
+		crypto_err("X509_REVOKED_new");
+	if (!ASN1_TIME_set_string(when, r->date))
+		errx(1, "%s - bad revocation date for %s", r->date,
+		    r->serial);
+	if (!X509_REVOKED_set_serialNumber(rev, serial) ||
+	    !X509_REVOKED_set_revocationDate(rev, when))
+		crypto_err("X509_REVOKED_set");
+	if (r->reason > 0) {
+		if ((reason = ASN1_ENUMERATED_new()) == NULL ||
+		    !ASN1_ENUMERATED_set(reason, r->reason) ||
+		    !X509_REVOKED_add1_ext_i2d(rev, NID_crl_reason, reason,
+		    0, 0))
+			crypto_err("reason code");
+		ASN1_ENUMERATED_free(reason);
+	}
+	if (!X509_CRL_add0_revoked(crl, rev))
+		crypto_err("X509_CRL_add0_revoked");
+	ASN1_TIME_free(when);
+}
+
+int
+main(int argc, char *argv[])
+{
+	const char *cafile = "intermediate/certs/intermediate.cert.pem";
+	const char *keyfile = "intermediate/private/intermediate.key.pem";
+	const char *dbpath = "intermediate/certdb", *index = NULL;
+	const char *numberfile = "intermediate/crlnumber";
+	const char *basefile = NULL, *outfile = NULL;
+	ASN1_INTEGER **base = NULL, *base_number = NULL, *number, **current;
+	struct revoked unhold;
+	X509V3_CTX v3;
+	X509_EXTENSION *akid;
+	ASN1_TIME *t;
+	X509_CRL *crl;
+	EVP_PKEY *key;
+	X509 *cacert;
+	FILE *fp;
+	size_t i, nbase = 0, entries = 0, removed = 0;
+	long long hours = 0;
+	int ch;
+
+	while ((ch = getopt(argc, argv, "c:d:D:i:k:n:o:v:")) != -1) {
+		switch (ch) {
+		case 'c':
+			cafile = optarg;
+			break;
+		case 'd':
+			dbpath = optarg;
+			break;
+		case 'D':
+			basefile = optarg;
+			break;
+		case 'i':
+			index = optarg;
+			break;
+		case 'k':
+			keyfile = optarg;
+			break;
+		case 'n':
+			numberfile = optarg;
+			break;
+		case 'o':
+			outfile = optarg;
+			break;
+		case 'v':
+			hours = getnum(optarg, 1, 24 * 3650);
+			break;
+		default:
+			usage();
+		}
+	}
+	if (outfile == NULL || optind != argc)
+		usage();
+	if (hours == 0)
+		hours = basefile ? 24 : 30 * 24;
+
+	if ((fp = fopen(cafile, "r")) == NULL)
+		err(1, "%s", cafile);
+	if ((cacert = PEM_read_X509(fp, NULL, NULL, NULL)) == NULL)
+		crypto_err("can't read CA certificate");
+	fclose(fp);
+	if ((fp = fopen(keyfile, "r")) == NULL)
+		err(1, "%s", keyfile);
+	if ((key = PEM_read_PrivateKey(fp, NULL, NULL, NULL)) == NULL)
+		crypto_err("can't read CA key");
+	fclose(fp);
+
+	if (basefile != NULL)
+		base = read_base(basefile, cacert, &nbase, &base_number);
+	if (index != NULL)
+		read_index(index);
+	else
+		read_db(dbpath);
+
+	if ((crl = X509_CRL_new()) == NULL || (t = ASN1_TIME_new()) == NULL)
+		crypto_err("X509_CRL_new");
+	if (!X509_CRL_set_version(crl, 1) ||
+	    !X509_CRL_set_issuer_name(crl, X509_get_subject_name(cacert)))
+		crypto_err("X509_CRL_set");
+	if (X509_gmtime_adj(t, 0) == NULL || !X509_CRL_set1_lastUpdate(crl, t))
+		crypto_err("lastUpdate");
+	if (X509_gmtime_adj(t, hours * 60 * 60) == NULL ||
+	    !X509_CRL_set1_nextUpdate(crl, t))
+		crypto_err("nextUpdate");
+	ASN1_TIME_free(t);
+
+	if ((current = calloc(nrevoked + 1, sizeof(*current))) == NULL)
+		err(1, NULL);
+	for (i = 0; i < nrevoked; i++) {
+		current[i] = hex_serial(revoked[i].serial);
+		if (base == NULL || bsearch(&current[i], base, nbase,
+		    sizeof(*base), cmp_serial) == NULL) {
+			add_entry(crl, &revoked[i], current[i]);
+			entries++;
+		}
+	}
+	/*
+	 * Anything in the base that isn't revoked any more (a hold that
+	 * was released) has to be taken back out, or nobody who only
+	 * fetches deltas would ever hear about it.
+	 */
+	if (base != NULL) {
+		qsort(current, nrevoked, sizeof(*current), cmp_serial);
+		memset(&unhold, 0, sizeof(unhold));
+		unhold.reason = REASON_REMOVE;
+		certdb_asn1time(time(NULL), unhold.date, sizeof(unhold.date));
+		for (i = 0; i < nbase; i++) {
+			if (bsearch(&base[i], current, nrevoked,
+			    sizeof(*current), cmp_serial) != NULL)
+				continue;
+			add_entry(crl, &unhold, base[i]);
+			removed++;
+		}
+	}
+	for (i = 0; i < nrevoked; i++)
+		ASN1_INTEGER_free(current[i]);
+	free(current);
+
+	number = next_number(numberfile);
+	if (!X509_CRL_add1_ext_i2d(crl, NID_crl_number, number, 0, 0))
+		crypto_err("CRL number");
+	if (base_number != NULL &&
+	    !X509_CRL_add1_ext_i2d(crl, NID_delta_crl, base_number, 1, 0))
+		crypto_err("delta CRL indicator");
+	X509V3_set_ctx(&v3, cacert, NULL, NULL, crl, 0);
+	if ((akid = X509V3_EXT_conf_nid(NULL, &v3,
+	    NID_authority_key_identifier, "keyid:always")) == NULL ||
+	    !X509_CRL_add_ext(crl, akid, -1))
+		crypto_err("authority key identifier");
+	X509_EXTENSION_free(akid);
+
+	if (!X509_CRL_sort(crl) || !X509_CRL_sign(crl, key, EVP_sha256()))
+		crypto_err("can't sign CRL");
+	if ((fp = fopen(outfile, "w")) == NULL)
+		err(1, "%s", outfile);
+	if (!PEM_write_X509_CRL(fp, crl) || fclose(fp) == EOF)
+		err(1, "%s", outfile);
+	fprintf(stderr, "%s: %s CRL with %zu of %zu revocations, "
+	    "%zu removed\n", outfile, base ? "delta" : "full",
+	    entries, nrevoked, removed);
+	return 0;
+}
@@ -46,27 +46,32 @@ else
     subject="/emailAddress=${email}/C=CA/ST=Edmonton/O=Bob Beck/OU=Certificanator/CN=${CN}"
 fi
 
-if [ -z "$cflag"]; then
+if [ -z "$cflag" ]; then
     type="server_cert"
 else
-    type="user_cert"
+    type="usr_cert"
 fi
 
-if [ -z "$days"]; then
+if [ -z "$days" ]; then
     days="375"
 fi
 
 keyfile="${CN}.key"
-csrfile="${CN},csr"
+csrfile="${CN}.csr"
 crtfile="${CN}.crt"
 
 (cd intermediate && openssl genrsa -out private/${keyfile} 2048)
-(cd intermediate && openssl req -batch -config openssl.cnf -new -key private/client.key -subj "${subject}" -out csr/$csrfile)
-openssl ca -batch -config intermediate/openssl.cnf -extensions ${type} -days ${days} -notext -md sha256 -in intermediate/csr/${csrfile} -out intermediate/certs/${crtfile}
+(cd intermediate && openssl req -batch -config openssl.cnf -new -key private/${keyfile} -subj "${subject}" -out csr/$csrfile)
+openssl x509 -req -CA intermediate/certs/intermediate.cert.pem \
+    -CAkey intermediate/private/intermediate.key.pem \
+    -CAserial intermediate/serial -extfile intermediate/openssl.cnf \
+    -sha256 -extensions ${type} -days ${days} \
+    -in intermediate/csr/${csrfile} -out intermediate/certs/${crtfile} &&
+    ./certdb add intermediate/certs/${crtfile}
 if [ $? -eq 0 ]; then
     cp intermediate/private/${keyfile} ${keyfile}
     cp intermediate/certs/${crtfile} ${crtfile}
 else
-    echo "openssl ca appears to have been unhappy.. much sadness"
+    echo "issuing the certificate appears to have been unhappy.. much sadness"
     exit 1
 fi
@@ -0,0 +1,394 @@
+/*
+ * Copyright (c) 2018 Bob Beck <beck@obtuse.com>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/*
+ * An in-memory certificate authority for tests and benchmarks.
+ *
+ * The certificates look like the ones the tutorial CA makes, with the
+ * same extensions as the server_cert and usr_cert profiles, minus the
+ * OCSP pointer, since nothing can answer for these. Serial numbers are
+ * random, so a certificate made here never collides with one from
+ * another run.
+ */
+
+#include <openssl/bn.h>
+#include <openssl/ec.h>
+#include <openssl/evp.h>
+#include <openssl/objects.h>
+#include <openssl/pem.h>
+#include <openssl/rsa.h>
+#include <openssl/x509.h>
+#include <openssl/x509v3.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "memca.h"
+
+#define NKEYTYPES 4
+
+struct memca {
+	X509 *cert;			/* the intermediate we issue from */
+	EVP_PKEY *key;
+	uint8_t *cert_pem;		/* appended to every chain we issue */
+	size_t cert_pem_len;
+	uint8_t *root_pem;
+	size_t root_pem_len;
+	int reuse;
+	EVP_PKEY *leaf_key[NKEYTYPES];	/* when reusing keys */
+};
+
+int
+memca_keytype(const char *name)
+{
+	static const char *names[NKEYTYPES] = {
+		"rsa2048", "rsa4096", "ec256", "ec384"
+	};
+	int i;
+
+	for (i = 0; i < NKEYTYPES; i++)
+		if (strcmp(name, names[i]) == 0)
+			return i;
+	return -1;
+}
+
+static EVP_PKEY *
+genkey(int keytype)
+{
+	EVP_PKEY_CTX *ctx;
+	EVP_PKEY *pkey = NULL;
+	int rsa = keytype == MEMCA_RSA2048 || keytype == MEMCA_RSA4096;
+
+	if ((ctx = EVP_PKEY_CTX_new_id(rsa ? EVP_PKEY_RSA : EVP_PKEY_EC,
+	    NULL)) == NULL)
+		return NULL;
+	if (EVP_PKEY_keygen_init(ctx) <= 0)
+		goto done;
+	switch (keytype) {
+	case MEMCA_RSA2048:
+	case MEMCA_RSA4096:
+		if (EVP_PKEY_CTX_set_rsa_keygen_bits(ctx,
+		    keytype == MEMCA_RSA2048 ? 2048 : 4096) <= 0)
+			goto done;
+		break;
+	case MEMCA_EC256:
+	case MEMCA_EC384:
+		if (EVP_PKEY_CTX_set_ec_paramgen_curve_nid(ctx,
+		    keytype == MEMCA_EC256 ? NID_X9_62_prime256v1 :
+		    NID_secp384r1) <= 0)
+			goto done;
+		break;
+	default:
+		goto done;
+	}
+	if (EVP_PKEY_keygen(ctx, &pkey) <= 0)
+		pkey = NULL;
+ done:
+	EVP_PKEY_CTX_free(ctx);
+	return pkey;
+}
+
+static int
+add_ext(X509 *cert, X509 *issuer, int nid, const char *value)
+{
+	X509V3_CTX v3;
+	X509_EXTENSION *ext;
+	int ok;
+
+	X509V3_set_ctx(&v3, issuer, cert, NULL, NULL, 0);
+	if ((ext = X509V3_EXT_conf_nid(NULL, &v3, nid, (char *)value)) == NULL)
+		return 0;
+	ok = X509_add_ext(cert, ext, -1);
+	X509_EXTENSION_free(ext);
+	return ok;
+}
+
+static int
+random_serial(X509 *cert)
+{
+	ASN1_INTEGER *serial;
+	BIGNUM *bn;
+	int ok = 0;
+
+	/* 63 random bits, so it is always positive and never zero */
+	if ((bn = BN_new()) == NULL)
+		return 0;
+	if (BN_rand(bn, 63, 0, 0) &&
+	    (serial = BN_to_ASN1_INTEGER(bn, NULL)) != NULL) {
+		ok = X509_set_serialNumber(cert, serial);
+		ASN1_INTEGER_free(serial);
+	}
+	BN_free(bn);
+	return ok;
+}
+
+/*
+ * Make and sign a certificate. A NULL issuer makes it self signed.
+ * exts is a list of nid, value pairs, ending with NID_undef.
+ */
+static X509 *
+make_cert(const char *ou, const char *cn, EVP_PKEY *pkey, X509 *issuer,
+    EVP_PKEY *issuer_key, long long valid, const int *nids,
+    const char **values)
+{
+	X509_NAME *name;
+	X509 *cert;
+	int i;
+
+	if ((cert = X509_new()) == NULL)
+		return NULL;
+	if (!X509_set_version(cert, 2) || !random_serial(cert))
+		goto err;
+	/* back date a minute, in case our clocks disagree a little */
+	if (X509_gmtime_adj(X509_getm_notBefore(cert), -60) == NULL ||
+	    X509_gmtime_adj(X509_getm_notAfter(cert), valid) == NULL)
+		goto err;
+	name = X509_get_subject_name(cert);
+	if (!X509_NAME_add_entry_by_txt(name, "C", MBSTRING_ASC,
+	    (const unsigned char *)"CA", -1, -1, 0) ||
+	    !X509_NAME_add_entry_by_txt(name, "O", MBSTRING_ASC,
+	    (const unsigned char *)"Bob Beck", -1, -1, 0) ||
+	    !X509_NAME_add_entry_by_txt(name, "OU", MBSTRING_ASC,
+	    (const unsigned char *)ou, -1, -1, 0) ||
+	    !X509_NAME_add_entry_by_txt(name, "CN", MBSTRING_UTF8,
+	    (const unsigned char *)cn, -1, -1, 0))
+		goto err;
+	if (!X509_set_issuer_name(cert, issuer ?
+	    X509_get_subject_name(issuer) : name) ||
+	    !X509_set_pubkey(cert, pkey))
+		goto err;
+	for (i = 0; nids[i] != NID_undef; i++)
+		if (!add_ext(cert, issuer ? issuer : cert, nids[i], values[i]))
+			goto err;
+	if (!X509_sign(cert, issuer_key, EVP_sha256()))
+		goto err;
+	return cert;
+ err:
+	X509_free(cert);
+	return NULL;
+}
+
+/* PEM encode into a buffer of our own, optionally with more on the end */
+static int
+to_pem(X509 *cert, EVP_PKEY *pkey, const uint8_t *tail, size_t tail_len,
+    uint8_t **out, size_t *out_len)
+{
+	BIO *bio;
+	char *p;
+	long len;
+	int ok = 0;
+
+	*out = NULL;
+	*out_len = 0;
+	if ((bio = BIO_new(BIO_s_mem())) == NULL)
+		return 0;
+	if (cert != NULL && !PEM_write_bio_X509(bio, cert))
+		goto done;
+	if (pkey != NULL &&
+	    !PEM_write_bio_PrivateKey(bio, pkey, NULL, NULL, 0, NULL, NULL))
+		goto done;
+	if ((len = BIO_get_mem_data(bio, &p)) <= 0)
+		goto done;
+	if ((*out = malloc(len + tail_len)) == NULL)
+		goto done;
+	memcpy(*out, p, len);
+	if (tail_len > 0)
+		memcpy(*out + len, tail, tail_len);
+	*out_len = len + tail_len;
+	ok = 1;
+ done:
+	BIO_free(bio);
+	return ok;
+}
+
+static const int ca_nids[] = {
+	NID_subject_key_identifier, NID_authority_key_identifier,
+	NID_basic_constraints, NID_key_usage, NID_undef
+};
+
+struct memca *
+memca_new(int keytype, long long valid)
+{
+	static const char *root_values[] = {
+		"hash", "keyid:always", "critical,CA:true",
+		"critical,digitalSignature,cRLSign,keyCertSign"
+	};
+	static const char *int_values[] = {
+		"hash", "keyid:always", "critical,CA:true,pathlen:0",
+		"critical,digitalSignature,cRLSign,keyCertSign"
+	};
+	struct memca *ca;
+	EVP_PKEY *root_key = NULL;
+	X509 *root = NULL;
+
+	if ((ca = calloc(1, sizeof(*ca))) == NULL)
+		return NULL;
+	if ((root_key = genkey(keytype)) == NULL ||
+	    (root = make_cert("LibTLS Tutorial", "Memory Root CA Cert",
+	    root_key, NULL, root_key, valid, ca_nids, root_values)) == NULL)
+		goto err;
+	if ((ca->key = genkey(keytype)) == NULL ||
+	    (ca->cert = make_cert("LibTLS Tutorial",
+	    "Memory Intermediate CA Cert", ca->key, root, root_key, valid,
+	    ca_nids, int_values)) == NULL)
+		goto err;
+	if (!to_pem(root, NULL, NULL, 0, &ca->root_pem, &ca->root_pem_len) ||
+	    !to_pem(ca->cert, NULL, NULL, 0, &ca->cert_pem,
+	    &ca->cert_pem_len))
+		goto err;
+	X509_free(root);
+	EVP_PKEY_free(root_key);
+	return ca;
+ err:
+	X509_free(root);
+	EVP_PKEY_free(root_key);
+	memca_free(ca);
+	return NULL;
+}
+
+static void *
+read_pem(const char *path, int key)
+{
+	void *p;
+	FILE *fp;
+
+	if ((fp = fopen(path, "r")) == NULL)
+		return NULL;
+	p = key ? (void *)PEM_read_PrivateKey(fp, NULL, NULL, NULL) :
+	    (void *)PEM_read_X509(fp, NULL, NULL, NULL);
+	fclose(fp);
+	return p;
+}
+
+struct memca *
+memca_load(const char *certfile, const char *keyfile, const char *rootfile)
+{
+	struct memca *ca;
+	X509 *root = NULL;
+
+	if ((ca = calloc(1, sizeof(*ca))) == NULL)
+		return NULL;
+	if ((ca->cert = read_pem(certfile, 0)) == NULL ||
+	    (ca->key = read_pem(keyfile, 1)) == NULL ||
+	    !X509_check_private_key(ca->cert, ca->key))
+		goto err;
+	if ((root = read_pem(rootfile, 0)) == NULL)
+		goto err;
+	if (!to_pem(root, NULL, NULL, 0, &ca->root_pem, &ca->root_pem_len) ||
+	    !to_pem(ca->cert, NULL, NULL, 0, &ca->cert_pem,
+	    &ca->cert_pem_len))
+		goto err;
+	X509_free(root);
+	return ca;
+ err:
+	X509_free(root);
+	memca_free(ca);
+	return NULL;
+}
+
+void
+memca_free(struct memca *ca)
+{
+	int i;
+
+	if (ca == NULL)
+		return;
+	X509_free(ca->cert);
+	EVP_PKEY_free(ca->key);
+	for (i = 0; i < NKEYTYPES; i++)
+		EVP_PKEY_free(ca->leaf_key[i]);
+	free(ca->cert_pem);
+	free(ca->root_pem);
+	free(ca);
+}
+
+const uint8_t *
+memca_root(struct memca *ca, size_t *len)
+{
+	*len = ca->root_pem_len;
+	return ca->root_pem;
+}
+
+void
+memca_reuse_key(struct memca *ca, int reuse)
+{
+	ca->reuse = reuse;
+}
+
+int
+memca_issue(struct memca *ca, const char *name, int type, int keytype,
+    long long valid, struct memca_cred *cred)
+{
+	static const int leaf_nids[] = {
+		NID_basic_constraints, NID_subject_key_identifier,
+		NID_authority_key_identifier, NID_key_usage,
+		NID_ext_key_usage, NID_subject_alt_name, NID_undef
+	};
+	const char *values[6];
+	char san[300];
+	EVP_PKEY *pkey;
+	X509 *cert;
+	int ok;
+
+	memset(cred, 0, sizeof(*cred));
+	if (keytype < 0 || keytype >= NKEYTYPES)
+		return -1;
+	if (snprintf(san, sizeof(san), "DNS:%s", name) >= (int)sizeof(san))
+		return -1;
+	values[0] = "CA:FALSE";
+	values[1] = "hash";
+	values[2] = "keyid,issuer";
+	values[3] = "critical,digitalSignature,keyEncipherment";
+	values[4] = type == MEMCA_SERVER ? "serverAuth" : "clientAuth";
+	values[5] = san;
+
+	if (ca->reuse && ca->leaf_key[keytype] != NULL) {
+		pkey = ca->leaf_key[keytype];
+		EVP_PKEY_up_ref(pkey);
+	} else if ((pkey = genkey(keytype)) == NULL)
+		return -1;
+	if (ca->reuse && ca->leaf_key[keytype] == NULL) {
+		ca->leaf_key[keytype] = pkey;
+		EVP_PKEY_up_ref(pkey);
+	}
+	cert = make_cert(type == MEMCA_SERVER ?
+	    "LibTLS Tutorial Server Certs" : "LibTLS Tutorial Client Certs",
+	    name, pkey, ca->cert, ca->key, valid, leaf_nids, values);
+	ok = cert != NULL &&
+	    to_pem(cert, NULL, ca->cert_pem, ca->cert_pem_len, &cred->cert,
+	    &cred->cert_len) &&
+	    to_pem(NULL, pkey, NULL, 0, &cred->key, &cred->key_len);
+	X509_free(cert);
+	EVP_PKEY_free(pkey);
+	if (!ok) {
+		memca_cred_free(cred);
+		return -1;
+	}
+	return 0;
+}
+
+void
+memca_cred_free(struct memca_cred *cred)
+{
+	free(cred->cert);
+	if (cred->key != NULL) {
+		/* it's a private key, don't leave it lying around */
+		explicit_bzero(cred->key, cred->key_len);
+		free(cred->key);
+	}
+	memset(cred, 0, sizeof(*cred));
+}
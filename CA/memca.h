@@ -0,0 +1,82 @@
+/*
+ * Copyright (c) 2018 Bob Beck <beck@obtuse.com>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#ifndef MEMCA_H
+#define MEMCA_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * A certificate authority that lives entirely in memory, for making
+ * test and benchmark identities without touching the filesystem. It
+ * can make its own root and intermediate, or load an existing
+ * intermediate (such as the one ../CA makes), and issues server and
+ * client certificates from the intermediate. Everything comes back as
+ * PEM in memory, ready for tls_config_set_keypair_mem() and
+ * tls_config_set_ca_mem().
+ */
+
+#define MEMCA_RSA2048	0
+#define MEMCA_RSA4096	1
+#define MEMCA_EC256	2
+#define MEMCA_EC384	3
+
+#define MEMCA_SERVER	0
+#define MEMCA_CLIENT	1
+
+struct memca;
+
+struct memca_cred {
+	uint8_t *cert;		/* leaf, then the intermediate */
+	size_t cert_len;
+	uint8_t *key;
+	size_t key_len;
+};
+
+/* Parse "rsa2048", "rsa4096", "ec256" or "ec384" */
+int memca_keytype(const char *name);
+
+/* A new root and intermediate, valid for the given number of seconds */
+struct memca *memca_new(int keytype, long long valid);
+
+/* Issue from an existing intermediate, e.g. the one in ../CA */
+struct memca *memca_load(const char *certfile, const char *keyfile,
+    const char *rootfile);
+
+void memca_free(struct memca *ca);
+
+/* The root certificate, as PEM for tls_config_set_ca_mem() */
+const uint8_t *memca_root(struct memca *ca, size_t *len);
+
+/*
+ * Reuse one leaf key for everything we issue, rather than making a new
+ * key every time. Key generation is by far the slowest part, and many
+ * benchmarks only care that the certificates differ.
+ */
+void memca_reuse_key(struct memca *ca, int reuse);
+
+/*
+ * Issue a certificate for name, valid from now for valid seconds, with
+ * a new key of keytype. Returns -1 on failure.
+ */
+int memca_issue(struct memca *ca, const char *name, int type, int keytype,
+    long long valid, struct memca_cred *cred);
+
+/* Free what memca_issue() handed back */
+void memca_cred_free(struct memca_cred *cred);
+
+#endif /* MEMCA_H */
@@ -0,0 +1,380 @@
+/*
+ * Copyright (c) 2018 Bob Beck <beck@obtuse.com>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/*
+ * ocspd - a small OCSP responder for the intermediate CA, answering
+ * from the certificate database.
+ *
+ * "openssl ocsp" loads all of index.txt when it starts, and has to be
+ * restarted to see anything revoked after that. We look each serial
+ * up in the database instead, opening it afresh for every request, so
+ * the answer is always current and costs the same however many
+ * certificates the CA has issued.
+ *
+ * Like the openssl command it replaces, this is for testing. It takes
+ * one HTTP POST at a time and is not something to put on the internet.
+ */
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include <openssl/bn.h>
+#include <openssl/err.h>
+#include <openssl/evp.h>
+#include <openssl/ocsp.h>
+#include <openssl/pem.h>
+#include <openssl/x509.h>
+
+#include <err.h>
+#include <errno.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "certdb.h"
+
+#define MAXHEADER	8192
+#define MAXREQUEST	65536
+
+static const char *dbpath = "intermediate/certdb";
+static X509 *issuer, *signer;
+static EVP_PKEY *key;
+static long long minutes = 240;
+static int verbose;
+
+static void
+usage(void)
+{
+	extern char *__progname;
+
+	fprintf(stderr, "usage: %s [-v] [-C issuer] [-d db] [-k key] "
+	    "[-l address] [-n minutes]\n"
+	    "\t[-p port] [-r signer]\n", __progname);
+	exit(1);
+}
+
+static long long
+getnum(const char *s, long long min, long long max)
+{
+	char *ep;
+	long long n;
+
+	errno = 0;
+	n = strtoll(s, &ep, 10);
+	if (*s == '\0' || *ep != '\0')
+		errx(1, "%s - not a number", s);
+	if (errno == ERANGE || n < min || n > max)
+		errx(1, "%s - value out of range", s);
+	return n;
+}
+
+static void
+crypto_err(const char *what)
+{
+	ERR_print_errors_fp(stderr);
+	errx(1, "%s", what);
+}
+
+static X509 *
+read_cert(const char *path)
+{
+	X509 *cert;
+	FILE *fp;
+
+	if ((fp = fopen(path, "r")) == NULL)
+		err(1, "%s", path);
+	if ((cert = PEM_read_X509(fp, NULL, NULL, NULL)) == NULL)
+		crypto_err(path);
+	fclose(fp);
+	return cert;
+}
+
+/*
+ * The status of one certificate. Anything that isn't ours, or that
+ * we have never heard of, is unknown.
+ */
+static void
+add_status(OCSP_BASICRESP *bs, struct certdb *db, OCSP_CERTID *cid,
+    ASN1_TIME *thisupd, ASN1_TIME *nextupd)
+{
+	ASN1_OBJECT *md_obj;
+	ASN1_INTEGER *serial;
+	ASN1_TIME *revtime = NULL;
+	OCSP_CERTID *ours = NULL;
+	const EVP_MD *md;
+	struct certdb_rec rec;
+	BIGNUM *bn = NULL;
+	char *hex = NULL;
+	int status = V_OCSP_CERTSTATUS_UNKNOWN, reason = 0;
+
+	if (!OCSP_id_get0_info(NULL, &md_obj, NULL, &serial, cid) ||
+	    (md = EVP_get_digestbyobj(md_obj)) == NULL ||
+	    (ours = OCSP_cert_to_id(md, NULL, issuer)) == NULL ||
+	    OCSP_id_issuer_cmp(ours, cid) != 0)
+		goto done;
+	if ((bn = ASN1_INTEGER_to_BN(serial, NULL)) == NULL ||
+	    (hex = BN_bn2hex(bn)) == NULL)
+		crypto_err("serial number");
+	if (certdb_find_serial(db, hex, &rec) == -1)
+		goto done;
+	if (rec.status == CERTDB_REVOKED) {
+		status = V_OCSP_CERTSTATUS_REVOKED;
+		reason = rec.reason >= 0 ? rec.reason :
+		    OCSP_REVOKED_STATUS_NOSTATUS;
+		if ((revtime = ASN1_TIME_set(NULL, rec.revoked)) == NULL)
+			crypto_err("revocation time");
+	} else
+		status = V_OCSP_CERTSTATUS_GOOD;
+ done:
+	if (verbose)
+		fprintf(stderr, "serial %s: %s\n", hex ? hex : "(not ours)",
+		    OCSP_cert_status_str(status));
+	if (OCSP_basic_add1_status(bs, cid, status, reason, revtime,
+	    thisupd, nextupd) == NULL)
+		crypto_err("OCSP_basic_add1_status");
+	ASN1_TIME_free(revtime);
+	OCSP_CERTID_free(ours);
+	OPENSSL_free(hex);
+	BN_free(bn);
+}
+
+static OCSP_RESPONSE *
+respond(OCSP_REQUEST *req)
+{
+	OCSP_BASICRESP *bs;
+	OCSP_RESPONSE *resp;
+	ASN1_TIME *thisupd, *nextupd;
+	struct certdb db;
+	int i, n;
+
+	if ((n = OCSP_request_onereq_count(req)) <= 0)
+		return OCSP_response_create(
+		    OCSP_RESPONSE_STATUS_MALFORMEDREQUEST, NULL);
+	/* a shared lock, so we never see a half done add or revoke */
+	if (certdb_open(&db, dbpath, 0) == -1)
+		return OCSP_response_create(
+		    OCSP_RESPONSE_STATUS_INTERNALERROR, NULL);
+
+	if ((bs = OCSP_BASICRESP_new()) == NULL ||
+	    (thisupd = X509_gmtime_adj(NULL, 0)) == NULL ||
+	    (nextupd = X509_gmtime_adj(NULL, minutes * 60)) == NULL)
+		crypto_err("OCSP_BASICRESP_new");
+	for (i = 0; i < n; i++)
+		add_status(bs, &db, OCSP_onereq_get0_id(
+		    OCSP_request_onereq_get0(req, i)), thisupd, nextupd);
+	certdb_close(&db);
+
+	OCSP_copy_nonce(bs, req);
+	if (!OCSP_basic_sign(bs, signer, key, EVP_sha256(), NULL, 0))
+		crypto_err("can't sign response");
+	resp = OCSP_response_create(OCSP_RESPONSE_STATUS_SUCCESSFUL, bs);
+	ASN1_TIME_free(thisupd);
+	ASN1_TIME_free(nextupd);
+	OCSP_BASICRESP_free(bs);
+	return resp;
+}
+
+/*
+ * Find a header, whatever its case, in the request head that ends at
+ * end, returning what follows its colon.
+ */
+static const char *
+header(const char *head, const char *end, const char *name)
+{
+	size_t len = strlen(name);
+	const char *p;
+
+	for (p = strstr(head, "\r\n"); p != NULL && p < end;
+	    p = strstr(p + 2, "\r\n"))
+		if (strncasecmp(p + 2, name, len) == 0 && p[2 + len] == ':')
+			return p + 3 + len;
+	return NULL;
+}
+
+static int
+writeall(int fd, const unsigned char *p, size_t len)
+{
+	ssize_t n;
+
+	while (len > 0) {
+		if ((n = write(fd, p, len)) == -1) {
+			if (errno == EINTR)
+				continue;
+			return -1;
+		}
+		p += n;
+		len -= n;
+	}
+	return 0;
+}
+
+/*
+ * Read one HTTP POST of an OCSP request off the connection, and send
+ * back the answer.
+ */
+static void
+serve(int fd)
+{
+	static unsigned char buf[MAXHEADER + MAXREQUEST];
+	const unsigned char *p;
+	unsigned char *der = NULL;
+	OCSP_REQUEST *req;
+	OCSP_RESPONSE *resp;
+	char hdr[128], *body;
+	const char *cl;
+	size_t have = 0, need = 0;
+	ssize_t n;
+	int len;
+
+	for (;;) {
+		if ((n = read(fd, buf + have, sizeof(buf) - 1 - have)) <= 0) {
+			if (n == -1 && errno == EINTR)
+				continue;
+			return;
+		}
+		have += n;
+		buf[have] = '\0';
+		if ((body = strstr((char *)buf, "\r\n\r\n")) != NULL)
+			break;
+		if (have >= MAXHEADER)
+			return;
+	}
+	body += 4;
+	if (strncmp((char *)buf, "POST ", 5) != 0 ||
+	    (cl = header((char *)buf, body, "Content-Length")) == NULL ||
+	    (need = strtoul(cl, NULL, 10)) == 0 ||
+	    need > MAXREQUEST) {
+		writeall(fd, (const unsigned char *)"HTTP/1.0 400 Bad Request"
+		    "\r\n\r\n", 28);
+		return;
+	}
+	while (have - ((unsigned char *)body - buf) < need) {
+		if ((n = read(fd, buf + have, sizeof(buf) - 1 - have)) <= 0) {
+			if (n == -1 && errno == EINTR)
+				continue;
+			return;
+		}
+		have += n;
+	}
+
+	p = (unsigned char *)body;
+	if ((req = d2i_OCSP_REQUEST(NULL, &p, need)) == NULL)
+		resp = OCSP_response_create(
+		    OCSP_RESPONSE_STATUS_MALFORMEDREQUEST, NULL);
+	else
+		resp = respond(req);
+	if (resp == NULL || (len = i2d_OCSP_RESPONSE(resp, &der)) <= 0)
+		crypto_err("can't make response");
+	snprintf(hdr, sizeof(hdr), "HTTP/1.0 200 OK\r\n"
+	    "Content-Type: application/ocsp-response\r\n"
+	    "Content-Length: %d\r\n\r\n", len);
+	if (writeall(fd, (unsigned char *)hdr, strlen(hdr)) == 0)
+		writeall(fd, der, len);
+	OPENSSL_free(der);
+	OCSP_RESPONSE_free(resp);
+	OCSP_REQUEST_free(req);
+}
+
+int
+main(int argc, char *argv[])
+{
+	const char *issuerfile = "intermediate/certs/intermediate.cert.pem";
+	const char *signerfile = "intermediate/certs/ocsp-localhost.pem";
+	const char *keyfile = "intermediate/private/ocsp-localhost.key.pem";
+	const char *address = "127.0.0.1";
+	struct sockaddr_in sin;
+	struct timeval tv = { 5, 0 };
+	FILE *fp;
+	int ch, sd, fd, one = 1;
+	long long port = 2560;
+
+	while ((ch = getopt(argc, argv, "C:d:k:l:n:p:r:v")) != -1) {
+		switch (ch) {
+		case 'C':
+			issuerfile = optarg;
+			break;
+		case 'd':
+			dbpath = optarg;
+			break;
+		case 'k':
+			keyfile = optarg;
+			break;
+		case 'l':
+			address = optarg;
+			break;
+		case 'n':
+			minutes = getnum(optarg, 1, 60 * 24 * 365);
+			break;
+		case 'p':
+			port = getnum(optarg, 1, 65535);
+			break;
+		case 'r':
+			signerfile = optarg;
+			break;
+		case 'v':
+			verbose = 1;
+			break;
+		default:
+			usage();
+		}
+	}
+	if (optind != argc)
+		usage();
+
+	issuer = read_cert(issuerfile);
+	signer = read_cert(signerfile);
+	if ((fp = fopen(keyfile, "r")) == NULL)
+		err(1, "%s", keyfile);
+	if ((key = PEM_read_PrivateKey(fp, NULL, NULL, NULL)) == NULL)
+		crypto_err("can't read signing key");
+	fclose(fp);
+
+	memset(&sin, 0, sizeof(sin));
+	sin.sin_family = AF_INET;
+	sin.sin_port = htons(port);
+	if (inet_pton(AF_INET, address, &sin.sin_addr) != 1)
+		errx(1, "%s - not an IPv4 address", address);
+	if ((sd = socket(AF_INET, SOCK_STREAM, 0)) == -1)
+		err(1, "socket");
+	if (setsockopt(sd, SOL_SOCKET, SO_REUSEADDR, &one,
+	    sizeof(one)) == -1)
+		err(1, "setsockopt");
+	if (bind(sd, (struct sockaddr *)&sin, sizeof(sin)) == -1)
+		err(1, "bind %s:%lld", address, port);
+	if (listen(sd, 128) == -1)
+		err(1, "listen");
+	signal(SIGPIPE, SIG_IGN);
+
+	for (;;) {
+		if ((fd = accept(sd, NULL, NULL)) == -1) {
+			if (errno == EINTR || errno == ECONNABORTED)
+				continue;
+			err(1, "accept");
+		}
+		/* nobody gets to hold us up for long */
+		setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+		setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+		serve(fd);
+		close(fd);
+	}
+}
@@ -5,5 +5,9 @@
 # GOD KILLS A BAG OF KITTENS EVERY TIME SOMEONE EXPOSES THE OPENSSL COMMAND AS ATTACK SURFACE!
 # PLEASE THINK OF THE KITTENS
 
-openssl ocsp -port 127.0.0.1:2560 -text -sha256  -index intermediate/index.txt -CA chain.pem -rkey intermediate/private/ocsp-localhost.key.pem -rsigner intermediate/certs/ocsp-localhost.pem
+# We used to run "openssl ocsp -index intermediate/index.txt" here, but
+# that reads the whole index at startup and never notices revocations
+# after it. ocspd looks each request up in intermediate/certdb.
+
+make ocspd && ./ocspd -v -l 127.0.0.1 -p 2560 -n 240 -C intermediate/certs/intermediate.cert.pem -k intermediate/private/ocsp-localhost.key.pem -r intermediate/certs/ocsp-localhost.pem
 
@@ -14,81 +14,465 @@
  * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
  */
 
-/* client.c  - the "classic" example of a socket client */
+/* client.c  - the "classic" example of a socket client, now with TLS */
 #include <arpa/inet.h>
 
 #include <netinet/in.h>
 
 #include <sys/types.h>
+#include <sys/mman.h>
 #include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
 
 #include <err.h>
 #include <errno.h>
+#include <fcntl.h>
 #include <limits.h>
+#include <netdb.h>
 #include <signal.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
+#include <tls.h>
 #include <unistd.h>
 
-
+#include "connrace.h"
+#include "ocspcache.h"
 
 static void usage()
 {
 	extern char * __progname;
-	fprintf(stderr, "usage: %s ipaddress portnumber\n", __progname);
+	fprintf(stderr, "usage: %s [-C cafile] [-O cachefile] [-n stripes] "
+	    "[-u file]\n\thost portnumber\n", __progname);
 	exit(1);
 }
 
+static long long
+getnum(const char *s, long long min, long long max)
+{
+	char *ep;
+	long long n;
+
+	errno = 0;
+	n = strtoll(s, &ep, 10);
+	if (*s == '\0' || *ep != '\0')
+		errx(1, "%s - not a number", s);
+	if (errno == ERANGE || n < min || n > max)
+		errx(1, "%s - value out of range", s);
+	return n;
+}
+
+/*
+ * Get the TLS session saved from our last connection, so we can
+ * resume it, unless we no longer have a good OCSP result for the
+ * certificate it was for. A resumed session brings no staple with it,
+ * so the cached result is all we have to go on.
+ */
+static int
+session_open(struct ocsp_cache *cache)
+{
+	char path[1024];
+	int fd;
+
+	if (snprintf(path, sizeof(path), "%s.session", cache->path) >=
+	    (int)sizeof(path))
+		errx(1, "%s - cache file name too long", cache->path);
+	if ((fd = open(path, O_RDWR | O_CREAT, 0600)) == -1)
+		err(1, "can't open session file %s", path);
+	if (cache->session[0] == '\0' ||
+	    ocspcache_lookup(cache, cache->session, time(NULL)) == NULL) {
+		if (ftruncate(fd, 0) == -1)
+			err(1, "can't truncate session file %s", path);
+		cache->session[0] = '\0';
+	}
+	return fd;
+}
+
+/*
+ * Check the server's certificate status, from the staple libtls has
+ * already verified or, if we resumed a session, from the cache.
+ */
+static void
+staple_check(struct tls *tls_ctx, struct ocsp_cache *cache)
+{
+	struct ocsp_entry e, *cached;
+	const char *hash;
+	time_t now = time(NULL);
+
+	if ((hash = tls_peer_cert_hash(tls_ctx)) == NULL)
+		errx(1, "no server certificate hash");
+	cached = ocspcache_lookup(cache, hash, now);
+	if (tls_conn_session_resumed(tls_ctx) == 1) {
+		if (cached == NULL)
+			errx(1, "resumed a session with no cached OCSP status");
+		cache->hits++;
+		if (cached->status != TLS_OCSP_CERT_GOOD)
+			errx(1, "cached OCSP status for server is %d",
+			    cached->status);
+		fprintf(stderr, "OCSP status from cache, good until %s",
+		    ctime(&cached->next_update));
+	} else {
+		/* libtls has checked the signature on any staple by now */
+		if (tls_peer_ocsp_response_status(tls_ctx) !=
+		    TLS_OCSP_RESPONSE_SUCCESSFUL)
+			errx(1, "server did not staple a good OCSP response");
+		memset(&e, 0, sizeof(e));
+		snprintf(e.hash, sizeof(e.hash), "%s", hash);
+		e.digest = ocspcache_digest(tls_ctx);
+		e.status = tls_peer_ocsp_cert_status(tls_ctx);
+		e.next_update = tls_peer_ocsp_next_update(tls_ctx);
+		if (e.status != TLS_OCSP_CERT_GOOD)
+			errx(1, "OCSP status for server is %d", e.status);
+		if (cached != NULL && cached->digest == e.digest) {
+			/* the staple we already have, nothing new learned */
+			cache->hits++;
+			fprintf(stderr, "OCSP status from the cached staple, "
+			    "good until %s", ctime(&e.next_update));
+		} else {
+			cache->misses++;
+			fprintf(stderr, "OCSP status from a new staple, "
+			    "good until %s", ctime(&e.next_update));
+			if (e.next_update > now)
+				ocspcache_store(cache, &e);
+		}
+	}
+	snprintf(cache->session, sizeof(cache->session), "%s", hash);
+	fprintf(stderr, "OCSP cache: %llu hits, %llu misses\n", cache->hits,
+	    cache->misses);
+	ocspcache_save(cache);
+}
+
+static double
+seconds(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/*
+ * Send a file to a server started with -u: a line saying which part of
+ * which upload follows, "id offset length total", then those bytes of
+ * the file. We map the file rather than read it, so tls_write encrypts
+ * straight out of the page cache, and hand it over a megabyte at a
+ * time, which lets libtls fill whole records without us going round
+ * for each one. Telling the kernel we'll go through it in order gets
+ * it reading well ahead of us, and pages we've sent get dropped from
+ * our mapping so a big file doesn't pile up in our resident size.
+ *
+ * With -n the file goes in that many stripes of whole megabytes, each
+ * sent by a process of its own over a connection of its own, and the
+ * server puts them back together by offset. One connection can only
+ * have a window's worth in flight each round trip, which on a long
+ * link is much less than the link can carry, and one process can only
+ * encrypt as fast as one cpu can.
+ */
+#define UPLOAD_CHUNK (1024 * 1024)
+#define MAX_STRIPES 64
+
+struct upload {
+	unsigned char *map;
+	off_t size;
+	char id[17];		/* so the server can tell uploads apart */
+};
+
+static void
+upload_open(struct upload *up, const char *file)
+{
+	struct stat sb;
+	int fd;
+
+	if ((fd = open(file, O_RDONLY)) == -1)
+		err(1, "%s", file);
+	if (fstat(fd, &sb) == -1)
+		err(1, "%s", file);
+	if (!S_ISREG(sb.st_mode))
+		errx(1, "%s - not a regular file", file);
+	up->map = NULL;
+	up->size = sb.st_size;
+	if (sb.st_size > 0) {
+		up->map = mmap(NULL, sb.st_size, PROT_READ, MAP_SHARED, fd, 0);
+		if (up->map == MAP_FAILED)
+			err(1, "can't mmap %s", file);
+		if (madvise(up->map, sb.st_size, MADV_SEQUENTIAL) == -1)
+			warn("madvise");
+	}
+	close(fd);
+	snprintf(up->id, sizeof(up->id), "%08x%08x", arc4random(),
+	    arc4random());
+}
+
+static void
+upload_close(struct upload *up)
+{
+	if (up->map != NULL)
+		munmap(up->map, up->size);
+}
+
+/*
+ * Send stripe i of n, reporting progress on the way if asked to.
+ * Returns how many bytes of the file that was.
+ */
+static off_t
+upload(struct tls *tls_ctx, struct upload *up, int i, int n, int progress)
+{
+	char header[96];
+	double start, last, now;
+	off_t chunks, first, end, sent, done;
+	size_t len;
+	ssize_t w;
+
+	chunks = (up->size + UPLOAD_CHUNK - 1) / UPLOAD_CHUNK;
+	first = chunks * i / n * UPLOAD_CHUNK;
+	end = chunks * (i + 1) / n * UPLOAD_CHUNK;
+	if (end > up->size)
+		end = up->size;
+
+	len = snprintf(header, sizeof(header), "%s %lld %lld %lld\n",
+	    up->id, (long long)first, (long long)(end - first),
+	    (long long)up->size);
+	while (len > 0) {
+		w = tls_write(tls_ctx, header, len);
+		if (w == TLS_WANT_POLLIN || w == TLS_WANT_POLLOUT)
+			continue;
+		if (w == -1)
+			errx(1, "tls_write failed (%s)", tls_error(tls_ctx));
+		memmove(header, header + w, len - w);
+		len -= w;
+	}
+
+	start = last = seconds();
+	sent = done = first;
+	while (sent < end) {
+		len = end - sent < UPLOAD_CHUNK ? end - sent : UPLOAD_CHUNK;
+		w = tls_write(tls_ctx, up->map + sent, len);
+		if (w == TLS_WANT_POLLIN || w == TLS_WANT_POLLOUT)
+			continue;
+		if (w == -1)
+			errx(1, "tls_write failed (%s)", tls_error(tls_ctx));
+		sent += w;
+		/* done with these pages, whole ones only */
+		if (sent - done >= UPLOAD_CHUNK) {
+			len = (sent - done) & ~(UPLOAD_CHUNK - 1);
+			madvise(up->map + done, len, MADV_DONTNEED);
+			done += len;
+		}
+		if (progress && (now = seconds()) - last >= 1) {
+			fprintf(stderr, "\r%lld of %lld MB, %.1f MB/s",
+			    (long long)sent >> 20, (long long)up->size >> 20,
+			    sent / (now - start) / 1e6);
+			last = now;
+		}
+	}
+	if (progress) {
+		now = seconds();
+		fprintf(stderr, "%ssent %lld bytes in %.2f seconds, "
+		    "%.1f Mbit/s\n", last > start ? "\n" : "",
+		    (long long)sent, now - start,
+		    now > start ? sent * 8 / (now - start) / 1e6 : 0.0);
+	}
+	return end - first;
+}
+
+/*
+ * Connect to whichever address answers first, and do the handshake,
+ * expecting a certificate for host.
+ */
+static struct tls *
+dial(struct addrinfo *res, const char *host, struct tls_config *tls_cfg,
+    int *sdp)
+{
+	struct tls *tls_ctx;
+	int i, sd;
+
+	if ((tls_ctx = tls_client()) == NULL)
+		errx(1, "tls client creation failed");
+	if (tls_configure(tls_ctx, tls_cfg) == -1)
+		errx(1, "tls configuration failed (%s)", tls_error(tls_ctx));
+	if ((sd = connrace(res, CONNRACE_DELAY, 0)) == -1)
+		err(1, "connect failed");
+	if (tls_connect_socket(tls_ctx, sd, host) == -1)
+		errx(1, "tls connection failed (%s)", tls_error(tls_ctx));
+	do {
+		i = tls_handshake(tls_ctx);
+	} while (i == TLS_WANT_POLLIN || i == TLS_WANT_POLLOUT);
+	if (i == -1)
+		errx(1, "tls handshake failed (%s)", tls_error(tls_ctx));
+	*sdp = sd;
+	return tls_ctx;
+}
+
+/* One stripe's process. The server tells us how much it got */
+static int
+stripe(struct addrinfo *res, const char *host, struct tls_config *tls_cfg,
+    struct upload *up, int i, int n)
+{
+	struct tls *tls_ctx;
+	unsigned long long got;
+	char buffer[80];
+	off_t len;
+	ssize_t r = -1, rc = 0;
+	int sd;
+
+	tls_ctx = dial(res, host, tls_cfg, &sd);
+	len = upload(tls_ctx, up, i, n, 0);
+	while (r != 0 && rc < sizeof(buffer) - 1) {
+		r = tls_read(tls_ctx, buffer + rc, sizeof(buffer) - 1 - rc);
+		if (r == TLS_WANT_POLLIN || r == TLS_WANT_POLLOUT)
+			continue;
+		if (r == -1)
+			errx(1, "tls_read failed (%s)", tls_error(tls_ctx));
+		rc += r;
+	}
+	buffer[rc] = '\0';
+	if (sscanf(buffer, "received %llu bytes", &got) != 1 ||
+	    got != (unsigned long long)len) {
+		warnx("stripe %d: sent %lld bytes, server said \"%.*s\"", i,
+		    (long long)len, (int)strcspn(buffer, "\n"), buffer);
+		return 1;
+	}
+	do {
+		i = tls_close(tls_ctx);
+	} while (i == TLS_WANT_POLLIN || i == TLS_WANT_POLLOUT);
+	tls_free(tls_ctx);
+	close(sd);
+	return 0;
+}
+
+static void
+upload_striped(struct addrinfo *res, const char *host,
+    struct tls_config *tls_cfg, const char *file, int n)
+{
+	struct upload up;
+	double start, now;
+	pid_t pid;
+	int i, status, failed = 0;
+
+	upload_open(&up, file);
+	start = seconds();
+	for (i = 0; i < n; i++) {
+		if ((pid = fork()) == -1)
+			err(1, "fork");
+		if (pid == 0)
+			_exit(stripe(res, host, tls_cfg, &up, i, n));
+	}
+	while ((pid = wait(&status)) != -1 || errno == EINTR)
+		if (pid != -1 && (!WIFEXITED(status) ||
+		    WEXITSTATUS(status) != 0))
+			failed++;
+	now = seconds();
+	upload_close(&up);
+	if (failed)
+		errx(1, "%d of %d stripes failed", failed, n);
+	fprintf(stderr, "sent %lld bytes in %.2f seconds over %d "
+	    "connections, %.1f Mbit/s\n", (long long)up.size, now - start, n,
+	    now > start ? up.size * 8 / (now - start) / 1e6 : 0.0);
+}
+
 int main(int argc, char *argv[])
 {
-	struct sockaddr_in server_sa;
-	char buffer[80], *ep;
+	struct addrinfo hints, *res;
+	struct tls_config *tls_cfg = NULL;
+	struct tls *tls_ctx = NULL;
+	struct ocsp_cache cache;
+	const char *cafile = "../CA/root.pem";
+	const char *cachefile = NULL;
+	const char *uploadfile = NULL;
+	struct upload up;
+	char buffer[80];
 	size_t maxread;
 	ssize_t r, rc;
-	u_short port;
-	u_long p;
-	int sd;
+	int ch, error, i, sd, sessionfd = -1, stripes = 0;
 
-	if (argc != 3)
-		usage();
+	while ((ch = getopt(argc, argv, "C:n:O:u:")) != -1) {
+		switch (ch) {
+		case 'C':
+			cafile = optarg;
+			break;
+		case 'n':
+			stripes = getnum(optarg, 1, MAX_STRIPES);
+			break;
+		case 'O':
+			cachefile = optarg;
+			break;
+		case 'u':
+			uploadfile = optarg;
+			break;
+		default:
+			usage();
+		}
+	}
+	argc -= optind;
+	argv += optind;
 
-        p = strtoul(argv[2], &ep, 10);
-        if (*argv[2] == '\0' || *ep != '\0') {
-		/* parameter wasn't a number, or was empty */
-		fprintf(stderr, "%s - not a number\n", argv[2]);
+	if (argc != 2)
 		usage();
-	}
-        if ((errno == ERANGE && p == ULONG_MAX) || (p > USHRT_MAX)) {
-		/* It's a number, but it either can't fit in an unsigned
-		 * long, or is too big for an unsigned short
-		 */
-		fprintf(stderr, "%s - value out of range\n", argv[2]);
+	if (stripes > 0 && uploadfile == NULL)
+		errx(1, "-n is for striping an upload with -u");
+	/* the stripes would all be saving their sessions at once */
+	if (stripes > 0 && cachefile != NULL)
+		errx(1, "-n and -O don't go together");
+
+	/*
+	 * look up the server. It may have several addresses, of either
+	 * family, and we will race connections to all of them.
+	 */
+	memset(&hints, 0, sizeof(hints));
+	hints.ai_family = AF_UNSPEC;
+	hints.ai_socktype = SOCK_STREAM;
+	if ((error = getaddrinfo(argv[0], argv[1], &hints, &res)) != 0) {
+		fprintf(stderr, "%s %s: %s\n", argv[0], argv[1],
+		    gai_strerror(error));
 		usage();
 	}
-	/* now safe to do this */
-	port = p;
 
 	/*
-	 * first set up "server_sa" to be the location of the server
+	 * set up TLS. We verify the server's certificate against our
+	 * root, and check it is for the host named on the command line.
+	 * The tutorial CA makes the server certificate for "localhost",
+	 * so that is the name to give rather than an address.
 	 */
-	memset(&server_sa, 0, sizeof(server_sa));
-	server_sa.sin_family = AF_INET;
-	server_sa.sin_port = htons(port);
-	server_sa.sin_addr.s_addr = inet_addr(argv[1]);
-	if (server_sa.sin_addr.s_addr == INADDR_NONE) {
-		fprintf(stderr, "Invalid IP address %s\n", argv[1]);
-		usage();
+	if (tls_init() == -1)
+		errx(1, "unable to initialize TLS");
+	if ((tls_cfg = tls_config_new()) == NULL)
+		errx(1, "unable to allocate TLS config");
+	if (tls_config_set_ca_file(tls_cfg, cafile) == -1)
+		errx(1, "unable to set root CA file %s", cafile);
+	if (cachefile != NULL) {
+		/*
+		 * insist on a stapled OCSP response, but keep what we
+		 * learn from it so we can skip checking it again. We
+		 * can't use tls_config_ocsp_require_stapling for this,
+		 * as it would also insist on a staple when we resume a
+		 * session, so we require it ourselves in staple_check.
+		 */
+		ocspcache_load(&cache, cachefile);
+		sessionfd = session_open(&cache);
+		if (tls_config_set_session_fd(tls_cfg, sessionfd) == -1)
+			errx(1, "unable to set session file (%s)",
+			    tls_config_error(tls_cfg));
+	}
+	if (stripes > 0) {
+		upload_striped(res, argv[0], tls_cfg, uploadfile, stripes);
+		freeaddrinfo(res);
+		tls_config_free(tls_cfg);
+		return(0);
 	}
 
-	/* ok now get a socket. we don't care where... */
-	if ((sd=socket(AF_INET,SOCK_STREAM,0)) == -1)
-		err(1, "socket failed");
+	/* ok now get a socket connected to whichever address answers */
+	tls_ctx = dial(res, argv[0], tls_cfg, &sd);
+	freeaddrinfo(res);
 
-	/* connect the socket to the server described in "server_sa" */
-	if (connect(sd, (struct sockaddr *)&server_sa, sizeof(server_sa))
-	    == -1)
-		err(1, "connect failed");
+	if (cachefile != NULL)
+		staple_check(tls_ctx, &cache);
+	if (uploadfile != NULL) {
+		upload_open(&up, uploadfile);
+		upload(tls_ctx, &up, 0, 1, 1);
+		upload_close(&up);
+	}
 
 	/*
 	 * finally, we are connected. find out what magnificent wisdom
@@ -100,19 +484,19 @@ int main(int argc, char *argv[])
 	 * is going to send us an entire message, then close the connection
 	 * to us, so that we see an end-of-file condition on the read.
 	 *
-	 * we also make sure we handle EINTR in case we got interrupted
-	 * by a signal.
+	 * tls_read may want us to go around again without having read
+	 * anything, in which case we just try again.
 	 */
 	r = -1;
 	rc = 0;
 	maxread = sizeof(buffer) - 1; /* leave room for a 0 byte */
 	while ((r != 0) && rc < maxread) {
-		r = read(sd, buffer + rc, maxread - rc);
-		if (r == -1) {
-			if (errno != EINTR)
-				err(1, "read failed");
-		} else
-			rc += r;
+		r = tls_read(tls_ctx, buffer + rc, maxread - rc);
+		if (r == TLS_WANT_POLLIN || r == TLS_WANT_POLLOUT)
+			continue;
+		if (r == -1)
+			errx(1, "tls_read failed (%s)", tls_error(tls_ctx));
+		rc += r;
 	}
 	/*
 	 * we must make absolutely sure buffer has a terminating 0 byte
@@ -121,6 +505,13 @@ int main(int argc, char *argv[])
 	buffer[rc] = '\0';
 
 	printf("Server sent:  %s",buffer);
+	do {
+		i = tls_close(tls_ctx);
+	} while (i == TLS_WANT_POLLIN || i == TLS_WANT_POLLOUT);
+	tls_free(tls_ctx);
+	tls_config_free(tls_cfg);
+	if (sessionfd != -1)
+		close(sessionfd);
 	close(sd);
 	return(0);
 }
@@ -0,0 +1,206 @@
+/*
+ * Copyright (c) 2018 Bob Beck <beck@obtuse.com>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include <sys/types.h>
+#include <sys/socket.h>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <netdb.h>
+#include <poll.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "connrace.h"
+
+static long long
+now_ms(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000LL + ts.tv_nsec / 1000000;
+}
+
+/* Put the addresses in the order we will try them */
+static int
+order(const struct addrinfo *res, const struct addrinfo **ai)
+{
+	const struct addrinfo *r, *first[CONNRACE_MAX], *other[CONNRACE_MAX];
+	int i, n = 0, nfirst = 0, nother = 0;
+
+	for (r = res; r != NULL && nfirst + nother < CONNRACE_MAX;
+	    r = r->ai_next) {
+		if (r->ai_family == res->ai_family)
+			first[nfirst++] = r;
+		else
+			other[nother++] = r;
+	}
+	for (i = 0; i < nfirst || i < nother; i++) {
+		if (i < nfirst)
+			ai[n++] = first[i];
+		if (i < nother)
+			ai[n++] = other[i];
+	}
+	return n;
+}
+
+/* Start connecting to ai, returning the socket or -1 */
+static int
+attempt(const struct addrinfo *ai, int *connected)
+{
+	int fd, flags;
+
+	*connected = 0;
+	if ((fd = socket(ai->ai_family, ai->ai_socktype,
+	    ai->ai_protocol)) == -1)
+		return -1;
+	if ((flags = fcntl(fd, F_GETFL)) == -1 ||
+	    fcntl(fd, F_SETFL, flags | O_NONBLOCK) == -1)
+		goto fail;
+	if (connect(fd, ai->ai_addr, ai->ai_addrlen) == 0) {
+		*connected = 1;
+		return fd;
+	}
+	if (errno == EINPROGRESS)
+		return fd;
+ fail:
+	flags = errno;
+	close(fd);
+	errno = flags;
+	return -1;
+}
+
+void
+connrace_start(struct connrace *cr, const struct addrinfo *res,
+    int delay_ms, int timeout_ms)
+{
+	long long now = now_ms();
+
+	cr->n = order(res, cr->ai);
+	cr->next = cr->npfd = 0;
+	cr->delay_ms = delay_ms;
+	cr->next_start = now;
+	cr->deadline = timeout_ms > 0 ? now + timeout_ms : 0;
+	cr->error = cr->n == 0 ? EADDRNOTAVAIL : ETIMEDOUT;
+}
+
+/*
+ * Run the race until something connects or everything has failed, or,
+ * if we may not wait, until nothing more can happen without waiting.
+ */
+static int
+race(struct connrace *cr, int wait)
+{
+	long long now;
+	socklen_t len;
+	int connected, error, fd = -1, i, ms, nready;
+
+	while (fd == -1) {
+		now = now_ms();
+		if (cr->deadline != 0 && now >= cr->deadline) {
+			cr->error = ETIMEDOUT;
+			break;
+		}
+		/* time for another attempt? */
+		if (cr->next < cr->n &&
+		    (cr->npfd == 0 || now >= cr->next_start)) {
+			fd = attempt(cr->ai[cr->next++], &connected);
+			if (fd == -1) {
+				cr->error = errno;
+				continue;
+			}
+			if (connected)
+				break;
+			cr->pfd[cr->npfd].fd = fd;
+			cr->pfd[cr->npfd].events = POLLOUT;
+			cr->npfd++;
+			cr->next_start = now + cr->delay_ms;
+			fd = -1;
+		}
+		if (cr->npfd == 0)
+			break;	/* nothing left to try */
+
+		ms = 0;
+		if (wait) {
+			ms = -1;
+			if (cr->next < cr->n)
+				ms = cr->next_start > now ?
+				    cr->next_start - now : 0;
+			if (cr->deadline != 0 &&
+			    (ms == -1 || cr->deadline - now < ms))
+				ms = cr->deadline - now;
+		}
+		if ((nready = poll(cr->pfd, cr->npfd, ms)) == -1) {
+			if (errno == EINTR)
+				continue;
+			cr->error = errno;
+			break;
+		}
+		for (i = cr->npfd - 1; i >= 0; i--) {
+			if (cr->pfd[i].revents == 0)
+				continue;
+			len = sizeof(error);
+			if (getsockopt(cr->pfd[i].fd, SOL_SOCKET, SO_ERROR,
+			    &error, &len) == -1)
+				error = errno;
+			if (error == 0) {
+				fd = cr->pfd[i].fd;
+				cr->pfd[i] = cr->pfd[--cr->npfd];
+				break;
+			}
+			/* this one failed, so don't wait to start another */
+			close(cr->pfd[i].fd);
+			cr->pfd[i] = cr->pfd[--cr->npfd];
+			cr->next_start = now;
+			cr->error = error;
+		}
+		if (fd == -1 && !wait && nready == 0)
+			return CONNRACE_PENDING;
+	}
+
+	for (i = 0; i < cr->npfd; i++)
+		close(cr->pfd[i].fd);
+	cr->npfd = 0;
+	if (fd == -1)
+		errno = cr->error;
+	return fd;
+}
+
+int
+connrace_step(struct connrace *cr)
+{
+	return race(cr, 0);
+}
+
+int
+connrace(const struct addrinfo *res, int delay_ms, int timeout_ms)
+{
+	struct connrace cr;
+	int error, fd, flags;
+
+	connrace_start(&cr, res, delay_ms, timeout_ms);
+	if ((fd = race(&cr, 1)) == -1)
+		return -1;
+	if ((flags = fcntl(fd, F_GETFL)) == -1 ||
+	    fcntl(fd, F_SETFL, flags & ~O_NONBLOCK) == -1) {
+		error = errno;
+		close(fd);
+		errno = error;
+		return -1;
+	}
+	return fd;
+}
@@ -0,0 +1,66 @@
+/*
+ * Copyright (c) 2018 Bob Beck <beck@obtuse.com>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#ifndef CONNRACE_H
+#define CONNRACE_H
+
+#include <netdb.h>
+#include <poll.h>
+
+/*
+ * Connect to whichever of a list of addresses answers first, in the
+ * style of Happy Eyeballs (RFC 8305). We start a non-blocking connect
+ * to the first address, and if it hasn't connected after delay_ms, we
+ * start one to the next as well, and so on, moving on at once whenever
+ * an attempt fails. The first to connect wins and the rest are closed.
+ * Addresses are tried alternating between families, starting with the
+ * family of the first one.
+ */
+
+#define CONNRACE_DELAY	250	/* RFC 8305's recommended attempt delay */
+#define CONNRACE_MAX	32	/* most addresses we will try */
+
+/*
+ * Returns a connected, blocking, socket, or -1 with errno set from the
+ * last attempt to fail, or to ETIMEDOUT if nothing connected within
+ * timeout_ms (0 to wait as long as the kernel does).
+ */
+int connrace(const struct addrinfo *res, int delay_ms, int timeout_ms);
+
+/*
+ * The same race, for callers with a poll loop of their own that can't
+ * wait in connrace(). connrace_start() sets one up, and each call to
+ * connrace_step() moves it along without blocking. That returns
+ * CONNRACE_PENDING until the race is over, and then a connected,
+ * non-blocking, socket, or -1 with errno set as connrace() would.
+ */
+
+#define CONNRACE_PENDING	-2
+
+struct connrace {
+	const struct addrinfo *ai[CONNRACE_MAX];	/* in the order tried */
+	struct pollfd pfd[CONNRACE_MAX];	/* attempts in progress */
+	int n, next, npfd;
+	int delay_ms;
+	long long next_start, deadline;
+	int error;			/* from the last attempt to fail */
+};
+
+void connrace_start(struct connrace *cr, const struct addrinfo *res,
+    int delay_ms, int timeout_ms);
+int connrace_step(struct connrace *cr);
+
+#endif /* CONNRACE_H */
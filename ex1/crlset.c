@@ -0,0 +1,271 @@
+/*
+ * Copyright (c) 2018 Bob Beck <beck@obtuse.com>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/*
+ * An in-memory revocation set built from a base CRL and delta CRLs.
+ *
+ * We keep the serials in sorted arrays and binary search them, which
+ * is about as small and as fast as it gets for a set that only changes
+ * when a new CRL shows up.
+ */
+
+#include <openssl/pem.h>
+#include <openssl/x509.h>
+#include <openssl/x509v3.h>
+
+#include <err.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "crlset.h"
+
+#define REASON_REMOVE 8		/* removeFromCRL */
+
+static int
+serial_cmp(const void *a, const void *b)
+{
+	const struct crl_serial *x = a, *y = b;
+
+	if (x->len != y->len)
+		return x->len < y->len ? -1 : 1;
+	return memcmp(x->b, y->b, x->len);
+}
+
+static int
+serial_set(struct crl_serial *s, const ASN1_INTEGER *ai)
+{
+	const unsigned char *p = ASN1_STRING_get0_data(ai);
+	int len = ASN1_STRING_length(ai);
+
+	/* leading zeros don't make it a different serial */
+	while (len > 1 && *p == 0) {
+		p++;
+		len--;
+	}
+	if (len > (int)sizeof(s->b))
+		return 0;
+	memset(s, 0, sizeof(*s));
+	s->len = len;
+	memcpy(s->b, p, len);
+	return 1;
+}
+
+/*
+ * Read and check a CRL. It has to be signed by one of the certificates
+ * in cafile.
+ */
+static X509_CRL *
+crl_read(const char *crlfile, const char *cafile)
+{
+	X509_CRL *crl = NULL;
+	EVP_PKEY *pkey;
+	X509 *x;
+	FILE *fp;
+	int ok = 0;
+
+	if ((fp = fopen(crlfile, "r")) == NULL) {
+		warn("%s", crlfile);
+		return NULL;
+	}
+	crl = PEM_read_X509_CRL(fp, NULL, NULL, NULL);
+	fclose(fp);
+	if (crl == NULL) {
+		warnx("%s: can't read CRL", crlfile);
+		return NULL;
+	}
+	if ((fp = fopen(cafile, "r")) == NULL) {
+		warn("%s", cafile);
+		X509_CRL_free(crl);
+		return NULL;
+	}
+	while (!ok && (x = PEM_read_X509(fp, NULL, NULL, NULL)) != NULL) {
+		if (X509_NAME_cmp(X509_get_subject_name(x),
+		    X509_CRL_get_issuer(crl)) == 0 &&
+		    (pkey = X509_get_pubkey(x)) != NULL) {
+			ok = X509_CRL_verify(crl, pkey) > 0;
+			EVP_PKEY_free(pkey);
+		}
+		X509_free(x);
+	}
+	fclose(fp);
+	if (!ok) {
+		warnx("%s: not signed by a certificate in %s", crlfile, cafile);
+		X509_CRL_free(crl);
+		return NULL;
+	}
+	return crl;
+}
+
+static long
+crl_ext_number(X509_CRL *crl, int nid)
+{
+	ASN1_INTEGER *ai;
+	long n;
+
+	if ((ai = X509_CRL_get_ext_d2i(crl, nid, NULL, NULL)) == NULL)
+		return -1;
+	n = ASN1_INTEGER_get(ai);
+	ASN1_INTEGER_free(ai);
+	return n;
+}
+
+/* Turn a CRL's entries into a sorted array */
+static struct crl_serial *
+crl_serials(X509_CRL *crl, size_t *count)
+{
+	STACK_OF(X509_REVOKED) *revs = X509_CRL_get_REVOKED(crl);
+	struct crl_serial *s;
+	ASN1_ENUMERATED *reason;
+	X509_REVOKED *rev;
+	size_t i, n = 0;
+
+	*count = revs ? sk_X509_REVOKED_num(revs) : 0;
+	if ((s = calloc(*count + 1, sizeof(*s))) == NULL)
+		return NULL;
+	for (i = 0; i < *count; i++) {
+		rev = sk_X509_REVOKED_value(revs, i);
+		if (!serial_set(&s[n], X509_REVOKED_get0_serialNumber(rev)))
+			continue;
+		if ((reason = X509_REVOKED_get_ext_d2i(rev, NID_crl_reason,
+		    NULL, NULL)) != NULL) {
+			s[n].removed = ASN1_ENUMERATED_get(reason) ==
+			    REASON_REMOVE;
+			ASN1_ENUMERATED_free(reason);
+		}
+		n++;
+	}
+	*count = n;
+	qsort(s, n, sizeof(*s), serial_cmp);
+	return s;
+}
+
+int
+crlset_load_base(struct crlset *set, const char *crlfile, const char *cafile)
+{
+	struct crl_serial *s;
+	X509_NAME *issuer;
+	X509_CRL *crl;
+	size_t n;
+
+	if ((crl = crl_read(crlfile, cafile)) == NULL)
+		return -1;
+	if (crl_ext_number(crl, NID_delta_crl) != -1) {
+		warnx("%s: is a delta CRL, not a base", crlfile);
+		X509_CRL_free(crl);
+		return -1;
+	}
+	if ((s = crl_serials(crl, &n)) == NULL) {
+		warn("%s", crlfile);
+		X509_CRL_free(crl);
+		return -1;
+	}
+	if ((issuer = X509_NAME_dup(X509_CRL_get_issuer(crl))) == NULL) {
+		warnx("%s: can't copy issuer", crlfile);
+		free(s);
+		X509_CRL_free(crl);
+		return -1;
+	}
+	X509_NAME_free(set->issuer);
+	set->issuer = issuer;
+	free(set->base);
+	set->base = s;
+	set->nbase = n;
+	set->base_number = crl_ext_number(crl, NID_crl_number);
+	/* a delta for an older base can't be trusted to cover this one */
+	if (set->delta != NULL && set->delta_base < set->base_number) {
+		free(set->delta);
+		set->delta = NULL;
+		set->ndelta = 0;
+	}
+	X509_CRL_free(crl);
+	return 0;
+}
+
+int
+crlset_load_delta(struct crlset *set, const char *crlfile, const char *cafile)
+{
+	struct crl_serial *s;
+	X509_CRL *crl;
+	long base;
+	size_t n;
+
+	if ((crl = crl_read(crlfile, cafile)) == NULL)
+		return -1;
+	/*
+	 * A delta can be applied to any base at least as new as the one
+	 * it names, but not to an older one.
+	 */
+	if ((base = crl_ext_number(crl, NID_delta_crl)) == -1 ||
+	    base > set->base_number) {
+		warnx("%s: not a delta CRL for base CRL %ld", crlfile,
+		    set->base_number);
+		X509_CRL_free(crl);
+		return -1;
+	}
+	/* and it has to be about the same certificates */
+	if (set->issuer == NULL ||
+	    X509_NAME_cmp(X509_CRL_get_issuer(crl), set->issuer) != 0) {
+		warnx("%s: not from the issuer of the base CRL", crlfile);
+		X509_CRL_free(crl);
+		return -1;
+	}
+	if ((s = crl_serials(crl, &n)) == NULL) {
+		warn("%s", crlfile);
+		X509_CRL_free(crl);
+		return -1;
+	}
+	free(set->delta);
+	set->delta = s;
+	set->ndelta = n;
+	set->delta_base = base;
+	X509_CRL_free(crl);
+	return 0;
+}
+
+static int
+crlset_revoked(const struct crlset *set, const struct crl_serial *key)
+{
+	const struct crl_serial *s;
+
+	if (set->ndelta > 0 && (s = bsearch(key, set->delta, set->ndelta,
+	    sizeof(*key), serial_cmp)) != NULL)
+		return !s->removed;
+	return set->nbase > 0 && bsearch(key, set->base, set->nbase,
+	    sizeof(*key), serial_cmp) != NULL;
+}
+
+int
+crlset_revoked_pem(const struct crlset *set, const uint8_t *pem, size_t len)
+{
+	struct crl_serial key;
+	BIO *bio;
+	X509 *x;
+	int ret = -1;
+
+	if (pem == NULL || (bio = BIO_new_mem_buf(pem, len)) == NULL)
+		return -1;
+	if ((x = PEM_read_bio_X509(bio, NULL, NULL, NULL)) != NULL) {
+		/* a serial only means something to the CA that issued it */
+		if (set->issuer != NULL && X509_NAME_cmp(
+		    X509_get_issuer_name(x), set->issuer) == 0 &&
+		    serial_set(&key, X509_get_serialNumber(x)))
+			ret = crlset_revoked(set, &key);
+		X509_free(x);
+	}
+	BIO_free(bio);
+	return ret;
+}
@@ -0,0 +1,60 @@
+/*
+ * Copyright (c) 2018 Bob Beck <beck@obtuse.com>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#ifndef CRLSET_H
+#define CRLSET_H
+
+#include <openssl/x509.h>
+
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * The set of revoked serial numbers from a base CRL plus the latest
+ * delta CRL against it. A delta carries every change since its base,
+ * so loading a new one only ever replaces the previous delta - the
+ * base, which is the big part, stays put until it is reissued.
+ */
+
+struct crl_serial {
+	unsigned char len;
+	unsigned char removed;		/* delta says removeFromCRL */
+	unsigned char b[20];		/* RFC 5280 caps serials at 20 */
+};
+
+struct crlset {
+	struct crl_serial *base, *delta;
+	X509_NAME *issuer;		/* whose certificates these are */
+	size_t nbase, ndelta;
+	long base_number;		/* CRL number of the base */
+	long delta_base;		/* base number the delta applies to */
+};
+
+/* Load a base CRL, or a delta against it, checking the signature */
+int crlset_load_base(struct crlset *set, const char *crlfile,
+    const char *cafile);
+int crlset_load_delta(struct crlset *set, const char *crlfile,
+    const char *cafile);
+
+/*
+ * Is the first certificate in a PEM chain revoked? Returns -1 if we
+ * can't tell, which includes a certificate from some other issuer
+ * than the one that signed the CRLs.
+ */
+int crlset_revoked_pem(const struct crlset *set, const uint8_t *pem,
+    size_t len);
+
+#endif /* CRLSET_H */
@@ -0,0 +1,161 @@
+/*
+ * Copyright (c) 2018 Bob Beck <beck@obtuse.com>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/*
+ * Handshake cpu time, by class.
+ *
+ * A class is the protocol version, cipher, our key type, and whether
+ * the session was resumed. There are only ever a handful of those, so
+ * they live in a small fixed table, and anything past the end of it is
+ * lumped into a last "other" class.
+ */
+
+#include <sys/types.h>
+
+#include <openssl/evp.h>
+#include <openssl/pem.h>
+
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <tls.h>
+
+#include "hsstats.h"
+
+#define HS_CLASSES 32
+
+struct hs_class {
+	struct hs_sample key;		/* cpu and wall are totals here */
+	unsigned long long count;
+};
+
+static struct hs_class classes[HS_CLASSES];
+static int nclasses;
+
+uint64_t
+hs_cputime(void)
+{
+	struct timespec ts;
+
+	if (clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts) == -1)
+		return 0;
+	return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+const char *
+hs_keytype(const char *keyfile)
+{
+	static char buf[16];
+	EVP_PKEY *pkey;
+	FILE *fp;
+
+	snprintf(buf, sizeof(buf), "unknown");
+	if ((fp = fopen(keyfile, "r")) == NULL)
+		return buf;
+	if ((pkey = PEM_read_PrivateKey(fp, NULL, NULL, NULL)) != NULL) {
+		switch (EVP_PKEY_base_id(pkey)) {
+		case EVP_PKEY_RSA:
+			snprintf(buf, sizeof(buf), "rsa%d",
+			    EVP_PKEY_bits(pkey));
+			break;
+		case EVP_PKEY_EC:
+			snprintf(buf, sizeof(buf), "ec%d",
+			    EVP_PKEY_bits(pkey));
+			break;
+		default:
+			snprintf(buf, sizeof(buf), "type%d",
+			    EVP_PKEY_base_id(pkey));
+			break;
+		}
+		EVP_PKEY_free(pkey);
+	}
+	fclose(fp);
+	return buf;
+}
+
+void
+hs_classify(struct hs_sample *hs, struct tls *ctx, const char *keytype)
+{
+	const char *s;
+
+	s = tls_conn_version(ctx);
+	snprintf(hs->version, sizeof(hs->version), "%s", s ? s : "none");
+	s = tls_conn_cipher(ctx);
+	snprintf(hs->cipher, sizeof(hs->cipher), "%s", s ? s : "none");
+	snprintf(hs->keytype, sizeof(hs->keytype), "%s", keytype);
+	hs->resumed = tls_conn_session_resumed(ctx) == 1;
+}
+
+static int
+same_class(const struct hs_sample *a, const struct hs_sample *b)
+{
+	return a->resumed == b->resumed &&
+	    strcmp(a->version, b->version) == 0 &&
+	    strcmp(a->cipher, b->cipher) == 0 &&
+	    strcmp(a->keytype, b->keytype) == 0;
+}
+
+void
+hs_account(const struct hs_sample *hs)
+{
+	struct hs_class *c;
+	int i;
+
+	for (i = 0; i < nclasses; i++)
+		if (same_class(&classes[i].key, hs))
+			break;
+	if (i == nclasses) {
+		if (nclasses < HS_CLASSES)
+			nclasses++;
+		else
+			i--;
+		c = &classes[i];
+		if (i == HS_CLASSES - 1) {
+			/* out of room, lump the rest together */
+			snprintf(c->key.version, sizeof(c->key.version),
+			    "other");
+			snprintf(c->key.cipher, sizeof(c->key.cipher), "other");
+			snprintf(c->key.keytype, sizeof(c->key.keytype),
+			    "other");
+			c->key.resumed = -1;
+		} else {
+			c->key = *hs;
+			c->key.cpu_nsec = c->key.wall_usec = 0;
+		}
+	}
+	c = &classes[i];
+	c->count++;
+	c->key.cpu_nsec += hs->cpu_nsec;
+	c->key.wall_usec += hs->wall_usec;
+}
+
+void
+hs_report(int fd)
+{
+	struct hs_class *c;
+	int i;
+
+	for (i = 0; i < nclasses; i++) {
+		c = &classes[i];
+		dprintf(fd, "handshake %s %s %s %s count %llu "
+		    "cpu_usec_avg %llu wall_usec_avg %llu\n",
+		    c->key.version, c->key.cipher, c->key.keytype,
+		    c->key.resumed == -1 ? "other" :
+		    c->key.resumed ? "resumed" : "full", c->count,
+		    (unsigned long long)(c->key.cpu_nsec / 1000 / c->count),
+		    (unsigned long long)(c->key.wall_usec / c->count));
+	}
+}
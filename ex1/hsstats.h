@@ -0,0 +1,54 @@
+/*
+ * Copyright (c) 2018 Bob Beck <beck@obtuse.com>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#ifndef HSSTATS_H
+#define HSSTATS_H
+
+#include <stdint.h>
+
+/*
+ * Handshake cost accounting. We sample the thread's cpu clock around
+ * every call to tls_handshake(), so time spent waiting on the peer or
+ * sitting in a queue doesn't count, and total it up by the kind of
+ * handshake it turned out to be.
+ */
+
+struct hs_sample {
+	char version[16];		/* tls_conn_version() */
+	char cipher[64];		/* tls_conn_cipher() */
+	char keytype[16];		/* our key, from hs_keytype() */
+	int resumed;			/* tls_conn_session_resumed() */
+	uint64_t cpu_nsec;		/* cpu spent in tls_handshake() */
+	uint64_t wall_usec;		/* accept to handshake done */
+};
+
+/* Thread cpu time in nanoseconds, to bracket tls_handshake() with */
+uint64_t hs_cputime(void);
+
+/* Describe the key in keyfile as e.g. "rsa2048" or "ec256" */
+const char *hs_keytype(const char *keyfile);
+
+/* Fill in the class of a finished handshake from the connection */
+struct tls;
+void hs_classify(struct hs_sample *hs, struct tls *ctx, const char *keytype);
+
+/* Add a finished handshake to the totals for its class */
+void hs_account(const struct hs_sample *hs);
+
+/* Write one line per class to fd */
+void hs_report(int fd);
+
+#endif /* HSSTATS_H */
@@ -0,0 +1,151 @@
+/*
+ * Copyright (c) 2008 Bob Beck <beck@obtuse.com>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/*
+ * OCSP staple result cache for the client.
+ *
+ * The cache is a little text file, rewritten whole every time - it
+ * only ever holds a handful of servers, so there is no point being
+ * any cleverer than that.
+ */
+
+#include <err.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <tls.h>
+
+#include "ocspcache.h"
+
+void
+ocspcache_load(struct ocsp_cache *cache, const char *path)
+{
+	struct ocsp_entry *e;
+	char line[256];
+	long long next;
+	FILE *fp;
+
+	memset(cache, 0, sizeof(*cache));
+	cache->path = path;
+	if ((fp = fopen(path, "r")) == NULL)
+		return;
+	while (fgets(line, sizeof(line), fp) != NULL) {
+		e = &cache->entry[cache->nentries];
+		if (sscanf(line, "counters %llu %llu", &cache->hits,
+		    &cache->misses) == 2)
+			continue;
+		if (sscanf(line, "session %79s", cache->session) == 1)
+			continue;
+		if (cache->nentries < OCSPCACHE_ENTRIES &&
+		    sscanf(line, "%79s %llx %d %lld", e->hash,
+		    (unsigned long long *)&e->digest, &e->status, &next) == 4) {
+			e->next_update = next;
+			cache->nentries++;
+		}
+	}
+	fclose(fp);
+}
+
+void
+ocspcache_save(struct ocsp_cache *cache)
+{
+	struct ocsp_entry *e;
+	char tmp[1024];
+	time_t now = time(NULL);
+	FILE *fp;
+	int i;
+
+	/* write a new one and rename it, so nobody sees half a cache */
+	if (snprintf(tmp, sizeof(tmp), "%s.new", cache->path) >=
+	    (int)sizeof(tmp) || (fp = fopen(tmp, "w")) == NULL) {
+		warnx("can't write OCSP cache %s", cache->path);
+		return;
+	}
+	fprintf(fp, "counters %llu %llu\n", cache->hits, cache->misses);
+	if (cache->session[0] != '\0')
+		fprintf(fp, "session %s\n", cache->session);
+	for (i = 0; i < cache->nentries; i++) {
+		e = &cache->entry[i];
+		if (e->next_update <= now)
+			continue;
+		fprintf(fp, "%s %016llx %d %lld\n", e->hash,
+		    (unsigned long long)e->digest, e->status,
+		    (long long)e->next_update);
+	}
+	if (fclose(fp) == EOF || rename(tmp, cache->path) == -1)
+		warn("can't write OCSP cache %s", cache->path);
+}
+
+struct ocsp_entry *
+ocspcache_lookup(struct ocsp_cache *cache, const char *hash, time_t now)
+{
+	int i;
+
+	for (i = 0; i < cache->nentries; i++) {
+		if (strcmp(cache->entry[i].hash, hash) == 0)
+			return cache->entry[i].next_update > now ?
+			    &cache->entry[i] : NULL;
+	}
+	return NULL;
+}
+
+void
+ocspcache_store(struct ocsp_cache *cache, const struct ocsp_entry *e)
+{
+	int i;
+
+	for (i = 0; i < cache->nentries; i++)
+		if (strcmp(cache->entry[i].hash, e->hash) == 0)
+			break;
+	if (i == OCSPCACHE_ENTRIES) {
+		/* full, throw out the one that runs out soonest */
+		int j;
+
+		for (i = 0, j = 1; j < cache->nentries; j++)
+			if (cache->entry[j].next_update <
+			    cache->entry[i].next_update)
+				i = j;
+	} else if (i == cache->nentries)
+		cache->nentries++;
+	cache->entry[i] = *e;
+}
+
+/*
+ * libtls checks the staple's signature itself during the handshake,
+ * but doesn't hand us the raw response afterwards, so we digest the
+ * fields it verified instead. Any new staple has a new thisUpdate.
+ */
+uint64_t
+ocspcache_digest(struct tls *ctx)
+{
+	long long v[6];
+	const unsigned char *p = (const unsigned char *)v;
+	uint64_t h = 0xcbf29ce484222325ULL;	/* FNV-1a */
+	size_t i;
+
+	v[0] = tls_peer_ocsp_response_status(ctx);
+	v[1] = tls_peer_ocsp_cert_status(ctx);
+	v[2] = tls_peer_ocsp_crl_reason(ctx);
+	v[3] = tls_peer_ocsp_this_update(ctx);
+	v[4] = tls_peer_ocsp_next_update(ctx);
+	v[5] = tls_peer_ocsp_revocation_time(ctx);
+	for (i = 0; i < sizeof(v); i++) {
+		h ^= p[i];
+		h *= 0x100000001b3ULL;
+	}
+	return h;
+}
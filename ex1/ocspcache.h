@@ -0,0 +1,62 @@
+/*
+ * Copyright (c) 2008 Bob Beck <beck@obtuse.com>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#ifndef OCSPCACHE_H
+#define OCSPCACHE_H
+
+#include <stdint.h>
+#include <time.h>
+
+/*
+ * A small on-disk cache of OCSP staple results for the client, keyed
+ * by the hash of the server's certificate. An entry is good until the
+ * staple's nextUpdate. It also keeps a digest of the staple it came
+ * from, so a full handshake that brings the same staple again counts
+ * as a hit and leaves the entry as it is.
+ */
+
+#define OCSPCACHE_ENTRIES 64
+
+struct ocsp_entry {
+	char hash[80];			/* tls_peer_cert_hash() */
+	uint64_t digest;		/* of the verified staple */
+	int status;			/* TLS_OCSP_CERT_* */
+	time_t next_update;
+};
+
+struct ocsp_cache {
+	const char *path;
+	unsigned long long hits, misses;
+	char session[80];		/* cert hash of the saved session */
+	int nentries;
+	struct ocsp_entry entry[OCSPCACHE_ENTRIES];
+};
+
+void ocspcache_load(struct ocsp_cache *cache, const char *path);
+void ocspcache_save(struct ocsp_cache *cache);
+
+/* Find an unexpired entry for a certificate hash */
+struct ocsp_entry *ocspcache_lookup(struct ocsp_cache *cache,
+    const char *hash, time_t now);
+
+/* Remember a verified staple result, replacing any older one */
+void ocspcache_store(struct ocsp_cache *cache, const struct ocsp_entry *e);
+
+/* Digest the verified staple fields of a connection */
+struct tls;
+uint64_t ocspcache_digest(struct tls *ctx);
+
+#endif /* OCSPCACHE_H */
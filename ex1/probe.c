@@ -0,0 +1,514 @@
+/*
+ * Copyright (c) 2008 Bob Beck <beck@obtuse.com>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/*
+ * probe - check the TLS setup of lots of endpoints at once.
+ *
+ * Takes a list of targets, one per line as "host port [servername]",
+ * connects to them from a single poll(2) loop with non-blocking
+ * connects and handshakes, and writes what report_tls.c would tell you
+ * about each one as a line of JSON on stdout, so the output can be fed
+ * straight into jq or a database. Names are resolved up front, before
+ * we start probing, so use addresses if you have lots of targets.
+ *
+ * One process can only do so many handshakes a second, so -j splits
+ * the list between that many processes, each with its own loop.
+ */
+
+#include <sys/types.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+
+#include <netinet/in.h>
+
+#include <err.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <netdb.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <tls.h>
+#include <unistd.h>
+
+#define MAX_PROBES	4096
+
+struct target {
+	char *host;
+	char *port;
+	char *name;		/* for SNI and verification */
+	struct addrinfo *res;	/* where it is, once we've looked */
+	int gai_error;		/* or why we don't know */
+};
+
+struct probe {
+	struct target *target;
+	struct tls *tls;
+	int fd;
+	int connecting;
+	short events;
+	double start;		/* when we began to connect */
+	double connected;	/* when the connect finished */
+	double deadline;
+};
+
+static struct tls_config *config;
+static struct probe probes[MAX_PROBES];
+static struct pollfd pfd[MAX_PROBES];
+static int nprobes;
+
+/* shared by all the processes when we have more than one */
+struct counts {
+	unsigned long long ok, failed;
+};
+static struct counts *counts;
+
+static void
+usage(void)
+{
+	extern char *__progname;
+
+	fprintf(stderr, "usage: %s [-i] [-C cafile] [-c concurrency] "
+	    "[-j jobs] [-t timeout]\n"
+	    "\t[targetfile]\n", __progname);
+	exit(1);
+}
+
+static long long
+getnum(const char *s, long long min, long long max)
+{
+	char *ep;
+	long long n;
+
+	errno = 0;
+	n = strtoll(s, &ep, 10);
+	if (*s == '\0' || *ep != '\0')
+		errx(1, "%s - not a number", s);
+	if (errno == ERANGE || n < min || n > max)
+		errx(1, "%s - value out of range", s);
+	return n;
+}
+
+static double
+now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static struct target *
+read_targets(FILE *fp, size_t *count)
+{
+	struct target *t = NULL, *nt;
+	char *line = NULL, *host, *port, *name;
+	size_t linesize = 0, n = 0, max = 0;
+
+	while (getline(&line, &linesize, fp) != -1) {
+		host = strtok(line, " \t\r\n");
+		if (host == NULL || *host == '#')
+			continue;
+		if ((port = strtok(NULL, " \t\r\n")) == NULL)
+			errx(1, "target %s has no port", host);
+		name = strtok(NULL, " \t\r\n");
+		if (n == max) {
+			max = max ? max * 2 : 1024;
+			if ((nt = reallocarray(t, max, sizeof(*t))) == NULL)
+				err(1, "reallocarray");
+			t = nt;
+		}
+		if ((t[n].host = strdup(host)) == NULL ||
+		    (t[n].port = strdup(port)) == NULL ||
+		    (t[n].name = strdup(name ? name : host)) == NULL)
+			err(1, "strdup");
+		n++;
+	}
+	free(line);
+	if (ferror(fp))
+		err(1, "reading targets");
+	*count = n;
+	return t;
+}
+
+/*
+ * Look up every target before we start, so the probe loop never
+ * stops to wait for the resolver.
+ */
+static void
+resolve_targets(struct target *t, size_t count)
+{
+	struct addrinfo hints;
+	size_t i;
+
+	memset(&hints, 0, sizeof(hints));
+	hints.ai_family = AF_UNSPEC;
+	hints.ai_socktype = SOCK_STREAM;
+	for (i = 0; i < count; i++)
+		t[i].gai_error = getaddrinfo(t[i].host, t[i].port, &hints,
+		    &t[i].res);
+}
+
+/* Write s as a quoted JSON string, or null */
+static void
+json_quote(const char *s)
+{
+	const unsigned char *p;
+
+	if (s == NULL) {
+		fputs("null", stdout);
+		return;
+	}
+	putchar('"');
+	for (p = (const unsigned char *)s; *p != '\0'; p++) {
+		if (*p == '"' || *p == '\\')
+			printf("\\%c", *p);
+		else if (*p < 0x20)
+			printf("\\u%04x", *p);
+		else
+			putchar(*p);
+	}
+	putchar('"');
+}
+
+static void
+json_str(const char *key, const char *s)
+{
+	printf(",\"%s\":", key);
+	json_quote(s);
+}
+
+static void
+json_time(const char *key, time_t t)
+{
+	if (t == -1)
+		printf(",\"%s\":null", key);
+	else
+		printf(",\"%s\":%lld", key, (long long)t);
+}
+
+/*
+ * The same things report_tls() prints, as one line of JSON. Times are
+ * seconds since the epoch, and expires_days is how long the
+ * certificate has left, which is usually what you are looking for.
+ */
+static void
+report(struct probe *p, const char *error)
+{
+	struct tls *tls = p->tls;
+	double t = now();
+	time_t notafter;
+	int status;
+
+	fputs("{\"host\":", stdout);
+	json_quote(p->target->host);
+	json_str("port", p->target->port);
+	json_str("name", p->target->name);
+	printf(",\"ok\":%s", error == NULL ? "true" : "false");
+	if (error != NULL) {
+		json_str("error", error);
+		printf(",\"ms\":%.3f}\n", (t - p->start) * 1e3);
+		__atomic_add_fetch(&counts->failed, 1, __ATOMIC_RELAXED);
+		return;
+	}
+	__atomic_add_fetch(&counts->ok, 1, __ATOMIC_RELAXED);
+	printf(",\"connect_ms\":%.3f,\"handshake_ms\":%.3f",
+	    (p->connected - p->start) * 1e3, (t - p->connected) * 1e3);
+	json_str("version", tls_conn_version(tls));
+	json_str("cipher", tls_conn_cipher(tls));
+	json_str("subject", tls_peer_cert_subject(tls));
+	json_str("issuer", tls_peer_cert_issuer(tls));
+	json_str("hash", tls_peer_cert_hash(tls));
+	json_time("notbefore", tls_peer_cert_notbefore(tls));
+	notafter = tls_peer_cert_notafter(tls);
+	json_time("notafter", notafter);
+	if (notafter != -1)
+		printf(",\"expires_days\":%.1f",
+		    difftime(notafter, time(NULL)) / 86400);
+	json_str("ocsp_url", tls_peer_ocsp_url(tls));
+	if ((status = tls_peer_ocsp_response_status(tls)) == -1)
+		fputs(",\"staple\":null", stdout);
+	else {
+		printf(",\"staple\":{\"response_status\":%d", status);
+		if (status == TLS_OCSP_RESPONSE_SUCCESSFUL) {
+			printf(",\"cert_status\":%d,\"crl_reason\":%d",
+			    tls_peer_ocsp_cert_status(tls),
+			    tls_peer_ocsp_crl_reason(tls));
+			json_time("this_update",
+			    tls_peer_ocsp_this_update(tls));
+			json_time("next_update",
+			    tls_peer_ocsp_next_update(tls));
+			json_time("revocation",
+			    tls_peer_ocsp_revocation_time(tls));
+		}
+		json_str("result", tls_peer_ocsp_result(tls));
+		putchar('}');
+	}
+	puts("}");
+}
+
+static void
+finish(int i, const char *error)
+{
+	struct probe *p = &probes[i];
+
+	report(p, error);
+	if (p->tls != NULL) {
+		/* one go at a polite close, we won't wait for it */
+		if (error == NULL)
+			(void)tls_close(p->tls);
+		tls_free(p->tls);
+	}
+	close(p->fd);
+	/* fill the hole with the last one */
+	nprobes--;
+	if (i != nprobes) {
+		probes[i] = probes[nprobes];
+		pfd[i] = pfd[nprobes];
+	}
+}
+
+static void
+start(struct target *t, double timeout)
+{
+	struct probe *p = &probes[nprobes];
+	struct addrinfo *res = t->res;
+
+	memset(p, 0, sizeof(*p));
+	p->target = t;
+	p->fd = -1;
+	p->start = now();
+	p->deadline = p->start + timeout;
+
+	if (t->gai_error != 0) {
+		report(p, gai_strerror(t->gai_error));
+		return;
+	}
+	p->fd = socket(res->ai_family, res->ai_socktype | SOCK_NONBLOCK,
+	    res->ai_protocol);
+	if (p->fd == -1) {
+		report(p, strerror(errno));
+		return;
+	}
+	if (connect(p->fd, res->ai_addr, res->ai_addrlen) == -1 &&
+	    errno != EINPROGRESS) {
+		report(p, strerror(errno));
+		close(p->fd);
+		return;
+	}
+	p->connecting = 1;
+	p->events = POLLOUT;
+	pfd[nprobes].fd = p->fd;
+	pfd[nprobes].events = POLLOUT;
+	nprobes++;
+}
+
+/* Move a probe along, returning 0 if it is finished */
+static int
+step(int i)
+{
+	struct probe *p = &probes[i];
+	socklen_t len = sizeof(int);
+	int error, ret;
+
+	if (p->connecting) {
+		if (getsockopt(p->fd, SOL_SOCKET, SO_ERROR, &error,
+		    &len) == -1)
+			error = errno;
+		if (error != 0) {
+			finish(i, strerror(error));
+			return 0;
+		}
+		p->connecting = 0;
+		p->connected = now();
+		if ((p->tls = tls_client()) == NULL) {
+			finish(i, "unable to allocate TLS context");
+			return 0;
+		}
+		if (tls_configure(p->tls, config) == -1 ||
+		    tls_connect_socket(p->tls, p->fd, p->target->name) == -1) {
+			finish(i, tls_error(p->tls));
+			return 0;
+		}
+	}
+	switch ((ret = tls_handshake(p->tls))) {
+	case TLS_WANT_POLLIN:
+		pfd[i].events = POLLIN;
+		return 1;
+	case TLS_WANT_POLLOUT:
+		pfd[i].events = POLLOUT;
+		return 1;
+	case 0:
+		finish(i, NULL);
+		return 0;
+	default:
+		finish(i, tls_error(p->tls));
+		return 0;
+	}
+}
+
+/* Probe every stride'th target, starting with the first */
+static void
+probe_all(struct target *targets, size_t ntargets, size_t stride,
+    int concurrency, double timeout)
+{
+	size_t next_target = 0;
+	double t, next;
+	int i, n, ms;
+
+	while (next_target < ntargets || nprobes > 0) {
+		while (next_target < ntargets && nprobes < concurrency) {
+			start(&targets[next_target], timeout);
+			next_target += stride;
+		}
+		if (nprobes == 0)
+			continue;
+
+		t = now();
+		next = probes[0].deadline;
+		for (i = 1; i < nprobes; i++)
+			if (probes[i].deadline < next)
+				next = probes[i].deadline;
+		ms = next > t ? (int)((next - t) * 1000) + 1 : 0;
+		if ((n = poll(pfd, nprobes, ms)) == -1) {
+			if (errno == EINTR)
+				continue;
+			err(1, "poll");
+		}
+
+		/*
+		 * Walk backwards, since finishing a probe moves the last
+		 * one into its slot, and we have already looked at that.
+		 */
+		t = now();
+		for (i = nprobes - 1; i >= 0; i--) {
+			if (pfd[i].revents != 0)
+				step(i);
+			else if (probes[i].deadline <= t)
+				finish(i, probes[i].connecting ?
+				    "connect timed out" :
+				    "handshake timed out");
+		}
+	}
+	fflush(stdout);
+}
+
+int
+main(int argc, char *argv[])
+{
+	struct target *targets;
+	struct rlimit rl;
+	const char *cafile = "../CA/root.pem";
+	double began, timeout = 5;
+	size_t ntargets;
+	FILE *fp = stdin;
+	pid_t pid;
+	int ch, i, insecure = 0, status;
+	long long concurrency = 512, jobs = 1;
+
+	while ((ch = getopt(argc, argv, "C:c:ij:t:")) != -1) {
+		switch (ch) {
+		case 'C':
+			cafile = optarg;
+			break;
+		case 'c':
+			concurrency = getnum(optarg, 1, MAX_PROBES);
+			break;
+		case 'i':
+			insecure = 1;
+			break;
+		case 'j':
+			jobs = getnum(optarg, 1, 256);
+			break;
+		case 't':
+			timeout = getnum(optarg, 1, 3600000) / 1000.0;
+			break;
+		default:
+			usage();
+		}
+	}
+	argc -= optind;
+	argv += optind;
+	if (argc > 1)
+		usage();
+	if (argc == 1 && strcmp(argv[0], "-") != 0 &&
+	    (fp = fopen(argv[0], "r")) == NULL)
+		err(1, "%s", argv[0]);
+	targets = read_targets(fp, &ntargets);
+	resolve_targets(targets, ntargets);
+
+	/* we want a descriptor for every probe, and a few to spare */
+	if (getrlimit(RLIMIT_NOFILE, &rl) == 0 &&
+	    rl.rlim_cur < (rlim_t)concurrency + 16) {
+		rl.rlim_cur = rl.rlim_max;
+		(void)setrlimit(RLIMIT_NOFILE, &rl);
+		if (rl.rlim_cur < (rlim_t)concurrency + 16)
+			concurrency = rl.rlim_cur > 32 ? rl.rlim_cur - 16 : 16;
+	}
+	signal(SIGPIPE, SIG_IGN);
+
+	/*
+	 * By default a certificate that doesn't verify is a failure, with
+	 * the reason as the error. -i reports on whatever we are given.
+	 */
+	if (tls_init() == -1)
+		errx(1, "unable to initialize TLS");
+	if ((config = tls_config_new()) == NULL)
+		errx(1, "unable to allocate TLS config");
+	if (insecure) {
+		tls_config_insecure_noverifycert(config);
+		tls_config_insecure_noverifyname(config);
+	} else if (tls_config_set_ca_file(config, cafile) == -1)
+		errx(1, "unable to set root CA file %s", cafile);
+
+	counts = mmap(NULL, sizeof(*counts), PROT_READ | PROT_WRITE,
+	    MAP_ANON | MAP_SHARED, -1, 0);
+	if (counts == MAP_FAILED)
+		err(1, "mmap");
+
+	began = now();
+	if (jobs == 1)
+		probe_all(targets, ntargets, 1, concurrency, timeout);
+	else {
+		/*
+		 * Line buffered, so the processes' output doesn't get
+		 * mixed up in the middle of a line.
+		 */
+		fflush(stdout);
+		setvbuf(stdout, NULL, _IOLBF, 0);
+		for (i = 0; i < jobs && (size_t)i < ntargets; i++) {
+			if ((pid = fork()) == -1)
+				err(1, "fork");
+			if (pid == 0) {
+				probe_all(targets + i, ntargets - i, jobs,
+				    concurrency, timeout);
+				_exit(0);
+			}
+		}
+		while (wait(&status) != -1 || errno == EINTR)
+			;
+	}
+	fprintf(stderr, "probed %zu targets in %.3f s, %llu ok, "
+	    "%llu failed\n", ntargets, now() - began, counts->ok,
+	    counts->failed);
+	tls_config_free(config);
+	return counts->failed > 0;
+}
@@ -0,0 +1,404 @@
+/*
+ * Copyright (c) 2018 Bob Beck <beck@obtuse.com>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/*
+ * rttproxy - pretend the loopback is a long way away.
+ *
+ *	rttproxy [-b mbits] [-d delay] [-w window] listenport host port
+ *
+ * Connections to listenport are passed on to host and port, with each
+ * byte taking delay/2 milliseconds to get across in either direction.
+ * What makes a long link hard for one connection is not the wait but
+ * the window: TCP only lets a window's worth of data be in flight
+ * before it hears back, so a connection can't go faster than window
+ * per round trip however fat the pipe is. We do the same thing here.
+ * Once a connection has window bytes on their way, we stop reading
+ * from it until a round trip after they went out, and the kernel's
+ * own buffers push back on the sender. -b caps what the link carries
+ * each way, all connections together, so there is a point past which
+ * more connections don't help.
+ */
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+
+#include <err.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <netdb.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#define MAX_SESSIONS 128
+#define READ_MAX (64 * 1024)
+
+/* some bytes on their way */
+struct chunk {
+	struct chunk *next;
+	uint64_t deliver;	/* when they reach the other end */
+	uint64_t acked;		/* when the sender hears they did */
+	size_t len, written;
+	unsigned char data[];
+};
+
+/* one direction of a session */
+struct pipe {
+	int from, to;		/* indexes in the session's fds */
+	struct chunk *head, *tail;
+	size_t inflight;
+	int eof;		/* the sender is done, pass it on */
+	int shut;		/* and we have */
+};
+
+struct session {
+	int fd[2];		/* the client, and the server */
+	struct pipe pipe[2];	/* client to server, server to client */
+};
+
+static struct session sessions[MAX_SESSIONS];
+static struct pollfd pfds[1 + MAX_SESSIONS * 2];
+static uint64_t half_rtt, window, usec_per_mb;
+static uint64_t link_free[2];	/* when each way is next idle, with -b */
+static struct addrinfo *upstream;
+
+static void
+usage(void)
+{
+	extern char *__progname;
+
+	fprintf(stderr, "usage: %s [-b mbits] [-d delay] [-w window] "
+	    "listenport host port\n", __progname);
+	exit(1);
+}
+
+static long long
+getnum(const char *s, long long min, long long max)
+{
+	char *ep;
+	long long n;
+
+	errno = 0;
+	n = strtoll(s, &ep, 10);
+	if (*s == '\0' || *ep != '\0')
+		errx(1, "%s - not a number", s);
+	if (errno == ERANGE || n < min || n > max)
+		errx(1, "%s - value out of range", s);
+	return n;
+}
+
+static uint64_t
+now_usec(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000ULL + ts.tv_nsec / 1000;
+}
+
+static void
+nonblock(int fd)
+{
+	int flags;
+
+	if ((flags = fcntl(fd, F_GETFL)) == -1 ||
+	    fcntl(fd, F_SETFL, flags | O_NONBLOCK) == -1)
+		err(1, "fcntl");
+}
+
+static int
+dial(void)
+{
+	struct addrinfo *ai;
+	int fd;
+
+	for (ai = upstream; ai != NULL; ai = ai->ai_next) {
+		if ((fd = socket(ai->ai_family, ai->ai_socktype,
+		    ai->ai_protocol)) == -1)
+			continue;
+		if (connect(fd, ai->ai_addr, ai->ai_addrlen) == 0)
+			return fd;
+		close(fd);
+	}
+	return -1;
+}
+
+static void
+session_close(struct session *s)
+{
+	struct chunk *c;
+	int i;
+
+	for (i = 0; i < 2; i++) {
+		close(s->fd[i]);
+		s->fd[i] = -1;
+		while ((c = s->pipe[i].head) != NULL) {
+			s->pipe[i].head = c->next;
+			free(c);
+		}
+	}
+}
+
+static void
+session_open(int cfd)
+{
+	struct session *s;
+	int i, sfd;
+
+	for (i = 0; i < MAX_SESSIONS; i++)
+		if (sessions[i].fd[0] == -1)
+			break;
+	if (i == MAX_SESSIONS) {
+		warnx("too many connections");
+		close(cfd);
+		return;
+	}
+	if ((sfd = dial()) == -1) {
+		warn("can't connect upstream");
+		close(cfd);
+		return;
+	}
+	nonblock(cfd);
+	nonblock(sfd);
+	s = &sessions[i];
+	memset(s, 0, sizeof(*s));
+	s->fd[0] = cfd;
+	s->fd[1] = sfd;
+	s->pipe[0].from = 0;
+	s->pipe[0].to = 1;
+	s->pipe[1].from = 1;
+	s->pipe[1].to = 0;
+}
+
+/* Take in what the window lets us. 0 if the session is broken */
+static int
+pipe_read(struct session *s, struct pipe *p, int way, uint64_t now)
+{
+	struct chunk *c;
+	uint64_t start;
+	size_t want;
+	ssize_t r;
+
+	if (p->eof || p->inflight >= window)
+		return 1;
+	want = window - p->inflight;
+	if (want > READ_MAX)
+		want = READ_MAX;
+	if ((c = malloc(sizeof(*c) + want)) == NULL)
+		err(1, "malloc");
+	r = read(s->fd[p->from], c->data, want);
+	if (r == -1 && (errno == EAGAIN || errno == EINTR)) {
+		free(c);
+		return 1;
+	}
+	if (r <= 0) {
+		free(c);
+		if (r == -1)
+			return 0;
+		p->eof = 1;
+		return 1;
+	}
+	/* queue behind whatever else is going this way, with -b */
+	start = now;
+	if (usec_per_mb > 0) {
+		if (link_free[way] > start)
+			start = link_free[way];
+		start += r * usec_per_mb / (1024 * 1024);
+		link_free[way] = start;
+	}
+	c->next = NULL;
+	c->len = r;
+	c->written = 0;
+	c->deliver = start + half_rtt;
+	c->acked = c->deliver + half_rtt;
+	if (p->tail != NULL)
+		p->tail->next = c;
+	else
+		p->head = c;
+	p->tail = c;
+	p->inflight += r;
+	return 1;
+}
+
+/*
+ * Pass on what has arrived, and forget what has been acknowledged.
+ * 0 if the session is broken. *wait gets when we next have work.
+ */
+static int
+pipe_write(struct session *s, struct pipe *p, uint64_t now, uint64_t *wait,
+    int *blocked)
+{
+	struct chunk *c;
+	ssize_t w;
+
+	*blocked = 0;
+	for (c = p->head; c != NULL && c->deliver <= now; c = c->next) {
+		while (c->written < c->len) {
+			w = write(s->fd[p->to], c->data + c->written,
+			    c->len - c->written);
+			if (w == -1 && errno == EINTR)
+				continue;
+			if (w == -1 && errno == EAGAIN) {
+				*blocked = 1;
+				return 1;
+			}
+			if (w == -1)
+				return 0;
+			c->written += w;
+		}
+	}
+	if (c != NULL && c->deliver < *wait)
+		*wait = c->deliver;
+	while ((c = p->head) != NULL && c->written == c->len) {
+		if (c->acked > now) {
+			if (c->acked < *wait)
+				*wait = c->acked;
+			break;
+		}
+		p->inflight -= c->len;
+		p->head = c->next;
+		if (p->head == NULL)
+			p->tail = NULL;
+		free(c);
+	}
+	if (p->eof && p->head == NULL && !p->shut) {
+		shutdown(s->fd[p->to], SHUT_WR);
+		p->shut = 1;
+	}
+	return 1;
+}
+
+int
+main(int argc, char *argv[])
+{
+	struct addrinfo hints, *res;
+	struct session *s;
+	struct pipe *p;
+	uint64_t now, wait;
+	long long mbits = 0;
+	int ch, error, fd, i, j, lsd, blocked, timeout, one = 1;
+
+	half_rtt = 25000;
+	window = 256 * 1024;
+	while ((ch = getopt(argc, argv, "b:d:w:")) != -1) {
+		switch (ch) {
+		case 'b':
+			mbits = getnum(optarg, 1, 1000000);
+			break;
+		case 'd':
+			half_rtt = getnum(optarg, 0, 60000) * 1000 / 2;
+			break;
+		case 'w':
+			window = getnum(optarg, 1024, 1024 * 1024 * 1024);
+			break;
+		default:
+			usage();
+		}
+	}
+	argc -= optind;
+	argv += optind;
+	if (argc != 3)
+		usage();
+	if (mbits > 0)
+		usec_per_mb = 8 * 1024 * 1024 / mbits;
+
+	memset(&hints, 0, sizeof(hints));
+	hints.ai_family = AF_UNSPEC;
+	hints.ai_socktype = SOCK_STREAM;
+	if ((error = getaddrinfo(argv[1], argv[2], &hints, &upstream)) != 0)
+		errx(1, "%s %s: %s", argv[1], argv[2], gai_strerror(error));
+	hints.ai_flags = AI_PASSIVE;
+	hints.ai_family = AF_INET;
+	if ((error = getaddrinfo("127.0.0.1", argv[0], &hints, &res)) != 0)
+		errx(1, "%s: %s", argv[0], gai_strerror(error));
+	if ((lsd = socket(res->ai_family, res->ai_socktype, 0)) == -1)
+		err(1, "socket");
+	if (setsockopt(lsd, SOL_SOCKET, SO_REUSEADDR, &one,
+	    sizeof(one)) == -1)
+		err(1, "setsockopt");
+	if (bind(lsd, res->ai_addr, res->ai_addrlen) == -1)
+		err(1, "bind %s", argv[0]);
+	if (listen(lsd, 128) == -1)
+		err(1, "listen");
+	freeaddrinfo(res);
+	signal(SIGPIPE, SIG_IGN);
+
+	for (i = 0; i < MAX_SESSIONS; i++)
+		sessions[i].fd[0] = sessions[i].fd[1] = -1;
+	pfds[0].fd = lsd;
+	pfds[0].events = POLLIN;
+
+	for (;;) {
+		now = now_usec();
+		wait = UINT64_MAX;
+		for (i = 0; i < MAX_SESSIONS; i++) {
+			s = &sessions[i];
+			pfds[1 + i * 2].fd = s->fd[0];
+			pfds[2 + i * 2].fd = s->fd[1];
+			if (s->fd[0] == -1)
+				continue;
+			pfds[1 + i * 2].events = pfds[2 + i * 2].events = 0;
+			for (j = 0; j < 2; j++) {
+				p = &s->pipe[j];
+				if (!pipe_write(s, p, now, &wait, &blocked))
+					break;
+				if (blocked)
+					pfds[1 + i * 2 + p->to].events |=
+					    POLLOUT;
+				if (!p->eof && p->inflight < window)
+					pfds[1 + i * 2 + p->from].events |=
+					    POLLIN;
+			}
+			if (j < 2 || (s->pipe[0].shut && s->pipe[1].shut)) {
+				session_close(s);
+				pfds[1 + i * 2].fd = pfds[2 + i * 2].fd = -1;
+			}
+		}
+		if (wait == UINT64_MAX)
+			timeout = -1;
+		else
+			timeout = (wait - now + 999) / 1000;
+		if (poll(pfds, 1 + MAX_SESSIONS * 2, timeout) == -1) {
+			if (errno == EINTR)
+				continue;
+			err(1, "poll");
+		}
+		now = now_usec();
+		if (pfds[0].revents & POLLIN &&
+		    (fd = accept(lsd, NULL, NULL)) != -1)
+			session_open(fd);
+		for (i = 0; i < MAX_SESSIONS; i++) {
+			s = &sessions[i];
+			if (s->fd[0] == -1)
+				continue;
+			for (j = 0; j < 2; j++) {
+				if (!(pfds[1 + i * 2 + j].revents &
+				    (POLLIN | POLLHUP | POLLERR)))
+					continue;
+				if (!pipe_read(s, &s->pipe[j], j, now)) {
+					session_close(s);
+					break;
+				}
+			}
+		}
+	}
+}
@@ -14,97 +14,656 @@
  * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
  */
 
-/* server.c  - the "classic" example of a socket server */
+/* server.c  - the "classic" example of a socket server, now with TLS */
 
 /*
- * compile with gcc -o server server.c
+ * compile with
+ * gcc -o server server.c stats.c hsstats.c crlset.c -ltls -lcrypto
  * or if you are on a crappy version of linux without strlcpy
  * thanks to the bozos who do glibc, do
  * gcc -c strlcpy.c
- * gcc -o server server.c strlcpy.o
+ * gcc -o server server.c stats.c hsstats.c crlset.c strlcpy.o \
+ *     -ltls -lcrypto
  *
  */
 
 #include <sys/types.h>
 #include <sys/socket.h>
+#include <sys/time.h>
 #include <sys/wait.h>
 #include <netinet/in.h>
 
 #include <err.h>
 #include <errno.h>
+#include <fcntl.h>
 #include <limits.h>
+#include <poll.h>
 #include <signal.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
+#include <tls.h>
 #include <unistd.h>
 
+#include "crlset.h"
+#include "stats.h"
+
 static void usage()
 {
 	extern char * __progname;
-	fprintf(stderr, "usage: %s portnumber\n", __progname);
+	fprintf(stderr, "usage: %s [-C cafile] [-c certfile] [-i idle] "
+	    "[-k keyfile] [-o staplefile]\n"
+	    "\t[-R deltacrl] [-r crl] [-s statsport] [-u] [-w dir] "
+	    "portnumber\n",
+	    __progname);
 	exit(1);
 }
 
+static volatile sig_atomic_t kids_exited;
+static volatile sig_atomic_t reload_delta;
+
 static void kidhandler(int signum) {
-	/* signal handler for SIGCHLD */
-	waitpid(WAIT_ANY, NULL, WNOHANG);
+	/*
+	 * signal handler for SIGCHLD - we just note it happened, and
+	 * reap them in the main loop, so we can collect their stats.
+	 */
+	kids_exited = 1;
 }
 
+static void hup_handler(int signum) {
+	/* reload the delta CRL when we get back to the main loop */
+	reload_delta = 1;
+}
 
-int main(int argc,  char *argv[])
+static u_short
+getport(const char *s)
 {
-	struct sockaddr_in sockname, client;
-	char buffer[80], *ep;
-	struct sigaction sa;
-	int sd;
-	socklen_t clientlen;
-	u_short port;
-	pid_t pid;
+	char *ep;
 	u_long p;
 
-	/*
-	 * first, figure out what port we will listen on - it should
-	 * be our first parameter.
-	 */
-
-	if (argc != 2)
-		usage();
-		errno = 0;
-        p = strtoul(argv[1], &ep, 10);
-        if (*argv[1] == '\0' || *ep != '\0') {
+	errno = 0;
+        p = strtoul(s, &ep, 10);
+        if (*s == '\0' || *ep != '\0') {
 		/* parameter wasn't a number, or was empty */
-		fprintf(stderr, "%s - not a number\n", argv[1]);
+		fprintf(stderr, "%s - not a number\n", s);
 		usage();
 	}
         if ((errno == ERANGE && p == ULONG_MAX) || (p > USHRT_MAX)) {
 		/* It's a number, but it either can't fit in an unsigned
 		 * long, or is too big for an unsigned short
 		 */
-		fprintf(stderr, "%s - value out of range\n", argv[1]);
+		fprintf(stderr, "%s - value out of range\n", s);
 		usage();
 	}
-	/* now safe to do this */
-	port = p;
+	return p;
+}
 
-	/* the message we send the client */
-	strlcpy(buffer,
-	    "What is the air speed velocity of a coconut laden swallow?\n",
-	    sizeof(buffer));
+static long long
+getnum(const char *s, long long min, long long max)
+{
+	char *ep;
+	long long n;
+
+	errno = 0;
+	n = strtoll(s, &ep, 10);
+	if (*s == '\0' || *ep != '\0')
+		errx(1, "%s - not a number", s);
+	if (errno == ERANGE || n < min || n > max)
+		errx(1, "%s - value out of range", s);
+	return n;
+}
+
+static int
+listen_on(u_short port, in_addr_t addr)
+{
+	struct sockaddr_in sockname;
+	int sd, one = 1;
 
 	memset(&sockname, 0, sizeof(sockname));
 	sockname.sin_family = AF_INET;
 	sockname.sin_port = htons(port);
-	sockname.sin_addr.s_addr = htonl(INADDR_ANY);
+	sockname.sin_addr.s_addr = htonl(addr);
 	sd=socket(AF_INET,SOCK_STREAM,0);
 	if ( sd == -1)
 		err(1, "socket failed");
 
+	if (setsockopt(sd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one)) == -1)
+		err(1, "SO_REUSEADDR setsockopt failed");
+
 	if (bind(sd, (struct sockaddr *) &sockname, sizeof(sockname)) == -1)
 		err(1, "bind failed");
 
-	if (listen(sd,3) == -1)
+	/* room for all the stripes of an upload arriving at once */
+	if (listen(sd, 128) == -1)
 		err(1, "listen failed");
+	return sd;
+}
+
+static const char *keytype;
+
+/*
+ * Revoked client certificates, from a base CRL and the latest delta.
+ * The parent loads them, and the children get their own copy when
+ * they are forked.
+ */
+static struct crlset crls;
+static const char *crlfile;
+
+/*
+ * With -u we take uploads instead of sending our message: the client
+ * sends a header line, then the bytes it promised, and we tell it how
+ * many we got. The header is just a length, or "id offset length
+ * total" for a stripe of a bigger upload sent over several connections
+ * at once. Without -w we count the bytes and throw them away. With -w
+ * dir the stripes of an upload all go into dir/id, each at its offset,
+ * so the file comes together in order however they arrive. Each stripe
+ * is a connection, so a child of its own, and they need nothing from
+ * each other to do that.
+ */
+#define SINK_BUFLEN (256 * 1024)
+#define SINK_HDRLEN 96
+#define SINK_IDLEN 16
+static int sink;
+static const char *sinkdir;
+
+/*
+ * With -i, a new connection waits in the parent, with no child and no
+ * TLS, until the client sends something - its ClientHello, if it is
+ * going to do TLS at all. Port scanners, health checks and load
+ * balancer probes that connect and say nothing then cost us a poll
+ * slot instead of a fork and a TLS context, and we close them after
+ * idle seconds. If they all fill up we go back to forking straight
+ * away.
+ */
+#define WAITERS 256
+static int idle_timeout;
+static struct pollfd *waiters;
+static struct timespec waited[WAITERS];
+
+/* Park a new connection until it speaks. -1 if there is no room */
+static int
+waiter_add(int fd)
+{
+	int i;
+
+	for (i = 0; i < WAITERS; i++) {
+		if (waiters[i].fd == -1) {
+			waiters[i].fd = fd;
+			waiters[i].events = POLLIN;
+			waiters[i].revents = 0;
+			clock_gettime(CLOCK_MONOTONIC, &waited[i]);
+			return 0;
+		}
+	}
+	return -1;
+}
+
+static int
+waiters_idle(void)
+{
+	int i;
+
+	for (i = 0; i < WAITERS; i++)
+		if (waiters[i].fd != -1)
+			return 0;
+	return 1;
+}
+
+/*
+ * Close the connections that went away without a word or have been
+ * quiet too long, and hand back one that has something for us to
+ * read, or -1. Anyone else with something to say gets their turn next
+ * time around.
+ */
+static int
+waiter_ready(void)
+{
+	struct timespec now;
+	ssize_t n;
+	char c;
+	int i, fd, ready = -1;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	for (i = 0; i < WAITERS; i++) {
+		if ((fd = waiters[i].fd) == -1)
+			continue;
+		if (waiters[i].revents == 0) {
+			if (now.tv_sec - waited[i].tv_sec >= idle_timeout) {
+				close(fd);
+				waiters[i].fd = -1;
+				stats_unserved(1);
+			}
+			continue;
+		}
+		n = recv(fd, &c, 1, MSG_PEEK | MSG_DONTWAIT);
+		if (n == -1 && (errno == EAGAIN || errno == EINTR))
+			continue;
+		if (n == 1) {
+			if (ready == -1) {
+				ready = fd;
+				waiters[i].fd = -1;
+			}
+			continue;
+		}
+		/* closed, or broken, before it sent anything */
+		close(fd);
+		waiters[i].fd = -1;
+		stats_unserved(0);
+	}
+	return ready;
+}
+
+static int
+sink_write(int fd, const char *buf, size_t len, unsigned long long off)
+{
+	ssize_t w;
+
+	while (len > 0) {
+		if ((w = pwrite(fd, buf, len, off)) == -1) {
+			if (errno == EINTR)
+				continue;
+			warn("upload write failed");
+			return 0;
+		}
+		buf += w;
+		len -= w;
+		off += w;
+	}
+	return 1;
+}
+
+static int
+sink_upload(struct tls *tls_cctx, struct child_stats *cs, char *reply,
+    size_t replylen)
+{
+	static char buf[SINK_BUFLEN];
+	char id[SINK_IDLEN + 1], path[PATH_MAX];
+	unsigned long long off = 0, want, got, total;
+	size_t have = 0, len;
+	char *nl, *ep;
+	ssize_t r;
+	int n = 0, fd = -1, rv = 0;
+
+	/* read the header, and maybe the start of the upload with it */
+	while ((nl = memchr(buf, '\n', have)) == NULL) {
+		if (have == SINK_HDRLEN) {
+			warnx("upload header too long");
+			return 0;
+		}
+		r = tls_read(tls_cctx, buf + have, SINK_HDRLEN - have);
+		if (r == TLS_WANT_POLLIN || r == TLS_WANT_POLLOUT)
+			continue;
+		if (r <= 0) {
+			warnx("upload ended before its header");
+			return 0;
+		}
+		have += r;
+		cs->bytes_in += r;
+	}
+	*nl = '\0';
+	id[0] = '\0';
+	if (sscanf(buf, "%16[0-9a-f] %llu %llu %llu%n", id, &off, &want,
+	    &total, &n) == 4 && buf[n] == '\0') {
+		if (off > total || want > total - off) {
+			warnx("upload stripe out of range");
+			return 0;
+		}
+	} else {
+		id[0] = '\0';
+		errno = 0;
+		want = strtoull(buf, &ep, 10);
+		if (buf[0] == '\0' || *ep != '\0' || errno == ERANGE) {
+			warnx("bad upload header");
+			return 0;
+		}
+	}
+	if (sinkdir != NULL && id[0] != '\0') {
+		if (snprintf(path, sizeof(path), "%s/%s", sinkdir, id) >=
+		    (int)sizeof(path)) {
+			warnx("%s/%s - path too long", sinkdir, id);
+			return 0;
+		}
+		if ((fd = open(path, O_WRONLY | O_CREAT, 0644)) == -1) {
+			warn("%s", path);
+			return 0;
+		}
+		/* every stripe does this, it's the same size each time */
+		if (ftruncate(fd, total) == -1) {
+			warn("%s", path);
+			goto done;
+		}
+	}
+	got = have - (nl + 1 - buf);
+	if (got > want) {
+		warnx("upload longer than its header said");
+		goto done;
+	}
+	if (fd != -1 && !sink_write(fd, nl + 1, got, off))
+		goto done;
+
+	while (got < want) {
+		len = want - got < sizeof(buf) ? want - got : sizeof(buf);
+		r = tls_read(tls_cctx, buf, len);
+		if (r == TLS_WANT_POLLIN || r == TLS_WANT_POLLOUT)
+			continue;
+		if (r <= 0) {
+			warnx("upload ended after %llu of %llu bytes", got,
+			    want);
+			goto done;
+		}
+		if (fd != -1 && !sink_write(fd, buf, r, off + got))
+			goto done;
+		got += r;
+		cs->bytes_in += r;
+	}
+	snprintf(reply, replylen, "received %llu bytes\n", got);
+	rv = 1;
+ done:
+	if (fd != -1)
+		close(fd);
+	return rv;
+}
+
+/*
+ * A client that stops halfway through its handshake would keep its
+ * child forever, so the handshake gets this many seconds. Until it is
+ * done a read or write on the socket gives up after that long too,
+ * and tls_handshake() hands back a TLS_WANT we stop on.
+ */
+#define HANDSHAKE_TIMEOUT 10
+
+static void
+io_timeout(int sd, int seconds)
+{
+	struct timeval tv;
+
+	tv.tv_sec = seconds;
+	tv.tv_usec = 0;
+	if (setsockopt(sd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv)) == -1 ||
+	    setsockopt(sd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv)) == -1)
+		warn("setsockopt");
+}
+
+/*
+ * Everything a child does for one connection. We keep score in our
+ * slot of the shared stats region as we go, which is just memory - no
+ * system calls get added to talking to the client.
+ */
+static void
+serve(struct tls *tls_ctx, int clientsd, const char *buffer,
+    struct child_stats *cs)
+{
+	struct tls *tls_cctx = NULL;
+	struct timespec now, deadline;
+	char reply[80];
+	ssize_t written, w;
+	uint64_t start;
+	int i;
+
+	if (tls_accept_socket(tls_ctx, &tls_cctx, clientsd) == -1) {
+		warnx("tls_accept_socket failed: %s", tls_error(tls_ctx));
+		stats_finish(cs, OUTCOME_FAILED);
+		return;
+	}
+	/*
+	 * we only charge the handshake with the cpu time spent inside
+	 * tls_handshake, not the time spent waiting on the client.
+	 */
+	io_timeout(clientsd, HANDSHAKE_TIMEOUT);
+	clock_gettime(CLOCK_MONOTONIC, &deadline);
+	deadline.tv_sec += HANDSHAKE_TIMEOUT;
+	do {
+		start = hs_cputime();
+		i = tls_handshake(tls_cctx);
+		cs->hs.cpu_nsec += hs_cputime() - start;
+		clock_gettime(CLOCK_MONOTONIC, &now);
+	} while ((i == TLS_WANT_POLLIN || i == TLS_WANT_POLLOUT) &&
+	    now.tv_sec < deadline.tv_sec);
+	if (i != 0) {
+		if (i == -1)
+			warnx("tls handshake failed: %s", tls_error(tls_cctx));
+		else
+			warnx("tls handshake timed out");
+		stats_finish(cs, OUTCOME_FAILED);
+		tls_free(tls_cctx);
+		return;
+	}
+	io_timeout(clientsd, 0);
+	stats_handshake(cs, tls_cctx, keytype);
+	if (crlfile != NULL && tls_peer_cert_provided(tls_cctx)) {
+		const uint8_t *pem;
+		size_t len;
+
+		pem = tls_peer_cert_chain_pem(tls_cctx, &len);
+		if (crlset_revoked_pem(&crls, pem, len) != 0) {
+			warnx("client certificate revoked, or unreadable");
+			stats_finish(cs, OUTCOME_FAILED);
+			tls_free(tls_cctx);
+			return;
+		}
+	}
+	if (sink) {
+		if (!sink_upload(tls_cctx, cs, reply, sizeof(reply))) {
+			stats_finish(cs, OUTCOME_FAILED);
+			tls_free(tls_cctx);
+			return;
+		}
+		buffer = reply;
+	}
+
+	/*
+	 * write the message to the client, being sure to
+	 * handle a short write, or being interrupted by
+	 * a signal before we could write anything.
+	 */
+	w = 0;
+	written = 0;
+	while (written < strlen(buffer)) {
+		w = tls_write(tls_cctx, buffer + written,
+		    strlen(buffer) - written);
+		if (w == TLS_WANT_POLLIN || w == TLS_WANT_POLLOUT)
+			continue;
+		if (w == -1) {
+			warnx("tls_write failed: %s", tls_error(tls_cctx));
+			stats_finish(cs, OUTCOME_FAILED);
+			tls_free(tls_cctx);
+			return;
+		}
+		written += w;
+		cs->bytes_out += w;
+	}
+	do {
+		i = tls_close(tls_cctx);
+	} while (i == TLS_WANT_POLLIN || i == TLS_WANT_POLLOUT);
+	tls_free(tls_cctx);
+	stats_finish(cs, OUTCOME_OK);
+}
+
+/*
+ * Shake hands with ourselves, over a socketpair, before we fork
+ * anything. The first handshake a TLS library does sets up a good deal
+ * it keeps for later - algorithm tables, caches, random state - and
+ * otherwise every child would do that for itself, writing to pages it
+ * shares with us and so getting its own copy of each. Done here once,
+ * the children find it all ready and only read it.
+ */
+static void
+warm_up(struct tls *tls_ctx)
+{
+	struct tls_config *cfg;
+	struct tls *client = NULL, *server = NULL;
+	int sv[2], cdone = 0, sdone = 0, i, r;
+	char c;
+
+	if (socketpair(AF_UNIX, SOCK_STREAM, 0, sv) == -1)
+		err(1, "socketpair failed");
+	for (i = 0; i < 2; i++)
+		if (fcntl(sv[i], F_SETFL, O_NONBLOCK) == -1)
+			err(1, "fcntl failed");
+	if ((cfg = tls_config_new()) == NULL ||
+	    (client = tls_client()) == NULL)
+		errx(1, "unable to allocate TLS client");
+	tls_config_insecure_noverifycert(cfg);
+	tls_config_insecure_noverifyname(cfg);
+	if (tls_configure(client, cfg) == -1 ||
+	    tls_connect_socket(client, sv[0], "localhost") == -1 ||
+	    tls_accept_socket(tls_ctx, &server, sv[1]) == -1)
+		errx(1, "warm up failed");
+	/* both ends are ours, so take turns until both are done */
+	for (i = 0; i < 100 && !(cdone && sdone); i++) {
+		if (!cdone && (r = tls_handshake(client)) != TLS_WANT_POLLIN &&
+		    r != TLS_WANT_POLLOUT)
+			cdone = r == 0 ? 1 : -1;
+		if (!sdone && (r = tls_handshake(server)) != TLS_WANT_POLLIN &&
+		    r != TLS_WANT_POLLOUT)
+			sdone = r == 0 ? 1 : -1;
+		if (cdone == -1 || sdone == -1)
+			break;
+	}
+	/* and a byte each way, for the record layer */
+	if (cdone == 1 && sdone == 1) {
+		tls_write(server, "x", 1);
+		tls_read(client, &c, 1);
+		tls_write(client, "x", 1);
+		tls_read(server, &c, 1);
+	} else
+		warnx("warm up handshake failed, carrying on");
+	tls_free(client);
+	tls_free(server);
+	tls_config_free(cfg);
+	close(sv[0]);
+	close(sv[1]);
+}
+
+int main(int argc,  char *argv[])
+{
+	struct sockaddr_in client;
+	struct tls_config *tls_cfg = NULL;
+	struct tls *tls_ctx = NULL;
+	struct pollfd pfd[2 + WAITERS];
+	struct timespec tick = { 1, 0 };
+	const char *certfile = "../CA/server.crt";
+	const char *keyfile = "../CA/server.key";
+	const char *staplefile = NULL;
+	const char *cafile = "../CA/chain.pem";
+	const char *deltafile = NULL;
+	char buffer[80];
+	struct sigaction sa;
+	sigset_t blocked, waiting;
+	int ch, i, sd, statsd = -1;
+	socklen_t clientlen;
+	u_short port, statsport = 0;
+	pid_t pid;
+
+	while ((ch = getopt(argc, argv, "C:c:i:k:o:R:r:s:uw:")) != -1) {
+		switch (ch) {
+		case 'C':
+			cafile = optarg;
+			break;
+		case 'c':
+			certfile = optarg;
+			break;
+		case 'i':
+			idle_timeout = getnum(optarg, 1, 3600);
+			break;
+		case 'k':
+			keyfile = optarg;
+			break;
+		case 'o':
+			staplefile = optarg;
+			break;
+		case 'R':
+			deltafile = optarg;
+			break;
+		case 'r':
+			crlfile = optarg;
+			break;
+		case 's':
+			statsport = getport(optarg);
+			break;
+		case 'u':
+			sink = 1;
+			break;
+		case 'w':
+			sinkdir = optarg;
+			break;
+		default:
+			usage();
+		}
+	}
+	argc -= optind;
+	argv += optind;
+
+	/*
+	 * first, figure out what port we will listen on - it should
+	 * be our first parameter.
+	 */
+
+	if (argc != 1)
+		usage();
+	if (sinkdir != NULL && !sink)
+		errx(1, "-w is where -u keeps uploads");
+	/* now safe to do this */
+	port = getport(argv[0]);
+
+	/* the message we send the client */
+	strlcpy(buffer,
+	    "What is the air speed velocity of a coconut laden swallow?\n",
+	    sizeof(buffer));
+
+	/*
+	 * set up our TLS configuration once, up front. Every child
+	 * inherits it, and only has to do the handshake.
+	 */
+	if (tls_init() == -1)
+		errx(1, "unable to initialize TLS");
+	if ((tls_cfg = tls_config_new()) == NULL)
+		errx(1, "unable to allocate TLS config");
+	if (tls_config_set_cert_file(tls_cfg, certfile) == -1)
+		errx(1, "unable to set TLS certificate file %s", certfile);
+	if (tls_config_set_key_file(tls_cfg, keyfile) == -1)
+		errx(1, "unable to set TLS key file %s", keyfile);
+	if (staplefile != NULL &&
+	    tls_config_set_ocsp_staple_file(tls_cfg, staplefile) == -1)
+		errx(1, "unable to set OCSP staple file %s", staplefile);
+	/*
+	 * let clients resume sessions with tickets. The ticket keys are
+	 * made when we configure, so every child shares them.
+	 */
+	if (tls_config_set_session_lifetime(tls_cfg, 2 * 60 * 60) == -1)
+		errx(1, "unable to set session lifetime");
+	if (crlfile != NULL) {
+		/*
+		 * ask for client certificates, and check them against
+		 * the CRLs ourselves after the handshake.
+		 */
+		if (tls_config_set_ca_file(tls_cfg, cafile) == -1)
+			errx(1, "unable to set CA file %s", cafile);
+		tls_config_verify_client_optional(tls_cfg);
+		if (crlset_load_base(&crls, crlfile, cafile) == -1)
+			exit(1);
+		if (deltafile != NULL &&
+		    crlset_load_delta(&crls, deltafile, cafile) == -1)
+			exit(1);
+	}
+	if ((tls_ctx = tls_server()) == NULL)
+		errx(1, "TLS server creation failed");
+	if (tls_configure(tls_ctx, tls_cfg) == -1)
+		errx(1, "TLS configuration failed (%s)", tls_error(tls_ctx));
+	keytype = hs_keytype(keyfile);
+	warm_up(tls_ctx);
+
+	/*
+	 * the stats region has to exist before we fork anything, so
+	 * that every child shares it with us.
+	 */
+	stats_init();
+
+	sd = listen_on(port, INADDR_ANY);
+	if (statsport != 0)
+		statsd = listen_on(statsport, INADDR_LOOPBACK);
 
 	/*
 	 * we're now bound, and listening for connections on "sd" -
@@ -122,54 +681,110 @@ int main(int argc,  char *argv[])
         sigemptyset(&sa.sa_mask);
 	/*
 	 * we want to allow system calls like accept to be restarted if they
-	 * get interrupted by a SIGCHLD
+	 * get interrupted by a SIGCHLD. poll won't be, which is what we
+	 * want, so we get to reap the kids.
 	 */
         sa.sa_flags = SA_RESTART;
         if (sigaction(SIGCHLD, &sa, NULL) == -1)
                 err(1, "sigaction failed");
+	sa.sa_handler = hup_handler;
+	if (sigaction(SIGHUP, &sa, NULL) == -1)
+		err(1, "sigaction failed");
+
+	/*
+	 * If a child exits after we've looked at kids_exited but before
+	 * we go to sleep in poll, we wouldn't reap it until somebody else
+	 * connected. So keep SIGCHLD and SIGHUP blocked, and only let
+	 * them in while we are waiting in ppoll, which then returns EINTR.
+	 */
+	sigemptyset(&blocked);
+	sigaddset(&blocked, SIGCHLD);
+	sigaddset(&blocked, SIGHUP);
+	if (sigprocmask(SIG_BLOCK, &blocked, &waiting) == -1)
+		err(1, "sigprocmask failed");
+
+	pfd[0].fd = sd;
+	pfd[0].events = POLLIN;
+	pfd[1].fd = statsd;
+	pfd[1].events = POLLIN;
+	waiters = pfd + 2;
+	for (i = 0; i < WAITERS; i++)
+		waiters[i].fd = -1;
 
 	/*
 	 * finally - the main loop.  accept connections and deal with 'em
 	 */
 	printf("Server up and listening for connections on port %u\n", port);
+	fflush(stdout);	/* or every child flushes it again on exit */
 	for(;;) {
+		struct child_stats *cs;
 		int clientsd;
-		clientlen = sizeof(&client);
-		clientsd = accept(sd, (struct sockaddr *)&client, &clientlen);
-		if (clientsd == -1)
-			err(1, "accept failed");
+
+		if (reload_delta) {
+			reload_delta = 0;
+			if (deltafile != NULL)
+				crlset_load_delta(&crls, deltafile, cafile);
+		}
+		if (kids_exited) {
+			kids_exited = 0;
+			while ((pid = waitpid(WAIT_ANY, NULL, WNOHANG)) > 0)
+				stats_reap(pid);
+		}
+		/* with connections waiting, look at them once a second */
+		if (ppoll(pfd, 2 + WAITERS, idle_timeout > 0 &&
+		    !waiters_idle() ? &tick : NULL, &waiting) == -1) {
+			if (errno == EINTR)
+				continue;
+			err(1, "poll failed");
+		}
+		if (pfd[1].revents & POLLIN) {
+			int fd;
+
+			if ((fd = accept(statsd, NULL, NULL)) != -1) {
+				stats_serve(fd);
+				close(fd);
+			}
+		}
+		clientsd = idle_timeout > 0 ? waiter_ready() : -1;
+		if (clientsd == -1) {
+			if (!(pfd[0].revents & POLLIN))
+				continue;
+			clientlen = sizeof(client);
+			clientsd = accept(sd, (struct sockaddr *)&client,
+			    &clientlen);
+			if (clientsd == -1) {
+				if (errno == EINTR || errno == ECONNABORTED)
+					continue;
+				err(1, "accept failed");
+			}
+			if (idle_timeout > 0 && waiter_add(clientsd) == 0)
+				continue;
+		}
 		/*
 		 * We fork child to deal with each connection, this way more
 		 * than one client can connect to us and get served at any one
 		 * time.
 		 */
 
+		cs = stats_slot();
 		pid = fork();
 		if (pid == -1)
 		     err(1, "fork failed");
 
 		if(pid == 0) {
-			ssize_t written, w;
-			/*
-			 * write the message to the client, being sure to
-			 * handle a short write, or being interrupted by
-			 * a signal before we could write anything.
-			 */
-			w = 0;
-			written = 0;
-			while (written < strlen(buffer)) {
-				w = write(clientsd, buffer + written,
-				    strlen(buffer) - written);
-				if (w == -1) {
-					if (errno != EINTR)
-						err(1, "write failed");
-				}
-				else
-					written += w;
-			}
+			stats_forked(cs);
+			sigprocmask(SIG_SETMASK, &waiting, NULL);
+			close(sd);
+			if (statsd != -1)
+				close(statsd);
+			for (i = 0; i < WAITERS; i++)
+				if (waiters[i].fd != -1)
+					close(waiters[i].fd);
+			serve(tls_ctx, clientsd, buffer, cs);
 			close(clientsd);
 			exit(0);
 		}
+		stats_started(cs, pid);
 		close(clientsd);
 	}
 }
@@ -0,0 +1,297 @@
+/*
+ * Copyright (c) 2008 Bob Beck <beck@obtuse.com>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/*
+ * Shared memory statistics for a forking server.
+ *
+ * Children only ever write to their own slot, so they need no locks.
+ * If we run out of slots, a child gets a private scratch slot instead,
+ * and adds it into the shared overflow counters with atomic adds when
+ * it finishes. Only children with slots are counted in the handshake
+ * classes, which the parent keeps as it reaps them.
+ */
+
+#include <sys/types.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+
+#include <err.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "stats.h"
+
+struct totals {
+	unsigned long long connections;
+	unsigned long long handshakes_ok;
+	unsigned long long handshakes_failed;
+	unsigned long long aborted;
+	unsigned long long handshake_usec;
+	unsigned long long handshake_cpu_nsec;
+	unsigned long long duration_usec;
+	unsigned long long bytes_in, bytes_out;
+	unsigned long long fork_usec, minflt, private_kb;
+};
+
+struct stats_region {
+	struct totals overflow;		/* atomically updated by children */
+	struct child_stats slot[STATS_SLOTS];
+};
+
+static struct stats_region *region;
+static struct child_stats scratch;	/* for children without a slot */
+static struct totals totals;		/* the parent's, not shared */
+static unsigned long long unslotted;
+static unsigned long long idle_closed, empty_closed;
+
+static unsigned long long
+usec_since(const struct timespec *then)
+{
+	struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (now.tv_sec - then->tv_sec) * 1000000ULL +
+	    (now.tv_nsec - then->tv_nsec) / 1000;
+}
+
+void
+stats_init(void)
+{
+	region = mmap(NULL, sizeof(*region), PROT_READ | PROT_WRITE,
+	    MAP_ANON | MAP_SHARED, -1, 0);
+	if (region == MAP_FAILED)
+		err(1, "mmap of stats region failed");
+	memset(region, 0, sizeof(*region));
+}
+
+struct child_stats *
+stats_slot(void)
+{
+	struct child_stats *cs = &scratch;
+	int i;
+
+	for (i = 0; i < STATS_SLOTS; i++) {
+		if (!region->slot[i].inuse) {
+			cs = &region->slot[i];
+			break;
+		}
+	}
+	if (cs == &scratch)
+		unslotted++;
+	memset(cs, 0, sizeof(*cs));
+	cs->inuse = 1;
+	clock_gettime(CLOCK_MONOTONIC, &cs->start);
+	return cs;
+}
+
+void
+stats_started(struct child_stats *cs, pid_t pid)
+{
+	if (cs != &scratch)
+		cs->pid = pid;
+}
+
+static void
+fold(struct totals *t, const struct child_stats *cs)
+{
+	t->connections++;
+	switch (cs->outcome) {
+	case OUTCOME_OK:
+		t->handshakes_ok++;
+		break;
+	case OUTCOME_FAILED:
+		if (cs->handshaken)
+			t->handshakes_ok++;
+		else
+			t->handshakes_failed++;
+		break;
+	default:
+		t->aborted++;
+		break;
+	}
+	if (cs->handshaken) {
+		t->handshake_usec += cs->handshake_usec;
+		t->handshake_cpu_nsec += cs->hs.cpu_nsec;
+	}
+	t->duration_usec += cs->duration_usec;
+	t->bytes_in += cs->bytes_in;
+	t->bytes_out += cs->bytes_out;
+	t->fork_usec += cs->fork_usec;
+	t->minflt += cs->minflt;
+	t->private_kb += cs->private_kb;
+}
+
+void
+stats_reap(pid_t pid)
+{
+	int i;
+
+	for (i = 0; i < STATS_SLOTS; i++) {
+		if (region->slot[i].inuse && region->slot[i].pid == pid) {
+			fold(&totals, &region->slot[i]);
+			if (region->slot[i].handshaken)
+				hs_account(&region->slot[i].hs);
+			region->slot[i].inuse = 0;
+			return;
+		}
+	}
+}
+
+void
+stats_unserved(int timedout)
+{
+	if (timedout)
+		idle_closed++;
+	else
+		empty_closed++;
+}
+
+void
+stats_serve(int fd)
+{
+	struct totals t = totals;
+	struct totals *o = &region->overflow;
+	int i, active = 0;
+
+	for (i = 0; i < STATS_SLOTS; i++)
+		if (region->slot[i].inuse)
+			active++;
+	t.connections += __atomic_load_n(&o->connections, __ATOMIC_RELAXED);
+	t.handshakes_ok += __atomic_load_n(&o->handshakes_ok,
+	    __ATOMIC_RELAXED);
+	t.handshakes_failed += __atomic_load_n(&o->handshakes_failed,
+	    __ATOMIC_RELAXED);
+	t.handshake_usec += __atomic_load_n(&o->handshake_usec,
+	    __ATOMIC_RELAXED);
+	t.handshake_cpu_nsec += __atomic_load_n(&o->handshake_cpu_nsec,
+	    __ATOMIC_RELAXED);
+	t.duration_usec += __atomic_load_n(&o->duration_usec,
+	    __ATOMIC_RELAXED);
+	t.bytes_in += __atomic_load_n(&o->bytes_in, __ATOMIC_RELAXED);
+	t.bytes_out += __atomic_load_n(&o->bytes_out, __ATOMIC_RELAXED);
+	t.fork_usec += __atomic_load_n(&o->fork_usec, __ATOMIC_RELAXED);
+	t.minflt += __atomic_load_n(&o->minflt, __ATOMIC_RELAXED);
+	t.private_kb += __atomic_load_n(&o->private_kb, __ATOMIC_RELAXED);
+
+	dprintf(fd,
+	    "active %d\n"
+	    "connections %llu\n"
+	    "handshakes_ok %llu\n"
+	    "handshakes_failed %llu\n"
+	    "aborted %llu\n"
+	    "unslotted %llu\n"
+	    "bytes_in %llu\n"
+	    "bytes_out %llu\n"
+	    "idle_closed %llu\n"
+	    "empty_closed %llu\n"
+	    "handshake_usec_avg %llu\n"
+	    "handshake_cpu_usec_avg %llu\n"
+	    "duration_usec_avg %llu\n"
+	    "fork_usec_avg %llu\n"
+	    "child_minflt_avg %llu\n"
+	    "child_private_kb_avg %llu\n",
+	    active, t.connections, t.handshakes_ok, t.handshakes_failed,
+	    t.aborted, unslotted, t.bytes_in, t.bytes_out, idle_closed,
+	    empty_closed,
+	    t.handshakes_ok ? t.handshake_usec / t.handshakes_ok : 0,
+	    t.handshakes_ok ?
+	    t.handshake_cpu_nsec / 1000 / t.handshakes_ok : 0,
+	    t.connections ? t.duration_usec / t.connections : 0,
+	    t.connections ? t.fork_usec / t.connections : 0,
+	    t.connections ? t.minflt / t.connections : 0,
+	    t.connections ? t.private_kb / t.connections : 0);
+	hs_report(fd);
+}
+
+void
+stats_forked(struct child_stats *cs)
+{
+	cs->fork_usec = usec_since(&cs->start);
+}
+
+/*
+ * What the child cost us in memory: every page it wrote that it shared
+ * with the parent was copied, one fault each, and they all end up in
+ * its private dirty memory along with anything it allocated itself.
+ * Only Linux will tell us the second, from smaps_rollup. This is done
+ * once the client has gone, so it costs the client nothing.
+ */
+static void
+child_memory(struct child_stats *cs)
+{
+	struct rusage ru;
+	char buf[2048], *p;	/* not stdio, its buffer would count too */
+	ssize_t len;
+	int fd;
+
+	if (getrusage(RUSAGE_SELF, &ru) == 0)
+		cs->minflt = ru.ru_minflt;
+	if ((fd = open("/proc/self/smaps_rollup", O_RDONLY)) == -1)
+		return;
+	len = read(fd, buf, sizeof(buf) - 1);
+	close(fd);
+	if (len <= 0)
+		return;
+	buf[len] = '\0';
+	if ((p = strstr(buf, "Private_Dirty:")) != NULL)
+		cs->private_kb = strtoull(p + strlen("Private_Dirty:"), NULL,
+		    10);
+}
+
+void
+stats_handshake(struct child_stats *cs, struct tls *ctx, const char *keytype)
+{
+	cs->handshake_usec = usec_since(&cs->start);
+	cs->hs.wall_usec = cs->handshake_usec;
+	hs_classify(&cs->hs, ctx, keytype);
+	cs->handshaken = 1;
+}
+
+void
+stats_finish(struct child_stats *cs, int outcome)
+{
+	struct totals *o = &region->overflow;
+
+	cs->duration_usec = usec_since(&cs->start);
+	child_memory(cs);
+	if (cs != &scratch) {
+		/* make sure the parent sees the rest before the outcome */
+		__atomic_store_n(&cs->outcome, outcome, __ATOMIC_RELEASE);
+		return;
+	}
+	cs->outcome = outcome;
+	__atomic_fetch_add(&o->connections, 1, __ATOMIC_RELAXED);
+	if (cs->handshaken) {
+		__atomic_fetch_add(&o->handshakes_ok, 1, __ATOMIC_RELAXED);
+		__atomic_fetch_add(&o->handshake_usec, cs->handshake_usec,
+		    __ATOMIC_RELAXED);
+		__atomic_fetch_add(&o->handshake_cpu_nsec, cs->hs.cpu_nsec,
+		    __ATOMIC_RELAXED);
+	} else
+		__atomic_fetch_add(&o->handshakes_failed, 1,
+		    __ATOMIC_RELAXED);
+	__atomic_fetch_add(&o->duration_usec, cs->duration_usec,
+	    __ATOMIC_RELAXED);
+	__atomic_fetch_add(&o->bytes_in, cs->bytes_in, __ATOMIC_RELAXED);
+	__atomic_fetch_add(&o->bytes_out, cs->bytes_out, __ATOMIC_RELAXED);
+	__atomic_fetch_add(&o->fork_usec, cs->fork_usec, __ATOMIC_RELAXED);
+	__atomic_fetch_add(&o->minflt, cs->minflt, __ATOMIC_RELAXED);
+	__atomic_fetch_add(&o->private_kb, cs->private_kb, __ATOMIC_RELAXED);
+}
@@ -0,0 +1,76 @@
+/*
+ * Copyright (c) 2008 Bob Beck <beck@obtuse.com>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#ifndef STATS_H
+#define STATS_H
+
+#include <sys/types.h>
+
+#include <time.h>
+
+#include "hsstats.h"
+
+/*
+ * Statistics shared between the server and its forked children. The
+ * region is anonymous shared memory set up before the first fork. The
+ * parent hands each child a slot of its own to scribble in, and folds
+ * the slot into its totals once it has reaped the child.
+ */
+
+#define STATS_SLOTS 256
+
+#define OUTCOME_NONE	0	/* still going, or died without saying */
+#define OUTCOME_OK	1
+#define OUTCOME_FAILED	2
+
+struct child_stats {
+	/* set by the parent */
+	pid_t pid;
+	int inuse;
+	struct timespec start;		/* when we accepted the connection */
+	/* set by the child */
+	int outcome;
+	int handshaken;
+	struct hs_sample hs;		/* what kind, and the cpu it took */
+	unsigned long long handshake_usec;
+	unsigned long long duration_usec;
+	unsigned long long bytes_in, bytes_out;
+	unsigned long long fork_usec;	/* slot taken to child running */
+	unsigned long long minflt;	/* page faults, copy on write mostly */
+	unsigned long long private_kb;	/* memory that is ours alone */
+} __attribute__((aligned(64)));
+
+void stats_init(void);
+
+/* In the parent, before fork: find a slot for the next child */
+struct child_stats *stats_slot(void);
+/* In the parent, after fork: say who has it */
+void stats_started(struct child_stats *cs, pid_t pid);
+/* In the parent, after waitpid: fold the child's slot into the totals */
+void stats_reap(pid_t pid);
+/* In the parent: a connection closed before it sent anything */
+void stats_unserved(int timedout);
+/* In the parent: write the totals out to fd */
+void stats_serve(int fd);
+
+/* In the child, first thing */
+void stats_forked(struct child_stats *cs);
+/* In the child */
+void stats_handshake(struct child_stats *cs, struct tls *ctx,
+    const char *keytype);
+void stats_finish(struct child_stats *cs, int outcome);
+
+#endif /* STATS_H */
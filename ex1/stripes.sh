@@ -0,0 +1,39 @@
+#!/bin/sh
+#
+# stripes.sh - find how many stripes get a file to a server fastest.
+#
+#	stripes.sh file host port [count ...]
+#
+# Uploads the file with "client -n" for each count (1 2 4 8 16 32 by
+# default) and prints the throughput of each. The best count is the
+# fewest stripes that get within 5% of the fastest: past that, more
+# connections only cost more handshakes and more processes. Run it
+# through rttproxy to see what a long link would do.
+
+if [ $# -lt 3 ]; then
+    echo "usage: stripes.sh file host port [count ...]"
+    exit 1
+fi
+file=$1; host=$2; port=$3
+shift 3
+counts=${*:-"1 2 4 8 16 32"}
+
+results=""
+for n in ${counts}; do
+    mbits=`./client -n ${n} -u ${file} ${host} ${port} 2>&1 |
+	sed -n 's/.*connections, \([0-9.]*\) Mbit\/s$/\1/p'`
+    if [ -z "${mbits}" ]; then
+	echo "upload with ${n} stripes failed" >&2
+	exit 1
+    fi
+    results="${results}${n} ${mbits}
+"
+done
+printf "%s" "${results}" | awk '
+    { n[NR] = $1; m[NR] = $2; printf "%8d stripes %10.1f Mbit/s\n", $1, $2
+      if ($2 > max) max = $2 }
+    END { for (i = 1; i <= NR; i++)
+	      if (m[i] >= max * 0.95) {
+		  printf "best: %d stripes, %.1f Mbit/s\n", n[i], m[i]
+		  exit
+	      } }'
@@ -0,0 +1,257 @@
+/*
+ * Copyright (c) 2018 Bob Beck <beck@obtuse.com>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/*
+ * Chained buffers built from pooled fixed size chunks.
+ */
+
+#include <sys/types.h>
+#include <sys/uio.h>
+
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "chain.h"
+
+#define POOL_MAX 1024	/* free chunks we hang on to */
+#define CHAIN_IOV 64	/* pieces we hand writev at once */
+
+static struct chunk *pool;
+static size_t pool_free;
+static size_t chunks_used;
+static size_t chunks_peak;
+static size_t budget_chunks;
+static unsigned long long chunks_denied;
+
+static struct chunk *
+chunk_get(void)
+{
+	struct chunk *chunk;
+
+	if ((chunk = pool) != NULL) {
+		pool = chunk->next;
+		pool_free--;
+	} else {
+		if (budget_chunks != 0 && chunks_used >= budget_chunks) {
+			chunks_denied++;
+			return NULL;
+		}
+		if ((chunk = malloc(sizeof(*chunk))) == NULL)
+			return NULL;
+	}
+	chunk->next = NULL;
+	chunk->start = chunk->end = 0;
+	if (++chunks_used + pool_free > chunks_peak)
+		chunks_peak = chunks_used + pool_free;
+	return chunk;
+}
+
+static void
+chunk_put(struct chunk *chunk)
+{
+	chunks_used--;
+	if (pool_free >= POOL_MAX ||
+	    (budget_chunks != 0 && chunks_used + pool_free >= budget_chunks)) {
+		free(chunk);
+		return;
+	}
+	chunk->next = pool;
+	pool = chunk;
+	pool_free++;
+}
+
+void
+chain_set_budget(size_t bytes)
+{
+	budget_chunks = bytes / sizeof(struct chunk);
+	if (bytes != 0 && budget_chunks == 0)
+		budget_chunks = 1;
+}
+
+void
+chain_get_stats(struct chain_stats *stats)
+{
+	stats->budget = budget_chunks * sizeof(struct chunk);
+	stats->used = chunks_used * sizeof(struct chunk);
+	stats->pooled = pool_free * sizeof(struct chunk);
+	stats->peak = chunks_peak * sizeof(struct chunk);
+	stats->denied = chunks_denied;
+}
+
+void
+chain_pool_trim(void)
+{
+	struct chunk *chunk;
+
+	while ((chunk = pool) != NULL) {
+		pool = chunk->next;
+		free(chunk);
+	}
+	pool_free = 0;
+}
+
+void
+chain_init(struct chain *chain, size_t cap)
+{
+	chain->head = chain->tail = NULL;
+	chain->len = 0;
+	chain->cap = cap;
+}
+
+void
+chain_clear(struct chain *chain)
+{
+	struct chunk *chunk;
+
+	while ((chunk = chain->head) != NULL) {
+		chain->head = chunk->next;
+		chunk_put(chunk);
+	}
+	chain->tail = NULL;
+	chain->len = 0;
+}
+
+size_t
+chain_space(const struct chain *chain)
+{
+	return chain->cap - chain->len;
+}
+
+unsigned char *
+chain_reserve(struct chain *chain, size_t *space)
+{
+	struct chunk *chunk = chain->tail;
+	size_t n;
+
+	*space = 0;
+	if (chain->len >= chain->cap)
+		return NULL;
+	if (chunk == NULL || chunk->end == CHUNK_SIZE) {
+		if ((chunk = chunk_get()) == NULL)
+			return NULL;
+		if (chain->tail == NULL)
+			chain->head = chunk;
+		else
+			chain->tail->next = chunk;
+		chain->tail = chunk;
+	}
+	n = CHUNK_SIZE - chunk->end;
+	if (n > chain->cap - chain->len)
+		n = chain->cap - chain->len;
+	*space = n;
+	return chunk->data + chunk->end;
+}
+
+void
+chain_commit(struct chain *chain, size_t len)
+{
+	chain->tail->end += len;
+	chain->len += len;
+}
+
+size_t
+chain_put(struct chain *chain, const void *buf, size_t len)
+{
+	const unsigned char *p = buf;
+	unsigned char *dst;
+	size_t n, space, done = 0;
+
+	while (done < len) {
+		if ((dst = chain_reserve(chain, &space)) == NULL)
+			break;
+		n = len - done;
+		if (n > space)
+			n = space;
+		memcpy(dst, p + done, n);
+		chain_commit(chain, n);
+		done += n;
+	}
+	return done;
+}
+
+const unsigned char *
+chain_peek(const struct chain *chain, size_t *len)
+{
+	struct chunk *chunk = chain->head;
+
+	*len = 0;
+	if (chain->len == 0)
+		return NULL;
+	*len = chunk->end - chunk->start;
+	return chunk->data + chunk->start;
+}
+
+int
+chain_iov(const struct chain *chain, struct iovec *iov, int iovcnt)
+{
+	struct chunk *chunk;
+	int n = 0;
+
+	for (chunk = chain->head; chunk != NULL && n < iovcnt;
+	    chunk = chunk->next) {
+		if (chunk->end == chunk->start)
+			continue;
+		iov[n].iov_base = chunk->data + chunk->start;
+		iov[n].iov_len = chunk->end - chunk->start;
+		n++;
+	}
+	return n;
+}
+
+void
+chain_consume(struct chain *chain, size_t len)
+{
+	struct chunk *chunk;
+	size_t n;
+
+	while (len > 0 && (chunk = chain->head) != NULL) {
+		n = chunk->end - chunk->start;
+		if (n > len)
+			n = len;
+		chunk->start += n;
+		chain->len -= n;
+		len -= n;
+		if (chunk->start < chunk->end)
+			break;
+		chain->head = chunk->next;
+		if (chain->head == NULL)
+			chain->tail = NULL;
+		chunk_put(chunk);
+	}
+}
+
+ssize_t
+chain_writev(struct chain *chain, int fd)
+{
+	struct iovec iov[CHAIN_IOV];
+	ssize_t w;
+	int n;
+
+	if ((n = chain_iov(chain, iov, CHAIN_IOV)) == 0)
+		return 0;
+	if ((w = writev(fd, iov, n)) > 0)
+		chain_consume(chain, w);
+	return w;
+}
+
+void
+chain_shrink(struct chain *chain)
+{
+	if (chain->len == 0)
+		chain_clear(chain);
+}
@@ -0,0 +1,98 @@
+/*
+ * Copyright (c) 2018 Bob Beck <beck@obtuse.com>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#ifndef CHAIN_H
+#define CHAIN_H
+
+#include <sys/types.h>
+#include <sys/uio.h>
+
+#include <stddef.h>
+
+/*
+ * A chain is a buffer made of a list of fixed size chunks, which can
+ * grow up to a cap without ever moving data already in it. Chunks come
+ * from, and go back to, a pool shared by every chain in the process.
+ */
+
+#define CHUNK_SIZE 16384	/* one full TLS record */
+
+struct chunk {
+	struct chunk *next;
+	size_t start, end;	/* data lives in data[start] to data[end - 1] */
+	unsigned char data[CHUNK_SIZE];
+};
+
+struct chain {
+	struct chunk *head, *tail;
+	size_t len;		/* bytes buffered */
+	size_t cap;		/* most we will buffer */
+};
+
+void chain_init(struct chain *chain, size_t cap);
+
+/* Throw away everything buffered, giving the chunks back to the pool */
+void chain_clear(struct chain *chain);
+
+/* How many more bytes the chain will take before hitting its cap */
+size_t chain_space(const struct chain *chain);
+
+/*
+ * Get contiguous space at the end of the chain to read into, setting
+ * *space to how big it is. Returns NULL if the chain is at its cap or
+ * we could not get a chunk. Follow with chain_commit() for however
+ * much was actually filled in.
+ */
+unsigned char *chain_reserve(struct chain *chain, size_t *space);
+void chain_commit(struct chain *chain, size_t len);
+
+/* Copy data in, returning how much fit */
+size_t chain_put(struct chain *chain, const void *buf, size_t len);
+
+/* Get the first contiguous piece of buffered data */
+const unsigned char *chain_peek(const struct chain *chain, size_t *len);
+
+/* Describe up to iovcnt pieces of the buffered data */
+int chain_iov(const struct chain *chain, struct iovec *iov, int iovcnt);
+
+/* Drop len bytes from the front */
+void chain_consume(struct chain *chain, size_t len);
+
+/* Write as much as we can with one writev(2), consuming what went */
+ssize_t chain_writev(struct chain *chain, int fd);
+
+/* Give back a chain's chunks that hold no data */
+void chain_shrink(struct chain *chain);
+
+/*
+ * All chunk memory in the process can be held to a budget, after which
+ * chain_reserve() fails until some is given back.
+ */
+struct chain_stats {
+	size_t budget;			/* most chunk memory allowed, or 0 */
+	size_t used;			/* bytes of chunks held by chains */
+	size_t pooled;			/* bytes of chunks in the pool */
+	size_t peak;			/* most used + pooled we have seen */
+	unsigned long long denied;	/* chunks refused by the budget */
+};
+
+void chain_set_budget(size_t bytes);
+void chain_get_stats(struct chain_stats *stats);
+
+/* Free every chunk in the pool */
+void chain_pool_trim(void);
+
+#endif /* CHAIN_H */
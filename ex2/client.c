@@ -17,6 +17,12 @@
 /*
  * A relatively simple buffering echo client that uses poll(2),
  * for instructional purposes.
+ *
+ * Given more than one server, it keeps a connection to each and sends
+ * every line to the better of two picked at random, as pool.c
+ * describes. If the server doesn't echo the line within -H
+ * milliseconds, or its connection breaks, the server is ejected and
+ * the line goes to another one.
  */
 
 #include <sys/types.h>
@@ -34,17 +40,31 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
 #include <unistd.h>
 
+#include "chain.h"
+#include "connrace.h"
+#include "frame.h"
+#include "pool.h"
 
 #define BUFLEN 4096
+#define MAXPENDING 64
 
 static int debug = 0;
+static int latency = 0;
+static int pooled = 0;
+static struct pool pool;
+static struct connrace *races;	/* reconnects to ejected servers */
+static int *racing;
+static long long health = 1000;
 
 static void usage()
 {
 	extern char * __progname;
-	fprintf(stderr, "usage: %s host portnumber\n", __progname);
+	fprintf(stderr, "usage: %s [-l] [-b bufsize] [-H health] "
+	    "host portnumber\n"
+	    "\t[host portnumber ...]\n", __progname);
 	exit(1);
 }
 
@@ -54,81 +74,55 @@ static void usage()
 
 struct server {
 	int state;
-	unsigned char *readptr, *writeptr, *nextptr;
-	unsigned char buf[BUFLEN];
+	struct framer framer;
+	/* when each message we are waiting on was sent */
+	struct timespec sent[MAXPENDING];
+	unsigned int sent_head, sent_tail;
+	struct chain chain;	/* lines waiting to go to the server */
 };
 
-static struct server server;
+static struct server *servers;
+static struct pollfd *pollfds;
+static int nservers;
+static size_t server_cap = 1024 * 1024;
 
 static void
 server_init(struct server *server)
 {
-	server->readptr = server->writeptr = server->nextptr = server->buf;
+	chain_init(&server->chain, server_cap);
 	server->state = STATE_NONE;
+	server->sent_head = server->sent_tail = 0;
+	framer_init(&server->framer);
 }
 
-static ssize_t
-server_consume(struct server *server, size_t len)
-{
-	size_t n = 0;
-
-	while (n < len) {
-		if (server->readptr == server->nextptr)
-			break;
-		server->readptr++;
-		n++;
-	}
-
-	if (debug && n > 0)
-                fprintf(stderr, "server_consume: %ld bytes from buffer\n", n);
-
-        return ((ssize_t)n);
-}
-
-static ssize_t
-server_get(struct server * server, unsigned char *outbuf, size_t outlen)
+static void
+server_sent(struct server *server)
 {
-        unsigned char *nextptr = server->readptr;
-        size_t n = 0;
-
-        while (n < outlen) {
-                if (nextptr == server->writeptr)
-                        break;
-                *outbuf++ = *nextptr++;
-                if ((size_t)(nextptr - server->buf) >= sizeof(server->buf))
-                        nextptr = server->buf;
-		server->nextptr = nextptr;
-                n++;
-        }
-
-        if (debug && n > 0)
-                fprintf(stderr, "server_get: got %ld bytes from buffer\n", n);
-
-        return ((ssize_t)n);
+	if (server->sent_tail - server->sent_head == MAXPENDING)
+		errx(1, "too many messages outstanding");
+	clock_gettime(CLOCK_MONOTONIC,
+	    &server->sent[server->sent_tail++ % MAXPENDING]);
 }
 
-static ssize_t
-server_put(struct server *server, const unsigned char *inbuf, size_t inlen)
+/*
+ * Account for n echoed messages having arrived, returning how many we
+ * are still waiting on.
+ */
+static unsigned int
+server_received(struct server *server, size_t n)
 {
-        unsigned char *nextptr = server->writeptr;
-        unsigned char *prevptr;
-        size_t n = 0;
-
-        while (n < inlen) {
-                prevptr = nextptr++;
-                if ((size_t)(nextptr - server->buf) >= sizeof(server->buf))
-                        nextptr = server->buf;
-                if (nextptr == server->readptr)
-                        break;
-                *prevptr = *inbuf++;
-                server->writeptr = nextptr;
-                n++;
-        }
-
-        if (debug && n > 0)
-                fprintf(stderr, "server_put: put %ld bytes into buffer\n", n);
-
-        return ((ssize_t)n);
+	struct timespec now, *then;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	while (n-- > 0 && server->sent_head != server->sent_tail) {
+		then = &server->sent[server->sent_head++ % MAXPENDING];
+		if (latency)
+			fprintf(stderr, "message %llu: %lld usec\n",
+			    server->framer.messages - n,
+			    (long long)(now.tv_sec - then->tv_sec) * 1000000 +
+			    (now.tv_nsec - then->tv_nsec) / 1000);
+	}
+	return server->sent_tail - server->sent_head;
 }
 
 static void
@@ -137,7 +131,9 @@ closeconn (struct pollfd *pfd)
 	close(pfd->fd);
 	pfd->fd = -1;
 	pfd->revents = 0;
-	exit(0);
+	/* with a pool, we can carry on with the other servers */
+	if (!pooled)
+		exit(0);
 }
 
 static void
@@ -156,12 +152,12 @@ newconn(struct pollfd *pfd, int newfd, int events) {
 static void
 handle_server(struct pollfd *pfd, struct server *server)
 {
-	if ((pfd->revents & (POLLERR | POLLNVAL)))
+	if ((pfd->revents & POLLNVAL) || (!pooled && (pfd->revents & POLLERR)))
 		errx(1, "bad fd %d", pfd->fd);
-	if (pfd->revents & POLLHUP)
+	if (pfd->revents & (POLLHUP | POLLERR))
 		closeconn(pfd);
 	else if (pfd->revents & pfd->events) {
-		char buf[BUFLEN];
+		unsigned char buf[BUFLEN];
 		ssize_t len = 0;
 		if (server->state == STATE_READING) {
 			ssize_t w = 0;
@@ -172,12 +168,14 @@ handle_server(struct pollfd *pfd, struct server *server)
 					w = write(STDOUT_FILENO, buf, len);
 					if (w == -1) {
 						if (errno != EINTR)
-							closeconn(pfd);
+							err(1, "stdout");
 					}
 					else
 						written += w;
 				} while (written < len);
-				if (buf[len - 1] == '\n') {
+				if (server_received(server,
+				    framer_feed(&server->framer, buf, len))
+				    == 0) {
 					server->state=STATE_NONE;
 					pfd->events = POLLHUP;
 				}
@@ -187,21 +185,20 @@ handle_server(struct pollfd *pfd, struct server *server)
 			else
 				pfd->events = POLLIN | POLLHUP;
 		} else if (server->state == STATE_WRITING) {
-			ssize_t w = 0;
-			ssize_t written = 0;
-			do {
-				len = server_get(server, buf, sizeof(buf));
-				w = write(pfd->fd, buf, len);
-				if (w == -1) {
-					if (errno != EINTR)
+			while (server->chain.len > 0) {
+				len = chain_writev(&server->chain, pfd->fd);
+				if (len == -1) {
+					if (errno == EAGAIN)
+						break;
+					if (errno != EINTR) {
 						closeconn(pfd);
-				}
-				else {
-					written += w;
-					server_consume(server, w);
-				}
-			} while (written < len);
-			if (pfd->fd > 0) {
+						return;
+					}
+				} else if (debug)
+					fprintf(stderr, "wrote %zd bytes\n",
+					    len);
+			}
+			if (server->chain.len == 0) {
 				server->state = STATE_READING;
 				pfd->events = POLLIN | POLLHUP;
 			}
@@ -209,54 +206,208 @@ handle_server(struct pollfd *pfd, struct server *server)
 	}
 }
 
-int main(int argc, char **argv) {
+static long long
+elapsed_ms(const struct timespec *then)
+{
+	struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (now.tv_sec - then->tv_sec) * 1000LL +
+	    (now.tv_nsec - then->tv_nsec) / 1000000;
+}
+
+/*
+ * Try again to connect to ejected servers whose time is up. Each
+ * reconnect is raced a step at a time, every time we come round, so
+ * a server that doesn't answer doesn't hold up the line in flight.
+ */
+static void
+reconnect(struct addrinfo **res)
+{
+	struct timespec now;
+	int i, fd;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	for (i = 0; i < nservers; i++) {
+		if (!racing[i]) {
+			if (!pool_recheck(&pool, i, &now))
+				continue;
+			connrace_start(&races[i], res[i], CONNRACE_DELAY,
+			    health);
+			racing[i] = 1;
+		}
+		if ((fd = connrace_step(&races[i])) == CONNRACE_PENDING)
+			continue;
+		racing[i] = 0;
+		if (fd == -1) {
+			pool_eject(&pool, i, &now);
+			continue;
+		}
+		chain_clear(&servers[i].chain);
+		newconn(&pollfds[i], fd, 0);
+		server_init(&servers[i]);
+		pool_reinstate(&pool, i);
+	}
+}
 
-	struct addrinfo hints, *res;
-	int serverfd, error;
-	struct pollfd pollfd;
+int main(int argc, char **argv) {
 
-	if (argc != 3)
+	struct addrinfo hints, **res;
+	struct timespec now, sent_at;
+	struct server *server;
+	char *ep, *line = NULL;
+	size_t size = 0, linelen = 0;
+	ssize_t len;
+	long long ms;
+	int ch, error, fd, i, cur = -1;
+
+	while ((ch = getopt(argc, argv, "b:H:l")) != -1) {
+		switch (ch) {
+		case 'b':
+			errno = 0;
+			server_cap = strtoul(optarg, &ep, 10);
+			if (*optarg == '\0' || *ep != '\0' || errno == ERANGE ||
+			    server_cap == 0)
+				errx(1, "%s - bad buffer size", optarg);
+			break;
+		case 'H':
+			errno = 0;
+			health = strtoll(optarg, &ep, 10);
+			if (*optarg == '\0' || *ep != '\0' || errno == ERANGE ||
+			    health <= 0)
+				errx(1, "%s - bad health timeout", optarg);
+			break;
+		case 'l':
+			latency = 1;
+			break;
+		default:
+			usage();
+		}
+	}
+	argc -= optind;
+	argv += optind;
+	if (argc < 2 || argc % 2 != 0)
 		usage();
+	nservers = argc / 2;
+	pooled = nservers > 1;
+
+	if ((res = calloc(nservers, sizeof(*res))) == NULL ||
+	    (servers = calloc(nservers, sizeof(*servers))) == NULL ||
+	    (pollfds = calloc(nservers, sizeof(*pollfds))) == NULL)
+		err(1, "calloc");
+	if (pooled) {
+		pool_init(&pool, nservers);
+		if ((races = calloc(nservers, sizeof(*races))) == NULL ||
+		    (racing = calloc(nservers, sizeof(*racing))) == NULL)
+			err(1, "calloc");
+	}
 
 	bzero(&hints, sizeof(hints));
-	hints.ai_family = AF_INET;
+	hints.ai_family = AF_UNSPEC;
 	hints.ai_socktype = SOCK_STREAM;
-	hints.ai_flags = AI_PASSIVE;
-	if ((error = getaddrinfo(argv[1], argv[2], &hints, &res))) {
-		fprintf(stderr, "%s\n", gai_strerror(error));
-		usage();
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	for (i = 0; i < nservers; i++) {
+		if ((error = getaddrinfo(argv[2 * i], argv[2 * i + 1], &hints,
+		    &res[i]))) {
+			fprintf(stderr, "%s %s: %s\n", argv[2 * i],
+			    argv[2 * i + 1], gai_strerror(error));
+			usage();
+		}
+		server_init(&servers[i]);
+		pollfds[i].fd = -1;
+
+		/*
+		 * the server may have more than one address, and some of
+		 * them may not work, so race connections to all of them.
+		 */
+		if ((fd = connrace(res[i], CONNRACE_DELAY,
+		    pooled ? health : 0)) == -1) {
+			if (!pooled)
+				err(1, "connect failed");
+			warn("%s %s: connect failed", argv[2 * i],
+			    argv[2 * i + 1]);
+			pool_eject(&pool, i, &now);
+		} else
+			newconn(&pollfds[i], fd, 0);
+		if (pooled) {
+			pool.ep[i].host = argv[2 * i];
+			pool.ep[i].port = argv[2 * i + 1];
+		}
 	}
 
-	if ((serverfd = socket(AF_INET, SOCK_STREAM, 0)) == -1)
-		err(1, "socket failed");
-
-	if (connect(serverfd, res->ai_addr, res->ai_addrlen) == -1)
-		err(1, "connect failed");
-
-	newconn(&pollfd, serverfd, 0);
-	server_init(&server);
-
 	while(1) {
-		if (server.state == STATE_NONE) {
-			char *line = NULL;
-			size_t size = 0;
-			ssize_t len;
-
-			if ((len = getline(&line, &size, stdin)) != -1) {
-				if (server_put(&server, line, len) != len)
-					errx(1, "can't buffer line to server");
-				server.state=STATE_WRITING;
-				pollfd.events = POLLOUT | POLLHUP;
+		if (cur == -1) {
+			/* send the next line, or send this one again */
+			if (linelen == 0) {
+				if ((len = getline(&line, &size, stdin)) == -1)
+					break;
+				linelen = len;
+			}
+			if (pooled)
+				reconnect(res);
+			if ((cur = pooled ? pool_pick(&pool) : 0) == -1) {
+				/* everyone is ejected, wait a bit */
+				poll(NULL, 0, 50);
+				continue;
 			}
-			free(line);
-			if (len == -1)
-				break;
+			server = &servers[cur];
+			if (chain_put(&server->chain, line, linelen) !=
+			    linelen)
+				errx(1, "line longer than %zu bytes",
+				    server_cap);
+			server_sent(server);
+			server->state=STATE_WRITING;
+			pollfds[cur].events = POLLOUT | POLLHUP;
+			if (pooled)
+				pool_sent(&pool, cur);
+			clock_gettime(CLOCK_MONOTONIC, &sent_at);
 		}
-		if (poll(&pollfd, 1, -1) == -1)
+		if (poll(pollfds, nservers, pooled ? 50 : -1) == -1)
 			err(1, "poll failed");
-		handle_server(&pollfd, &server);
+		for (i = 0; i < nservers; i++) {
+			if (pollfds[i].fd != -1 && pollfds[i].revents != 0)
+				handle_server(&pollfds[i], &servers[i]);
+		}
+		if (!pooled) {
+			if (servers[0].state == STATE_NONE) {
+				cur = -1;
+				linelen = 0;
+			}
+			continue;
+		}
+
+		reconnect(res);
+		clock_gettime(CLOCK_MONOTONIC, &now);
+		for (i = 0; i < nservers; i++) {
+			if (pollfds[i].fd == -1 && !pool.ep[i].ejected) {
+				warnx("%s %s: connection lost, ejecting",
+				    pool.ep[i].host, pool.ep[i].port);
+				pool_eject(&pool, i, &now);
+			}
+		}
+		ms = elapsed_ms(&sent_at);
+		if (pollfds[cur].fd == -1) {
+			/* it broke, send the line to someone else */
+			pool_dropped(&pool, cur);
+			cur = -1;
+		} else if (servers[cur].state == STATE_NONE) {
+			pool_answered(&pool, cur, ms * 1000.0);
+			cur = -1;
+			linelen = 0;
+		} else if (ms > health) {
+			warnx("%s %s: no answer in %lld ms, ejecting",
+			    pool.ep[cur].host, pool.ep[cur].port, health);
+			pool_dropped(&pool, cur);
+			closeconn(&pollfds[cur]);
+			chain_clear(&servers[cur].chain);
+			pool_eject(&pool, cur, &now);
+			cur = -1;
+		}
 	}
 
-	freeaddrinfo(res);
+	for (i = 0; i < nservers; i++)
+		freeaddrinfo(res[i]);
+	free(res);
+	free(line);
 	return 0;
 }
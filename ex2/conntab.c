@@ -0,0 +1,187 @@
+/*
+ * Copyright (c) 2018 Bob Beck <beck@obtuse.com>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/*
+ * The connection table, a snapshot at a time.
+ */
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include <err.h>
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "conntab.h"
+
+/*
+ * Cipher and version names. There are only ever a handful, so a row
+ * gets a number instead of a copy, and past the end of the table a
+ * name is just "other".
+ */
+#define CONNTAB_NAMES 64
+
+static const char *names[CONNTAB_NAMES] = { "-" };
+static int nnames = 1;
+
+/* the most a row can come to as text */
+#define ROW_MAX (INET6_ADDRSTRLEN + 128 + CONNTAB_SUBJECT)
+
+int
+conntab_init(struct conntab *ct, size_t max)
+{
+	memset(ct, 0, sizeof(*ct));
+	if (max == 0)
+		max = 1;
+	if ((ct->rows = calloc(max, sizeof(*ct->rows))) == NULL ||
+	    (ct->buf = malloc(CONNTAB_BUFLEN)) == NULL) {
+		warn("connection table");
+		free(ct->rows);
+		return -1;
+	}
+	ct->maxrows = max;
+	ct->len = snprintf(ct->buf, CONNTAB_BUFLEN, "%-5s %-40s %-9s %9s "
+	    "%12s %12s %8s %-7s %-28s %s\n", "fd", "peer", "state",
+	    "age_ms", "bytes_in", "bytes_out", "buffered", "version",
+	    "cipher", "subject");
+	return 0;
+}
+
+struct conntab_row *
+conntab_row(struct conntab *ct)
+{
+	struct conntab_row *row;
+
+	if (ct->nrows == ct->maxrows)
+		return NULL;
+	row = &ct->rows[ct->nrows++];
+	memset(row, 0, sizeof(*row));
+	return row;
+}
+
+void
+conntab_clear(struct conntab *ct)
+{
+	ct->nrows = ct->next = 0;
+}
+
+uint8_t
+conntab_intern(const char *name)
+{
+	int i;
+
+	if (name == NULL)
+		return 0;
+	/* libtls hands back the same pointers, so try that first */
+	for (i = 1; i < nnames; i++)
+		if (names[i] == name)
+			return i;
+	for (i = 1; i < nnames; i++)
+		if (strcmp(names[i], name) == 0)
+			return i;
+	if (nnames == CONNTAB_NAMES - 1)
+		return CONNTAB_NAMES - 1;
+	if ((names[nnames] = strdup(name)) == NULL)
+		return 0;
+	return nnames++;
+}
+
+static const char *
+name(uint8_t i)
+{
+	if (i == CONNTAB_NAMES - 1)
+		return "other";
+	return i < nnames ? names[i] : "-";
+}
+
+static size_t
+format_row(const struct conntab_row *row, char *buf, size_t len)
+{
+	char addr[INET6_ADDRSTRLEN], peer[INET6_ADDRSTRLEN + 8];
+	int n;
+
+	switch (row->peer.sa.sa_family) {
+	case AF_INET:
+		inet_ntop(AF_INET, &row->peer.sin.sin_addr, addr,
+		    sizeof(addr));
+		snprintf(peer, sizeof(peer), "%s:%u", addr,
+		    ntohs(row->peer.sin.sin_port));
+		break;
+	case AF_INET6:
+		inet_ntop(AF_INET6, &row->peer.sin6.sin6_addr, addr,
+		    sizeof(addr));
+		snprintf(peer, sizeof(peer), "[%s]:%u", addr,
+		    ntohs(row->peer.sin6.sin6_port));
+		break;
+	default:
+		snprintf(peer, sizeof(peer), "-");
+	}
+	n = snprintf(buf, len, "%-5d %-40s %-9s %9lld %12llu %12llu %8zu "
+	    "%-7s %-28s %s\n", row->fd, peer, row->state,
+	    (long long)row->age_msec, row->bytes_in, row->bytes_out,
+	    row->buffered, name(row->version), name(row->cipher),
+	    row->subject[0] != '\0' ? row->subject : "-");
+	return n < 0 ? 0 : (size_t)n >= len ? len - 1 : (size_t)n;
+}
+
+/* at most this much formatting and writing each time we are called */
+#define SEND_ROUNDS 4
+
+int
+conntab_send(struct conntab *ct, int fd)
+{
+	ssize_t w;
+	int round;
+
+	for (round = 0; round < SEND_ROUNDS; round++) {
+		/* top up the buffer with whole rows */
+		if (ct->off > 0) {
+			memmove(ct->buf, ct->buf + ct->off, ct->len - ct->off);
+			ct->len -= ct->off;
+			ct->off = 0;
+		}
+		while (ct->next < ct->nrows &&
+		    CONNTAB_BUFLEN - ct->len > ROW_MAX)
+			ct->len += format_row(&ct->rows[ct->next++],
+			    ct->buf + ct->len, CONNTAB_BUFLEN - ct->len);
+		if (ct->len == 0)
+			return 0;
+		while (ct->off < ct->len) {
+			w = write(fd, ct->buf + ct->off, ct->len - ct->off);
+			if (w == -1 && errno == EINTR)
+				continue;
+			if (w == -1 && errno == EAGAIN)
+				return 1;
+			if (w == -1)
+				return -1;
+			ct->off += w;
+		}
+	}
+	return ct->off < ct->len || ct->next < ct->nrows;
+}
+
+void
+conntab_free(struct conntab *ct)
+{
+	free(ct->rows);
+	free(ct->buf);
+	memset(ct, 0, sizeof(*ct));
+}
@@ -0,0 +1,89 @@
+/*
+ * Copyright (c) 2018 Bob Beck <beck@obtuse.com>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#ifndef CONNTAB_H
+#define CONNTAB_H
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * A table of the server's connections, for the stats socket's "conns"
+ * command.
+ *
+ * The server copies what it knows about each connection into a row, a
+ * table's worth of rows in one go, so each lot is a snapshot of a
+ * single moment. When they have been written out it empties the table
+ * with conntab_clear() and copies the next lot. That is a copy of a
+ * couple of hundred bytes a connection and no more:
+ * cipher and version names are kept once each and rows just number
+ * them, and nothing is formatted. Turning rows into text and getting
+ * it to the reader is done a buffer at a time, whenever the stats
+ * connection can take more, so a big table or a slow reader never
+ * holds up the poll loop for more than that.
+ */
+
+#define CONNTAB_SUBJECT 128	/* enough of the peer's subject to go on */
+#define CONNTAB_BUFLEN (64 * 1024)
+
+union conntab_addr {
+	struct sockaddr sa;
+	struct sockaddr_in sin;
+	struct sockaddr_in6 sin6;
+};
+
+struct conntab_row {
+	union conntab_addr peer;
+	const char *state;	/* a string constant */
+	int fd;
+	uint8_t version;	/* conntab_intern() numbers, 0 for none */
+	uint8_t cipher;
+	int64_t age_msec;
+	unsigned long long bytes_in, bytes_out;
+	size_t buffered;
+	char subject[CONNTAB_SUBJECT];
+};
+
+struct conntab {
+	struct conntab_row *rows;
+	size_t nrows, maxrows;
+	size_t next;		/* the next row to format */
+	char *buf;		/* formatted, waiting to be written */
+	size_t len, off;
+};
+
+/* Make room for up to max rows. -1 and warn on failure */
+int conntab_init(struct conntab *ct, size_t max);
+/* The next row to fill in, zeroed, or NULL if the table is full */
+struct conntab_row *conntab_row(struct conntab *ct);
+/* Empty the rows for the next lot, once conntab_send() has sent them */
+void conntab_clear(struct conntab *ct);
+/* A number for a cipher or version name, the same one every time */
+uint8_t conntab_intern(const char *name);
+
+/*
+ * Write some more of the table to a nonblocking fd. Returns 1 if there
+ * is more to come, 0 when it has all gone, and -1 if the reader went
+ * away.
+ */
+int conntab_send(struct conntab *ct, int fd);
+void conntab_free(struct conntab *ct);
+
+#endif /* CONNTAB_H */
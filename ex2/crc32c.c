@@ -0,0 +1,189 @@
+/*
+ * Copyright (c) 2018 Bob Beck <beck@obtuse.com>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/*
+ * CRC32C for checking echoed payloads at line rate.
+ *
+ * On amd64 cpus with SSE4.2 we use the crc32 instruction, running three
+ * independent lanes at once to hide its latency and then stitching the
+ * lanes back together with precomputed "shift by n zero bytes" tables.
+ * Everywhere else we use a portable slicing-by-8 table implementation.
+ */
+
+#include <stdint.h>
+#include <string.h>
+
+#include "crc32c.h"
+
+#if defined(__x86_64__) && (defined(__GNUC__) || defined(__clang__))
+#define CRC32C_HW
+#include <nmmintrin.h>
+#endif
+
+#define POLY 0x82f63b78	/* reflected Castagnoli polynomial */
+#define LANE 2048	/* bytes per lane in the hardware path */
+
+static uint32_t table[8][256];
+#ifdef CRC32C_HW
+static uint32_t shift1[4][256];	/* advance a crc past LANE zero bytes */
+static uint32_t shift2[4][256];	/* advance a crc past 2 * LANE zero bytes */
+#endif
+static int initialized;
+static int have_hw;
+
+static uint32_t
+zeros(uint32_t crc, size_t len)
+{
+	while (len--)
+		crc = (crc >> 8) ^ table[0][crc & 0xff];
+	return crc;
+}
+
+static void
+crc32c_init(void)
+{
+	uint32_t crc;
+	int i, j;
+
+	for (i = 0; i < 256; i++) {
+		crc = i;
+		for (j = 0; j < 8; j++)
+			crc = (crc & 1) ? (crc >> 1) ^ POLY : crc >> 1;
+		table[0][i] = crc;
+	}
+	for (i = 0; i < 256; i++) {
+		crc = table[0][i];
+		for (j = 1; j < 8; j++) {
+			crc = (crc >> 8) ^ table[0][crc & 0xff];
+			table[j][i] = crc;
+		}
+	}
+#ifdef CRC32C_HW
+	if (__builtin_cpu_supports("sse4.2")) {
+		/*
+		 * crc over zero bytes is linear in the starting value, so
+		 * we can tabulate it a byte at a time.
+		 */
+		for (j = 0; j < 4; j++) {
+			for (i = 0; i < 256; i++) {
+				shift1[j][i] = zeros((uint32_t)i << (8 * j),
+				    LANE);
+				shift2[j][i] = zeros(shift1[j][i], LANE);
+			}
+		}
+		have_hw = 1;
+	}
+#endif
+	initialized = 1;
+}
+
+static uint32_t
+crc32c_sw(uint32_t crc, const unsigned char *p, size_t len)
+{
+	uint64_t w;
+
+	while (len > 0 && ((uintptr_t)p & 7) != 0) {
+		crc = (crc >> 8) ^ table[0][(crc ^ *p++) & 0xff];
+		len--;
+	}
+	while (len >= 8) {
+		memcpy(&w, p, sizeof(w));
+		w ^= crc;
+		crc = table[7][w & 0xff] ^
+		    table[6][(w >> 8) & 0xff] ^
+		    table[5][(w >> 16) & 0xff] ^
+		    table[4][(w >> 24) & 0xff] ^
+		    table[3][(w >> 32) & 0xff] ^
+		    table[2][(w >> 40) & 0xff] ^
+		    table[1][(w >> 48) & 0xff] ^
+		    table[0][w >> 56];
+		p += 8;
+		len -= 8;
+	}
+	while (len-- > 0)
+		crc = (crc >> 8) ^ table[0][(crc ^ *p++) & 0xff];
+	return crc;
+}
+
+#ifdef CRC32C_HW
+static inline uint32_t
+shift(uint32_t t[4][256], uint32_t crc)
+{
+	return t[0][crc & 0xff] ^ t[1][(crc >> 8) & 0xff] ^
+	    t[2][(crc >> 16) & 0xff] ^ t[3][crc >> 24];
+}
+
+__attribute__((target("sse4.2")))
+static uint32_t
+crc32c_hw(uint32_t crc, const unsigned char *p, size_t len)
+{
+	uint64_t c0, c1, c2, w0, w1, w2;
+	size_t i;
+
+	while (len > 0 && ((uintptr_t)p & 7) != 0) {
+		crc = _mm_crc32_u8(crc, *p++);
+		len--;
+	}
+	while (len >= 3 * LANE) {
+		c0 = crc;
+		c1 = c2 = 0;
+		for (i = 0; i < LANE; i += 8) {
+			memcpy(&w0, p + i, 8);
+			memcpy(&w1, p + LANE + i, 8);
+			memcpy(&w2, p + 2 * LANE + i, 8);
+			c0 = _mm_crc32_u64(c0, w0);
+			c1 = _mm_crc32_u64(c1, w1);
+			c2 = _mm_crc32_u64(c2, w2);
+		}
+		crc = shift(shift2, (uint32_t)c0) ^ shift(shift1, (uint32_t)c1) ^
+		    (uint32_t)c2;
+		p += 3 * LANE;
+		len -= 3 * LANE;
+	}
+	c0 = crc;
+	while (len >= 8) {
+		memcpy(&w0, p, 8);
+		c0 = _mm_crc32_u64(c0, w0);
+		p += 8;
+		len -= 8;
+	}
+	crc = (uint32_t)c0;
+	while (len-- > 0)
+		crc = _mm_crc32_u8(crc, *p++);
+	return crc;
+}
+#endif
+
+uint32_t
+crc32c(uint32_t crc, const void *buf, size_t len)
+{
+	if (!initialized)
+		crc32c_init();
+	crc = ~crc;
+#ifdef CRC32C_HW
+	if (have_hw)
+		return ~crc32c_hw(crc, buf, len);
+#endif
+	return ~crc32c_sw(crc, buf, len);
+}
+
+const char *
+crc32c_impl(void)
+{
+	if (!initialized)
+		crc32c_init();
+	return have_hw ? "sse4.2" : "slicing-by-8";
+}
@@ -17,12 +17,21 @@
 /*
  * A relatively simple buffering echo server that uses poll(2),
  * for instructional purposes.
+ *
+ * By default the server speaks plain TCP, or TLS with -T, and checks
+ * which one each connection uses as it goes. Building with
+ * -DTRANSPORT=TRANSPORT_PLAIN, TRANSPORT_TLS or TRANSPORT_UNIX instead
+ * gives a server that only speaks the one, where those checks are
+ * constants and the compiler throws away the code for the others, so
+ * every transport gets a loop of its own from the same source.
  */
 
 #include <sys/types.h>
 #include <sys/socket.h>
+#include <sys/un.h>
 #include <sys/wait.h>
 #include <netinet/in.h>
+#include <netinet/tcp.h>
 
 #include <err.h>
 #include <errno.h>
@@ -31,113 +40,343 @@
 #include <netdb.h>
 #include <poll.h>
 #include <signal.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
+#include <tls.h>
 #include <unistd.h>
 
-#define MAX_CONNECTIONS 256
-#define BUFLEN 4096
+#include "chain.h"
+#include "conntab.h"
+#include "crlset.h"
+#include "frame.h"
+#include "hsstats.h"
+#include "iplimit.h"
+#include "ocspcheck.h"
+#include "renew.h"
+
+/* glibc can tell us how much of the heap is in use, for soak */
+#if defined(__GLIBC__) && (__GLIBC__ > 2 || __GLIBC_MINOR__ >= 33)
+#include <malloc.h>
+#define HEAP_STATS
+#endif
+
+#define TRANSPORT_ANY 0		/* plain TCP, or TLS with -T */
+#define TRANSPORT_PLAIN 1	/* plain TCP only */
+#define TRANSPORT_TLS 2		/* TLS over TCP only */
+#define TRANSPORT_UNIX 3	/* plain, on a unix domain socket */
+
+#ifndef TRANSPORT
+#define TRANSPORT TRANSPORT_ANY
+#endif
+
+#if TRANSPORT == TRANSPORT_ANY
+#define TRANSPORT_NAME "any"
+#define SERVER_TLS (tls_ctx != NULL)
+#define CLIENT_TLS(client) ((client)->tls != NULL)
+#elif TRANSPORT == TRANSPORT_TLS
+#define TRANSPORT_NAME "tls"
+#define SERVER_TLS 1
+#define CLIENT_TLS(client) 1
+#elif TRANSPORT == TRANSPORT_PLAIN || TRANSPORT == TRANSPORT_UNIX
+#define TRANSPORT_NAME (TRANSPORT == TRANSPORT_UNIX ? "unix" : "plain")
+#define SERVER_TLS 0
+#define CLIENT_TLS(client) 0
+#else
+#error "unknown TRANSPORT"
+#endif
+
+#define LISTEN_SLOT 0	/* pollfds[0] is the listening socket */
+#define STATS_SLOT 1	/* pollfds[1] is the stats socket, if we have one */
+#define RENEW_SLOT 2	/* pollfds[2] is the certificate helper, with -L */
+#define OCSP_SLOT 3	/* then OCSPCHECK_SLOTS slots for OCSP queries */
+#define STATSCONN_SLOT (OCSP_SLOT + OCSPCHECK_SLOTS)	/* stats readers */
+#define STATS_CONNS 4
+#define FIRST_CLIENT (STATSCONN_SLOT + STATS_CONNS)	/* then clients */
 
 static int debug = 0;
 
 static void usage()
 {
 	extern char * __progname;
-	fprintf(stderr, "usage: %s host portnumber\n", __progname);
+	fprintf(stderr, "usage: %s [-BdT] [-b bufsize] [-C cafile] "
+	    "[-c certfile] [-i idle] [-k keyfile]\n"
+	    "\t[-H rate] [-L lifetime] [-l perhost] [-m budget] "
+	    "[-n connections]\n"
+	    "\t[-O open|closed] [-R deltacrl] [-r crl] [-S statsocket] "
+#if TRANSPORT == TRANSPORT_UNIX
+	    "path\n", __progname);
+#else
+	    "host portnumber\n", __progname);
+#endif
 	exit(1);
 }
 
-#define STATE_READING 0
-#define STATE_WRITING 1
-
 struct client {
-	int state;
-	unsigned char *readptr, *writeptr, *nextptr;
-	unsigned char buf[BUFLEN];
+	struct framer framer;
+	struct chain chain;	/* read into the tail, echoed from the head */
+	int stalled;		/* couldn't get a chunk within the budget */
+	struct tls *tls;	/* NULL unless we are doing TLS */
+	int handshaking;
+	int pending;		/* tls may be holding data we haven't read */
+	short want_read;	/* what tls_read is waiting for */
+	short want_write;	/* what tls_write is waiting for */
+	struct timespec accepted;
+	struct timespec hs_start;	/* when we started its handshake */
+	struct hs_sample hs;
+	int ocsp;		/* OCSP check we are waiting on, or -1 */
+	union conntab_addr peer;
+	unsigned long long bytes_in, bytes_out;
+	int ipslot;		/* iplimit entry we count against, or -1 */
+	int waiting;		/* with -i, hasn't sent anything yet */
+	int flush;		/* with -B, has echoes for the send pass */
 };
 
-static struct client clients[MAX_CONNECTIONS];
-static struct pollfd pollfds[MAX_CONNECTIONS];
+static struct client *clients;
+static struct pollfd *pollfds;
+static int max_connections = 256;
+static int nclients;
 static int throttle = 0;
+static size_t client_cap = 1024 * 1024;
 
-static void
-client_init(struct client *client)
+/*
+ * The memory budget covers every chunk of buffered data in the
+ * process. Once we get within 10% of it we are under pressure: we stop
+ * reading from the connections holding the most data until they drain,
+ * give idle buffers back, and turn away new connections. Pressure lets
+ * up when we are back below 75%.
+ */
+static size_t budget = 0;
+static int pressure = 0;
+static int paused = 0;
+static unsigned long long pressure_events, rejected;
+
+static struct tls *tls_ctx = NULL;
+static const char *certfile, *keyfile;
+static const char *keytype;
+static unsigned long long handshakes_failed;
+
+/*
+ * A client gets HANDSHAKE_TIMEOUT seconds from when we give it a TLS
+ * context to finish its handshake, so one that sends a byte and stops
+ * doesn't keep its slot for good.
+ */
+#define HANDSHAKE_TIMEOUT 10
+static int nhandshaking;
+static unsigned long long handshake_timeouts;
+
+/*
+ * With -L we don't use a certificate from a file, we get short lived
+ * ones from a helper holding the CA (see renew.h), and swap each new
+ * one in well before the last runs out. -c and -k are then the CA's
+ * certificate and key. A client that knows a certificate is only good
+ * for hours can skip revocation checks on it, and with them the CRL
+ * or OCSP work that would otherwise be in every handshake.
+ */
+static struct renewer renew;
+static long long lifetime;
+
+/*
+ * Client certificates are checked against our own revocation set,
+ * made from a base CRL and the latest delta CRL. SIGHUP reloads just
+ * the delta.
+ */
+static struct crlset crls;
+static const char *cafile = "../CA/chain.pem";
+static const char *crlfile, *deltafile;
+static volatile sig_atomic_t reload_delta;
+static unsigned long long revoked_rejected;
+
+/*
+ * With -O, client certificates are also checked with their CA's OCSP
+ * responder (see ocspcheck.h). A connection that is waiting on the
+ * answer isn't read from or written to until it comes. "-O open" lets
+ * clients in when we can't get an answer, "-O closed" doesn't.
+ */
+static const char *ocsp_policy;
+static unsigned long long ocsp_rejected;
+
+/*
+ * With -l and -H, each address may have only so many connections at
+ * once and open only so many a second (see iplimit.h). Anything over
+ * is closed as soon as it is accepted, before any TLS.
+ */
+static unsigned int perhost, persec;
+
+/*
+ * With -i, a connection gets no TLS context until it sends something,
+ * its ClientHello if it is going to do TLS at all, and is closed if it
+ * stays quiet for idle seconds. Port scanners, health checks and load
+ * balancer probes that connect and say nothing then cost us a slot and
+ * nothing more.
+ */
+static int idle_timeout;
+static int nwaiting;
+static unsigned long long idle_closed, empty_closed;
+
+/*
+ * With -B, sending is batched. A first pass over the clients reads all
+ * each one has ready - every record libtls will give us, not stopping
+ * at the first short one - and only then does a second pass write the
+ * echoes, as much as a chunk holds in each tls_write and so in each
+ * record. A client that pipelines small writes gets a record back per
+ * pass instead of one per line, and every record costs a seal, a MAC
+ * and a write(2) whatever its size.
+ *
+ * That is as near as libtls lets us get to sealing records for many
+ * connections together: it has no way to hand it more than one
+ * connection's data at once, and OpenSSL's multi-block code is for one
+ * connection's large writes with the old CBC and HMAC ciphers, not GCM
+ * or ChaCha20.
+ */
+static int batch;
+static unsigned long long tls_writes;
+
+/*
+ * Make the server's TLS configuration, with either the files we were
+ * given or a certificate from the helper.
+ */
+static struct tls_config *
+server_config(const struct memca_cred *cred)
 {
-	client->readptr = client->writeptr = client->nextptr = client->buf;
-	client->state = STATE_READING;
+	struct tls_config *cfg;
+
+	if ((cfg = tls_config_new()) == NULL)
+		errx(1, "unable to allocate TLS config");
+	if (cred != NULL) {
+		if (tls_config_set_keypair_mem(cfg, cred->cert, cred->cert_len,
+		    cred->key, cred->key_len) == -1)
+			errx(1, "unable to use our new certificate");
+	} else {
+		if (tls_config_set_cert_file(cfg, certfile) == -1)
+			errx(1, "unable to set TLS certificate file %s",
+			    certfile);
+		if (tls_config_set_key_file(cfg, keyfile) == -1)
+			errx(1, "unable to set TLS key file %s", keyfile);
+	}
+	if (crlfile != NULL || ocsp_policy != NULL) {
+		/*
+		 * ask for client certificates, and check them against
+		 * the CRLs or OCSP ourselves after the handshake.
+		 */
+		if (tls_config_set_ca_file(cfg, cafile) == -1)
+			errx(1, "unable to set CA file %s", cafile);
+		tls_config_verify_client_optional(cfg);
+	}
+	return cfg;
 }
 
-static ssize_t
-client_consume(struct client *client, size_t len)
+/*
+ * Pick up the certificate the helper made, and use it for every
+ * handshake from now on. Connections already going keep the one they
+ * started with.
+ */
+static void
+renew_swap(void)
 {
-	size_t n = 0;
+	struct memca_cred cred;
+	struct tls_config *cfg;
 
-	while (n < len) {
-		if (client->readptr == client->nextptr)
-			break;
-		client->readptr++;
-		n++;
+	if (renew_collect(&renew, &cred) == -1) {
+		warnx("certificate renewal failed, the current one is good "
+		    "for %lld more seconds", (long long)(renew.expires -
+		    time(NULL)));
+		return;
 	}
+	cfg = server_config(&cred);
+	if (tls_configure(tls_ctx, cfg) == -1)
+		errx(1, "TLS configuration failed (%s)", tls_error(tls_ctx));
+	/* tls_ctx has its own reference */
+	tls_config_free(cfg);
+	memca_cred_free(&cred);
+	if (debug)
+		fprintf(stderr, "new certificate, good for %lld seconds\n",
+		    lifetime);
+}
 
-	if (debug && n > 0)
-                fprintf(stderr, "client_consume: %ld bytes from buffer\n", n);
+static void
+hup_handler(int signum)
+{
+	reload_delta = 1;
+}
 
-        return ((ssize_t)n);
+static short
+tls_want(ssize_t ret)
+{
+	return ret == TLS_WANT_POLLOUT ? POLLOUT : POLLIN;
 }
 
-static ssize_t
-client_get(struct client * client, unsigned char *outbuf, size_t outlen)
+static void
+client_init(struct client *client)
 {
-        unsigned char *nextptr = client->readptr;
-        size_t n = 0;
-
-        while (n < outlen) {
-                if (nextptr == client->writeptr)
-                        break;
-                *outbuf++ = *nextptr++;
-                if ((size_t)(nextptr - client->buf) >= sizeof(client->buf))
-                        nextptr = client->buf;
-                client->nextptr = nextptr;
-                n++;
-        }
-
-        if (debug && n > 0)
-                fprintf(stderr, "client_get: got %ld bytes from buffer\n", n);
-
-        return ((ssize_t)n);
+	chain_init(&client->chain, client_cap);
+	framer_init(&client->framer);
+	client->stalled = 0;
+	client->tls = NULL;
+	client->handshaking = 0;
+	client->pending = 0;
+	client->want_read = POLLIN;
+	client->want_write = POLLOUT;
+	clock_gettime(CLOCK_MONOTONIC, &client->accepted);
+	client->hs_start = client->accepted;
+	memset(&client->hs, 0, sizeof(client->hs));
+	client->ocsp = -1;
+	memset(&client->peer, 0, sizeof(client->peer));
+	client->bytes_in = client->bytes_out = 0;
+	client->ipslot = -1;
+	client->waiting = 0;
+	client->flush = 0;
+	nclients++;
 }
 
-static ssize_t
-client_put(struct client *client, const unsigned char *inbuf, size_t inlen)
+/*
+ * Set up TLS on a freshly accepted connection. The handshake itself
+ * happens as the socket becomes ready.
+ */
+static int
+client_tls(struct client *client, int fd)
 {
-        unsigned char *nextptr = client->writeptr;
-        unsigned char *prevptr;
-        size_t n = 0;
-
-        while (n < inlen) {
-                prevptr = nextptr++;
-                if ((size_t)(nextptr - client->buf) >= sizeof(client->buf))
-                        nextptr = client->buf;
-                if (nextptr == client->readptr)
-                        break;
-                *prevptr = *inbuf++;
-                client->writeptr = nextptr;
-                n++;
-        }
-
-        if (debug && n > 0)
-                fprintf(stderr, "client_put: put %ld bytes into buffer\n", n);
-
-        return ((ssize_t)n);
+	if (tls_accept_socket(tls_ctx, &client->tls, fd) == -1) {
+		if (debug)
+			warnx("tls_accept_socket failed: %s",
+			    tls_error(tls_ctx));
+		handshakes_failed++;
+		return 0;
+	}
+	client->handshaking = 1;
+	nhandshaking++;
+	/* with -i, the time spent waiting isn't handshake time */
+	clock_gettime(CLOCK_MONOTONIC, &client->hs_start);
+	return 1;
 }
 
 static void
-closeconn (struct pollfd *pfd)
+closeconn (struct pollfd *pfd, struct client *client)
 {
+	if (client->tls != NULL) {
+		/* best effort, we don't wait around for the peer */
+		if (!client->handshaking)
+			tls_close(client->tls);
+		tls_free(client->tls);
+		client->tls = NULL;
+	}
+	if (client->handshaking) {
+		client->handshaking = 0;
+		nhandshaking--;
+	}
 	close(pfd->fd);
 	pfd->fd = -1;
 	pfd->revents = 0;
+	chain_clear(&client->chain);
+	iplimit_release(client->ipslot);
+	client->ipslot = -1;
+	if (client->waiting) {
+		client->waiting = 0;
+		nwaiting--;
+	}
+	nclients--;
 	throttle = 0;
 }
 
@@ -154,78 +393,898 @@ newconn(struct pollfd *pfd, int newfd) {
 	pfd->revents = 0;
 }
 
+static void
+client_received(struct pollfd *pfd, struct client *client,
+    const unsigned char *p, size_t len)
+{
+	size_t n;
+
+	chain_commit(&client->chain, len);
+	client->bytes_in += len;
+	n = framer_feed(&client->framer, p, len);
+	if (debug && n > 0)
+		fprintf(stderr, "fd %d: %zu messages, %llu total\n",
+		    pfd->fd, n, client->framer.messages);
+}
+
+/*
+ * Take the next step of a TLS handshake, charging the cpu it took to
+ * the connection. Returns 0 if the handshake failed.
+ */
+static int
+client_handshake(struct pollfd *pfd, struct client *client)
+{
+	struct timespec now;
+	uint64_t start;
+	int i;
+
+	start = hs_cputime();
+	i = tls_handshake(client->tls);
+	client->hs.cpu_nsec += hs_cputime() - start;
+	if (i == TLS_WANT_POLLIN || i == TLS_WANT_POLLOUT) {
+		client->want_read = tls_want(i);
+		return 1;
+	}
+	if (i == -1) {
+		if (debug)
+			warnx("fd %d: tls handshake failed: %s", pfd->fd,
+			    tls_error(client->tls));
+		handshakes_failed++;
+		return 0;
+	}
+	if (crlfile != NULL && tls_peer_cert_provided(client->tls)) {
+		const uint8_t *pem;
+		size_t len;
+
+		pem = tls_peer_cert_chain_pem(client->tls, &len);
+		if (crlset_revoked_pem(&crls, pem, len) != 0) {
+			if (debug)
+				warnx("fd %d: client certificate revoked, "
+				    "or unreadable", pfd->fd);
+			revoked_rejected++;
+			return 0;
+		}
+	}
+	if (ocsp_policy != NULL && tls_peer_cert_provided(client->tls)) {
+		const uint8_t *pem;
+		size_t len;
+		int verdict;
+
+		pem = tls_peer_cert_chain_pem(client->tls, &len);
+		client->ocsp = ocspcheck_start(pem, len, &verdict);
+		if (verdict == OCSPCHECK_REJECT) {
+			if (debug)
+				warnx("fd %d: client certificate refused by "
+				    "OCSP", pfd->fd);
+			ocsp_rejected++;
+			return 0;
+		}
+	}
+	client->handshaking = 0;
+	nhandshaking--;
+	client->want_read = POLLIN;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	client->hs.wall_usec = (now.tv_sec - client->hs_start.tv_sec) *
+	    1000000ULL + (now.tv_nsec - client->hs_start.tv_nsec) / 1000;
+	hs_classify(&client->hs, client->tls, keytype);
+	hs_account(&client->hs);
+	return 1;
+}
+
+/*
+ * Read whatever is there straight into the client's chain. Returns 0
+ * if the connection is finished with.
+ */
+static int
+client_read(struct pollfd *pfd, struct client *client)
+{
+	unsigned char *p;
+	size_t space;
+	ssize_t len;
+
+	do {
+		if ((p = chain_reserve(&client->chain, &space)) == NULL) {
+			/*
+			 * Either we are at the cap, or over budget. Either
+			 * way wait for the writes to catch up.
+			 */
+			if (chain_space(&client->chain) > 0)
+				client->stalled = 1;
+			return 1;
+		}
+		if (!CLIENT_TLS(client)) {
+			len = read(pfd->fd, p, space);
+			if (len == 0)
+				return 0;
+			if (len == -1)
+				return (errno == EINTR || errno == EAGAIN);
+			client_received(pfd, client, p, len);
+			return 1;
+		}
+		/*
+		 * tls_read gives us at most a record at a time, and if
+		 * the record didn't fit, the rest is sitting inside libtls
+		 * where poll can't see it. So keep going until we get less
+		 * than we asked for, and if we run out of room first,
+		 * remember there may be more. With -B keep going until
+		 * there is nothing left, to echo it all in one go.
+		 */
+		client->pending = 0;
+		len = tls_read(client->tls, p, space);
+		if (len == TLS_WANT_POLLIN || len == TLS_WANT_POLLOUT) {
+			client->want_read = tls_want(len);
+			return 1;
+		}
+		if (len <= 0)
+			return 0;
+		client->want_read = POLLIN;
+		client_received(pfd, client, p, len);
+		client->pending = 1;
+	} while ((size_t)len == space || batch);
+	client->pending = 0;
+	return 1;
+}
+
+static int
+client_write_tls(struct pollfd *pfd, struct client *client)
+{
+	const unsigned char *p;
+	size_t len;
+	ssize_t w;
+
+	while ((p = chain_peek(&client->chain, &len)) != NULL) {
+		w = tls_write(client->tls, p, len);
+		tls_writes++;
+		if (w == TLS_WANT_POLLIN || w == TLS_WANT_POLLOUT) {
+			client->want_write = tls_want(w);
+			return 1;
+		}
+		if (w == -1)
+			return 0;
+		chain_consume(&client->chain, w);
+		client->bytes_out += w;
+		if (debug)
+			fprintf(stderr, "fd %d: wrote %zd bytes\n", pfd->fd, w);
+	}
+	client->want_write = POLLOUT;
+	return 1;
+}
+
+/*
+ * Write as much of the chain as the socket will take.
+ */
+static int
+client_write(struct pollfd *pfd, struct client *client)
+{
+	ssize_t w;
+
+	if (CLIENT_TLS(client))
+		return client_write_tls(pfd, client);
+	while (client->chain.len > 0) {
+		if ((w = chain_writev(&client->chain, pfd->fd)) == -1) {
+			if (errno == EINTR)
+				continue;
+			return (errno == EAGAIN);
+		}
+		client->bytes_out += w;
+		if (debug)
+			fprintf(stderr, "fd %d: wrote %zd bytes\n", pfd->fd, w);
+	}
+	return 1;
+}
+
+/* Let a client in, or throw it out, once its OCSP answer is back */
+static void
+ocsp_resolve(struct pollfd *pfd, struct client *client)
+{
+	int verdict;
+
+	if (pfd->fd == -1 || client->ocsp == -1)
+		return;
+	if ((verdict = ocspcheck_verdict(client->ocsp)) == OCSPCHECK_PENDING)
+		return;
+	client->ocsp = -1;
+	if (verdict == OCSPCHECK_REJECT) {
+		if (debug)
+			warnx("fd %d: client certificate refused by OCSP",
+			    pfd->fd);
+		ocsp_rejected++;
+		closeconn(pfd, client);
+	}
+}
+
+/* Close connections that have been quiet since they were accepted */
+static void
+idle_sweep(void)
+{
+	struct timespec now;
+	int i;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	for (i = FIRST_CLIENT; nwaiting > 0 && i < max_connections; i++) {
+		if (pollfds[i].fd != -1 && clients[i].waiting &&
+		    now.tv_sec - clients[i].accepted.tv_sec >= idle_timeout) {
+			idle_closed++;
+			closeconn(&pollfds[i], &clients[i]);
+		}
+	}
+}
+
+/* Close connections that have been handshaking for too long */
+static void
+handshake_sweep(void)
+{
+	struct timespec now;
+	int i;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	for (i = FIRST_CLIENT; nhandshaking > 0 && i < max_connections; i++) {
+		if (pollfds[i].fd != -1 && clients[i].handshaking &&
+		    now.tv_sec - clients[i].hs_start.tv_sec >=
+		    HANDSHAKE_TIMEOUT) {
+			if (debug)
+				warnx("fd %d: tls handshake timed out",
+				    pollfds[i].fd);
+			handshake_timeouts++;
+			closeconn(&pollfds[i], &clients[i]);
+		}
+	}
+}
+
 static void
 handle_client(struct pollfd *pfd, struct client *client)
 {
-	if ((pfd->revents & (POLLERR | POLLNVAL)))
+	short readable = POLLIN;
+
+	if (pfd->fd == -1)
+		return;
+	if (pfd->revents == 0 && !(client->pending && pfd->events & POLLIN))
+		return;
+	if (client->ocsp != -1 && !(pfd->revents & (POLLERR | POLLHUP)))
+		return;
+	if (pfd->revents & POLLNVAL)
 		errx(1, "bad fd %d", pfd->fd);
-	if (pfd->revents & POLLHUP)
-		closeconn(pfd);
-	else if (pfd->revents & pfd->events) {
-		char buf[BUFLEN];
-		ssize_t len = 0;
-		if (client->state == STATE_READING) {
-			len = read(pfd->fd, buf, sizeof(buf));
-			if (len > 0) {
-				if (client_put(client, buf, len)
-				    != len) {
-					warnx("client buffer failed");
-					closeconn(pfd);
-				} else {
-					client->state=STATE_WRITING;
-					pfd->events = POLLOUT | POLLHUP;
-				}
-			}
-			else if (len == 0)
-				closeconn(pfd);
-			else
-				pfd->events = POLLIN | POLLHUP;
-		} else if (client->state == STATE_WRITING) {
-			ssize_t w = 0;
-			ssize_t written = 0;
-			do {
-				len = client_get(client, buf, sizeof(buf));
-				w = write(pfd->fd, buf, len);
-				if (w == -1) {
-					if (errno != EINTR)
-						closeconn(pfd);
-				}
-				else {
-					written += w;
-					client_consume(client, w);
-				}
-			} while (written < len);
-			if (pfd->fd > 0) {
-				client->state = STATE_READING;
-				pfd->events = POLLIN | POLLHUP;
+	if (pfd->revents & POLLERR ||
+	    (pfd->revents & POLLHUP && client->chain.len == 0)) {
+		if (client->waiting)
+			empty_closed++;
+		closeconn(pfd, client);
+		return;
+	}
+	if (client->waiting) {
+		ssize_t n;
+		char c;
+
+		/* a close, or the first sign of life */
+		n = recv(pfd->fd, &c, 1, MSG_PEEK);
+		if (n == -1 && (errno == EAGAIN || errno == EINTR))
+			return;
+		if (n != 1) {
+			empty_closed++;
+			closeconn(pfd, client);
+			return;
+		}
+		client->waiting = 0;
+		nwaiting--;
+		if (SERVER_TLS && !client_tls(client, pfd->fd)) {
+			closeconn(pfd, client);
+			return;
+		}
+	}
+	if (CLIENT_TLS(client)) {
+		/*
+		 * With TLS either direction can need the socket to be
+		 * readable or writable, so any readiness is worth a try.
+		 */
+		if (client->handshaking) {
+			if (!client_handshake(pfd, client)) {
+				closeconn(pfd, client);
+				return;
 			}
+			if (client->handshaking || client->ocsp != -1)
+				return;
+		}
+		readable = POLLIN | POLLOUT;
+		if (client->pending)
+			pfd->revents |= POLLIN;
+	}
+	if ((pfd->revents & readable) && !client_read(pfd, client)) {
+		closeconn(pfd, client);
+		return;
+	}
+	if (client->chain.len > 0) {
+		if (batch)
+			client->flush = 1;
+		else if (!client_write(pfd, client))
+			closeconn(pfd, client);
+	}
+}
+
+/* With -B, write what the read pass left us to echo */
+static void
+send_pass(void)
+{
+	int i;
+
+	for (i = FIRST_CLIENT; i < max_connections; i++) {
+		if (pollfds[i].fd == -1 || !clients[i].flush)
+			continue;
+		clients[i].flush = 0;
+		if (!client_write(&pollfds[i], &clients[i]))
+			closeconn(&pollfds[i], &clients[i]);
+	}
+}
+
+/*
+ * Work out whether we are under memory pressure, returning how much
+ * a connection has to be holding before we count it as heavy.
+ */
+static size_t
+budget_update(int *room)
+{
+	struct chain_stats cs;
+	size_t heavy;
+	int i;
+
+	*room = 1;
+	if (budget == 0)
+		return SIZE_MAX;
+	chain_get_stats(&cs);
+	if (!pressure && cs.used + cs.pooled >= budget / 10 * 9) {
+		pressure = 1;
+		pressure_events++;
+		for (i = FIRST_CLIENT; i < max_connections; i++)
+			if (pollfds[i].fd != -1)
+				chain_shrink(&clients[i].chain);
+		chain_pool_trim();
+		chain_get_stats(&cs);
+		if (debug)
+			fprintf(stderr, "memory pressure: %zu of %zu used\n",
+			    cs.used, budget);
+	} else if (pressure) {
+		/* anything given back while under pressure goes to the os */
+		if (cs.pooled > 0) {
+			chain_pool_trim();
+			chain_get_stats(&cs);
 		}
+		if (cs.used < budget / 4 * 3)
+			pressure = 0;
+	}
+	*room = cs.pooled > 0 ||
+	    cs.used + sizeof(struct chunk) <= cs.budget;
+	heavy = nclients > 0 ? cs.used / nclients : 0;
+	return heavy > CHUNK_SIZE ? heavy : CHUNK_SIZE;
+}
+
+static void
+client_events(struct pollfd *pfd, struct client *client, size_t heavy,
+    int room)
+{
+	if (room)
+		client->stalled = 0;
+	pfd->events = POLLHUP;
+	if (client->ocsp != -1)
+		return;
+	if (client->handshaking) {
+		pfd->events |= client->want_read;
+		return;
 	}
+	if (client->chain.len > 0)
+		pfd->events |= client->want_write;
+	if (chain_space(&client->chain) == 0)
+		return;
+	if (client->stalled || (pressure && client->chain.len >= heavy))
+		paused++;
+	else
+		pfd->events |= client->want_read;
+}
+
+static void
+stats_serve(int fd)
+{
+	struct chain_stats cs;
+	char buf[1024];
+	int len;
+
+	chain_get_stats(&cs);
+	len = snprintf(buf, sizeof(buf),
+	    "connections %d\n"
+	    "max_connections %d\n"
+	    "rejected %llu\n"
+	    "budget %zu\n"
+	    "buffer_used %zu\n"
+	    "buffer_pooled %zu\n"
+	    "buffer_peak %zu\n"
+	    "buffer_denied %llu\n"
+	    "pressure %d\n"
+	    "pressure_events %llu\n"
+	    "paused %d\n"
+	    "transport %s\n"
+	    "tls %d\n"
+	    "handshakes_failed %llu\n"
+	    "handshake_timeouts %llu\n"
+	    "batch %d\n"
+	    "tls_writes %llu\n"
+	    "crl_base %ld %zu\n"
+	    "crl_delta %ld %zu\n"
+	    "revoked_rejected %llu\n",
+	    nclients, max_connections - FIRST_CLIENT, rejected, cs.budget,
+	    cs.used, cs.pooled, cs.peak, cs.denied, pressure, pressure_events,
+	    paused, TRANSPORT_NAME, tls_ctx != NULL, handshakes_failed,
+	    handshake_timeouts, batch, tls_writes, crls.base_number,
+	    crls.nbase, crls.delta_base, crls.ndelta, revoked_rejected);
+	if (len > 0 && write(fd, buf, len) == -1 && debug)
+		warn("stats write failed");
+#ifdef HEAP_STATS
+	{
+		struct mallinfo2 mi = mallinfo2();
+
+		len = snprintf(buf, sizeof(buf),
+		    "heap_inuse %zu\n"
+		    "heap_free %zu\n",
+		    mi.uordblks + mi.hblkhd, mi.fordblks);
+		if (len > 0 && write(fd, buf, len) == -1 && debug)
+			warn("stats write failed");
+	}
+#endif
+	if (lifetime > 0) {
+		len = snprintf(buf, sizeof(buf),
+		    "cert_lifetime %lld\n"
+		    "cert_expires_in %lld\n"
+		    "cert_renewals %llu\n"
+		    "cert_renew_failed %llu\n",
+		    lifetime, (long long)(renew.expires - time(NULL)),
+		    renew.renewals, renew.failures);
+		if (len > 0 && write(fd, buf, len) == -1 && debug)
+			warn("stats write failed");
+	}
+	if (ocsp_policy != NULL) {
+		struct ocspcheck_stats os;
+
+		ocspcheck_get_stats(&os);
+		len = snprintf(buf, sizeof(buf),
+		    "ocsp_policy %s\n"
+		    "ocsp_cache_hits %llu\n"
+		    "ocsp_coalesced %llu\n"
+		    "ocsp_queries %llu\n"
+		    "ocsp_failures %llu\n"
+		    "ocsp_good %llu\n"
+		    "ocsp_revoked %llu\n"
+		    "ocsp_unknown %llu\n"
+		    "ocsp_rejected %llu\n",
+		    ocsp_policy, os.hits, os.coalesced, os.queries,
+		    os.failures, os.good, os.revoked, os.unknown,
+		    ocsp_rejected);
+		if (len > 0 && write(fd, buf, len) == -1 && debug)
+			warn("stats write failed");
+	}
+	if (perhost != 0 || persec != 0) {
+		struct iplimit_stats is;
+
+		iplimit_get_stats(&is);
+		len = snprintf(buf, sizeof(buf),
+		    "iplimit_perhost %u\n"
+		    "iplimit_persec %u\n"
+		    "iplimit_slots %zu\n"
+		    "iplimit_hosts %zu\n"
+		    "iplimit_conn_limited %llu\n"
+		    "iplimit_rate_limited %llu\n"
+		    "iplimit_untracked %llu\n",
+		    perhost, persec, is.slots, is.hosts, is.conn_limited,
+		    is.rate_limited, is.untracked);
+		if (len > 0 && write(fd, buf, len) == -1 && debug)
+			warn("stats write failed");
+	}
+	if (idle_timeout > 0) {
+		len = snprintf(buf, sizeof(buf),
+		    "idle_timeout %d\n"
+		    "waiting %d\n"
+		    "idle_closed %llu\n"
+		    "empty_closed %llu\n",
+		    idle_timeout, nwaiting, idle_closed, empty_closed);
+		if (len > 0 && write(fd, buf, len) == -1 && debug)
+			warn("stats write failed");
+	}
+	hs_report(fd);
+}
+
+/* What a connection is up to, for the connection table */
+static const char *
+client_state(struct pollfd *pfd, struct client *client)
+{
+	if (client->waiting)
+		return "waiting";
+	if (client->handshaking)
+		return "handshake";
+	if (client->ocsp != -1)
+		return "ocsp";
+	if (chain_space(&client->chain) == 0)
+		return "full";
+	if (!(pfd->events & client->want_read))
+		return "paused";
+	return "open";
+}
+
+/*
+ * Copy connections into the table for the "conns" command, from slot
+ * *next on, until it is full, in one pass so that they all show as
+ * they were at one moment. With lots of connections that would be
+ * too long a stop, so the table holds CONNS_ROWS at a time and each
+ * lot is a moment of its own.
+ */
+#define CONNS_ROWS 4096
+
+static void
+conns_snapshot(struct conntab *ct, int *next)
+{
+	struct conntab_row *row;
+	struct client *client;
+	struct timespec now;
+	const char *subject;
+	int i;
+
+	conntab_clear(ct);
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	for (i = *next; i < max_connections; i++) {
+		if (pollfds[i].fd == -1)
+			continue;
+		if ((row = conntab_row(ct)) == NULL)
+			break;
+		client = &clients[i];
+		row->fd = pollfds[i].fd;
+		row->peer = client->peer;
+		row->state = client_state(&pollfds[i], client);
+		row->age_msec = (now.tv_sec - client->accepted.tv_sec) * 1000 +
+		    (now.tv_nsec - client->accepted.tv_nsec) / 1000000;
+		row->bytes_in = client->bytes_in;
+		row->bytes_out = client->bytes_out;
+		row->buffered = client->chain.len;
+		if (client->tls == NULL || client->handshaking)
+			continue;
+		row->version = conntab_intern(tls_conn_version(client->tls));
+		row->cipher = conntab_intern(tls_conn_cipher(client->tls));
+		if ((subject = tls_peer_cert_subject(client->tls)) != NULL)
+			snprintf(row->subject, sizeof(row->subject), "%s",
+			    subject);
+	}
+	*next = i;
+}
+
+/*
+ * Connections to the stats socket. Each sends a line saying what it
+ * wants: "conns" for the connection table, and "stats", an empty line,
+ * or just shutting down its side for the counters. The counters are
+ * small enough to go in one write, the table goes out a piece at a
+ * time as the reader takes it. One that hasn't said anything, or
+ * taken any of the table, for STATS_TIMEOUT seconds gets closed.
+ */
+#define STATS_TIMEOUT 5
+
+struct statsconn {
+	char cmd[32];
+	size_t cmdlen;
+	int sending;		/* the table, to a conns command */
+	struct conntab table;
+	int next;		/* the slot to copy into the table next */
+	time_t active;		/* when it last said or took something */
+};
+
+static struct statsconn statsconns[STATS_CONNS];
+
+static void
+stats_close(int i)
+{
+	struct pollfd *pfd = &pollfds[STATSCONN_SLOT + i];
+
+	if (statsconns[i].sending)
+		conntab_free(&statsconns[i].table);
+	statsconns[i].sending = 0;
+	close(pfd->fd);
+	pfd->fd = -1;
+	pfd->revents = 0;
+}
+
+static void
+stats_accept(int fd)
+{
+	int i;
+
+	for (i = 0; i < STATS_CONNS; i++)
+		if (pollfds[STATSCONN_SLOT + i].fd == -1)
+			break;
+	if (i == STATS_CONNS) {
+		close(fd);
+		return;
+	}
+	newconn(&pollfds[STATSCONN_SLOT + i], fd);
+	memset(&statsconns[i], 0, sizeof(statsconns[i]));
+	statsconns[i].active = time(NULL);
+}
+
+/* Send more of the table, copying the next lot when one has gone */
+static int
+stats_send(struct statsconn *sc, int fd)
+{
+	int ret;
+
+	while ((ret = conntab_send(&sc->table, fd)) == 0 &&
+	    sc->next < max_connections)
+		conns_snapshot(&sc->table, &sc->next);
+	return ret;
+}
+
+static void
+stats_handle(int i)
+{
+	struct pollfd *pfd = &pollfds[STATSCONN_SLOT + i];
+	struct statsconn *sc = &statsconns[i];
+	char *nl;
+	ssize_t r;
+	int flags;
+
+	if (pfd->fd == -1)
+		return;
+	if (pfd->revents == 0) {
+		if (time(NULL) - sc->active >= STATS_TIMEOUT)
+			stats_close(i);
+		return;
+	}
+	sc->active = time(NULL);
+	if (sc->sending) {
+		if (stats_send(sc, pfd->fd) != 1)
+			stats_close(i);
+		return;
+	}
+	r = read(pfd->fd, sc->cmd + sc->cmdlen,
+	    sizeof(sc->cmd) - 1 - sc->cmdlen);
+	if (r == -1 && (errno == EINTR || errno == EAGAIN))
+		return;
+	if (r == -1) {
+		stats_close(i);
+		return;
+	}
+	sc->cmdlen += r;
+	sc->cmd[sc->cmdlen] = '\0';
+	if ((nl = strchr(sc->cmd, '\n')) == NULL && r > 0 &&
+	    sc->cmdlen < sizeof(sc->cmd) - 1)
+		return;
+	sc->cmd[strcspn(sc->cmd, "\r\n")] = '\0';
+
+	if (strcmp(sc->cmd, "conns") == 0) {
+		if (conntab_init(&sc->table, CONNS_ROWS) == -1) {
+			stats_close(i);
+			return;
+		}
+		sc->sending = 1;
+		sc->next = FIRST_CLIENT;
+		conns_snapshot(&sc->table, &sc->next);
+		pfd->events = POLLOUT;
+		if (stats_send(sc, pfd->fd) != 1)
+			stats_close(i);
+		return;
+	}
+	if (sc->cmd[0] == '\0' || strcmp(sc->cmd, "stats") == 0) {
+		/* a few hundred bytes, just write them */
+		if ((flags = fcntl(pfd->fd, F_GETFL)) != -1)
+			fcntl(pfd->fd, F_SETFL, flags & ~O_NONBLOCK);
+		stats_serve(pfd->fd);
+	} else if (write(pfd->fd, "unknown command\n", 16) == -1 && debug)
+		warn("stats write failed");
+	stats_close(i);
+}
+
+static int
+unix_listen(const char *path, int backlog)
+{
+	struct sockaddr_un sun;
+	int fd;
+
+	memset(&sun, 0, sizeof(sun));
+	sun.sun_family = AF_UNIX;
+	if (snprintf(sun.sun_path, sizeof(sun.sun_path), "%s", path) >=
+	    (int)sizeof(sun.sun_path))
+		errx(1, "%s - socket path too long", path);
+	if ((fd = socket(AF_UNIX, SOCK_STREAM, 0)) == -1)
+		err(1, "%s: socket failed", path);
+	unlink(path);
+	if (bind(fd, (struct sockaddr *)&sun, sizeof(sun)) == -1)
+		err(1, "%s: bind failed", path);
+	if (listen(fd, backlog) == -1)
+		err(1, "%s: listen failed", path);
+	return fd;
+}
+
+static long long
+getnum(const char *s, long long min, long long max)
+{
+	char *ep;
+	long long n;
+
+	errno = 0;
+	n = strtoll(s, &ep, 10);
+	if (*s == '\0' || *ep != '\0')
+		errx(1, "%s - not a number", s);
+	if (errno == ERANGE || n < min || n > max)
+		errx(1, "%s - value out of range", s);
+	return n;
 }
 
 int main(int argc, char **argv) {
 
+#if TRANSPORT != TRANSPORT_UNIX
 	struct addrinfo hints, *res;
-	int i, listenfd, error;
+	int error;
+#endif
+	struct tls_config *tls_cfg = NULL;
+	struct memca_cred cred;
+	int ch, i, listenfd, room, timeout;
+	int use_tls = TRANSPORT == TRANSPORT_TLS;
+	char *statspath = NULL;
+	time_t now, wait;
+	size_t heavy;
 
-	if (argc != 3)
+	while ((ch = getopt(argc, argv,
+	    "Bb:C:c:dH:i:k:L:l:m:n:O:R:r:S:T")) != -1) {
+		switch (ch) {
+		case 'B':
+			batch = 1;
+			break;
+		case 'b':
+			client_cap = getnum(optarg, 1, LLONG_MAX);
+			break;
+		case 'C':
+			cafile = optarg;
+			break;
+		case 'c':
+			certfile = optarg;
+			break;
+		case 'd':
+			debug = 1;
+			break;
+		case 'H':
+			persec = getnum(optarg, 1, 1000000);
+			break;
+		case 'i':
+			idle_timeout = getnum(optarg, 1, 3600);
+			break;
+		case 'k':
+			keyfile = optarg;
+			break;
+		case 'L':
+			lifetime = getnum(optarg, 60, 365 * 24 * 60 * 60);
+			break;
+		case 'l':
+			perhost = getnum(optarg, 1, 65535);
+			break;
+		case 'm':
+			budget = getnum(optarg, sizeof(struct chunk),
+			    LLONG_MAX);
+			break;
+		case 'n':
+			max_connections = getnum(optarg, 1, INT_MAX -
+			    FIRST_CLIENT);
+			break;
+		case 'O':
+			if (strcmp(optarg, "open") != 0 &&
+			    strcmp(optarg, "closed") != 0)
+				errx(1, "%s - OCSP policy is open or closed",
+				    optarg);
+			ocsp_policy = optarg;
+			break;
+		case 'R':
+			deltafile = optarg;
+			break;
+		case 'r':
+			crlfile = optarg;
+			break;
+		case 'S':
+			statspath = optarg;
+			break;
+		case 'T':
+			if (TRANSPORT != TRANSPORT_ANY &&
+			    TRANSPORT != TRANSPORT_TLS)
+				errx(1, "built for %s only, no TLS",
+				    TRANSPORT_NAME);
+			use_tls = 1;
+			break;
+		default:
+			usage();
+		}
+	}
+	argc -= optind;
+	argv += optind;
+#if TRANSPORT == TRANSPORT_UNIX
+	if (argc != 1)
+		usage();
+#else
+	if (argc != 2)
 		usage();
 
 	bzero(&hints, sizeof(hints));
 	hints.ai_family = AF_INET;
 	hints.ai_socktype = SOCK_STREAM;
 	hints.ai_flags = AI_PASSIVE;
-	if ((error = getaddrinfo(argv[1], argv[2], &hints, &res))) {
+	if ((error = getaddrinfo(argv[0], argv[1], &hints, &res))) {
 		fprintf(stderr, "%s\n", gai_strerror(error));
 		usage();
 	}
+#endif
 
-	for (i = 0; i < MAX_CONNECTIONS; i++)  {
+	if (lifetime > 0 && !use_tls)
+		errx(1, "-L needs TLS");
+	if (ocsp_policy != NULL && !use_tls)
+		errx(1, "-O needs TLS");
+	if (TRANSPORT == TRANSPORT_UNIX && (perhost != 0 || persec != 0))
+		errx(1, "-l and -H need TCP");
+	if (certfile == NULL)
+		certfile = lifetime > 0 ?
+		    "../CA/intermediate/certs/intermediate.cert.pem" :
+		    "../CA/server.crt";
+	if (keyfile == NULL)
+		keyfile = lifetime > 0 ?
+		    "../CA/intermediate/private/intermediate.key.pem" :
+		    "../CA/server.key";
+
+	if (use_tls) {
+		if (tls_init() == -1)
+			errx(1, "unable to initialize TLS");
+		if (lifetime > 0) {
+			/* the first one we wait for */
+			if (renew_start(&renew, certfile, keyfile,
+			    "../CA/root.pem", "localhost", MEMCA_EC256,
+			    lifetime) == -1 || renew_ask(&renew) == -1 ||
+			    renew_collect(&renew, &cred) == -1)
+				errx(1, "couldn't get a certificate");
+			tls_cfg = server_config(&cred);
+			memca_cred_free(&cred);
+			keytype = "ec256";
+		} else {
+			tls_cfg = server_config(NULL);
+			keytype = hs_keytype(keyfile);
+		}
+		if (ocsp_policy != NULL &&
+		    ocspcheck_init(cafile, ocsp_policy[0] == 'o') == -1)
+			exit(1);
+		if (crlfile != NULL) {
+			if (crlset_load_base(&crls, crlfile, cafile) == -1)
+				exit(1);
+			if (deltafile != NULL &&
+			    crlset_load_delta(&crls, deltafile, cafile) == -1)
+				exit(1);
+			signal(SIGHUP, hup_handler);
+		}
+		if ((tls_ctx = tls_server()) == NULL)
+			errx(1, "TLS server creation failed");
+		if (tls_configure(tls_ctx, tls_cfg) == -1)
+			errx(1, "TLS configuration failed (%s)",
+			    tls_error(tls_ctx));
+	}
+
+	/*
+	 * A client that goes away while we still have something to send
+	 * it would otherwise kill the whole server with SIGPIPE. We see
+	 * EPIPE from the write instead and just close that connection.
+	 */
+	signal(SIGPIPE, SIG_IGN);
+
+	max_connections += FIRST_CLIENT;
+	if ((perhost != 0 || persec != 0) &&
+	    iplimit_init(max_connections, perhost, persec) == -1)
+		exit(1);
+	if ((clients = calloc(max_connections, sizeof(*clients))) == NULL ||
+	    (pollfds = calloc(max_connections, sizeof(*pollfds))) == NULL)
+		err(1, "calloc");
+	chain_set_budget(budget);
+
+	for (i = 0; i < max_connections; i++)  {
 		pollfds[i].fd = -1;
 		pollfds[i].events = POLLIN | POLLHUP;
 		pollfds[i].revents = 0;
 	}
 
+#if TRANSPORT == TRANSPORT_UNIX
+	listenfd = unix_listen(argv[0], max_connections);
+#else
 	if ((listenfd = socket(res->ai_family, res->ai_socktype,
 		    res->ai_protocol)) < 0)
 		err(1, "Couldn't get listen socket");
@@ -233,42 +1292,173 @@ int main(int argc, char **argv) {
 	if (bind(listenfd, res->ai_addr, res->ai_addrlen) == -1)
 		err(1, "bind failed");
 
-	if (listen(listenfd, MAX_CONNECTIONS) == -1)
+	if (listen(listenfd, max_connections) == -1)
 		err(1, "listen failed");
 
-	if (setsockopt(listenfd, SOL_SOCKET, SO_REUSEADDR, &i, sizeof(int)) == -1)
+	if (setsockopt(listenfd, SOL_SOCKET, SO_REUSEADDR, &i,
+	    sizeof(int)) == -1)
 		err(1, "SO_REUSEADDR setsockopt failed");
+#endif
 
-	newconn(&pollfds[0], listenfd);
+	newconn(&pollfds[LISTEN_SLOT], listenfd);
+	if (statspath != NULL)
+		newconn(&pollfds[STATS_SLOT], unix_listen(statspath, 5));
+	/* not through newconn(), talking to the helper blocks */
+	if (lifetime > 0)
+		pollfds[RENEW_SLOT].fd = renew.fd;
 
 	while(1) {
+		if (reload_delta) {
+			reload_delta = 0;
+			if (deltafile != NULL &&
+			    crlset_load_delta(&crls, deltafile, cafile) == 0 &&
+			    debug)
+				fprintf(stderr, "delta CRL has %zu entries\n",
+				    crls.ndelta);
+		}
 		if (!throttle)
-			pollfds[0].events = POLLIN | POLLHUP;
+			pollfds[LISTEN_SLOT].events = POLLIN | POLLHUP;
 		else
-			pollfds[0].events = 0;
+			pollfds[LISTEN_SLOT].events = 0;
 
-		if (poll(pollfds, MAX_CONNECTIONS, -1) == -1)
+		/*
+		 * Don't sleep if libtls is sitting on data for someone
+		 * we'd read from.
+		 */
+		timeout = -1;
+		for (i = FIRST_CLIENT; SERVER_TLS &&
+		    i < max_connections; i++) {
+			if (pollfds[i].fd != -1 && clients[i].pending &&
+			    pollfds[i].events & POLLIN) {
+				timeout = 0;
+				break;
+			}
+		}
+		if (lifetime > 0) {
+			now = time(NULL);
+			if (!renew.asked && now >= renew.renew_at &&
+			    renew_ask(&renew) == -1)
+				errx(1, "certificate helper went away");
+			pollfds[RENEW_SLOT].events = renew.asked ? POLLIN : 0;
+			/* wake up for the next one, in an hour at most */
+			wait = renew.renew_at - now;
+			if (wait > 3600)
+				wait = 3600;
+			if (!renew.asked && (timeout == -1 ||
+			    wait * 1000 < timeout))
+				timeout = wait * 1000;
+		}
+		if (nwaiting > 0) {
+			idle_sweep();
+			if (timeout == -1 || timeout > 1000)
+				timeout = 1000;
+		}
+		if (nhandshaking > 0) {
+			handshake_sweep();
+			if (timeout == -1 || timeout > 1000)
+				timeout = 1000;
+		}
+		/* come back to close stats readers that have stalled */
+		for (i = 0; i < STATS_CONNS; i++)
+			if (pollfds[STATSCONN_SLOT + i].fd != -1 &&
+			    (timeout == -1 || timeout > 1000))
+				timeout = 1000;
+		if (ocsp_policy != NULL) {
+			int t = ocspcheck_events(pollfds + OCSP_SLOT);
+
+			if (t != -1 && (timeout == -1 || t < timeout))
+				timeout = t;
+		}
+		if (poll(pollfds, max_connections, timeout) == -1) {
+			if (errno == EINTR)
+				continue;
 			err(1, "poll failed");
-		if (pollfds[0].revents) {
-			struct sockaddr csaddr;
-			socklen_t cssize;
-			int fd;
+		}
+		if (pollfds[LISTEN_SLOT].revents) {
+			struct sockaddr_storage csaddr;
+			socklen_t cssize = sizeof(csaddr);
+			int fd, ipslot = -1, limited, one = 1;
 
-			fd = accept(pollfds[0].fd, &csaddr, &cssize);
-			throttle = 1;
-			for (i = 1; fd >= 0 && i < MAX_CONNECTIONS; i++)  {
+			fd = accept(pollfds[LISTEN_SLOT].fd,
+			    (struct sockaddr *)&csaddr, &cssize);
+			/* over its limits, it costs us no more than this */
+			limited = fd >= 0 && (perhost != 0 || persec != 0) &&
+			    iplimit_admit((struct sockaddr *)&csaddr,
+			    &ipslot) == -1;
+			if (limited) {
+				close(fd);
+				fd = -1;
+			}
+			/*
+			 * An echo is a small write, and with TLS 1.3 it can
+			 * come right behind the session tickets, where Nagle
+			 * holds it until the client's delayed ack, 40ms on.
+			 */
+			if (TRANSPORT != TRANSPORT_UNIX && fd >= 0 &&
+			    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one,
+			    sizeof(one)) == -1 && debug)
+				warn("TCP_NODELAY");
+			throttle = !limited;
+			for (i = FIRST_CLIENT; fd >= 0 && !pressure &&
+			    i < max_connections; i++)  {
 				if (pollfds[i].fd == -1) {
 					newconn(&pollfds[i], fd);
 					client_init(&clients[i]);
+					clients[i].ipslot = ipslot;
+					if (cssize <= sizeof(clients[i].peer))
+						memcpy(&clients[i].peer,
+						    &csaddr, cssize);
+					if (idle_timeout > 0) {
+						clients[i].waiting = 1;
+						nwaiting++;
+					} else if (SERVER_TLS &&
+					    !client_tls(&clients[i], fd))
+						closeconn(&pollfds[i],
+						    &clients[i]);
 					throttle = 0;
+					fd = -1;
 					break;
 				}
 			}
+			if (fd >= 0) {
+				/* no room at the inn */
+				close(fd);
+				iplimit_release(ipslot);
+				rejected++;
+				throttle = !pressure;
+			}
+		}
+		if (pollfds[STATS_SLOT].revents) {
+			int fd;
+
+			if ((fd = accept(pollfds[STATS_SLOT].fd, NULL,
+			    NULL)) >= 0)
+				stats_accept(fd);
 		}
-		for (i = 1; i < MAX_CONNECTIONS; i++)
+		for (i = 0; i < STATS_CONNS; i++)
+			stats_handle(i);
+		if (pollfds[RENEW_SLOT].revents)
+			renew_swap();
+		if (ocsp_policy != NULL) {
+			ocspcheck_run(pollfds + OCSP_SLOT);
+			for (i = FIRST_CLIENT; i < max_connections; i++)
+				ocsp_resolve(&pollfds[i], &clients[i]);
+		}
+		for (i = FIRST_CLIENT; i < max_connections; i++)
 			handle_client(&pollfds[i], &clients[i]);
+		if (batch)
+			send_pass();
+
+		heavy = budget_update(&room);
+		paused = 0;
+		for (i = FIRST_CLIENT; i < max_connections; i++)
+			if (pollfds[i].fd != -1)
+				client_events(&pollfds[i], &clients[i], heavy,
+				    room);
 	}
 
+#if TRANSPORT != TRANSPORT_UNIX
 	freeaddrinfo(res);
+#endif
 	return 0;
 }
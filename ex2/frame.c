@@ -0,0 +1,237 @@
+/*
+ * Copyright (c) 2018 Bob Beck <beck@obtuse.com>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/*
+ * Newline scanning for line framed echo traffic.
+ *
+ * On amd64 we compare 16 (SSE2) or 32 (AVX2) bytes at a time against
+ * a vector of newlines and turn the result into a bitmask, so finding
+ * the first newline is a count of trailing zeros, and counting them
+ * all is a popcount. Elsewhere we fall back to memchr(3).
+ */
+
+#include <stdint.h>
+#include <string.h>
+
+#include "frame.h"
+
+#if defined(__x86_64__) && (defined(__GNUC__) || defined(__clang__))
+#define FRAME_SIMD
+#include <immintrin.h>
+#endif
+
+static const unsigned char *scan_generic(const unsigned char *, size_t);
+static size_t count_generic(const unsigned char *, size_t, size_t *);
+
+static const unsigned char *(*scan)(const unsigned char *, size_t);
+static size_t (*count)(const unsigned char *, size_t, size_t *);
+static const char *impl;
+
+static const unsigned char *
+scan_generic(const unsigned char *buf, size_t len)
+{
+	return memchr(buf, '\n', len);
+}
+
+static size_t
+count_generic(const unsigned char *buf, size_t len, size_t *tail)
+{
+	const unsigned char *p = buf, *nl, *end = buf + len;
+	size_t n = 0;
+
+	*tail = len;
+	while ((nl = memchr(p, '\n', end - p)) != NULL) {
+		n++;
+		p = nl + 1;
+		*tail = end - p;
+	}
+	return n;
+}
+
+#ifdef FRAME_SIMD
+static const unsigned char *
+scan_sse2(const unsigned char *buf, size_t len)
+{
+	const __m128i nl = _mm_set1_epi8('\n');
+	size_t i = 0;
+	unsigned int mask;
+
+	for (; i + 16 <= len; i += 16) {
+		mask = _mm_movemask_epi8(_mm_cmpeq_epi8(nl,
+		    _mm_loadu_si128((const __m128i *)(buf + i))));
+		if (mask != 0)
+			return buf + i + __builtin_ctz(mask);
+	}
+	for (; i < len; i++)
+		if (buf[i] == '\n')
+			return buf + i;
+	return NULL;
+}
+
+static size_t
+count_sse2(const unsigned char *buf, size_t len, size_t *tail)
+{
+	const __m128i nl = _mm_set1_epi8('\n');
+	size_t i = 0, n = 0, last = len;
+	unsigned int mask;
+
+	for (; i + 16 <= len; i += 16) {
+		mask = _mm_movemask_epi8(_mm_cmpeq_epi8(nl,
+		    _mm_loadu_si128((const __m128i *)(buf + i))));
+		if (mask != 0) {
+			n += __builtin_popcount(mask);
+			last = i + 31 - __builtin_clz(mask);
+		}
+	}
+	for (; i < len; i++) {
+		if (buf[i] == '\n') {
+			n++;
+			last = i;
+		}
+	}
+	*tail = (last == len) ? len : len - last - 1;
+	return n;
+}
+
+__attribute__((target("avx2")))
+static const unsigned char *
+scan_avx2(const unsigned char *buf, size_t len)
+{
+	const __m256i nl = _mm256_set1_epi8('\n');
+	__m256i a, b, c, d;
+	size_t i = 0;
+	uint64_t lo, hi;
+	unsigned int mask;
+
+	/* 128 bytes a go, only working out where once we know */
+	for (; i + 128 <= len; i += 128) {
+		a = _mm256_cmpeq_epi8(nl,
+		    _mm256_loadu_si256((const __m256i *)(buf + i)));
+		b = _mm256_cmpeq_epi8(nl,
+		    _mm256_loadu_si256((const __m256i *)(buf + i + 32)));
+		c = _mm256_cmpeq_epi8(nl,
+		    _mm256_loadu_si256((const __m256i *)(buf + i + 64)));
+		d = _mm256_cmpeq_epi8(nl,
+		    _mm256_loadu_si256((const __m256i *)(buf + i + 96)));
+		if (_mm256_movemask_epi8(_mm256_or_si256(_mm256_or_si256(a, b),
+		    _mm256_or_si256(c, d))) == 0)
+			continue;
+		lo = (uint32_t)_mm256_movemask_epi8(a) |
+		    (uint64_t)(uint32_t)_mm256_movemask_epi8(b) << 32;
+		if (lo != 0)
+			return buf + i + __builtin_ctzll(lo);
+		hi = (uint32_t)_mm256_movemask_epi8(c) |
+		    (uint64_t)(uint32_t)_mm256_movemask_epi8(d) << 32;
+		return buf + i + 64 + __builtin_ctzll(hi);
+	}
+	for (; i + 32 <= len; i += 32) {
+		mask = _mm256_movemask_epi8(_mm256_cmpeq_epi8(nl,
+		    _mm256_loadu_si256((const __m256i *)(buf + i))));
+		if (mask != 0)
+			return buf + i + __builtin_ctz(mask);
+	}
+	return scan_sse2(buf + i, len - i);
+}
+
+__attribute__((target("avx2,popcnt")))
+static size_t
+count_avx2(const unsigned char *buf, size_t len, size_t *tail)
+{
+	const __m256i nl = _mm256_set1_epi8('\n');
+	size_t i = 0, n = 0, last = len, rtail;
+	uint64_t mask;
+
+	for (; i + 64 <= len; i += 64) {
+		mask = (uint32_t)_mm256_movemask_epi8(_mm256_cmpeq_epi8(nl,
+		    _mm256_loadu_si256((const __m256i *)(buf + i)))) |
+		    (uint64_t)(uint32_t)_mm256_movemask_epi8(_mm256_cmpeq_epi8(
+		    nl, _mm256_loadu_si256((const __m256i *)(buf + i + 32))))
+		    << 32;
+		if (mask != 0) {
+			n += __builtin_popcountll(mask);
+			last = i + 63 - __builtin_clzll(mask);
+		}
+	}
+	n += count_sse2(buf + i, len - i, &rtail);
+	if (rtail != len - i)
+		last = len - rtail - 1;
+	*tail = (last == len) ? len : len - last - 1;
+	return n;
+}
+#endif
+
+static void
+frame_init(void)
+{
+	scan = scan_generic;
+	count = count_generic;
+	impl = "memchr";
+#ifdef FRAME_SIMD
+	scan = scan_sse2;
+	count = count_sse2;
+	impl = "sse2";
+	if (__builtin_cpu_supports("avx2")) {
+		scan = scan_avx2;
+		count = count_avx2;
+		impl = "avx2";
+	}
+#endif
+}
+
+const unsigned char *
+frame_scan(const unsigned char *buf, size_t len)
+{
+	if (scan == NULL)
+		frame_init();
+	return scan(buf, len);
+}
+
+size_t
+frame_count(const unsigned char *buf, size_t len, size_t *tail)
+{
+	if (count == NULL)
+		frame_init();
+	return count(buf, len, tail);
+}
+
+const char *
+frame_impl(void)
+{
+	if (impl == NULL)
+		frame_init();
+	return impl;
+}
+
+void
+framer_init(struct framer *framer)
+{
+	framer->partial = 0;
+	framer->messages = 0;
+}
+
+size_t
+framer_feed(struct framer *framer, const unsigned char *buf, size_t len)
+{
+	size_t n, tail;
+
+	n = frame_count(buf, len, &tail);
+	if (n == 0)
+		framer->partial += len;
+	else
+		framer->partial = tail;
+	framer->messages += n;
+	return n;
+}
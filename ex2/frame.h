@@ -0,0 +1,51 @@
+/*
+ * Copyright (c) 2018 Bob Beck <beck@obtuse.com>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#ifndef FRAME_H
+#define FRAME_H
+
+#include <stddef.h>
+
+/*
+ * Line framing for the echo client and server. A message is everything
+ * up to and including a newline. Data can arrive in any number of
+ * pieces, so a framer remembers how much of an unfinished message it
+ * has already seen.
+ */
+struct framer {
+	size_t partial;			/* bytes of the unfinished message */
+	unsigned long long messages;	/* complete messages seen */
+};
+
+/* Return a pointer to the first newline in buf, or NULL if none */
+const unsigned char *frame_scan(const unsigned char *buf, size_t len);
+
+/*
+ * Count the newlines in buf, and set *tail to the number of bytes
+ * following the last one (len if there are none).
+ */
+size_t frame_count(const unsigned char *buf, size_t len, size_t *tail);
+
+/* Name of the scanner picked for this cpu */
+const char *frame_impl(void);
+
+void framer_init(struct framer *framer);
+
+/* Feed a segment, returning the number of messages it completed */
+size_t framer_feed(struct framer *framer, const unsigned char *buf,
+    size_t len);
+
+#endif /* FRAME_H */
@@ -0,0 +1,154 @@
+/*
+ * Copyright (c) 2018 Bob Beck <beck@obtuse.com>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/*
+ * Time full TLS handshakes against a server, one after another, the
+ * way a client that connects afresh each time would see them: from
+ * making the libtls context to the end of the handshake, including
+ * checking the server's certificate and, with -r, looking it up in a
+ * CRL, which libtls loads for every connection. Run it with a CRL
+ * against "echo -T", and without one against "echo -T -L lifetime",
+ * to see what short lived certificates save the client.
+ */
+
+#include <sys/types.h>
+#include <sys/socket.h>
+
+#include <err.h>
+#include <errno.h>
+#include <netdb.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <tls.h>
+#include <unistd.h>
+
+static void
+usage(void)
+{
+	extern char *__progname;
+
+	fprintf(stderr, "usage: %s [-C cafile] [-n handshakes] [-r crlfile] "
+	    "host port\n", __progname);
+	exit(1);
+}
+
+static long long
+getnum(const char *s, long long min, long long max)
+{
+	char *ep;
+	long long n;
+
+	errno = 0;
+	n = strtoll(s, &ep, 10);
+	if (*s == '\0' || *ep != '\0')
+		errx(1, "%s - not a number", s);
+	if (errno == ERANGE || n < min || n > max)
+		errx(1, "%s - value out of range", s);
+	return n;
+}
+
+static double
+now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static int
+dcmp(const void *a, const void *b)
+{
+	double x = *(const double *)a, y = *(const double *)b;
+
+	return x < y ? -1 : x > y;
+}
+
+int
+main(int argc, char **argv)
+{
+	const char *cafile = "../CA/root.pem", *crlfile = NULL;
+	struct addrinfo hints, *res;
+	struct tls_config *cfg;
+	struct tls *ctx;
+	double start, *usec, total = 0;
+	int ch, error, fd, i, n = 1000;
+
+	while ((ch = getopt(argc, argv, "C:n:r:")) != -1) {
+		switch (ch) {
+		case 'C':
+			cafile = optarg;
+			break;
+		case 'n':
+			n = getnum(optarg, 1, 1000000);
+			break;
+		case 'r':
+			crlfile = optarg;
+			break;
+		default:
+			usage();
+		}
+	}
+	argc -= optind;
+	argv += optind;
+	if (argc != 2)
+		usage();
+
+	memset(&hints, 0, sizeof(hints));
+	hints.ai_family = AF_UNSPEC;
+	hints.ai_socktype = SOCK_STREAM;
+	if ((error = getaddrinfo(argv[0], argv[1], &hints, &res)) != 0)
+		errx(1, "%s: %s", argv[0], gai_strerror(error));
+
+	if (tls_init() == -1)
+		errx(1, "unable to initialize TLS");
+	if ((cfg = tls_config_new()) == NULL)
+		errx(1, "unable to allocate TLS config");
+	if (tls_config_set_ca_file(cfg, cafile) == -1)
+		errx(1, "unable to set CA file %s", cafile);
+	if (crlfile != NULL && tls_config_set_crl_file(cfg, crlfile) == -1)
+		errx(1, "unable to set CRL file %s", crlfile);
+	if ((usec = calloc(n, sizeof(*usec))) == NULL)
+		err(1, "calloc");
+
+	for (i = 0; i < n; i++) {
+		start = now();
+		if ((fd = socket(res->ai_family, res->ai_socktype,
+		    res->ai_protocol)) == -1)
+			err(1, "socket");
+		if (connect(fd, res->ai_addr, res->ai_addrlen) == -1)
+			err(1, "connect");
+		if ((ctx = tls_client()) == NULL)
+			errx(1, "tls_client failed");
+		if (tls_configure(ctx, cfg) == -1 ||
+		    tls_connect_socket(ctx, fd, "localhost") == -1 ||
+		    tls_handshake(ctx) == -1)
+			errx(1, "handshake %d: %s", i, tls_error(ctx));
+		usec[i] = (now() - start) * 1e6;
+		total += usec[i];
+		tls_close(ctx);
+		tls_free(ctx);
+		close(fd);
+	}
+	qsort(usec, n, sizeof(*usec), dcmp);
+	printf("%d handshakes, %s: avg %.0f p50 %.0f p99 %.0f max %.0f usec\n",
+	    n, crlfile ? "checking the CRL" : "no revocation check",
+	    total / n, usec[n / 2], usec[n * 99 / 100], usec[n - 1]);
+	freeaddrinfo(res);
+	return 0;
+}
@@ -0,0 +1,204 @@
+/*
+ * Copyright (c) 2018 Bob Beck <beck@obtuse.com>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/*
+ * Per address connection limits. See iplimit.h.
+ *
+ * Hosts live in a fixed table, found by hashing the address and
+ * probing a few slots along, the same way as the OCSP cache. An entry
+ * holding connections is never thrown out, so the slot handed back
+ * from iplimit_admit() stays good until it is released; the table has
+ * several slots for every connection we can have, so there is always
+ * somewhere to go unless someone has found a lot of addresses that
+ * hash together. The hash is seeded at random each run to make that
+ * harder.
+ *
+ * The rate limit is a token bucket, kept in thousandths of a
+ * connection so it can top up a millisecond at a time.
+ */
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+
+#include <err.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "iplimit.h"
+
+#define PROBE 8
+#define MIN_SLOTS 1024
+
+struct entry {
+	uint8_t addr[16];	/* IPv4 as ::ffff:a.b.c.d, IPv6 a /64 */
+	uint32_t last;		/* msec, when credit was last topped up */
+	uint32_t credit;	/* thousandths of a connection */
+	uint32_t conns;		/* open right now */
+	uint8_t used;
+};
+
+static struct entry *table;
+static size_t nslots, hosts;
+static unsigned int perhost, persec;
+static uint32_t seed;
+static struct iplimit_stats stats;
+
+int
+iplimit_init(size_t max, unsigned int conns, unsigned int rate)
+{
+	nslots = MIN_SLOTS;
+	while (nslots < max * 4 && nslots < SIZE_MAX / 2)
+		nslots *= 2;
+	if ((table = calloc(nslots, sizeof(*table))) == NULL) {
+		warn("address limit table");
+		return -1;
+	}
+	perhost = conns;
+	persec = rate > 1000000 ? 1000000 : rate;
+	seed = arc4random();
+	return 0;
+}
+
+static uint32_t
+msec(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+static uint32_t
+hash(const uint8_t *addr)
+{
+	uint32_t h = 2166136261U ^ seed;
+	int i;
+
+	for (i = 0; i < 16; i++) {
+		h ^= addr[i];
+		h *= 16777619U;
+	}
+	return h ^ (h >> 15);
+}
+
+/* Has an idle entry's allowance come all the way back? */
+static int
+idle(const struct entry *e, uint32_t now)
+{
+	return e->conns == 0 && now - e->last >= 1000;
+}
+
+/* Find the entry for an address, or somewhere to put it */
+static int
+slot_for(const uint8_t *addr, uint32_t now)
+{
+	uint32_t h = hash(addr);
+	int i, slot, victim = -1;
+
+	for (i = 0; i < PROBE; i++) {
+		slot = (h + i) & (nslots - 1);
+		if (table[slot].used &&
+		    memcmp(table[slot].addr, addr, 16) == 0)
+			return slot;
+	}
+	for (i = 0; i < PROBE; i++) {
+		slot = (h + i) & (nslots - 1);
+		if (!table[slot].used || idle(&table[slot], now))
+			return slot;
+		if (table[slot].conns == 0 && (victim == -1 ||
+		    now - table[slot].last > now - table[victim].last))
+			victim = slot;
+	}
+	return victim;
+}
+
+int
+iplimit_admit(const struct sockaddr *sa, int *slot)
+{
+	const struct sockaddr_in *sin = (const struct sockaddr_in *)sa;
+	const struct sockaddr_in6 *sin6 = (const struct sockaddr_in6 *)sa;
+	uint8_t addr[16];
+	struct entry *e;
+	uint32_t now, elapsed;
+	int i;
+
+	*slot = -1;
+	memset(addr, 0, sizeof(addr));
+	switch (sa->sa_family) {
+	case AF_INET:
+		addr[10] = addr[11] = 0xff;
+		memcpy(addr + 12, &sin->sin_addr, 4);
+		break;
+	case AF_INET6:
+		memcpy(addr, &sin6->sin6_addr, 8);
+		break;
+	default:
+		return 0;
+	}
+	now = msec();
+	if ((i = slot_for(addr, now)) == -1) {
+		stats.untracked++;
+		return 0;
+	}
+	e = &table[i];
+	if (!e->used || memcmp(e->addr, addr, 16) != 0) {
+		if (!e->used)
+			hosts++;
+		memcpy(e->addr, addr, 16);
+		e->used = 1;
+		e->conns = 0;
+		e->credit = persec * 1000;
+		e->last = now;
+	}
+	if ((elapsed = now - e->last) >= 1000)
+		e->credit = persec * 1000;
+	else if ((e->credit += elapsed * persec) > persec * 1000)
+		e->credit = persec * 1000;
+	e->last = now;
+
+	if (perhost != 0 && e->conns >= perhost) {
+		stats.conn_limited++;
+		return -1;
+	}
+	if (persec != 0) {
+		if (e->credit < 1000) {
+			stats.rate_limited++;
+			return -1;
+		}
+		e->credit -= 1000;
+	}
+	e->conns++;
+	*slot = i;
+	return 0;
+}
+
+void
+iplimit_release(int slot)
+{
+	if (slot >= 0 && table[slot].conns > 0)
+		table[slot].conns--;
+}
+
+void
+iplimit_get_stats(struct iplimit_stats *s)
+{
+	*s = stats;
+	s->slots = nslots;
+	s->hosts = hosts;
+}
@@ -0,0 +1,61 @@
+/*
+ * Copyright (c) 2018 Bob Beck <beck@obtuse.com>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#ifndef IPLIMIT_H
+#define IPLIMIT_H
+
+#include <sys/types.h>
+#include <sys/socket.h>
+
+#include <stddef.h>
+
+/*
+ * Per address limits on connections, checked as soon as a connection
+ * is accepted so that a host over its limit never gets as far as
+ * costing us a TLS handshake.
+ *
+ * A host may hold at most perhost connections at once, and may open
+ * new ones at persec a second, with up to a second's worth at once.
+ * Either limit is off when zero. IPv6 hosts are counted by /64, since
+ * anyone with one address has the rest of the /64 too.
+ *
+ * What we know about hosts is kept in a table sized once, at start, so
+ * spraying us from many addresses only pushes out hosts we have
+ * stopped caring about: those with no connections whose rate allowance
+ * has (nearly) come back anyway.
+ */
+
+struct iplimit_stats {
+	unsigned long long conn_limited;	/* refused, too many open */
+	unsigned long long rate_limited;	/* refused, too many too fast */
+	unsigned long long untracked;		/* no room, let through */
+	size_t slots, hosts;
+};
+
+/* Room for a server of max connections. -1 and warn on failure */
+int iplimit_init(size_t max, unsigned int perhost, unsigned int persec);
+
+/*
+ * May this peer have another connection? Returns 0 with *slot set to
+ * the entry to hand back to iplimit_release() when it closes, or -1 if
+ * it is over a limit. *slot is -1 for connections we don't track.
+ */
+int iplimit_admit(const struct sockaddr *sa, int *slot);
+void iplimit_release(int slot);
+
+void iplimit_get_stats(struct iplimit_stats *stats);
+
+#endif /* IPLIMIT_H */
@@ -0,0 +1,634 @@
+/*
+ * Copyright (c) 2018 Bob Beck <beck@obtuse.com>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/*
+ * A load generator for the echo server that checks everything it gets
+ * back. It opens a number of connections, and on each one sends
+ * a stream of frames, one per line:
+ *
+ *	cccccccc ssssssss llllllll xxxxxxxx payload...\n
+ *
+ * Where c is the connection number, s the sequence number, l the payload
+ * length and x the CRC32C of the payload, all in hex. Payloads are
+ * sliced out of a per-connection pseudo random pattern, so when
+ * a checksum doesn't match we can regenerate what we sent and say
+ * exactly where in the stream the echo went wrong.
+ *
+ * We also time each frame from when it is queued until its echo is
+ * complete, and report the latency distribution at the end.
+ *
+ * Given more than one server, we balance frames over them as a client
+ * library would (see pool.c): one connection to each, the same number
+ * of frames in flight in total as -c connections of -d depth would
+ * have, and each frame sent to whichever of two servers picked at
+ * random has the lower outstanding frames times latency. A server
+ * whose connection breaks, or that sits on a frame longer than -H
+ * milliseconds, is ejected until we can connect to it again, and the
+ * frames it had are sent again elsewhere.
+ */
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <netinet/in.h>
+
+#include <err.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <netdb.h>
+#include <poll.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "connrace.h"
+#include "crc32c.h"
+#include "frame.h"
+#include "pool.h"
+
+#define HDRLEN 36		/* four 8 digit hex fields and spaces */
+#define PATLEN 65536		/* pattern we slice payloads out of */
+#define MAXPAYLOAD 65536
+
+static int debug = 0;
+
+static void usage()
+{
+	extern char * __progname;
+	fprintf(stderr, "usage: %s [-r] [-c connections] [-d depth] "
+	    "[-H health] [-n frames]\n"
+	    "\t[-s size] host portnumber [host portnumber ...]\n",
+	    __progname);
+	exit(1);
+}
+
+struct conn {
+	int id;
+	uint32_t sent;			/* frames sent */
+	uint32_t recvd;			/* frames received and checked */
+	unsigned char *pattern;		/* PATLEN + size bytes */
+	struct timespec *queued;	/* when outstanding frames were queued */
+	unsigned char *out;		/* frames waiting to be written */
+	size_t outlen, outoff;
+	unsigned char *in;		/* partial frames read so far */
+	size_t inlen, insize;
+	unsigned long long rxoff;	/* stream offset of in[0] */
+	int racing;			/* pooled, reconnecting in races[] */
+};
+
+static struct conn *conns;
+static struct pollfd *pollfds;
+static int nconns = 1, depth = 1;
+static uint32_t window;		/* most frames in flight on a connection */
+static uint32_t nframes = 1000;
+static size_t size = 1024;
+static unsigned long long mismatches, rxbytes;
+static unsigned long long lat_hist[64], lat_max, lat_count;
+
+/* when balancing over a pool of servers */
+static int pooled;
+static struct pool pool;
+static struct connrace *races;	/* reconnects to ejected servers */
+static long long health = 1000;	/* ms we wait on a frame */
+static unsigned long long issued, answered, retried, total, inflight;
+
+static long long
+getnum(const char *s, long long min, long long max)
+{
+	char *ep;
+	long long n;
+
+	errno = 0;
+	n = strtoll(s, &ep, 10);
+	if (*s == '\0' || *ep != '\0')
+		errx(1, "%s - not a number", s);
+	if (errno == ERANGE || n < min || n > max)
+		errx(1, "%s - value out of range", s);
+	return n;
+}
+
+static const unsigned char *
+payload(struct conn *c, uint32_t seq)
+{
+	return c->pattern + ((seq * 4099UL) % PATLEN);
+}
+
+static void
+conn_init(struct conn *c, int id)
+{
+	static const char alphabet[] =
+	    "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+	uint64_t x = 0x9e3779b97f4a7c15ULL * (id + 1);
+	size_t i;
+
+	c->id = id;
+	c->sent = c->recvd = 0;
+	if ((c->pattern = malloc(PATLEN + size)) == NULL)
+		err(1, "malloc");
+	/* xorshift, printable and newline free */
+	for (i = 0; i < PATLEN + size; i++) {
+		x ^= x << 13;
+		x ^= x >> 7;
+		x ^= x << 17;
+		c->pattern[i] = alphabet[x & 63];
+	}
+	c->outlen = c->outoff = 0;
+	if ((c->out = malloc(window * (HDRLEN + size + 1))) == NULL)
+		err(1, "malloc");
+	c->inlen = 0;
+	c->insize = window * (HDRLEN + size + 1);
+	if ((c->in = malloc(c->insize)) == NULL)
+		err(1, "malloc");
+	c->rxoff = 0;
+	c->racing = 0;
+	if ((c->queued = calloc(window, sizeof(*c->queued))) == NULL)
+		err(1, "calloc");
+}
+
+/* Start over on a new connection */
+static void
+conn_reset(struct conn *c)
+{
+	c->sent = c->recvd = 0;
+	c->outlen = c->outoff = 0;
+	c->inlen = 0;
+	c->rxoff = 0;
+}
+
+/* Queue one more frame */
+static void
+conn_queue(struct conn *c)
+{
+	const unsigned char *p;
+	char hdr[HDRLEN + 1];
+
+	/* make room by moving what is still to be written to the front */
+	if (c->outoff > 0) {
+		memmove(c->out, c->out + c->outoff, c->outlen - c->outoff);
+		c->outlen -= c->outoff;
+		c->outoff = 0;
+	}
+	p = payload(c, c->sent);
+	snprintf(hdr, sizeof(hdr), "%08x %08x %08x %08x ", c->id,
+	    c->sent, (uint32_t)size, crc32c(0, p, size));
+	memcpy(c->out + c->outlen, hdr, HDRLEN);
+	memcpy(c->out + c->outlen + HDRLEN, p, size);
+	c->out[c->outlen + HDRLEN + size] = '\n';
+	c->outlen += HDRLEN + size + 1;
+	clock_gettime(CLOCK_MONOTONIC, &c->queued[c->sent % window]);
+	c->sent++;
+}
+
+/*
+ * Queue up frames until we have depth of them outstanding.
+ */
+static void
+conn_fill(struct conn *c)
+{
+	while (c->sent < nframes && c->sent - c->recvd < window)
+		conn_queue(c);
+}
+
+static void
+mismatch(struct conn *c, unsigned long long off, const char *what)
+{
+	warnx("connection %d: %s at offset %llu (frame %u)", c->id, what,
+	    off, c->recvd);
+	mismatches++;
+}
+
+/*
+ * Check one echoed frame of len bytes (without the newline) which
+ * started at stream offset off.
+ */
+static void
+frame_check(struct conn *c, const unsigned char *f, size_t len,
+    unsigned long long off)
+{
+	const unsigned char *want = payload(c, c->recvd);
+	unsigned int id, seq, plen, crc;
+	char hdr[HDRLEN + 1];
+	size_t i;
+
+	if (len < HDRLEN) {
+		mismatch(c, off, "short frame");
+		return;
+	}
+	memcpy(hdr, f, HDRLEN);
+	hdr[HDRLEN] = '\0';
+	if (sscanf(hdr, "%08x %08x %08x %08x ", &id, &seq, &plen, &crc) != 4 ||
+	    id != (unsigned int)c->id || seq != c->recvd || plen != size) {
+		mismatch(c, off, "bad frame header");
+		return;
+	}
+	if (len - HDRLEN != plen) {
+		mismatch(c, off + HDRLEN, "bad frame length");
+		return;
+	}
+	if (crc32c(0, f + HDRLEN, plen) == crc &&
+	    crc == crc32c(0, want, size))
+		return;
+	/* Slow path, find the first byte that differs */
+	for (i = 0; i < plen; i++)
+		if (f[HDRLEN + i] != want[i])
+			break;
+	mismatch(c, off + HDRLEN + i, "payload mismatch");
+}
+
+/*
+ * Latencies go in power of two microsecond buckets.
+ */
+static unsigned long long
+latency_record(const struct timespec *then, const struct timespec *now)
+{
+	unsigned long long usec;
+
+	usec = (now->tv_sec - then->tv_sec) * 1000000ULL +
+	    (now->tv_nsec - then->tv_nsec) / 1000;
+	lat_hist[usec == 0 ? 0 : 64 - __builtin_clzll(usec)]++;
+	if (usec > lat_max)
+		lat_max = usec;
+	lat_count++;
+	return usec;
+}
+
+static unsigned long long
+latency_percentile(double pct)
+{
+	unsigned long long seen = 0;
+	int i;
+
+	for (i = 0; i < 64; i++) {
+		seen += lat_hist[i];
+		if (seen >= lat_count * pct / 100)
+			return i == 0 ? 0 : 1ULL << i;
+	}
+	return lat_max;
+}
+
+static void
+conn_input(struct conn *c)
+{
+	const unsigned char *nl, *p;
+	struct timespec now;
+	unsigned long long usec;
+	size_t left;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	p = c->in;
+	left = c->inlen;
+	while ((nl = frame_scan(p, left)) != NULL) {
+		usec = latency_record(&c->queued[c->recvd % window], &now);
+		if (pooled) {
+			pool_answered(&pool, c->id, usec);
+			answered++;
+			inflight--;
+		}
+		frame_check(c, p, nl - p, c->rxoff);
+		c->recvd++;
+		c->rxoff += nl - p + 1;
+		left -= nl - p + 1;
+		p = nl + 1;
+	}
+	memmove(c->in, p, left);
+	c->inlen = left;
+	if (c->inlen == c->insize) {
+		mismatch(c, c->rxoff, "frame too long");
+		c->rxoff += c->inlen;
+		c->inlen = 0;
+	}
+}
+
+static int
+handle_conn(struct pollfd *pfd, struct conn *c)
+{
+	ssize_t len;
+
+	if ((pfd->revents & POLLNVAL))
+		errx(1, "bad fd %d", pfd->fd);
+	if (pfd->revents & POLLOUT) {
+		len = write(pfd->fd, c->out + c->outoff, c->outlen - c->outoff);
+		if (len == -1) {
+			if (errno != EINTR && errno != EAGAIN) {
+				/* with a pool, it's just one server down */
+				if (!pooled)
+					err(1, "connection %d: write failed",
+					    c->id);
+				warn("connection %d: write failed", c->id);
+				return 0;
+			}
+		} else
+			c->outoff += len;
+	}
+	if (pfd->revents & (POLLIN | POLLHUP | POLLERR)) {
+		len = read(pfd->fd, c->in + c->inlen, c->insize - c->inlen);
+		if (len == -1) {
+			if (errno != EINTR && errno != EAGAIN) {
+				if (!pooled)
+					err(1, "connection %d: read failed",
+					    c->id);
+				warn("connection %d: read failed", c->id);
+				return 0;
+			}
+		} else if (len == 0) {
+			warnx("connection %d: closed after %u frames", c->id,
+			    c->recvd);
+			return 0;
+		} else {
+			rxbytes += len;
+			c->inlen += len;
+			conn_input(c);
+		}
+	}
+	if (!pooled) {
+		if (c->recvd == nframes)
+			return 0;
+		conn_fill(c);
+	}
+	pfd->events = POLLIN;
+	if (c->outoff < c->outlen)
+		pfd->events |= POLLOUT;
+	return 1;
+}
+
+/* Connect to a server, returning a non-blocking socket or -1 */
+static int
+dial(const struct addrinfo *res, int timeout_ms)
+{
+	int fd, sflags;
+
+	if ((fd = connrace(res, CONNRACE_DELAY, timeout_ms)) == -1)
+		return -1;
+	if ((sflags = fcntl(fd, F_GETFL)) < 0)
+		err(1, "fcntl failed");
+	if (fcntl(fd, F_SETFL, sflags | O_NONBLOCK) < 0)
+		err(1, "fcntl failed");
+	return fd;
+}
+
+/* Queue frames on the pool's servers until we have a window full */
+static void
+dispatch(void)
+{
+	int i;
+
+	while (issued < total && inflight < window) {
+		if ((i = pool_pick(&pool)) == -1)
+			break;
+		conn_queue(&conns[i]);
+		pool_sent(&pool, i);
+		issued++;
+		inflight++;
+		pollfds[i].events |= POLLOUT;
+	}
+}
+
+/*
+ * Give up on a pooled server's connection, ejecting the server. The
+ * frames it hadn't answered will be sent again, to someone else.
+ */
+static void
+conn_lost(int i, const struct timespec *now)
+{
+	struct conn *c = &conns[i];
+	uint32_t n = c->sent - c->recvd;
+
+	close(pollfds[i].fd);
+	pollfds[i].fd = -1;
+	issued -= n;
+	inflight -= n;
+	retried += n;
+	pool.ep[i].outstanding = 0;
+	pool_eject(&pool, i, now);
+}
+
+/*
+ * Eject servers sitting on a frame for longer than health ms, and try
+ * to connect again to those whose ejection has run out. A reconnect
+ * is raced a step at a time on each pass, so a server that doesn't
+ * answer it holds up nobody while the others are busy.
+ */
+static void
+pool_health(struct addrinfo **res)
+{
+	struct timespec now, *oldest;
+	struct endpoint *ep;
+	struct conn *c;
+	long long age;
+	int i, fd, hopeless = 1;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	for (i = 0; i < pool.n; i++) {
+		if (pollfds[i].fd != -1 ||
+		    pool.ep[i].backoff < POOL_EJECT_MAX)
+			hopeless = 0;
+	}
+	if (hopeless)
+		errx(1, "can't connect to any server");
+	for (i = 0; i < pool.n; i++) {
+		c = &conns[i];
+		ep = &pool.ep[i];
+		if (!ep->ejected) {
+			if (c->sent == c->recvd)
+				continue;
+			oldest = &c->queued[c->recvd % window];
+			age = (now.tv_sec - oldest->tv_sec) * 1000LL +
+			    (now.tv_nsec - oldest->tv_nsec) / 1000000;
+			if (age > health) {
+				warnx("%s %s: no answer in %lld ms, ejecting",
+				    ep->host, ep->port, health);
+				conn_lost(i, &now);
+			}
+			continue;
+		}
+		if (!c->racing) {
+			if (!pool_recheck(&pool, i, &now))
+				continue;
+			connrace_start(&races[i], res[i], CONNRACE_DELAY,
+			    health);
+			c->racing = 1;
+		}
+		if ((fd = connrace_step(&races[i])) == CONNRACE_PENDING)
+			continue;
+		c->racing = 0;
+		if (fd == -1) {
+			pool_eject(&pool, i, &now);
+			continue;
+		}
+		conn_reset(c);
+		pollfds[i].fd = fd;
+		pollfds[i].events = POLLIN;
+		pool_reinstate(&pool, i);
+	}
+}
+
+int main(int argc, char **argv) {
+
+	struct addrinfo hints, **res;
+	struct timespec start, end, now;
+	struct endpoint *ep;
+	int ch, i, error, active, nservers, nfds;
+	double secs;
+
+	while ((ch = getopt(argc, argv, "c:d:DH:n:rs:")) != -1) {
+		switch (ch) {
+		case 'c':
+			nconns = getnum(optarg, 1, 65536);
+			break;
+		case 'd':
+			depth = getnum(optarg, 1, 1024);
+			break;
+		case 'D':
+			debug = 1;
+			break;
+		case 'H':
+			health = getnum(optarg, 1, 3600000);
+			break;
+		case 'n':
+			nframes = getnum(optarg, 1, UINT32_MAX);
+			break;
+		case 'r':
+			pool.random = 1;
+			break;
+		case 's':
+			size = getnum(optarg, 1, MAXPAYLOAD);
+			break;
+		default:
+			usage();
+		}
+	}
+	argc -= optind;
+	argv += optind;
+	if (argc < 2 || argc % 2 != 0)
+		usage();
+	nservers = argc / 2;
+	pooled = nservers > 1;
+
+	if ((res = calloc(nservers, sizeof(*res))) == NULL)
+		err(1, "calloc");
+	bzero(&hints, sizeof(hints));
+	hints.ai_family = AF_UNSPEC;
+	hints.ai_socktype = SOCK_STREAM;
+	for (i = 0; i < nservers; i++) {
+		if ((error = getaddrinfo(argv[2 * i], argv[2 * i + 1], &hints,
+		    &res[i]))) {
+			fprintf(stderr, "%s %s: %s\n", argv[2 * i],
+			    argv[2 * i + 1], gai_strerror(error));
+			usage();
+		}
+	}
+
+	if (pooled) {
+		/* the whole window can end up on one server */
+		if ((long long)nconns * depth > 65536)
+			errx(1, "at most 65536 frames in flight with a pool");
+		window = nconns * depth;
+		total = (unsigned long long)nconns * nframes;
+		nfds = nservers;
+		pool_init(&pool, nservers);
+		if ((races = calloc(nservers, sizeof(*races))) == NULL)
+			err(1, "calloc");
+	} else {
+		window = depth;
+		nfds = nconns;
+	}
+	if ((conns = calloc(nfds, sizeof(*conns))) == NULL ||
+	    (pollfds = calloc(nfds, sizeof(*pollfds))) == NULL)
+		err(1, "calloc");
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	for (i = 0; i < nfds; i++) {
+		conn_init(&conns[i], i);
+		pollfds[i].events = POLLIN | POLLOUT;
+		if (!pooled) {
+			if ((pollfds[i].fd = dial(res[0], 0)) == -1)
+				err(1, "connect failed");
+			conn_fill(&conns[i]);
+			continue;
+		}
+		ep = &pool.ep[i];
+		ep->host = argv[2 * i];
+		ep->port = argv[2 * i + 1];
+		if ((pollfds[i].fd = dial(res[i], health)) == -1) {
+			warn("%s %s: connect failed", ep->host, ep->port);
+			pool_eject(&pool, i, &now);
+		}
+	}
+	if (debug)
+		fprintf(stderr, "crc32c: using %s, framing: using %s\n",
+		    crc32c_impl(), frame_impl());
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	active = nfds;
+	if (pooled)
+		dispatch();
+	while (pooled ? answered < total : active > 0) {
+		/* with a pool we wake up now and then for health checks */
+		if (poll(pollfds, nfds, pooled ? 50 : -1) == -1) {
+			if (errno == EINTR)
+				continue;
+			err(1, "poll failed");
+		}
+		clock_gettime(CLOCK_MONOTONIC, &now);
+		for (i = 0; i < nfds; i++) {
+			if (pollfds[i].fd == -1 || pollfds[i].revents == 0)
+				continue;
+			if (handle_conn(&pollfds[i], &conns[i]))
+				continue;
+			if (pooled)
+				conn_lost(i, &now);
+			else {
+				close(pollfds[i].fd);
+				pollfds[i].fd = -1;
+				active--;
+			}
+		}
+		if (pooled) {
+			pool_health(res);
+			dispatch();
+		}
+	}
+	clock_gettime(CLOCK_MONOTONIC, &end);
+
+	secs = (end.tv_sec - start.tv_sec) +
+	    (end.tv_nsec - start.tv_nsec) / 1e9;
+	printf("%d connections, %llu bytes echoed in %.3f seconds, "
+	    "%.1f Mbit/s, %llu mismatches\n", nfds, rxbytes, secs,
+	    secs > 0 ? rxbytes * 8 / secs / 1e6 : 0.0, mismatches);
+	printf("%llu frames, latency usec p50 <= %llu, p99 <= %llu, "
+	    "p99.9 <= %llu, max %llu\n", lat_count, latency_percentile(50),
+	    latency_percentile(99), latency_percentile(99.9), lat_max);
+	if (pooled) {
+		if (retried > 0)
+			printf("%llu frames sent again after their server "
+			    "failed\n", retried);
+		for (i = 0; i < pool.n; i++) {
+			ep = &pool.ep[i];
+			printf("server %s %s: %llu frames, latency %.0f usec, "
+			    "ejected %llu times\n", ep->host, ep->port,
+			    ep->requests, ep->latency, ep->ejections);
+		}
+	}
+
+	for (i = 0; i < nservers; i++)
+		freeaddrinfo(res[i]);
+	free(res);
+	return mismatches ? 1 : 0;
+}
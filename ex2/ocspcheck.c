@@ -0,0 +1,770 @@
+/*
+ * Copyright (c) 2018 Bob Beck <beck@obtuse.com>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/*
+ * Nonblocking OCSP checks with a cache. See ocspcheck.h.
+ *
+ * The cache is a fixed table of entries, found by hashing the serial
+ * and probing a few slots along. An entry is queued when a check
+ * starts, querying once it gets one of the query slots, and done when
+ * we have the answer or have given up. Only done entries are ever
+ * thrown out to make room, so an id handed out stays good until the
+ * server has seen the verdict. We only take client certificates from
+ * the one CA, so the serial alone is the key.
+ *
+ * Responder names are looked up by a helper process, since
+ * getaddrinfo() can't be asked not to wait. We send it a struct lookup
+ * and it answers with a struct answer, each written all at once.
+ */
+
+#include <sys/types.h>
+#include <sys/socket.h>
+
+#include <openssl/bio.h>
+#include <openssl/ocsp.h>
+#include <openssl/pem.h>
+#include <openssl/x509.h>
+#include <openssl/x509v3.h>
+
+#include <err.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <netdb.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "ocspcheck.h"
+
+#define CACHE_SIZE 1024
+#define CACHE_PROBE 8
+#define MAXRESPONDERS 8
+#define MAXADDRS 8		/* of a responder we'll try */
+#define MAXRESPONSE 65536
+#define QUERY_TIMEOUT 5		/* seconds we give a responder */
+#define FAILED_TTL 10		/* seconds we remember having no answer */
+#define NONEXT_TTL 60		/* for answers without a nextUpdate */
+#define CLOCK_SKEW 300
+#define LOOKUP_RETRY 1		/* seconds before a failed lookup is retried */
+#define LOOKUP_RETRY_MAX 300	/* doubling each time it fails again */
+
+#define E_FREE 0
+#define E_QUEUED 1
+#define E_QUERYING 2
+#define E_DONE 3
+
+#define RS_NEW 0		/* not looked up yet */
+#define RS_LOOKUP 1		/* the helper is looking it up */
+#define RS_FOUND 2
+#define RS_FAILED 3		/* until it's time to try again */
+
+struct entry {
+	int state;
+	int verdict;		/* once done */
+	time_t expires;		/* and until when */
+	char serial[48];	/* hex */
+	OCSP_CERTID *cid;	/* while we are asking */
+	int responder;
+};
+
+struct address {
+	int family, socktype, protocol;
+	socklen_t len;
+	struct sockaddr_storage ss;
+};
+
+struct responder {
+	char host[256];
+	char port[8];
+	char path[256];
+	int state;
+	struct address addrs[MAXADDRS];
+	int naddrs;
+	time_t deadline;	/* for the lookup */
+	time_t retry;		/* when RS_FAILED, when to look it up again */
+	int backoff;		/* seconds until the next retry after that */
+};
+
+struct lookup {
+	int32_t responder;
+	char host[256];
+	char port[8];
+};
+
+struct answer {
+	int32_t responder;
+	int32_t naddrs;		/* 0 if the lookup failed */
+	struct address addrs[MAXADDRS];
+};
+
+struct query {
+	int entry;		/* -1 if the slot is free */
+	int fd;
+	int addr;		/* the responder address we are trying */
+	int connecting;
+	unsigned char *out;
+	size_t outlen, outoff;
+	unsigned char *in;
+	size_t inlen;
+	time_t deadline;
+};
+
+static struct entry cache[CACHE_SIZE];
+static struct responder responders[MAXRESPONDERS];
+static int nresponders, nqueued;
+static struct query queries[OCSPCHECK_QUERIES];
+static X509_STORE *store;
+static int fail_open;
+static struct ocspcheck_stats stats;
+static int helper_fd = -1;	/* our end of the socket to the helper */
+static int nlookups;		/* it hasn't answered yet */
+
+static int
+xfer(int fd, void *buf, size_t len, int out)
+{
+	unsigned char *p = buf;
+	ssize_t n;
+
+	while (len > 0) {
+		n = out ? write(fd, p, len) : read(fd, p, len);
+		if (n == -1 && errno == EINTR)
+			continue;
+		if (n <= 0)
+			return -1;
+		p += n;
+		len -= n;
+	}
+	return 0;
+}
+
+/* The helper: look names up until the server goes away */
+static void
+helper(int fd)
+{
+	struct addrinfo hints, *res, *ai;
+	struct address *a;
+	struct lookup lookup;
+	struct answer answer;
+
+	memset(&hints, 0, sizeof(hints));
+	hints.ai_family = AF_UNSPEC;
+	hints.ai_socktype = SOCK_STREAM;
+	while (xfer(fd, &lookup, sizeof(lookup), 0) == 0) {
+		memset(&answer, 0, sizeof(answer));
+		answer.responder = lookup.responder;
+		lookup.host[sizeof(lookup.host) - 1] = '\0';
+		lookup.port[sizeof(lookup.port) - 1] = '\0';
+		if (getaddrinfo(lookup.host, lookup.port, &hints, &res) == 0) {
+			for (ai = res; ai != NULL && answer.naddrs < MAXADDRS;
+			    ai = ai->ai_next) {
+				if (ai->ai_addrlen > sizeof(a->ss))
+					continue;
+				a = &answer.addrs[answer.naddrs++];
+				a->family = ai->ai_family;
+				a->socktype = ai->ai_socktype;
+				a->protocol = ai->ai_protocol;
+				a->len = ai->ai_addrlen;
+				memcpy(&a->ss, ai->ai_addr, ai->ai_addrlen);
+			}
+			freeaddrinfo(res);
+		}
+		if (xfer(fd, &answer, sizeof(answer), 1) == -1)
+			break;
+	}
+	_exit(0);
+}
+
+int
+ocspcheck_init(const char *cafile, int open)
+{
+	pid_t pid;
+	int i, sv[2];
+
+	fail_open = open;
+	for (i = 0; i < OCSPCHECK_QUERIES; i++) {
+		queries[i].entry = -1;
+		queries[i].fd = -1;
+	}
+	if ((store = X509_STORE_new()) == NULL ||
+	    X509_STORE_load_locations(store, cafile, NULL) != 1) {
+		warnx("%s: can't load CA certificates for OCSP", cafile);
+		return -1;
+	}
+	if (socketpair(AF_UNIX, SOCK_STREAM, 0, sv) == -1) {
+		warn("socketpair");
+		return -1;
+	}
+	if ((pid = fork()) == -1) {
+		warn("fork");
+		close(sv[0]);
+		close(sv[1]);
+		return -1;
+	}
+	if (pid == 0) {
+		close(sv[0]);
+		helper(sv[1]);
+	}
+	close(sv[1]);
+	helper_fd = sv[0];
+	return 0;
+}
+
+static uint32_t
+hash(const char *s)
+{
+	uint32_t h = 2166136261U;
+
+	while (*s != '\0') {
+		h ^= (unsigned char)*s++;
+		h *= 16777619U;
+	}
+	return h;
+}
+
+/* Give up on getting an answer, and let the policy decide */
+static void
+entry_failed(struct entry *e, time_t now)
+{
+	e->state = E_DONE;
+	e->verdict = fail_open ? OCSPCHECK_ACCEPT : OCSPCHECK_REJECT;
+	e->expires = now + FAILED_TTL;
+	OCSP_CERTID_free(e->cid);
+	e->cid = NULL;
+	stats.failures++;
+}
+
+/* Give up on the checks queued for a responder we can't reach */
+static void
+responder_failed(int i, time_t now)
+{
+	int j;
+
+	for (j = 0; j < CACHE_SIZE && nqueued > 0; j++) {
+		if (cache[j].state == E_QUEUED && cache[j].responder == i) {
+			entry_failed(&cache[j], now);
+			nqueued--;
+		}
+	}
+}
+
+/*
+ * Can a check wait on this responder? It can if we know where it is,
+ * or are finding out. A lookup that failed isn't tried again until
+ * its backoff is up, and meanwhile checks fail straight away.
+ */
+static int
+responder_ready(int i, time_t now)
+{
+	struct responder *r = &responders[i];
+	struct lookup lookup;
+
+	switch (r->state) {
+	case RS_FOUND:
+	case RS_LOOKUP:
+		return i;
+	case RS_FAILED:
+		if (now < r->retry)
+			return -1;
+		break;
+	}
+	memset(&lookup, 0, sizeof(lookup));
+	lookup.responder = i;
+	memcpy(lookup.host, r->host, sizeof(lookup.host));
+	memcpy(lookup.port, r->port, sizeof(lookup.port));
+	if (xfer(helper_fd, &lookup, sizeof(lookup), 1) == -1)
+		errx(1, "OCSP lookup helper went away");
+	r->state = RS_LOOKUP;
+	r->deadline = now + QUERY_TIMEOUT;
+	nlookups++;
+	return i;
+}
+
+/*
+ * We couldn't find out where a responder is, or not in time. Checks
+ * waiting on it fail, as do new ones until it's time to try again.
+ */
+static void
+lookup_failed(int i, time_t now)
+{
+	struct responder *r = &responders[i];
+
+	r->state = RS_FAILED;
+	r->retry = now + r->backoff;
+	if ((r->backoff *= 2) > LOOKUP_RETRY_MAX)
+		r->backoff = LOOKUP_RETRY_MAX;
+	responder_failed(i, now);
+}
+
+/*
+ * The helper has answered, the socket is readable. A late answer
+ * still counts, if we gave up on it.
+ */
+static void
+responder_answer(time_t now)
+{
+	struct responder *r;
+	struct answer answer;
+
+	if (xfer(helper_fd, &answer, sizeof(answer), 0) == -1)
+		errx(1, "OCSP lookup helper went away");
+	if (answer.responder < 0 || answer.responder >= nresponders ||
+	    answer.naddrs < 0 || answer.naddrs > MAXADDRS)
+		errx(1, "OCSP lookup helper is talking nonsense");
+	nlookups--;
+	r = &responders[answer.responder];
+	if (answer.naddrs > 0) {
+		memcpy(r->addrs, answer.addrs, sizeof(r->addrs));
+		r->naddrs = answer.naddrs;
+		r->state = RS_FOUND;
+		r->backoff = LOOKUP_RETRY;
+	} else if (r->state == RS_LOOKUP)
+		lookup_failed(answer.responder, now);
+}
+
+/*
+ * Find the responder for a URL, having the helper look its name up
+ * the first time we see it. Only plain http, which is all OCSP needs.
+ */
+static int
+responder_find(const char *url, time_t now)
+{
+	struct responder *r;
+	char host[256], port[8] = "80", path[256] = "/";
+	const char *p, *slash, *colon;
+	size_t len;
+	int i;
+
+	if (strncmp(url, "http://", 7) != 0)
+		return -1;
+	p = url + 7;
+	if ((slash = strchr(p, '/')) == NULL)
+		slash = p + strlen(p);
+	else if (snprintf(path, sizeof(path), "%s", slash) >=
+	    (int)sizeof(path))
+		return -1;
+	if ((colon = memchr(p, ':', slash - p)) != NULL) {
+		len = slash - colon - 1;
+		if (len == 0 || len >= sizeof(port))
+			return -1;
+		memcpy(port, colon + 1, len);
+		port[len] = '\0';
+	} else
+		colon = slash;
+	len = colon - p;
+	if (len == 0 || len >= sizeof(host))
+		return -1;
+	memcpy(host, p, len);
+	host[len] = '\0';
+
+	for (i = 0; i < nresponders; i++) {
+		r = &responders[i];
+		if (strcmp(r->host, host) == 0 && strcmp(r->port, port) == 0 &&
+		    strcmp(r->path, path) == 0)
+			return responder_ready(i, now);
+	}
+	if (nresponders == MAXRESPONDERS)
+		return -1;
+	r = &responders[nresponders];
+	memcpy(r->host, host, sizeof(host));
+	memcpy(r->port, port, sizeof(port));
+	memcpy(r->path, path, sizeof(path));
+	r->state = RS_NEW;
+	r->backoff = LOOKUP_RETRY;
+	return responder_ready(nresponders++, now);
+}
+
+/* Find the entry for a serial, or somewhere to put it */
+static int
+cache_slot(const char *serial, time_t now)
+{
+	uint32_t h = hash(serial);
+	int i, slot, victim = -1;
+
+	for (i = 0; i < CACHE_PROBE; i++) {
+		slot = (h + i) % CACHE_SIZE;
+		if (cache[slot].state != E_FREE &&
+		    strcmp(cache[slot].serial, serial) == 0)
+			return slot;
+	}
+	for (i = 0; i < CACHE_PROBE; i++) {
+		slot = (h + i) % CACHE_SIZE;
+		if (cache[slot].state == E_FREE ||
+		    (cache[slot].state == E_DONE &&
+		    cache[slot].expires <= now))
+			return slot;
+		if (cache[slot].state == E_DONE && (victim == -1 ||
+		    cache[slot].expires < cache[victim].expires))
+			victim = slot;
+	}
+	return victim;
+}
+
+int
+ocspcheck_start(const uint8_t *pem, size_t len, int *verdict)
+{
+	STACK_OF(OPENSSL_STRING) *urls = NULL;
+	X509_STORE_CTX *sctx = NULL;
+	X509 *leaf = NULL, *issuer = NULL;
+	const ASN1_INTEGER *ai;
+	const unsigned char *sp;
+	struct entry *e, failed;
+	char serial[sizeof(e->serial)];
+	time_t now = time(NULL);
+	BIO *bio;
+	int i, n, id = -1;
+
+	*verdict = OCSPCHECK_PENDING;
+	memset(&failed, 0, sizeof(failed));
+	e = &failed;
+
+	if ((bio = BIO_new_mem_buf(pem, len)) == NULL)
+		goto done;
+	leaf = PEM_read_bio_X509(bio, NULL, NULL, NULL);
+	BIO_free(bio);
+	if (leaf == NULL)
+		goto done;
+	ai = X509_get0_serialNumber(leaf);
+	sp = ASN1_STRING_get0_data(ai);
+	n = ASN1_STRING_length(ai);
+	if (n <= 0 || n * 2 >= (int)sizeof(serial))
+		goto done;
+	for (i = 0; i < n; i++)
+		snprintf(serial + i * 2, 3, "%02X", sp[i]);
+
+	if ((id = cache_slot(serial, now)) == -1)
+		goto done;	/* every slot nearby is busy */
+	e = &cache[id];
+	if (e->state != E_FREE && strcmp(e->serial, serial) == 0) {
+		if (e->state != E_DONE) {
+			stats.coalesced++;
+			goto done;
+		}
+		if (e->expires > now) {
+			stats.hits++;
+			*verdict = e->verdict;
+			id = -1;
+			goto done;
+		}
+	}
+
+	/* a new question, or an answer that has gone stale */
+	memset(e, 0, sizeof(*e));
+	memcpy(e->serial, serial, sizeof(serial));
+	if ((sctx = X509_STORE_CTX_new()) == NULL ||
+	    !X509_STORE_CTX_init(sctx, store, leaf, NULL) ||
+	    X509_STORE_CTX_get1_issuer(&issuer, sctx, leaf) != 1 ||
+	    (urls = X509_get1_ocsp(leaf)) == NULL ||
+	    sk_OPENSSL_STRING_num(urls) < 1 ||
+	    (e->responder = responder_find(sk_OPENSSL_STRING_value(urls,
+	    0), now)) == -1 ||
+	    (e->cid = OCSP_cert_to_id(NULL, leaf, issuer)) == NULL) {
+		entry_failed(e, now);
+		*verdict = e->verdict;
+		id = -1;
+		goto done;
+	}
+	e->state = E_QUEUED;
+	nqueued++;
+ done:
+	if (e == &failed) {
+		/* nothing we could even ask about */
+		entry_failed(e, now);
+		*verdict = e->verdict;
+		id = -1;
+	}
+	X509_email_free(urls);
+	X509_STORE_CTX_free(sctx);
+	X509_free(issuer);
+	X509_free(leaf);
+	return id;
+}
+
+int
+ocspcheck_verdict(int id)
+{
+	return cache[id].state == E_DONE ? cache[id].verdict :
+	    OCSPCHECK_PENDING;
+}
+
+static void
+query_close(struct query *q)
+{
+	if (q->fd != -1)
+		close(q->fd);
+	free(q->out);
+	free(q->in);
+	q->fd = -1;
+	q->out = q->in = NULL;
+	q->outlen = q->outoff = q->inlen = 0;
+	q->entry = -1;
+}
+
+/* Try to connect to the next of the responder's addresses */
+static int
+query_connect(struct query *q)
+{
+	struct responder *r = &responders[cache[q->entry].responder];
+	struct address *a;
+	int flags;
+
+	for (; q->addr < r->naddrs; q->addr++) {
+		a = &r->addrs[q->addr];
+		if (q->fd != -1)
+			close(q->fd);
+		if ((q->fd = socket(a->family, a->socktype,
+		    a->protocol)) == -1)
+			continue;
+		if ((flags = fcntl(q->fd, F_GETFL)) == -1 ||
+		    fcntl(q->fd, F_SETFL, flags | O_NONBLOCK) == -1)
+			continue;
+		if (connect(q->fd, (struct sockaddr *)&a->ss, a->len) == 0 ||
+		    errno == EINPROGRESS) {
+			q->connecting = 1;
+			return 0;
+		}
+	}
+	return -1;
+}
+
+static void
+query_start(struct query *q, int id, time_t now)
+{
+	struct entry *e = &cache[id];
+	struct responder *r = &responders[e->responder];
+	OCSP_REQUEST *req;
+	OCSP_CERTID *cid;
+	unsigned char *der = NULL;
+	char hdr[600];
+	int hlen, len = 0;
+
+	q->entry = id;
+	e->state = E_QUERYING;
+	nqueued--;
+	stats.queries++;
+	/* no nonce, the answer is meant to be cached */
+	if ((req = OCSP_REQUEST_new()) == NULL ||
+	    (cid = OCSP_CERTID_dup(e->cid)) == NULL ||
+	    OCSP_request_add0_id(req, cid) == NULL ||
+	    (len = i2d_OCSP_REQUEST(req, &der)) <= 0)
+		goto fail;
+	hlen = snprintf(hdr, sizeof(hdr), "POST %s HTTP/1.0\r\n"
+	    "Host: %s\r\n"
+	    "Content-Type: application/ocsp-request\r\n"
+	    "Content-Length: %d\r\n\r\n", r->path, r->host, len);
+	if (hlen < 0 || hlen >= (int)sizeof(hdr) ||
+	    (q->out = malloc(hlen + len)) == NULL)
+		goto fail;
+	memcpy(q->out, hdr, hlen);
+	memcpy(q->out + hlen, der, len);
+	q->outlen = hlen + len;
+	q->deadline = now + QUERY_TIMEOUT;
+	q->addr = 0;
+	if (query_connect(q) == -1)
+		goto fail;
+	OPENSSL_free(der);
+	OCSP_REQUEST_free(req);
+	return;
+ fail:
+	OPENSSL_free(der);
+	OCSP_REQUEST_free(req);
+	entry_failed(e, now);
+	query_close(q);
+}
+
+int
+ocspcheck_events(struct pollfd *pfds)
+{
+	struct query *q;
+	time_t now = time(NULL);
+	int i, j = 0, ms, timeout = -1;
+
+	for (i = 0; i < OCSPCHECK_QUERIES; i++) {
+		q = &queries[i];
+		/* anyone waiting for a slot gets this one */
+		while (q->entry == -1 && nqueued > 0 && j < CACHE_SIZE) {
+			if (cache[j].state == E_QUEUED &&
+			    responders[cache[j].responder].state == RS_FOUND)
+				query_start(q, j, now);
+			j++;
+		}
+		pfds[i].fd = q->fd;
+		pfds[i].revents = 0;
+		if (q->entry == -1)
+			continue;
+		pfds[i].events = q->connecting || q->outoff < q->outlen ?
+		    POLLOUT : POLLIN;
+		ms = q->deadline > now ? (q->deadline - now) * 1000 : 0;
+		if (timeout == -1 || ms < timeout)
+			timeout = ms;
+	}
+	/* and the helper's slot, while it has lookups to answer */
+	pfds[i].fd = nlookups > 0 ? helper_fd : -1;
+	pfds[i].events = POLLIN;
+	pfds[i].revents = 0;
+	for (i = 0; i < nresponders; i++) {
+		if (responders[i].state != RS_LOOKUP)
+			continue;
+		ms = responders[i].deadline > now ?
+		    (responders[i].deadline - now) * 1000 : 0;
+		if (timeout == -1 || ms < timeout)
+			timeout = ms;
+	}
+	return timeout;
+}
+
+static time_t
+asn1_time(const ASN1_GENERALIZEDTIME *t)
+{
+	struct tm tm;
+
+	if (!ASN1_TIME_to_tm(t, &tm))
+		return -1;
+	return timegm(&tm);
+}
+
+/*
+ * Make sense of the HTTP response to a query. Returns 0 if it wasn't
+ * an answer we can use.
+ */
+static int
+query_answer(struct query *q, time_t now)
+{
+	struct entry *e = &cache[q->entry];
+	ASN1_GENERALIZEDTIME *thisupd, *nextupd;
+	OCSP_BASICRESP *bs = NULL;
+	OCSP_RESPONSE *resp = NULL;
+	const unsigned char *p;
+	unsigned char *body;
+	int status, reason, ok = 0;
+
+	if (q->inlen < 12 || memcmp(q->in, "HTTP/1.", 7) != 0 ||
+	    memcmp(q->in + 8, " 200", 4) != 0)
+		return 0;
+	q->in[q->inlen] = '\0';
+	if ((body = (unsigned char *)strstr((char *)q->in,
+	    "\r\n\r\n")) == NULL)
+		return 0;
+	p = body + 4;
+	if ((resp = d2i_OCSP_RESPONSE(NULL, &p, q->in + q->inlen - p)) ==
+	    NULL || OCSP_response_status(resp) !=
+	    OCSP_RESPONSE_STATUS_SUCCESSFUL ||
+	    (bs = OCSP_response_get1_basic(resp)) == NULL ||
+	    OCSP_basic_verify(bs, NULL, store, 0) <= 0 ||
+	    !OCSP_resp_find_status(bs, e->cid, &status, &reason, NULL,
+	    &thisupd, &nextupd) ||
+	    !OCSP_check_validity(thisupd, nextupd, CLOCK_SKEW, -1))
+		goto done;
+
+	switch (status) {
+	case V_OCSP_CERTSTATUS_GOOD:
+		stats.good++;
+		e->verdict = OCSPCHECK_ACCEPT;
+		break;
+	case V_OCSP_CERTSTATUS_REVOKED:
+		stats.revoked++;
+		e->verdict = OCSPCHECK_REJECT;
+		break;
+	default:
+		/* the responder can't tell us either */
+		stats.unknown++;
+		goto done;
+	}
+	e->state = E_DONE;
+	if (nextupd == NULL || (e->expires = asn1_time(nextupd)) == -1)
+		e->expires = now + NONEXT_TTL;
+	OCSP_CERTID_free(e->cid);
+	e->cid = NULL;
+	ok = 1;
+ done:
+	OCSP_BASICRESP_free(bs);
+	OCSP_RESPONSE_free(resp);
+	return ok;
+}
+
+/* Returns 0 when the query is finished with, one way or the other */
+static int
+query_step(struct query *q, short revents, time_t now)
+{
+	unsigned char *p;
+	socklen_t len = sizeof(int);
+	ssize_t n;
+	int error;
+
+	if (q->connecting) {
+		if (getsockopt(q->fd, SOL_SOCKET, SO_ERROR, &error,
+		    &len) == -1 || error != 0) {
+			q->addr++;
+			return query_connect(q) == 0;
+		}
+		q->connecting = 0;
+	}
+	if (q->outoff < q->outlen) {
+		n = write(q->fd, q->out + q->outoff, q->outlen - q->outoff);
+		if (n == -1)
+			return errno == EINTR || errno == EAGAIN;
+		q->outoff += n;
+		return 1;
+	}
+	if (!(revents & (POLLIN | POLLHUP)))
+		return 1;
+	if (q->in == NULL && (q->in = malloc(MAXRESPONSE + 1)) == NULL)
+		return 0;
+	p = q->in + q->inlen;
+	if ((n = read(q->fd, p, MAXRESPONSE - q->inlen)) == -1)
+		return errno == EINTR || errno == EAGAIN;
+	q->inlen += n;
+	if (n > 0 && q->inlen < MAXRESPONSE)
+		return 1;
+	/* HTTP/1.0, the responder closes when it's done */
+	if (!query_answer(q, now))
+		entry_failed(&cache[q->entry], now);
+	return 0;
+}
+
+void
+ocspcheck_run(struct pollfd *pfds)
+{
+	struct query *q;
+	time_t now = time(NULL);
+	int i;
+
+	if (pfds[OCSPCHECK_QUERIES].revents != 0)
+		responder_answer(now);
+	for (i = 0; i < nresponders; i++)
+		if (responders[i].state == RS_LOOKUP &&
+		    now >= responders[i].deadline)
+			lookup_failed(i, now);
+	for (i = 0; i < OCSPCHECK_QUERIES; i++) {
+		q = &queries[i];
+		if (q->entry == -1)
+			continue;
+		/* a responder that keeps trickling still runs out of time */
+		if (now < q->deadline && (pfds[i].revents == 0 ||
+		    query_step(q, pfds[i].revents, now)))
+			continue;
+		if (cache[q->entry].state != E_DONE)
+			entry_failed(&cache[q->entry], now);
+		query_close(q);
+	}
+}
+
+void
+ocspcheck_get_stats(struct ocspcheck_stats *s)
+{
+	*s = stats;
+}
@@ -0,0 +1,87 @@
+/*
+ * Copyright (c) 2018 Bob Beck <beck@obtuse.com>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#ifndef OCSPCHECK_H
+#define OCSPCHECK_H
+
+#include <poll.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * OCSP checks of client certificates, done from the server's poll
+ * loop so nothing ever waits on a responder.
+ *
+ * Answers are cached by serial number until the response's nextUpdate.
+ * A certificate that is already being asked about doesn't get another
+ * query, its connection just waits on the one in flight. When we can't
+ * get an answer, the policy decides: fail open lets the client in,
+ * fail closed turns it away.
+ *
+ * Queries are plain HTTP POSTs to the responder in the certificate's
+ * AIA extension, at most OCSPCHECK_QUERIES at once, each with a poll
+ * slot of its own. A responder's name is looked up the first time we
+ * need it, by a helper process with a poll slot of its own, and
+ * remembered. Checks wait on the lookup like they do on a query. If
+ * it fails they get the policy, and so do new ones until the name is
+ * looked up again, a second later and then twice as long each time it
+ * fails again, up to five minutes.
+ */
+
+#define OCSPCHECK_QUERIES 8
+#define OCSPCHECK_SLOTS (OCSPCHECK_QUERIES + 1)	/* and the helper */
+
+#define OCSPCHECK_PENDING 0
+#define OCSPCHECK_ACCEPT 1
+#define OCSPCHECK_REJECT 2
+
+struct ocspcheck_stats {
+	unsigned long long hits;	/* answered from the cache */
+	unsigned long long coalesced;	/* waited on a query in flight */
+	unsigned long long queries;	/* sent to a responder */
+	unsigned long long failures;	/* no usable answer */
+	unsigned long long good, revoked, unknown;
+};
+
+/*
+ * Responses must verify against cafile. This forks the lookup helper.
+ * -1 and warn on failure.
+ */
+int ocspcheck_init(const char *cafile, int fail_open);
+
+/*
+ * Check the first certificate in a PEM chain, the second being its
+ * issuer. Returns an id to wait on with ocspcheck_verdict(), or -1
+ * with *verdict set if we know the answer already.
+ */
+int ocspcheck_start(const uint8_t *pem, size_t len, int *verdict);
+
+/* OCSPCHECK_PENDING until the check started as id is done */
+int ocspcheck_verdict(int id);
+
+/*
+ * Set up OCSPCHECK_SLOTS poll slots for the queries in flight and the
+ * helper, and return how long poll may sleep before something times
+ * out.
+ */
+int ocspcheck_events(struct pollfd *pfds);
+
+/* Move the queries along after poll */
+void ocspcheck_run(struct pollfd *pfds);
+
+void ocspcheck_get_stats(struct ocspcheck_stats *stats);
+
+#endif /* OCSPCHECK_H */
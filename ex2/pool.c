@@ -0,0 +1,175 @@
+/*
+ * Copyright (c) 2018 Bob Beck <beck@obtuse.com>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include <err.h>
+#include <stdlib.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "pool.h"
+
+#define DECAY 0.2	/* weight of a new sample that is faster */
+#define STREAK 100	/* answers in a row that forgive past ejections */
+
+void
+pool_init(struct pool *pool, int n)
+{
+	struct timespec ts;
+	int i;
+
+	if ((pool->ep = calloc(n, sizeof(*pool->ep))) == NULL)
+		err(1, "calloc");
+	pool->n = n;
+	for (i = 0; i < n; i++)
+		pool->ep[i].backoff = POOL_EJECT_MIN;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	pool->rng = (ts.tv_nsec ^ getpid()) | 1;
+}
+
+static uint32_t
+pool_random(struct pool *pool)
+{
+	uint64_t x = pool->rng;
+
+	x ^= x << 13;
+	x ^= x >> 7;
+	x ^= x << 17;
+	pool->rng = x;
+	return x >> 32;
+}
+
+static double
+score(const struct endpoint *ep)
+{
+	/* nothing heard yet counts as fast, so new endpoints get tried */
+	return (ep->outstanding + 1) * (ep->latency > 0 ? ep->latency : 1);
+}
+
+/* The nth endpoint that isn't ejected */
+static int
+nth_healthy(struct pool *pool, int n)
+{
+	int i;
+
+	for (i = 0; i < pool->n; i++)
+		if (!pool->ep[i].ejected && n-- == 0)
+			return i;
+	return -1;
+}
+
+int
+pool_pick(struct pool *pool)
+{
+	int a, b, n;
+
+	if ((n = pool_healthy(pool)) == 0)
+		return -1;
+	if (n == 1)
+		return nth_healthy(pool, 0);
+	a = pool_random(pool) % n;
+	if (pool->random)
+		return nth_healthy(pool, a);
+	b = pool_random(pool) % (n - 1);
+	if (b >= a)
+		b++;
+	a = nth_healthy(pool, a);
+	b = nth_healthy(pool, b);
+	return score(&pool->ep[b]) < score(&pool->ep[a]) ? b : a;
+}
+
+void
+pool_sent(struct pool *pool, int i)
+{
+	pool->ep[i].outstanding++;
+	pool->ep[i].requests++;
+}
+
+void
+pool_answered(struct pool *pool, int i, double usec)
+{
+	struct endpoint *ep = &pool->ep[i];
+
+	if (ep->outstanding > 0)
+		ep->outstanding--;
+	if (usec > ep->latency)
+		ep->latency = usec;
+	else
+		ep->latency += DECAY * (usec - ep->latency);
+	if (!ep->ejected && ++ep->streak == STREAK)
+		ep->backoff = POOL_EJECT_MIN;
+}
+
+void
+pool_dropped(struct pool *pool, int i)
+{
+	struct endpoint *ep = &pool->ep[i];
+
+	if (ep->outstanding > 0)
+		ep->outstanding--;
+}
+
+void
+pool_eject(struct pool *pool, int i, const struct timespec *now)
+{
+	struct endpoint *ep = &pool->ep[i];
+
+	ep->ejected = 1;
+	ep->ejections++;
+	ep->streak = 0;
+	ep->until = *now;
+	ep->until.tv_sec += ep->backoff / 1000;
+	ep->until.tv_nsec += (ep->backoff % 1000) * 1000000L;
+	if (ep->until.tv_nsec >= 1000000000L) {
+		ep->until.tv_sec++;
+		ep->until.tv_nsec -= 1000000000L;
+	}
+	if ((ep->backoff *= 2) > POOL_EJECT_MAX)
+		ep->backoff = POOL_EJECT_MAX;
+}
+
+int
+pool_recheck(struct pool *pool, int i, const struct timespec *now)
+{
+	struct endpoint *ep = &pool->ep[i];
+
+	return ep->ejected && (now->tv_sec > ep->until.tv_sec ||
+	    (now->tv_sec == ep->until.tv_sec &&
+	    now->tv_nsec >= ep->until.tv_nsec));
+}
+
+void
+pool_reinstate(struct pool *pool, int i)
+{
+	struct endpoint *ep = &pool->ep[i];
+
+	/*
+	 * It starts again with the latency that got it thrown out,
+	 * which decays as it answers. The backoff only resets once it
+	 * has answered STREAK requests in a row, in pool_answered().
+	 */
+	ep->ejected = 0;
+}
+
+int
+pool_healthy(struct pool *pool)
+{
+	int i, n = 0;
+
+	for (i = 0; i < pool->n; i++)
+		if (!pool->ep[i].ejected)
+			n++;
+	return n;
+}
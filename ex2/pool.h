@@ -0,0 +1,84 @@
+/*
+ * Copyright (c) 2018 Bob Beck <beck@obtuse.com>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#ifndef POOL_H
+#define POOL_H
+
+#include <stdint.h>
+#include <time.h>
+
+/*
+ * Client side load balancing over a pool of server endpoints.
+ *
+ * Each request goes to the better of two endpoints picked at random
+ * ("power of two choices"), where better means a lower score of
+ * (outstanding requests + 1) * latency. Latency is a "peak" moving
+ * average: it jumps straight up to any slower response, and decays
+ * back down as faster ones arrive, so a server that gets slow is
+ * avoided at once, but has to prove itself to get traffic back.
+ *
+ * An endpoint that fails a health check (its connection breaks, or a
+ * request takes longer than the caller will wait) is ejected and gets
+ * no requests until its backoff runs out. The caller then checks it
+ * again and either reinstates it or ejects it for twice as long.
+ */
+
+#define POOL_EJECT_MIN	250	/* first ejection, in ms */
+#define POOL_EJECT_MAX	30000	/* longest ejection, in ms */
+
+struct endpoint {
+	const char *host;
+	const char *port;
+	unsigned int outstanding;	/* requests sent, not answered */
+	double latency;			/* peak EWMA, in usec */
+	int ejected;
+	struct timespec until;		/* when ejected, until when */
+	int backoff;			/* next ejection, in ms */
+	unsigned int streak;		/* answers since last ejected */
+	unsigned long long requests;	/* requests sent here */
+	unsigned long long ejections;
+};
+
+struct pool {
+	struct endpoint *ep;
+	int n;
+	int random;		/* just pick at random, for comparison */
+	uint64_t rng;
+};
+
+void pool_init(struct pool *pool, int n);
+
+/* Pick an endpoint for the next request, or -1 if all are ejected */
+int pool_pick(struct pool *pool);
+
+/* A request was sent to, or answered in usec by, endpoint i */
+void pool_sent(struct pool *pool, int i);
+void pool_answered(struct pool *pool, int i, double usec);
+/* A request to endpoint i won't be answered, and isn't an answer */
+void pool_dropped(struct pool *pool, int i);
+
+/* Endpoint i failed a health check */
+void pool_eject(struct pool *pool, int i, const struct timespec *now);
+
+/* Is endpoint i ejected and due to be checked again? */
+int pool_recheck(struct pool *pool, int i, const struct timespec *now);
+
+/* Endpoint i passed its check, let it have requests again */
+void pool_reinstate(struct pool *pool, int i);
+
+int pool_healthy(struct pool *pool);
+
+#endif /* POOL_H */
@@ -0,0 +1,255 @@
+/*
+ * Copyright (c) 2018 Bob Beck <beck@obtuse.com>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/*
+ * Benchmark connrace() against trying addresses one at a time, when
+ * some of a server's addresses are dead.
+ *
+ * Everything is on the loopback: a live listener, "black holes" that
+ * drop every SYN (listeners with a full accept queue that we never
+ * accept from, which is what a dead or firewalled host looks like),
+ * and a port with nothing on it, which refuses straight away. We
+ * connect to lists of these and report how long each way takes.
+ */
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include <err.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <netdb.h>
+#include <poll.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "connrace.h"
+
+#define MAXADDRS 8
+
+static void
+usage(void)
+{
+	extern char *__progname;
+
+	fprintf(stderr, "usage: %s [-d delay] [-n iterations] [-t timeout]\n",
+	    __progname);
+	exit(1);
+}
+
+static long long
+getnum(const char *s, long long min, long long max)
+{
+	char *ep;
+	long long n;
+
+	errno = 0;
+	n = strtoll(s, &ep, 10);
+	if (*s == '\0' || *ep != '\0')
+		errx(1, "%s - not a number", s);
+	if (errno == ERANGE || n < min || n > max)
+		errx(1, "%s - value out of range", s);
+	return n;
+}
+
+static double
+now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static int
+listener(int backlog, struct sockaddr_in *sin)
+{
+	socklen_t len = sizeof(*sin);
+	int fd;
+
+	memset(sin, 0, sizeof(*sin));
+	sin->sin_family = AF_INET;
+	sin->sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	if ((fd = socket(AF_INET, SOCK_STREAM, 0)) == -1)
+		err(1, "socket");
+	if (bind(fd, (struct sockaddr *)sin, sizeof(*sin)) == -1)
+		err(1, "bind");
+	if (listen(fd, backlog) == -1)
+		err(1, "listen");
+	if (getsockname(fd, (struct sockaddr *)sin, &len) == -1)
+		err(1, "getsockname");
+	return fd;
+}
+
+/*
+ * A listener we never accept from. Once its queue is full the kernel
+ * drops any more SYNs, so connects to it hang until they time out.
+ */
+static void
+black_hole(struct sockaddr_in *sin)
+{
+	struct pollfd pfd;
+	int fd;
+
+	(void)listener(0, sin);
+	for (;;) {
+		if ((fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK,
+		    0)) == -1)
+			err(1, "socket");
+		if (connect(fd, (struct sockaddr *)sin, sizeof(*sin)) == -1 &&
+		    errno != EINPROGRESS)
+			err(1, "connect");
+		pfd.fd = fd;
+		pfd.events = POLLOUT;
+		if (poll(&pfd, 1, 100) == 0) {
+			close(fd);
+			return;
+		}
+		/* it got in, keep it to fill the queue */
+	}
+}
+
+/* A port with nothing listening on it */
+static void
+refused(struct sockaddr_in *sin)
+{
+	close(listener(1, sin));
+}
+
+/* The old way: each address in turn, giving each timeout_ms */
+static int
+sequential(const struct addrinfo *res, int timeout_ms)
+{
+	const struct addrinfo *ai;
+	struct pollfd pfd;
+	socklen_t len;
+	int fd, error;
+
+	for (ai = res; ai != NULL; ai = ai->ai_next) {
+		if ((fd = socket(ai->ai_family, ai->ai_socktype | SOCK_NONBLOCK,
+		    ai->ai_protocol)) == -1)
+			err(1, "socket");
+		if (connect(fd, ai->ai_addr, ai->ai_addrlen) == 0)
+			return fd;
+		if (errno == EINPROGRESS) {
+			pfd.fd = fd;
+			pfd.events = POLLOUT;
+			len = sizeof(error);
+			if (poll(&pfd, 1, timeout_ms) == 1 &&
+			    getsockopt(fd, SOL_SOCKET, SO_ERROR, &error,
+			    &len) == 0 && error == 0)
+				return fd;
+		}
+		close(fd);
+	}
+	return -1;
+}
+
+int
+main(int argc, char *argv[])
+{
+	static const struct {
+		const char *name;
+		const char *addrs;	/* l live, d dead, r refused */
+	} cases[] = {
+		{ "live", "l" },
+		{ "dead, live", "dl" },
+		{ "refused, live", "rl" },
+		{ "dead, dead, refused, live", "ddrl" },
+		{ "dead x 4, live", "ddddl" },
+	};
+	struct sockaddr_in live, dead[MAXADDRS], gone, *sin;
+	struct addrinfo ai[MAXADDRS];
+	double start, t_seq, t_race;
+	long long delay = CONNRACE_DELAY, iterations = 5, timeout = 1000;
+	size_t c;
+	int ch, fd, i, lfd, nai, ndead, it, fail_seq, fail_race;
+	const char *p;
+
+	while ((ch = getopt(argc, argv, "d:n:t:")) != -1) {
+		switch (ch) {
+		case 'd':
+			delay = getnum(optarg, 0, 60000);
+			break;
+		case 'n':
+			iterations = getnum(optarg, 1, 100000);
+			break;
+		case 't':
+			timeout = getnum(optarg, 1, 600000);
+			break;
+		default:
+			usage();
+		}
+	}
+	if (optind != argc)
+		usage();
+
+	lfd = listener(128, &live);
+	for (i = 0; i < MAXADDRS; i++)
+		black_hole(&dead[i]);
+	refused(&gone);
+
+	printf("%-28s %16s %16s\n", "addresses", "sequential ms",
+	    "connrace ms");
+	for (c = 0; c < sizeof(cases) / sizeof(cases[0]); c++) {
+		memset(ai, 0, sizeof(ai));
+		nai = ndead = 0;
+		for (p = cases[c].addrs; *p != '\0'; p++) {
+			sin = *p == 'l' ? &live : *p == 'r' ? &gone :
+			    &dead[ndead++];
+			ai[nai].ai_family = AF_INET;
+			ai[nai].ai_socktype = SOCK_STREAM;
+			ai[nai].ai_addr = (struct sockaddr *)sin;
+			ai[nai].ai_addrlen = sizeof(*sin);
+			if (nai > 0)
+				ai[nai - 1].ai_next = &ai[nai];
+			nai++;
+		}
+
+		t_seq = t_race = 0;
+		fail_seq = fail_race = 0;
+		for (it = 0; it < iterations; it++) {
+			start = now();
+			if ((fd = sequential(ai, timeout)) == -1)
+				fail_seq++;
+			t_seq += now() - start;
+			if (fd != -1) {
+				close(fd);
+				close(accept(lfd, NULL, NULL));
+			}
+
+			start = now();
+			if ((fd = connrace(ai, delay, 0)) == -1)
+				fail_race++;
+			t_race += now() - start;
+			if (fd != -1) {
+				close(fd);
+				close(accept(lfd, NULL, NULL));
+			}
+		}
+		printf("%-28s %16.1f %16.1f", cases[c].name,
+		    t_seq * 1e3 / iterations, t_race * 1e3 / iterations);
+		if (fail_seq || fail_race)
+			printf("  (%d and %d failed)", fail_seq, fail_race);
+		printf("\n");
+	}
+	return 0;
+}
@@ -0,0 +1,162 @@
+/*
+ * Copyright (c) 2018 Bob Beck <beck@obtuse.com>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/*
+ * The certificate helper. We ask with a byte, and it answers with a
+ * struct reply and then the certificate chain and key, as PEM.
+ */
+
+#include <sys/types.h>
+#include <sys/socket.h>
+
+#include <err.h>
+#include <errno.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "renew.h"
+
+#define MAXPEM 65536
+
+struct reply {
+	int32_t ok;
+	uint32_t cert_len;
+	uint32_t key_len;
+};
+
+static int
+xfer(int fd, void *buf, size_t len, int out)
+{
+	unsigned char *p = buf;
+	ssize_t n;
+
+	while (len > 0) {
+		n = out ? write(fd, p, len) : read(fd, p, len);
+		if (n == -1 && errno == EINTR)
+			continue;
+		if (n <= 0)
+			return -1;
+		p += n;
+		len -= n;
+	}
+	return 0;
+}
+
+static void
+helper(int fd, struct memca *ca, const char *name, int keytype,
+    long long lifetime)
+{
+	struct memca_cred cred;
+	struct reply reply;
+	char c;
+
+	/* the server going away is our cue to go too */
+	while (xfer(fd, &c, 1, 0) == 0) {
+		memset(&reply, 0, sizeof(reply));
+		if (memca_issue(ca, name, MEMCA_SERVER, keytype, lifetime,
+		    &cred) == 0) {
+			reply.ok = 1;
+			reply.cert_len = cred.cert_len;
+			reply.key_len = cred.key_len;
+		}
+		if (xfer(fd, &reply, sizeof(reply), 1) == -1 ||
+		    (reply.ok && (xfer(fd, cred.cert, cred.cert_len, 1) == -1 ||
+		    xfer(fd, cred.key, cred.key_len, 1) == -1)))
+			break;
+		memca_cred_free(&cred);
+	}
+	_exit(0);
+}
+
+int
+renew_start(struct renewer *r, const char *cacert, const char *cakey,
+    const char *root, const char *name, int keytype, long long lifetime)
+{
+	struct memca *ca;
+	int sv[2];
+
+	memset(r, 0, sizeof(*r));
+	r->fd = -1;
+	r->lifetime = lifetime;
+	if (socketpair(AF_UNIX, SOCK_STREAM, 0, sv) == -1) {
+		warn("socketpair");
+		return -1;
+	}
+	if ((r->pid = fork()) == -1) {
+		warn("fork");
+		close(sv[0]);
+		close(sv[1]);
+		return -1;
+	}
+	if (r->pid == 0) {
+		close(sv[0]);
+		if ((ca = memca_load(cacert, cakey, root)) == NULL)
+			errx(1, "can't load the issuing CA from %s and %s",
+			    cacert, cakey);
+		helper(sv[1], ca, name, keytype, lifetime);
+	}
+	close(sv[1]);
+	r->fd = sv[0];
+	return 0;
+}
+
+int
+renew_ask(struct renewer *r)
+{
+	char c = 'c';
+
+	if (xfer(r->fd, &c, 1, 1) == -1)
+		return -1;
+	r->asked = 1;
+	return 0;
+}
+
+int
+renew_collect(struct renewer *r, struct memca_cred *cred)
+{
+	struct reply reply;
+	time_t now = time(NULL);
+
+	memset(cred, 0, sizeof(*cred));
+	r->asked = 0;
+	/* the helper writes it all at once, so this doesn't wait long */
+	if (xfer(r->fd, &reply, sizeof(reply), 0) == -1)
+		errx(1, "certificate helper went away");
+	if (reply.cert_len > MAXPEM || reply.key_len > MAXPEM)
+		errx(1, "certificate helper is talking nonsense");
+	if (!reply.ok) {
+		/* try again in a while, the old one is still good */
+		r->failures++;
+		r->renew_at = now + (r->lifetime / 10 < 60 ?
+		    r->lifetime / 10 : 60);
+		return -1;
+	}
+	cred->cert_len = reply.cert_len;
+	cred->key_len = reply.key_len;
+	if ((cred->cert = malloc(cred->cert_len)) == NULL ||
+	    (cred->key = malloc(cred->key_len)) == NULL)
+		err(1, "malloc");
+	if (xfer(r->fd, cred->cert, cred->cert_len, 0) == -1 ||
+	    xfer(r->fd, cred->key, cred->key_len, 0) == -1)
+		errx(1, "certificate helper went away");
+	r->renewals++;
+	r->expires = now + r->lifetime;
+	r->renew_at = now + r->lifetime * 2 / 3;
+	return 0;
+}
@@ -0,0 +1,60 @@
+/*
+ * Copyright (c) 2018 Bob Beck <beck@obtuse.com>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#ifndef RENEW_H
+#define RENEW_H
+
+#include <sys/types.h>
+
+#include <time.h>
+
+#include "memca.h"
+
+/*
+ * Short lived server certificates, from a helper process.
+ *
+ * renew_start() forks a helper that loads the issuing CA (see
+ * ../CA/memca.h), so its key never lives in the server. The server asks
+ * for a certificate with renew_ask(), and once the helper's socket is
+ * readable picks it up with renew_collect(). Each one is good for
+ * lifetime seconds, and we want the next when two thirds of that has
+ * gone, which leaves plenty of time to try again if the helper fails.
+ */
+
+struct renewer {
+	int fd;			/* our end of the socket to the helper */
+	pid_t pid;
+	long long lifetime;	/* seconds each certificate is good for */
+	time_t expires;		/* when the current one runs out */
+	time_t renew_at;	/* when to ask for the next one */
+	int asked;		/* the helper is working on one */
+	unsigned long long renewals, failures;
+};
+
+/* Start the helper. -1 and warn on failure */
+int renew_start(struct renewer *r, const char *cacert, const char *cakey,
+    const char *root, const char *name, int keytype, long long lifetime);
+
+/* Ask the helper for a new certificate */
+int renew_ask(struct renewer *r);
+
+/*
+ * Collect the certificate the helper made, once its socket is
+ * readable. Returns -1 if it couldn't make one.
+ */
+int renew_collect(struct renewer *r, struct memca_cred *cred);
+
+#endif /* RENEW_H */
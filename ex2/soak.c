@@ -0,0 +1,650 @@
+/*
+ * Copyright (c) 2018 Bob Beck <beck@obtuse.com>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/*
+ * Soak a TLS server for a long time, watching for it to leak.
+ *
+ * Long lived connections echo lines back and forth, and are replaced
+ * with new ones every so often, while other workers open short
+ * connections back to back. With -1 we talk to ex1's server instead,
+ * which says its piece and hangs up, so every connection is a short
+ * one. Each worker is a process of its own using blocking libtls, and
+ * they count what they get done in a shared page.
+ *
+ * Every interval we sample the server process given with -p: its
+ * resident size, open descriptors and zombie children, and given the
+ * echo server's stats socket with -u, how much of its malloc heap is
+ * in use. At the end we compare the last quarter of the run with the
+ * first, after a warmup, and check the server has closed everything
+ * and reaped every child once the load has stopped. Growth beyond the
+ * thresholds fails the run.
+ */
+
+#include <sys/types.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+
+#include <dirent.h>
+#include <err.h>
+#include <errno.h>
+#include <limits.h>
+#include <netdb.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <tls.h>
+#include <unistd.h>
+
+#include "connrace.h"
+
+#define LINELEN 1024
+
+struct counters {
+	unsigned long long short_ok;
+	unsigned long long short_failed;
+	unsigned long long long_conns;	/* long connections tried */
+	unsigned long long long_bytes;
+	unsigned long long long_failed;
+};
+
+struct sample {
+	double when;		/* seconds since the start */
+	long rss;		/* KB */
+	int fds;
+	int zombies;
+	long long heap_inuse;	/* -1 if we don't know */
+	long long heap_free;
+	double short_rate;	/* short connections per second */
+	double long_rate;	/* long connection bytes per second */
+};
+
+static struct counters *counters;
+static struct tls_config *tls_cfg;
+static struct addrinfo *res;
+static const char *host;
+static double deadline;
+static int ex1;
+
+static void
+usage(void)
+{
+	extern char *__progname;
+
+	fprintf(stderr, "usage: %s [-1i] [-C cafile] [-d duration] "
+	    "[-f fds] [-F frag] [-g growth]\n"
+	    "\t[-I interval] [-k lifetime] [-L long] [-p pid] [-S short] "
+	    "[-t drop]\n"
+	    "\t[-u statsocket] host portnumber\n", __progname);
+	exit(1);
+}
+
+static long long
+getnum(const char *s, long long min, long long max)
+{
+	char *ep;
+	long long n;
+
+	errno = 0;
+	n = strtoll(s, &ep, 10);
+	if (*s == '\0' || *ep != '\0')
+		errx(1, "%s - not a number", s);
+	if (errno == ERANGE || n < min || n > max)
+		errx(1, "%s - value out of range", s);
+	return n;
+}
+
+static double
+now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void
+count(unsigned long long *c, unsigned long long n)
+{
+	__atomic_add_fetch(c, n, __ATOMIC_RELAXED);
+}
+
+/*
+ * Connect and handshake, returning NULL if we couldn't.
+ */
+static struct tls *
+soak_connect(int *fdp)
+{
+	struct tls *ctx;
+	int i;
+
+	if ((*fdp = connrace(res, CONNRACE_DELAY, 5000)) == -1)
+		return NULL;
+	if ((ctx = tls_client()) == NULL)
+		errx(1, "tls_client failed");
+	if (tls_configure(ctx, tls_cfg) == -1)
+		errx(1, "tls_configure failed: %s", tls_error(ctx));
+	if (tls_connect_socket(ctx, *fdp, host) == -1)
+		goto bad;
+	do {
+		i = tls_handshake(ctx);
+	} while (i == TLS_WANT_POLLIN || i == TLS_WANT_POLLOUT);
+	if (i == -1)
+		goto bad;
+	return ctx;
+ bad:
+	tls_free(ctx);
+	close(*fdp);
+	return NULL;
+}
+
+static void
+soak_close(struct tls *ctx, int fd)
+{
+	int i;
+
+	do {
+		i = tls_close(ctx);
+	} while (i == TLS_WANT_POLLIN || i == TLS_WANT_POLLOUT);
+	tls_free(ctx);
+	close(fd);
+}
+
+/*
+ * Write all of buf, or read exactly len bytes into it. Returns 0 if
+ * the connection failed or closed first.
+ */
+static int
+soak_io(struct tls *ctx, int out, char *buf, size_t len)
+{
+	ssize_t n;
+
+	while (len > 0) {
+		n = out ? tls_write(ctx, buf, len) : tls_read(ctx, buf, len);
+		if (n == TLS_WANT_POLLIN || n == TLS_WANT_POLLOUT)
+			continue;
+		if (n <= 0)
+			return 0;
+		buf += n;
+		len -= n;
+	}
+	return 1;
+}
+
+static int
+short_one(int id)
+{
+	struct tls *ctx;
+	char line[64], back[64];
+	ssize_t n, got = 0;
+	int fd, len, ok;
+
+	if ((ctx = soak_connect(&fd)) == NULL)
+		return 0;
+	if (ex1) {
+		/* ex1's server talks first, then hangs up */
+		do {
+			n = tls_read(ctx, back, sizeof(back));
+			if (n > 0)
+				got += n;
+		} while (n > 0 || n == TLS_WANT_POLLIN ||
+		    n == TLS_WANT_POLLOUT);
+		ok = n == 0 && got > 0;
+	} else {
+		len = snprintf(line, sizeof(line), "short %d\n", id);
+		ok = soak_io(ctx, 1, line, len) &&
+		    soak_io(ctx, 0, back, len) &&
+		    memcmp(line, back, len) == 0;
+	}
+	soak_close(ctx, fd);
+	return ok;
+}
+
+static void
+short_worker(int id)
+{
+	while (now() < deadline) {
+		if (short_one(id))
+			count(&counters->short_ok, 1);
+		else {
+			count(&counters->short_failed, 1);
+			usleep(100000);
+		}
+	}
+}
+
+/*
+ * Keep a connection echoing lines until its lifetime is up, somewhere
+ * between half and one and a half times the one we were given, then
+ * start another.
+ */
+static void
+long_worker(int id, int lifetime)
+{
+	struct tls *ctx;
+	char line[LINELEN], back[LINELEN];
+	double end;
+	int fd;
+
+	memset(line, 'a' + id % 26, sizeof(line));
+	line[sizeof(line) - 1] = '\n';
+	srandom(getpid());
+	while (now() < deadline) {
+		count(&counters->long_conns, 1);
+		if ((ctx = soak_connect(&fd)) == NULL) {
+			count(&counters->long_failed, 1);
+			usleep(100000);
+			continue;
+		}
+		end = now() + lifetime * (0.5 + random() / (double)RAND_MAX);
+		while (now() < end && now() < deadline) {
+			if (!soak_io(ctx, 1, line, sizeof(line)) ||
+			    !soak_io(ctx, 0, back, sizeof(back)) ||
+			    memcmp(line, back, sizeof(line)) != 0) {
+				count(&counters->long_failed, 1);
+				break;
+			}
+			count(&counters->long_bytes, sizeof(line));
+		}
+		soak_close(ctx, fd);
+	}
+}
+
+static FILE *
+ps(const char *args)
+{
+	FILE *f;
+
+	if ((f = popen(args, "r")) == NULL)
+		err(1, "popen");
+	return f;
+}
+
+static long
+rss_kb(pid_t pid)
+{
+	char cmd[64];
+	FILE *f;
+	long kb = -1;
+
+	snprintf(cmd, sizeof(cmd), "ps -o rss= -p %ld", (long)pid);
+	f = ps(cmd);
+	if (fscanf(f, "%ld", &kb) != 1)
+		kb = -1;
+	pclose(f);
+	return kb;
+}
+
+static int
+zombies(pid_t pid)
+{
+	char stat[16];
+	FILE *f;
+	long ppid;
+	int n = 0;
+
+	f = ps("ps -A -o ppid= -o stat=");
+	while (fscanf(f, "%ld %15s", &ppid, stat) == 2)
+		if (ppid == pid && stat[0] == 'Z')
+			n++;
+	pclose(f);
+	return n;
+}
+
+static int
+open_fds(pid_t pid)
+{
+	char path[64];
+	int n = 0;
+#ifdef __linux__
+	struct dirent *de;
+	DIR *dir;
+
+	snprintf(path, sizeof(path), "/proc/%ld/fd", (long)pid);
+	if ((dir = opendir(path)) == NULL)
+		return -1;
+	while ((de = readdir(dir)) != NULL)
+		if (de->d_name[0] != '.')
+			n++;
+	closedir(dir);
+#else
+	char line[256];
+	FILE *f;
+
+	/* fstat(1) prints a header and then a line per descriptor */
+	snprintf(path, sizeof(path), "fstat -p %ld", (long)pid);
+	f = ps(path);
+	while (fgets(line, sizeof(line), f) != NULL)
+		n++;
+	pclose(f);
+	n--;
+#endif
+	return n;
+}
+
+/*
+ * Ask the echo server's stats socket how its heap looks.
+ */
+static void
+heap_stats(const char *path, struct sample *s)
+{
+	struct sockaddr_un sun;
+	char buf[8192], *line, *p;
+	ssize_t n;
+	size_t len = 0;
+	int fd;
+
+	s->heap_inuse = s->heap_free = -1;
+	if (path == NULL)
+		return;
+	memset(&sun, 0, sizeof(sun));
+	sun.sun_family = AF_UNIX;
+	snprintf(sun.sun_path, sizeof(sun.sun_path), "%s", path);
+	if ((fd = socket(AF_UNIX, SOCK_STREAM, 0)) == -1)
+		err(1, "socket");
+	if (connect(fd, (struct sockaddr *)&sun, sizeof(sun)) == -1) {
+		warn("%s", path);
+		close(fd);
+		return;
+	}
+	if (write(fd, "stats\n", 6) != 6) {
+		warn("%s", path);
+		close(fd);
+		return;
+	}
+	while (len < sizeof(buf) - 1 &&
+	    (n = read(fd, buf + len, sizeof(buf) - 1 - len)) > 0)
+		len += n;
+	close(fd);
+	buf[len] = '\0';
+	for (p = buf; (line = strsep(&p, "\n")) != NULL; ) {
+		sscanf(line, "heap_inuse %lld", &s->heap_inuse);
+		sscanf(line, "heap_free %lld", &s->heap_free);
+	}
+}
+
+static void
+sample(struct sample *s, pid_t pid, const char *statspath)
+{
+	memset(s, 0, sizeof(*s));
+	s->rss = -1;
+	s->fds = s->zombies = -1;
+	if (pid != 0) {
+		s->rss = rss_kb(pid);
+		s->fds = open_fds(pid);
+		s->zombies = zombies(pid);
+	}
+	heap_stats(statspath, s);
+}
+
+static void
+sample_print(const struct sample *s)
+{
+	printf("%7.0fs rss %ld KB, fds %d, zombies %d", s->when, s->rss,
+	    s->fds, s->zombies);
+	if (s->heap_inuse != -1)
+		printf(", heap %lld KB used %lld KB free",
+		    s->heap_inuse / 1024, s->heap_free / 1024);
+	printf(", %.1f short/s, %.2f MB/s long\n", s->short_rate,
+	    s->long_rate / 1e6);
+}
+
+static double
+frag(const struct sample *s)
+{
+	if (s->heap_inuse <= 0)
+		return 0;
+	return 100.0 * s->heap_free / (s->heap_inuse + s->heap_free);
+}
+
+int
+main(int argc, char **argv)
+{
+	struct addrinfo hints;
+	struct counters last;
+	struct timespec ts;
+	unsigned long long attempts;
+	struct sample *samples, idle, end, first, final;
+	const char *cafile = "../CA/root.pem", *statspath = NULL;
+	double start, next, duration = 3600, interval = 10, t;
+	long long fdslack = 4, maxfrag = 50, growth = 20, drop = 20;
+	pid_t pid = 0, kid;
+	int ch, error, failed = 0, i, insecure = 0, lifetime = 60;
+	int nlong = 8, nshort = 2, n, nsamples, warm, q;
+
+	while ((ch = getopt(argc, argv, "1C:d:f:F:g:iI:k:L:p:S:t:u:")) !=
+	    -1) {
+		switch (ch) {
+		case '1':
+			ex1 = 1;
+			break;
+		case 'C':
+			cafile = optarg;
+			break;
+		case 'd':
+			duration = getnum(optarg, 10, 365 * 86400);
+			break;
+		case 'f':
+			fdslack = getnum(optarg, 0, INT_MAX);
+			break;
+		case 'F':
+			maxfrag = getnum(optarg, 0, 100);
+			break;
+		case 'g':
+			growth = getnum(optarg, 0, 10000);
+			break;
+		case 'i':
+			insecure = 1;
+			break;
+		case 'I':
+			interval = getnum(optarg, 1, 86400);
+			break;
+		case 'k':
+			lifetime = getnum(optarg, 1, INT_MAX);
+			break;
+		case 'L':
+			nlong = getnum(optarg, 0, 10000);
+			break;
+		case 'p':
+			pid = getnum(optarg, 1, INT_MAX);
+			break;
+		case 'S':
+			nshort = getnum(optarg, 0, 10000);
+			break;
+		case 't':
+			drop = getnum(optarg, 0, 100);
+			break;
+		case 'u':
+			statspath = optarg;
+			break;
+		default:
+			usage();
+		}
+	}
+	argc -= optind;
+	argv += optind;
+	if (argc != 2)
+		usage();
+	if (ex1)
+		nlong = 0;
+	if (nlong + nshort == 0)
+		errx(1, "nothing to do");
+	if (duration < 4 * interval)
+		errx(1, "run for at least four intervals");
+
+	host = argv[0];
+	memset(&hints, 0, sizeof(hints));
+	hints.ai_family = AF_UNSPEC;
+	hints.ai_socktype = SOCK_STREAM;
+	if ((error = getaddrinfo(argv[0], argv[1], &hints, &res))) {
+		fprintf(stderr, "%s %s: %s\n", argv[0], argv[1],
+		    gai_strerror(error));
+		usage();
+	}
+
+	if (tls_init() == -1)
+		errx(1, "unable to initialize TLS");
+	if ((tls_cfg = tls_config_new()) == NULL)
+		errx(1, "unable to allocate TLS config");
+	if (insecure) {
+		tls_config_insecure_noverifycert(tls_cfg);
+		tls_config_insecure_noverifyname(tls_cfg);
+	} else if (tls_config_set_ca_file(tls_cfg, cafile) == -1)
+		errx(1, "unable to set root CA file %s", cafile);
+
+	counters = mmap(NULL, sizeof(*counters), PROT_READ | PROT_WRITE,
+	    MAP_ANON | MAP_SHARED, -1, 0);
+	if (counters == MAP_FAILED)
+		err(1, "mmap");
+	nsamples = duration / interval + 1;
+	if ((samples = calloc(nsamples, sizeof(*samples))) == NULL)
+		err(1, "calloc");
+	signal(SIGPIPE, SIG_IGN);
+
+	/* how the server looks before we start */
+	sample(&idle, pid, statspath);
+	idle.when = 0;
+	printf("idle   ");
+	sample_print(&idle);
+
+	start = now();
+	/* keep the load on until just after the last sample */
+	deadline = start + duration + 1;
+	for (i = 0; i < nlong + nshort; i++) {
+		if ((kid = fork()) == -1)
+			err(1, "fork");
+		if (kid == 0) {
+			if (i < nlong)
+				long_worker(i, lifetime);
+			else
+				short_worker(i);
+			_exit(0);
+		}
+	}
+
+	memset(&last, 0, sizeof(last));
+	next = start;
+	for (n = 0; n < nsamples - 1; n++) {
+		struct sample *s = &samples[n];
+		struct counters c;
+
+		next += interval;
+		while ((t = next - now()) > 0) {
+			ts.tv_sec = t;
+			ts.tv_nsec = (t - ts.tv_sec) * 1e9;
+			nanosleep(&ts, NULL);
+		}
+		c.short_ok = __atomic_load_n(&counters->short_ok,
+		    __ATOMIC_RELAXED);
+		c.long_bytes = __atomic_load_n(&counters->long_bytes,
+		    __ATOMIC_RELAXED);
+		sample(s, pid, statspath);
+		s->when = now() - start;
+		s->short_rate = (c.short_ok - last.short_ok) / interval;
+		s->long_rate = (c.long_bytes - last.long_bytes) / interval;
+		last = c;
+		sample_print(s);
+		fflush(stdout);
+	}
+	while (wait(NULL) > 0 || errno == EINTR)
+		;
+
+	/* give the server a moment to notice everyone has gone */
+	sleep(2);
+	sample(&final, pid, statspath);
+	final.when = now() - start;
+	printf("after  ");
+	sample_print(&final);
+	printf("%llu short connections, %llu failed; %llu MB on %llu long "
+	    "connections, %llu failed\n", counters->short_ok,
+	    counters->short_failed, counters->long_bytes / 1000000,
+	    counters->long_conns, counters->long_failed);
+
+	/*
+	 * The first tenth of the run is warmup, while buffers and caches
+	 * fill. Average the first and last quarters of what's left.
+	 */
+	warm = n / 10;
+	q = (n - warm) / 4;
+	if (q == 0)
+		q = 1;
+	memset(&first, 0, sizeof(first));
+	memset(&end, 0, sizeof(end));
+	for (i = 0; i < q; i++) {
+		first.rss += samples[warm + i].rss;
+		first.short_rate += samples[warm + i].short_rate;
+		first.long_rate += samples[warm + i].long_rate;
+		end.rss += samples[n - q + i].rss;
+		end.short_rate += samples[n - q + i].short_rate;
+		end.long_rate += samples[n - q + i].long_rate;
+	}
+	first.rss /= q;
+	end.rss /= q;
+
+	if (pid != 0 && end.rss > first.rss * (100 + growth) / 100) {
+		printf("FAIL: rss grew from %ld KB to %ld KB\n", first.rss,
+		    end.rss);
+		failed = 1;
+	}
+	if (first.short_rate > 0 &&
+	    end.short_rate < first.short_rate * (100 - drop) / 100) {
+		printf("FAIL: short connections fell from %.1f/s to %.1f/s\n",
+		    first.short_rate / q, end.short_rate / q);
+		failed = 1;
+	}
+	if (first.long_rate > 0 &&
+	    end.long_rate < first.long_rate * (100 - drop) / 100) {
+		printf("FAIL: long connection throughput fell from %.2f "
+		    "MB/s to %.2f MB/s\n", first.long_rate / q / 1e6,
+		    end.long_rate / q / 1e6);
+		failed = 1;
+	}
+	if (pid != 0 && final.fds > idle.fds + fdslack) {
+		printf("FAIL: %d descriptors open after the run, %d before\n",
+		    final.fds, idle.fds);
+		failed = 1;
+	}
+	if (pid != 0 && final.zombies > 0) {
+		printf("FAIL: %d unreaped children after the run\n",
+		    final.zombies);
+		failed = 1;
+	}
+	if (frag(&samples[n - 1]) > maxfrag) {
+		printf("FAIL: %.0f%% of the heap is free but not returned\n",
+		    frag(&samples[n - 1]));
+		failed = 1;
+	}
+	if (pid != 0 && final.rss == -1) {
+		printf("FAIL: server %ld has gone away\n", (long)pid);
+		failed = 1;
+	}
+	attempts = counters->short_ok + counters->short_failed +
+	    counters->long_conns;
+	if (counters->short_failed + counters->long_failed > attempts / 1000) {
+		printf("FAIL: more than one in a thousand connections "
+		    "failed\n");
+		failed = 1;
+	}
+	if (!failed)
+		printf("ok\n");
+
+	freeaddrinfo(res);
+	tls_config_free(tls_cfg);
+	return failed;
+}
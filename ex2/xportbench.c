@@ -0,0 +1,779 @@
+/*
+ * Copyright (c) 2018 Bob Beck <beck@obtuse.com>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/*
+ * Benchmark builds of the echo server against each other.
+ *
+ * Each server is given as transport:command, for example "plain:./echo",
+ * "tls:./echo-tls" or "unix:./echo-unix". We start it with the address
+ * to listen on tacked onto the end of the command, bounce blocks of
+ * data off it over one connection for a while, then kill it and ask
+ * the kernel how much cpu it used. The servers take turns, a round at
+ * a time, so they all see the same machine, and we report the median
+ * round for each. Server cpu per megabyte echoed is the number to look
+ * at, the throughput mostly measures our side and the loopback.
+ *
+ * With -x we price TLS instead. Given a plain server and a TLS one,
+ * built from the same source so that TLS is the only difference, we
+ * run the same three workloads against each: connections that each
+ * echo one line and close, 64 byte lines back and forth over one
+ * connection, and blocks as above. Each runs on a server of its own,
+ * less what a server costs just to start and stop, so the cpu it used
+ * is the workload's. Our own cpu comes from getrusage around it. We
+ * report both, per connection, per message and per byte, with the
+ * latency, and what TLS adds to each.
+ *
+ * With -c we open that many connections to each server at once
+ * instead, and on each keep -d lines of 64 bytes in flight, writing
+ * every line by itself so that over TLS each is a record of its own.
+ * That is a lot of small connections all busy at once, which is where
+ * a server that batches its sending (echo -B) should show it, so we
+ * report lines echoed a second and server cpu per line.
+ */
+
+#include <sys/types.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include <err.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <tls.h>
+#include <unistd.h>
+
+#define MAXSERVERS 8
+#define MAXROUNDS 64
+#define MAXARGS 32
+
+/* the workloads for -x */
+#define TAX_SETUP 0		/* a connection per line */
+#define TAX_SMALL 1		/* lines over one connection */
+#define TAX_BULK 2		/* blocks over one connection */
+#define TAX_WORKLOADS 3
+#define TAX_LINE 64
+#define TAX_CONNS 1000		/* at most, a round, to spare the port space */
+
+/* the connections for -c */
+#define MANY_LINE 64
+#define MANY_MAX 4096
+
+/*
+ * echo takes only so many connections, -n or 256, and -c has to fit.
+ * We look for -n in the server's command to find out.
+ */
+#define SERVER_CONNS 256
+
+struct many {
+	struct tls *ctx;
+	int fd;
+	int inflight;		/* lines sent and not yet back */
+	size_t got;		/* bytes of the next line back */
+};
+
+struct tax {
+	double server[MAXROUNDS];	/* cpu per operation */
+	double client[MAXROUNDS];
+	double latency[MAXROUNDS];	/* usec, or MB/s for bulk */
+};
+
+struct server {
+	const char *spec;
+	char *argv[MAXARGS + 3];
+	int tls;
+	int unixsock;
+	int maxconns;		/* connections it will take */
+	double mbps[MAXROUNDS];
+	double cpu[MAXROUNDS];	/* server usec per MB echoed */
+	struct tax tax[TAX_WORKLOADS];
+	double lines[MAXROUNDS];	/* -c, lines a second */
+	double linecpu[MAXROUNDS];	/* -c, server usec per line */
+};
+
+static struct server servers[MAXSERVERS];
+static int nservers;
+static char port[16] = "9999";
+static char path[64];
+static struct tls_config *tls_cfg;
+
+static void
+usage(void)
+{
+	extern char *__progname;
+
+	fprintf(stderr, "usage: %s [-n rounds] [-p port] [-s size] "
+	    "[-t seconds]\n"
+	    "\ttransport:command ...\n"
+	    "       %s -x [-n rounds] [-p port] [-s size] [-t seconds]\n"
+	    "\tplain:command tls:command\n"
+	    "       %s -c connections [-d depth] [-n rounds] [-p port] "
+	    "[-t seconds]\n"
+	    "\ttransport:command ...\n", __progname, __progname,
+	    __progname);
+	exit(1);
+}
+
+static long long
+getnum(const char *s, long long min, long long max)
+{
+	char *ep;
+	long long n;
+
+	errno = 0;
+	n = strtoll(s, &ep, 10);
+	if (*s == '\0' || *ep != '\0')
+		errx(1, "%s - not a number", s);
+	if (errno == ERANGE || n < min || n > max)
+		errx(1, "%s - value out of range", s);
+	return n;
+}
+
+static double
+now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void
+server_parse(struct server *server, const char *spec)
+{
+	char *cmd, *p;
+	int i, n = 0;
+
+	server->spec = spec;
+	server->maxconns = SERVER_CONNS;
+	if ((p = strchr(spec, ':')) == NULL)
+		errx(1, "%s - expected transport:command", spec);
+	if (strncmp(spec, "plain:", 6) == 0)
+		;
+	else if (strncmp(spec, "tls:", 4) == 0)
+		server->tls = 1;
+	else if (strncmp(spec, "unix:", 5) == 0)
+		server->unixsock = 1;
+	else
+		errx(1, "%s - transport must be plain, tls or unix", spec);
+	if ((cmd = strdup(p + 1)) == NULL)
+		err(1, "strdup");
+	while ((p = strsep(&cmd, " \t")) != NULL) {
+		if (*p == '\0')
+			continue;
+		if (n == MAXARGS)
+			errx(1, "%s - too many arguments", spec);
+		server->argv[n++] = p;
+	}
+	if (n == 0)
+		errx(1, "%s - no command", spec);
+	for (i = 1; i < n; i++) {
+		if (strcmp(server->argv[i], "-n") == 0 && i + 1 < n)
+			server->maxconns = getnum(server->argv[i + 1], 1,
+			    INT_MAX);
+		else if (strncmp(server->argv[i], "-n", 2) == 0 &&
+		    server->argv[i][2] != '\0')
+			server->maxconns = getnum(server->argv[i] + 2, 1,
+			    INT_MAX);
+	}
+	if (server->unixsock)
+		server->argv[n++] = path;
+	else {
+		server->argv[n++] = "127.0.0.1";
+		server->argv[n++] = port;
+	}
+	server->argv[n] = NULL;
+}
+
+static pid_t
+server_start(struct server *server)
+{
+	pid_t pid;
+
+	if ((pid = fork()) == -1)
+		err(1, "fork");
+	if (pid == 0) {
+		execvp(server->argv[0], server->argv);
+		err(1, "%s", server->argv[0]);
+	}
+	return pid;
+}
+
+/*
+ * Connect to the server we just started, giving it a few seconds to
+ * get going.
+ */
+static int
+server_connect(struct server *server, pid_t pid)
+{
+	struct sockaddr_storage ss;
+	struct sockaddr_in *sin = (struct sockaddr_in *)&ss;
+	struct sockaddr_un *sun = (struct sockaddr_un *)&ss;
+	socklen_t len;
+	int fd, i;
+
+	memset(&ss, 0, sizeof(ss));
+	if (server->unixsock) {
+		sun->sun_family = AF_UNIX;
+		snprintf(sun->sun_path, sizeof(sun->sun_path), "%s", path);
+		len = sizeof(*sun);
+	} else {
+		sin->sin_family = AF_INET;
+		sin->sin_port = htons(atoi(port));
+		sin->sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+		len = sizeof(*sin);
+	}
+	for (i = 0; i < 500; i++) {
+		if ((fd = socket(ss.ss_family, SOCK_STREAM, 0)) == -1)
+			err(1, "socket");
+		if (connect(fd, (struct sockaddr *)&ss, len) == 0)
+			return fd;
+		close(fd);
+		if (waitpid(pid, NULL, WNOHANG) == pid)
+			errx(1, "%s: server exited", server->spec);
+		usleep(10000);
+	}
+	errx(1, "%s: couldn't connect to server", server->spec);
+}
+
+static void
+xfer(struct tls *ctx, int fd, int out, unsigned char *p, size_t len)
+{
+	ssize_t n;
+
+	while (len > 0) {
+		if (ctx != NULL && out)
+			n = tls_write(ctx, p, len);
+		else if (ctx != NULL)
+			n = tls_read(ctx, p, len);
+		else
+			n = out ? write(fd, p, len) : read(fd, p, len);
+		if (n == TLS_WANT_POLLIN || n == TLS_WANT_POLLOUT)
+			continue;
+		if (n == -1 && errno == EINTR)
+			continue;
+		if (n <= 0)
+			errx(1, "connection to server %s", n == 0 ?
+			    "closed" : "failed");
+		p += n;
+		len -= n;
+	}
+}
+
+/*
+ * Note what a read or write on a non-blocking connection did, adding
+ * what it moved to *done. If it moved nothing, add what to wait for
+ * to *events and return 0.
+ */
+static int
+moved(ssize_t n, short wait, short *events, size_t *done)
+{
+	if (n == TLS_WANT_POLLIN)
+		*events |= POLLIN;
+	else if (n == TLS_WANT_POLLOUT)
+		*events |= POLLOUT;
+	else if (n == -1 && errno == EAGAIN)
+		*events |= wait;
+	else if (n == -1 && errno == EINTR)
+		return 1;
+	else if (n <= 0)
+		errx(1, "connection to server %s", n == 0 ?
+		    "closed" : "failed");
+	else {
+		*done += n;
+		return 1;
+	}
+	return 0;
+}
+
+/*
+ * Bounce a block off the server over a non-blocking connection. We
+ * read as we write, since the server only buffers so much of what it
+ * has to send back, and won't read any more of a big block from us
+ * until we have taken some of it.
+ */
+static void
+bounce(struct tls *ctx, int fd, const unsigned char *block,
+    unsigned char *back, size_t size)
+{
+	struct pollfd pfd;
+	size_t sent = 0, got = 0;
+	int busy;
+
+	pfd.fd = fd;
+	while (got < size) {
+		pfd.events = 0;
+		busy = 0;
+		if (sent < size)
+			busy |= moved(ctx != NULL ?
+			    tls_write(ctx, block + sent, size - sent) :
+			    write(fd, block + sent, size - sent),
+			    POLLOUT, &pfd.events, &sent);
+		busy |= moved(ctx != NULL ?
+		    tls_read(ctx, back + got, size - got) :
+		    read(fd, back + got, size - got),
+		    POLLIN, &pfd.events, &got);
+		if (!busy && poll(&pfd, 1, -1) == -1 && errno != EINTR)
+			err(1, "poll");
+	}
+}
+
+static struct tls *
+tls_open(struct server *server, int fd)
+{
+	struct tls *ctx;
+
+	if ((ctx = tls_client()) == NULL)
+		errx(1, "tls_client failed");
+	if (tls_configure(ctx, tls_cfg) == -1 ||
+	    tls_connect_socket(ctx, fd, "localhost") == -1 ||
+	    tls_handshake(ctx) == -1)
+		errx(1, "%s: %s", server->spec, tls_error(ctx));
+	return ctx;
+}
+
+static void
+tls_done(struct tls *ctx, int fd)
+{
+	if (ctx != NULL) {
+		tls_close(ctx);
+		tls_free(ctx);
+	}
+	close(fd);
+}
+
+/* Stop a server, returning the cpu it used in usec */
+static double
+server_stop(pid_t pid)
+{
+	struct rusage ru;
+
+	kill(pid, SIGTERM);
+	if (wait4(pid, NULL, 0, &ru) == -1)
+		err(1, "wait4");
+	return (ru.ru_utime.tv_sec + ru.ru_stime.tv_sec) * 1e6 +
+	    ru.ru_utime.tv_usec + ru.ru_stime.tv_usec;
+}
+
+static double
+self_cpu(void)
+{
+	struct rusage ru;
+
+	if (getrusage(RUSAGE_SELF, &ru) == -1)
+		err(1, "getrusage");
+	return (ru.ru_utime.tv_sec + ru.ru_stime.tv_sec) * 1e6 +
+	    ru.ru_utime.tv_usec + ru.ru_stime.tv_usec;
+}
+
+/*
+ * Run one server for a round, returning the megabytes per second we
+ * got and setting how much server cpu each megabyte took.
+ */
+static double
+server_round(struct server *server, const unsigned char *block,
+    unsigned char *back, size_t size, double seconds, double *cpu)
+{
+	struct tls *ctx = NULL;
+	double start, elapsed;
+	unsigned long long bytes = 0;
+	pid_t pid;
+	int fd;
+
+	pid = server_start(server);
+	fd = server_connect(server, pid);
+	if (server->tls)
+		ctx = tls_open(server, fd);
+	if (fcntl(fd, F_SETFL, O_NONBLOCK) == -1)
+		err(1, "fcntl");
+	start = now();
+	do {
+		bounce(ctx, fd, block, back, size);
+		if (memcmp(block, back, size) != 0)
+			errx(1, "%s: echo doesn't match", server->spec);
+		bytes += size;
+	} while ((elapsed = now() - start) < seconds);
+	tls_done(ctx, fd);
+
+	*cpu = server_stop(pid) / (bytes / 1e6);
+	return bytes / 1e6 / elapsed;
+}
+
+/*
+ * What a server costs to start, take the one connection we use to see
+ * that it's up, and stop. The -x workloads are charged the rest.
+ */
+static double
+tax_baseline(struct server *server)
+{
+	pid_t pid;
+
+	pid = server_start(server);
+	close(server_connect(server, pid));
+	return server_stop(pid);
+}
+
+/*
+ * Run a -x workload against a server of its own for a round, filling
+ * in the cpu each operation took on both sides and the latency.
+ */
+static void
+tax_round(struct server *server, int work, const unsigned char *block,
+    unsigned char *back, size_t size, double seconds, double baseline,
+    int r)
+{
+	struct tax *tax = &server->tax[work];
+	struct tls *ctx = NULL;
+	unsigned char line[TAX_LINE];
+	double start, t, cpu, waited = 0;
+	unsigned long long ops = 0;
+	pid_t pid;
+	int fd;
+
+	memcpy(line, block, sizeof(line));
+	pid = server_start(server);
+	close(server_connect(server, pid));
+	cpu = self_cpu();
+	start = now();
+	if (work != TAX_SETUP) {
+		fd = server_connect(server, pid);
+		if (server->tls)
+			ctx = tls_open(server, fd);
+		if (work == TAX_BULK && fcntl(fd, F_SETFL, O_NONBLOCK) == -1)
+			err(1, "fcntl");
+	}
+	do {
+		t = now();
+		switch (work) {
+		case TAX_SETUP:
+			fd = server_connect(server, pid);
+			if (server->tls)
+				ctx = tls_open(server, fd);
+			xfer(ctx, fd, 1, line, sizeof(line));
+			xfer(ctx, fd, 0, back, sizeof(line));
+			tls_done(ctx, fd);
+			ctx = NULL;
+			ops++;
+			break;
+		case TAX_SMALL:
+			xfer(ctx, fd, 1, line, sizeof(line));
+			xfer(ctx, fd, 0, back, sizeof(line));
+			ops++;
+			break;
+		case TAX_BULK:
+			bounce(ctx, fd, block, back, size);
+			ops += size;
+			break;
+		}
+		waited += now() - t;
+	} while (now() - start < seconds &&
+	    (work != TAX_SETUP || ops < TAX_CONNS));
+	if (work != TAX_SETUP)
+		tls_done(ctx, fd);
+	tax->client[r] = (self_cpu() - cpu) / ops;
+	tax->server[r] = (server_stop(pid) - baseline) / ops;
+	if (work == TAX_BULK)
+		tax->latency[r] = ops / 1e6 / waited;
+	else
+		tax->latency[r] = waited * 1e6 / ops;
+}
+
+/* Send lines until depth are in flight, each one a write of its own */
+static void
+many_send(struct many *m, int depth, const unsigned char *line)
+{
+	ssize_t n;
+
+	while (m->inflight < depth) {
+		if (m->ctx != NULL)
+			n = tls_write(m->ctx, line, MANY_LINE);
+		else
+			n = write(m->fd, line, MANY_LINE);
+		if (n == TLS_WANT_POLLIN || n == TLS_WANT_POLLOUT ||
+		    (n == -1 && (errno == EAGAIN || errno == EINTR)))
+			return;
+		if (n != MANY_LINE)
+			errx(1, "connection to server failed");
+		m->inflight++;
+	}
+}
+
+/* Read what has come back, returning how many lines that finished */
+static int
+many_recv(struct many *m)
+{
+	unsigned char buf[16384];
+	ssize_t n;
+	int lines;
+
+	for (;;) {
+		if (m->ctx != NULL)
+			n = tls_read(m->ctx, buf, sizeof(buf));
+		else
+			n = read(m->fd, buf, sizeof(buf));
+		if (n == TLS_WANT_POLLIN || n == TLS_WANT_POLLOUT ||
+		    (n == -1 && (errno == EAGAIN || errno == EINTR)))
+			break;
+		if (n <= 0)
+			errx(1, "connection to server %s", n == 0 ?
+			    "closed" : "failed");
+		m->got += n;
+	}
+	lines = m->got / MANY_LINE;
+	m->got %= MANY_LINE;
+	m->inflight -= lines;
+	return lines;
+}
+
+/*
+ * Run a round of -c against a server of its own, setting the lines a
+ * second it echoed and the cpu each took it.
+ */
+static void
+many_round(struct server *server, int conns, int depth, double seconds,
+    double baseline, const unsigned char *line, int r)
+{
+	struct many *m;
+	struct pollfd *pfd;
+	unsigned long long lines = 0;
+	double start, elapsed;
+	pid_t pid;
+	int i;
+
+	if ((m = calloc(conns, sizeof(*m))) == NULL ||
+	    (pfd = calloc(conns, sizeof(*pfd))) == NULL)
+		err(1, "calloc");
+	pid = server_start(server);
+	close(server_connect(server, pid));
+	for (i = 0; i < conns; i++) {
+		m[i].fd = server_connect(server, pid);
+		if (server->tls)
+			m[i].ctx = tls_open(server, m[i].fd);
+		if (fcntl(m[i].fd, F_SETFL, O_NONBLOCK) == -1)
+			err(1, "fcntl");
+		pfd[i].fd = m[i].fd;
+		pfd[i].events = POLLIN;
+	}
+	start = now();
+	do {
+		for (i = 0; i < conns; i++)
+			many_send(&m[i], depth, line);
+		if (poll(pfd, conns, 1000) == -1 && errno != EINTR)
+			err(1, "poll");
+		for (i = 0; i < conns; i++)
+			if (pfd[i].revents != 0)
+				lines += many_recv(&m[i]);
+	} while ((elapsed = now() - start) < seconds);
+	for (i = 0; i < conns; i++)
+		tls_done(m[i].ctx, m[i].fd);
+	if (lines == 0)
+		errx(1, "%s - no lines echoed in %.0f seconds", server->spec,
+		    seconds);
+	server->lines[r] = lines / elapsed;
+	server->linecpu[r] = (server_stop(pid) - baseline) / lines;
+	free(m);
+	free(pfd);
+}
+
+static int
+dcmp(const void *a, const void *b)
+{
+	double x = *(const double *)a, y = *(const double *)b;
+
+	return x < y ? -1 : x > y;
+}
+
+static double
+median(double *v, int n)
+{
+	qsort(v, n, sizeof(*v), dcmp);
+	return n % 2 ? v[n / 2] : (v[n / 2 - 1] + v[n / 2]) / 2;
+}
+
+static void
+tax_line(const char *what, double plain, double tls)
+{
+	printf("  %-28s %12.2f %12.2f %12.2f\n", what, plain, tls,
+	    tls - plain);
+}
+
+static void
+tax_report(size_t size, int rounds, double seconds)
+{
+	struct tax *p, *t;
+	static const char *names[TAX_WORKLOADS] = {
+		"connections, one line each", "64 byte lines", NULL
+	};
+	static const char *units[TAX_WORKLOADS][3] = {
+		{ "server cpu, usec/conn", "client cpu, usec/conn",
+		    "latency, usec" },
+		{ "server cpu, usec/line", "client cpu, usec/line",
+		    "round trip, usec" },
+		{ "server cpu, nsec/byte", "client cpu, nsec/byte",
+		    "throughput, MB/s" },
+	};
+	double scale;
+	int w;
+
+	printf("%s against %s, %d rounds of %.0f seconds, medians\n",
+	    servers[0].spec, servers[1].spec, rounds, seconds);
+	printf("  %-28s %12s %12s %12s\n", "", "plain", "tls", "tls adds");
+	for (w = 0; w < TAX_WORKLOADS; w++) {
+		p = &servers[0].tax[w];
+		t = &servers[1].tax[w];
+		if (names[w] != NULL)
+			printf("%s\n", names[w]);
+		else
+			printf("%zu byte blocks\n", size);
+		/* bulk is per byte, and usec/byte is an awkward number */
+		scale = w == TAX_BULK ? 1000 : 1;
+		tax_line(units[w][0], median(p->server, rounds) * scale,
+		    median(t->server, rounds) * scale);
+		tax_line(units[w][1], median(p->client, rounds) * scale,
+		    median(t->client, rounds) * scale);
+		tax_line(units[w][2], median(p->latency, rounds),
+		    median(t->latency, rounds));
+	}
+}
+
+int
+main(int argc, char **argv)
+{
+	unsigned char *block, *back;
+	size_t size = 16384, i;
+	double seconds = 1, base[2];
+	int ch, j, rounds = 5, r, taxmode = 0, w, conns = 0, depth = 8;
+
+	while ((ch = getopt(argc, argv, "c:d:n:p:s:t:x")) != -1) {
+		switch (ch) {
+		case 'c':
+			conns = getnum(optarg, 1, MANY_MAX);
+			break;
+		case 'd':
+			depth = getnum(optarg, 1, 1024);
+			break;
+		case 'n':
+			rounds = getnum(optarg, 1, MAXROUNDS);
+			break;
+		case 'p':
+			snprintf(port, sizeof(port), "%lld",
+			    getnum(optarg, 1, 65535));
+			break;
+		case 's':
+			size = getnum(optarg, 1, 1024 * 1024);
+			break;
+		case 't':
+			seconds = getnum(optarg, 1, 3600);
+			break;
+		case 'x':
+			taxmode = 1;
+			break;
+		default:
+			usage();
+		}
+	}
+	argc -= optind;
+	argv += optind;
+	if (argc < 1 || argc > MAXSERVERS)
+		usage();
+
+	snprintf(path, sizeof(path), "/tmp/xportbench.%ld.sock",
+	    (long)getpid());
+	for (j = 0; j < argc; j++)
+		server_parse(&servers[j], argv[j]);
+	nservers = argc;
+	if (taxmode && (nservers != 2 || servers[0].tls ||
+	    servers[0].unixsock || !servers[1].tls))
+		errx(1, "-x wants a plain server, then a tls one");
+	if (taxmode && conns > 0)
+		errx(1, "-x and -c are different benchmarks");
+	/* the connection that saw it was up may not be gone yet */
+	for (j = 0; j < nservers; j++)
+		if (conns >= servers[j].maxconns)
+			errx(1, "%s - -c %d needs -n %d or more",
+			    servers[j].spec, conns, conns + 1);
+
+	if (tls_init() == -1)
+		errx(1, "unable to initialize TLS");
+	if ((tls_cfg = tls_config_new()) == NULL)
+		errx(1, "unable to allocate TLS config");
+	/* we are measuring the server, not checking who it is */
+	tls_config_insecure_noverifycert(tls_cfg);
+	tls_config_insecure_noverifyname(tls_cfg);
+
+	/* lines of 64 bytes, so the servers see plenty of messages */
+	if ((block = malloc(size)) == NULL || (back = malloc(size)) == NULL)
+		err(1, "malloc");
+	for (i = 0; i < size; i++)
+		block[i] = (i % 64 == 63) ? '\n' : 'a' + i % 26;
+
+	signal(SIGPIPE, SIG_IGN);
+	if (taxmode) {
+		for (r = 0; r < rounds; r++) {
+			for (j = 0; j < 2; j++)
+				base[j] = tax_baseline(&servers[j]);
+			for (w = 0; w < TAX_WORKLOADS; w++)
+				for (j = 0; j < 2; j++)
+					tax_round(&servers[j], w, block, back,
+					    size, seconds, base[j], r);
+		}
+		tax_report(size, rounds, seconds);
+		return 0;
+	}
+	if (conns > 0) {
+		for (r = 0; r < rounds; r++) {
+			for (j = 0; j < nservers; j++)
+				many_round(&servers[j], conns, depth, seconds,
+				    tax_baseline(&servers[j]), block, r);
+		}
+		unlink(path);
+		printf("%d connections, %d lines of %d bytes in flight on "
+		    "each, %d rounds of %.0f seconds, medians\n", conns,
+		    depth, MANY_LINE, rounds, seconds);
+		printf("%-32s %12s %18s\n", "server", "lines/s",
+		    "server usec/line");
+		for (j = 0; j < nservers; j++)
+			printf("%-32s %12.0f %18.2f\n", servers[j].spec,
+			    median(servers[j].lines, rounds),
+			    median(servers[j].linecpu, rounds));
+		return 0;
+	}
+	for (r = 0; r < rounds; r++) {
+		for (j = 0; j < nservers; j++)
+			servers[j].mbps[r] = server_round(&servers[j], block,
+			    back, size, seconds, &servers[j].cpu[r]);
+	}
+	unlink(path);
+
+	printf("%zu byte blocks, %d rounds of %.0f seconds, medians\n",
+	    size, rounds, seconds);
+	printf("%-32s %10s %16s\n", "server", "MB/s", "server usec/MB");
+	for (j = 0; j < nservers; j++)
+		printf("%-32s %10.1f %16.1f\n", servers[j].spec,
+		    median(servers[j].mbps, rounds),
+		    median(servers[j].cpu, rounds));
+	return 0;
+}